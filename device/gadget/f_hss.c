@@ -11,6 +11,7 @@
 #include <linux/mutex.h>
 #include <linux/net.h>
 #include <linux/hss.h>
+#include <linux/log2.h>
 #include <linux/spinlock.h>
 #include <net/sock.h>
 #include <net/hss.h>
@@ -39,7 +40,9 @@
 #define HSS_SUBCLASS 0xab
 #define MAX_INT_PACKET_SIZE    64
 #define HSS_STATUS_INTERVAL_MS 4 //32
-#define HSS_ACK_TIMEOUT 10000
+
+/* Bulk-in requests allocated at bind, each with a HSS_MAX_TRANSFER buffer */
+#define HSS_BULK_IN_REQS 8
 
 /**
  * Usb function structure definition
@@ -57,7 +60,18 @@ struct f_hss {
 	struct usb_request	*req_out;
 	struct usb_request	*req_bulk_out;
 
+	/* Requests for hss_send_bulk_msg, idle ones are on `bulk_in_idle` */
+	struct usb_request	*bulk_in_reqs[HSS_BULK_IN_REQS];
+	struct list_head	bulk_in_idle;
+	spinlock_t		bulk_in_lock;
+	wait_queue_head_t	bulk_in_wait;
+
 	void *proxy_context;
+
+	/* Agreed with the host through HSS_USB_REQ_CONFIG, `features` holds
+	 * the ones offered */
+	int max_transfer;
+	u32 features;
 };
 
 /* Forward declarations */
@@ -67,6 +81,10 @@ static int hss_read_out_bulk(struct f_hss *hss_inst);
 static void hss_send_int_msg(char *data, size_t len, void *hss_inst);
 static void hss_send_bulk_msg(char *hdr, size_t hdr_len, char *data, size_t len,
 	void *hss_inst);
+static void hss_send_bulk_msg_complete(struct usb_ep *ep,
+	struct usb_request *req);
+static int hss_bulk_in_alloc(struct f_hss *hss);
+static void hss_bulk_in_free(struct f_hss *hss);
 
 
 static struct hss_usb_descriptor hss_usb_intf = {
@@ -315,6 +333,7 @@ static inline struct f_hss *func_to_hss(struct usb_function *f)
 static int hss_bind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct usb_composite_dev *cdev;
+	struct f_hss_opts *opts;
 	struct f_hss *hss;
 	int id;
 	int ret;
@@ -395,9 +414,21 @@ static int hss_bind(struct usb_configuration *c, struct usb_function *f)
 	if (ret)
 		goto fail;
 
+	ret = hss_bulk_in_alloc(hss);
+	if (ret) {
+		ERROR(cdev, "%s: can't allocate bulk-in requests\n", f->name);
+		usb_free_all_descriptors(f);
+		goto fail;
+	}
+
 	/* Initialize the proxy and store it's instance for future calls */
 	hss->proxy_context = hss_proxy_init(hss, &hss_usb_intf);
 
+	opts = container_of(f->fi, struct f_hss_opts, func_inst);
+	mutex_lock(&opts->lock);
+	opts->proxy_context = hss->proxy_context;
+	mutex_unlock(&opts->lock);
+
 	DBG(cdev, "HSS bind complete at %s speed\n",
 		gadget_is_superspeed(c->cdev->gadget) ? "super" :
 		gadget_is_dualspeed(c->cdev->gadget) ? "dual" : "full");
@@ -413,8 +444,10 @@ static void hss_free_func(struct usb_function *f)
 
 	mutex_lock(&opts->lock);
 	opts->refcnt--;
+	opts->proxy_context = NULL;
 	mutex_unlock(&opts->lock);
 
+	hss_bulk_in_free(func_to_hss(f));
 	usb_free_all_descriptors(f);
 	kfree(func_to_hss(f));
 }
@@ -495,7 +528,8 @@ static int enable_hss(struct usb_composite_dev *cdev, struct f_hss *hss)
 		goto exit_free_ri;
 	}
 
-	hss->req_bulk_out = alloc_ep_req(hss->bulk_out, 2048);
+	/* The host may not have sent its config yet so take the largest */
+	hss->req_bulk_out = alloc_ep_req(hss->bulk_out, HSS_MAX_TRANSFER);
 	if (!hss->req_bulk_out) {
 		ERROR(cdev, "alloc_ep_req for req_bulk_out failed");
 		result = -ENOMEM;
@@ -568,10 +602,79 @@ exit:
 	return ret;
 }
 
+/**
+ * hss_setup - Handles vendor control requests for the interface
+ *
+ * @f The HSS function
+ * @ctrl The control request
+ *
+ * Answers HSS_USB_REQ_CONFIG with the largest transfer both sides can take.
+ * The host offers its maximum in KiB in wValue. HSS_USB_REQ_SET_FEATURES
+ * enables the offered features named in wValue.
+ *
+ * Returns: The number of bytes queued on ep0 or a negative error, which
+ * stalls the request.
+ */
+static int hss_setup(struct usb_function *f,
+	const struct usb_ctrlrequest *ctrl)
+{
+	struct f_hss *hss = func_to_hss(f);
+	struct usb_composite_dev *cdev = f->config->cdev;
+	struct usb_request *req = cdev->req;
+	struct hss_usb_config *config = req->buf;
+	u16 w_value = le16_to_cpu(ctrl->wValue);
+	u16 w_length = le16_to_cpu(ctrl->wLength);
+	int max_transfer;
+	u32 features;
+	int value = -EOPNOTSUPP;
+
+	switch ((ctrl->bRequestType << 8) | ctrl->bRequest) {
+	case ((USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE) << 8
+		| HSS_USB_REQ_CONFIG):
+		max_transfer = clamp_t(int, w_value * 1024, HSS_MIN_TRANSFER,
+			HSS_MAX_TRANSFER);
+		max_transfer = rounddown_pow_of_two(max_transfer);
+
+		hss->max_transfer = max_transfer;
+		hss_proxy_set_max_transfer(max_transfer, hss->proxy_context);
+
+		config->max_transfer = cpu_to_le32(max_transfer);
+		config->features = cpu_to_le32(hss->features);
+
+		req->length = min_t(u16, w_length, sizeof(*config));
+		break;
+	case ((USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE) << 8
+		| HSS_USB_REQ_SET_FEATURES):
+		if (w_length)
+			goto out;
+
+		features = w_value & hss->features;
+		hss_proxy_set_features(features, hss->proxy_context);
+
+		/* Only the status stage is left */
+		req->length = 0;
+		break;
+	default:
+		goto out;
+	}
+
+	req->zero = 0;
+	value = usb_ep_queue(cdev->gadget->ep0, req, GFP_ATOMIC);
+	if (value < 0)
+		ERROR(cdev, "%s: vendor request %d failed ret=%d\n",
+			f->name, ctrl->bRequest, value);
+	else
+		value = req->length;
+out:
+	return value;
+}
+
 static void hss_disable(struct usb_function *f)
 {
 	struct f_hss *sock = func_to_hss(f);
 
+	/* A new host has to ask for features again */
+	hss_proxy_set_features(0, sock->proxy_context);
 	disable_hss(sock);
 }
 
@@ -593,11 +696,22 @@ static struct usb_function *hss_alloc(struct usb_function_instance *fi)
 	hss->function.name = "hss";
 	hss->function.bind = hss_bind;
 	hss->function.set_alt = hss_set_alt;
+	hss->function.setup = hss_setup;
 	hss->function.disable = hss_disable;
 	hss->function.strings = hss_strings;
 
 	hss->function.free_func = hss_free_func;
 
+	INIT_LIST_HEAD(&hss->bulk_in_idle);
+	spin_lock_init(&hss->bulk_in_lock);
+	init_waitqueue_head(&hss->bulk_in_wait);
+
+	hss->max_transfer = HSS_MIN_TRANSFER;
+	hss->features = HSS_FEATURE_CREDITS | HSS_FEATURE_CUMULATIVE_ACK |
+		HSS_FEATURE_INBAND_CMD | HSS_FEATURE_OPEN_CONNECT |
+		HSS_FEATURE_CONNECT_NAME | HSS_FEATURE_DGRAM |
+		HSS_FEATURE_SOCKOPT;
+
 	return &hss->function;
 }
 
@@ -622,7 +736,37 @@ static struct configfs_item_operations hss_item_ops = {
 	.release                = hss_attr_release,
 };
 
+/*
+ * Read only attributes with the proxy's command round trip estimates, see
+ * hss_proxy_get_rtt. Reads give 0 until the function is bound.
+ */
+#define F_HSS_RTT_ATTR(name)						\
+static ssize_t f_hss_opts_##name##_show(struct config_item *item,	\
+	char *page)							\
+{									\
+	struct f_hss_opts *opts = to_f_hss_opts(item);			\
+	struct hss_proxy_rtt rtt = {};					\
+									\
+	mutex_lock(&opts->lock);					\
+	if (opts->proxy_context)					\
+		hss_proxy_get_rtt(&rtt, opts->proxy_context);		\
+	mutex_unlock(&opts->lock);					\
+									\
+	return sprintf(page, "%u\n", rtt.name);			\
+}									\
+									\
+CONFIGFS_ATTR_RO(f_hss_opts_, name)
+
+F_HSS_RTT_ATTR(srtt_us);
+F_HSS_RTT_ATTR(rttvar_us);
+F_HSS_RTT_ATTR(rto_us);
+F_HSS_RTT_ATTR(timeouts);
+
 static struct configfs_attribute *hss_attrs[] = {
+	&f_hss_opts_attr_srtt_us,
+	&f_hss_opts_attr_rttvar_us,
+	&f_hss_opts_attr_rto_us,
+	&f_hss_opts_attr_timeouts,
 	NULL,
 };
 
@@ -694,10 +838,86 @@ static void hss_send_int_msg(char *data, size_t len, void *inst)
 	ret = usb_ep_queue(hss_inst->cmd_in, hss_inst->req_in, GFP_ATOMIC);
 }
 
+/**
+ * hss_bulk_in_alloc - Allocates the requests used by hss_send_bulk_msg
+ *
+ * @hss The HSS function, its bulk_in endpoint already configured
+ *
+ * The host may not have sent its config yet so every buffer takes the
+ * largest transfer. The requests are kept for the life of the function.
+ *
+ * Returns: 0 on success or -ENOMEM
+ */
+static int hss_bulk_in_alloc(struct f_hss *hss)
+{
+	struct usb_request *req;
+	int i;
+
+	for (i = 0; i < HSS_BULK_IN_REQS; i++) {
+		req = alloc_ep_req(hss->bulk_in, HSS_MAX_TRANSFER);
+		if (!req)
+			goto free_reqs;
+
+		req->context = hss;
+		req->complete = hss_send_bulk_msg_complete;
+		hss->bulk_in_reqs[i] = req;
+		list_add_tail(&req->list, &hss->bulk_in_idle);
+	}
+
+	return 0;
+
+free_reqs:
+	hss_bulk_in_free(hss);
+	return -ENOMEM;
+}
+
+static void hss_bulk_in_free(struct f_hss *hss)
+{
+	int i;
+
+	INIT_LIST_HEAD(&hss->bulk_in_idle);
+	for (i = 0; i < HSS_BULK_IN_REQS; i++) {
+		if (hss->bulk_in_reqs[i])
+			free_ep_req(hss->bulk_in, hss->bulk_in_reqs[i]);
+		hss->bulk_in_reqs[i] = NULL;
+	}
+}
+
+/**
+ * hss_bulk_in_put - Returns a request to the idle list
+ *
+ * @hss The HSS function
+ * @req A request from `bulk_in_reqs`
+ */
+static void hss_bulk_in_put(struct f_hss *hss, struct usb_request *req)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hss->bulk_in_lock, flags);
+	list_add_tail(&req->list, &hss->bulk_in_idle);
+	spin_unlock_irqrestore(&hss->bulk_in_lock, flags);
+
+	wake_up(&hss->bulk_in_wait);
+}
+
+static struct usb_request *hss_bulk_in_get(struct f_hss *hss)
+{
+	struct usb_request *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hss->bulk_in_lock, flags);
+	req = list_first_entry_or_null(&hss->bulk_in_idle,
+		struct usb_request, list);
+	if (req)
+		list_del(&req->list);
+	spin_unlock_irqrestore(&hss->bulk_in_lock, flags);
+
+	return req;
+}
+
 static void hss_send_bulk_msg_complete(struct usb_ep *ep, struct usb_request *req)
 {
-	kfree(req->buf);
-	usb_ep_free_request(ep, req);
+	hss_bulk_in_put(req->context, req);
 }
 
 /**
@@ -715,30 +935,41 @@ static void hss_send_bulk_msg_complete(struct usb_ep *ep, struct usb_request *re
  * allocated in a contiguous buffer the same effect can be reached by putting
  * everything in @hdr and passing @data = NULL
  *
- * Returns: 0 if all endpoints were matched, -ENXIO otherwise
- *
+ * The message is copied into an idle request from `bulk_in_reqs`, waiting
+ * for one to complete if every request is queued. A message that can't be
+ * queued, because the endpoint is disabled, is dropped.
  */
 static void hss_send_bulk_msg(char *hdr, size_t hdr_len, char *data,
 	size_t data_len, void *inst)
 {
 	struct f_hss *hss_inst = (struct f_hss*) inst;
 	struct usb_request *in_req;
-	void *usb_data;
 	int total_len;
+	int ret;
 
 	total_len = hdr_len + (data ? data_len : 0);
+	if (WARN_ON_ONCE(total_len > HSS_MAX_TRANSFER))
+		return;
+
+	wait_event(hss_inst->bulk_in_wait,
+		(in_req = hss_bulk_in_get(hss_inst)) != NULL);
 
-	in_req = usb_ep_alloc_request(hss_inst->bulk_in, GFP_KERNEL);
 	in_req->length = total_len;
-	in_req->complete = hss_send_bulk_msg_complete;
 
-	usb_data = kmalloc(total_len, GFP_KERNEL);
-	in_req->buf = usb_data;
+	/*
+	 * End every message with a short packet, or a ZLP when it is a multiple
+	 * of wMaxPacketSize, so the host's bulk-in URB completes on it instead
+	 * of running on into the next message.
+	 */
+	in_req->zero = 1;
+
 	memcpy(in_req->buf, hdr, hdr_len);
 	if (data)
 		memcpy(((char *)in_req->buf) + hdr_len, data, data_len);
 
-	usb_ep_queue(hss_inst->bulk_in, in_req, GFP_ATOMIC);
+	ret = usb_ep_queue(hss_inst->bulk_in, in_req, GFP_ATOMIC);
+	if (ret)
+		hss_bulk_in_put(hss_inst, in_req);
 }
 static void hss_read_out_cmd_cb(struct usb_ep *ep, struct usb_request *req)
 {
@@ -784,8 +1015,7 @@ static int hss_read_out_bulk(struct f_hss *hss_inst)
 {
 	struct usb_request *out_bulk_req = hss_inst->req_bulk_out;
 
-	out_bulk_req->length = 2048;
-	out_bulk_req->buf = kmalloc(out_bulk_req->length, GFP_ATOMIC);
+	/* The buffer was sized by alloc_ep_req */
 	out_bulk_req->dma = 0;
 	out_bulk_req->complete = hss_read_out_bulk_cb;
 	out_bulk_req->context = hss_inst;
@@ -11,6 +11,7 @@ struct f_hss_opts {
 	struct usb_function_instance func_inst;
 	struct mutex lock;
 	int refcnt;
+	void *proxy_context; /* Of the bound function, for its attributes */
 };
 
 #endif
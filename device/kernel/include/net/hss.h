@@ -0,0 +1,40 @@
+#include <linux/hss.h>
+
+/* Connects an AF_HSS socket to a name the host resolves */
+struct sockaddr_hss {
+	sa_family_t	shss_family; /* AF_HSS */
+	__be16		shss_port;
+	char		shss_name[HSS_NAME_MAX + 1]; /* NUL terminated */
+};
+
+/* Command round trips to the host, see hss_proxy_get_rtt */
+struct hss_proxy_rtt {
+	u32 srtt_us; /* Smoothed, 0 until one is measured */
+	u32 rttvar_us; /* Mean deviation */
+	u32 rto_us; /* How long a command waits for its ACK */
+	u32 timeouts; /* Commands given up on */
+};
+
+struct hss_usb_descriptor {
+	void (*hss_cmd)(char*, size_t, void*);
+	void (*hss_transfer)(char *, size_t, char*, size_t, void*);
+	void (*hss_shutdown)(void*);
+};
+
+
+int hss_sock_handle_host_side_shutdown(int sock_id, int how);
+void hss_sock_connect_ack(int sock_id, struct hss_packet *packet);
+void hss_sock_transmit(int sock_id, struct sockaddr *from, int from_len,
+	void *data, int len);
+void hss_sock_transmit_credit(int sock_id, u32 window);
+void hss_sock_open_ack(int sock_id, struct hss_packet *ack);
+void hss_sock_sockopt_ack(int sock_id, struct hss_packet *ack);
+int hss_register(void *proxy_context);
+void *hss_proxy_init(void *usb_context, struct hss_usb_descriptor *intf);
+void hss_proxy_set_max_transfer(int max_transfer, void *proxy_ctx);
+void hss_proxy_set_features(u32 features, void *proxy_ctx);
+void hss_proxy_get_rtt(struct hss_proxy_rtt *rtt, void *proxy_ctx);
+
+void hss_proxy_rcv_data(char *packet, size_t len, void *proxy_ctx);
+void hss_proxy_rcv_cmd(char *packet, size_t len, void *proxy_ctx);
+
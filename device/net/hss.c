@@ -7,13 +7,19 @@
 #include <linux/module.h>
 #include <linux/net.h>
 #include <linux/hss.h>
+#include <linux/in.h>
+#include <linux/in6.h>
 #include <linux/rhashtable.h>
 #include <linux/sched/signal.h>
+#include <linux/tcp.h>
+#include <linux/uaccess.h>
 #include <net/sock.h>
 #include <net/hss.h>
 #include "hss.h"
 
 #define HSS_SK_BUFF_SIZE 512
+/* Queued datagrams are charged to sk_rcvbuf, room for a whole window */
+#define HSS_SK_DGRAM_RCVBUF (2 * HSS_INITIAL_WINDOW)
 #define HSS_SK_SND_TIMEO (HZ * 30)
 
 MODULE_LICENSE("GPL v2");
@@ -49,8 +55,74 @@ struct hss_pinfo {
 	size_t			read_cache_size;
 	struct hss_packet *wait_ack;
 	struct rhash_head hash;
+	/* The host has the socket. With HSS_FEATURE_OPEN_CONNECT the OPEN is
+	 * held back until the socket is connected. */
+	bool opened;
+	/* Credit windows, see struct hss_payload_ack. Only used once the host
+	 * has enabled HSS_FEATURE_CREDITS. */
+	u32 snd_sent; /* Bytes passed to the proxy */
+	u32 snd_window; /* Set by the host as it drains the socket */
+	u32 rcv_consumed; /* Bytes read out of `read_cache` */
+	u32 rcv_advertised; /* The last window given to the host */
+	/* Host socket options by enum hss_sockopt. Only used once the host
+	 * has enabled HSS_FEATURE_SOCKOPT. */
+	u32 opt_val[HSS_SOCKOPT_NUM]; /* Cached for getsockopt */
+	u16 opt_msg_id[HSS_SOCKOPT_NUM]; /* The latest command per option */
+	unsigned long opt_known; /* `opt_val` may be used */
+	unsigned long opt_pending; /* Set before the host had the socket */
+	unsigned long opt_failed; /* The host refused the latest command */
+	unsigned long opt_timedout; /* Or it was not answered in time */
 };
 
+/**
+ * struct hss_sock_opt - A socket option passed on to the host
+ *
+ * @level The level applications set it at
+ * @optname The name applications set it by
+ * @opt The enum hss_sockopt it is sent as
+ * @stream_only Only TCP sockets have it
+ * @flag Only on or off, any other value is taken as on
+ * @zero_default Off or 0 on every host until set
+ */
+struct hss_sock_opt {
+	int level;
+	int optname;
+	int opt;
+	bool stream_only;
+	bool flag;
+	bool zero_default;
+};
+
+/*
+ * The options that matter for latency and throughput, nothing else is passed.
+ * getsockopt never reaches the socket for SOL_SOCKET, so those are only set.
+ */
+static const struct hss_sock_opt hss_sock_opts[] = {
+	{SOL_SOCKET, SO_KEEPALIVE, HSS_SO_KEEPALIVE, false, true, true},
+	{SOL_SOCKET, SO_SNDBUF, HSS_SO_SNDBUF, false, false, false},
+	{SOL_SOCKET, SO_RCVBUF, HSS_SO_RCVBUF, false, false, false},
+	{SOL_TCP, TCP_NODELAY, HSS_TCP_NODELAY, true, true, true},
+	{SOL_TCP, TCP_CORK, HSS_TCP_CORK, true, true, true},
+	{SOL_TCP, TCP_KEEPIDLE, HSS_TCP_KEEPIDLE, true, false, false},
+	{SOL_TCP, TCP_KEEPINTVL, HSS_TCP_KEEPINTVL, true, false, false},
+	{SOL_TCP, TCP_KEEPCNT, HSS_TCP_KEEPCNT, true, false, false},
+	{SOL_IP, IP_TOS, HSS_IP_TOS, false, false, true},
+	{SOL_IPV6, IPV6_TCLASS, HSS_IP_TOS, false, false, true},
+};
+
+/*
+ * Datagram sockets queue each datagram from the host as its own skb on
+ * sk_receive_queue instead of using the read cache. Where it came from is
+ * kept in its cb, AF_UNSPEC if the socket is connected.
+ */
+union hss_sock_addr {
+	struct sockaddr sa;
+	struct sockaddr_in in4;
+	struct sockaddr_in6 in6;
+};
+
+#define HSS_SKB_ADDR(skb) ((union hss_sock_addr *)(skb)->cb)
+
 static struct rhashtable_params ht_parms = {
 	.nelem_hint = 8,
 	.key_len = sizeof(int),
@@ -107,8 +179,9 @@ static int hss_sock_side_shutdown(struct socket *socket, int how)
 
 	hss_sock_side_shutdown_internal(sk, how);
 
-	/* Send shutdown to peer */
-	hss_proxy_close_socket(psk->local_id, g_proxy_context);
+	/* Send shutdown to peer, if it ever heard of the socket */
+	if (psk->opened)
+		hss_proxy_close_socket(psk->local_id, g_proxy_context);
 	return 0;
 }
 
@@ -146,6 +219,7 @@ static int hss_sock_side_release(struct socket *sock)
 
 		rhashtable_remove_fast(&g_hss_socket_table, &psk->hash,
 				       ht_parms);
+		skb_queue_purge(&sk->sk_receive_queue);
 		sock->sk = NULL;
 		sk->sk_shutdown = SHUTDOWN_MASK;
 		sk->sk_state_change(sk);
@@ -162,6 +236,187 @@ static int hss_sock_side_release(struct socket *sock)
 	return 0;
 }
 
+static bool hss_sock_credits(void)
+{
+	return hss_proxy_get_features(g_proxy_context) & HSS_FEATURE_CREDITS;
+}
+
+/**
+ * hss_sock_send_credit - Gets how much may be sent to the host right now
+ *
+ * @psk The socket to send on
+ *
+ * Returns: The bytes left in the socket's window, or INT_MAX if the host does
+ * not use credits.
+ */
+static int hss_sock_send_credit(struct hss_pinfo *psk)
+{
+	s32 credit;
+
+	if (!hss_sock_credits())
+		return INT_MAX;
+
+	credit = READ_ONCE(psk->snd_window) - psk->snd_sent;
+	return max(credit, 0);
+}
+
+/**
+ * hss_sock_transmit_credit - Moves the window the host gave a socket
+ *
+ * @sock_id The socket the host has room for
+ * @window The window from the host's HSS_E_CREDIT ACK
+ *
+ * Windows older than the current one are ignored. Writers waiting for credit
+ * are woken when the window moves.
+ *
+ * Note: Called in an atomic context
+ */
+void hss_sock_transmit_credit(int sock_id, u32 window)
+{
+	struct hss_pinfo *psk;
+	struct sock *sk;
+	u32 old;
+
+	rcu_read_lock();
+	sk = hss_get_sock(sock_id);
+	psk = (struct hss_pinfo *)sk;
+	if (!psk)
+		goto out;
+
+	/* ACKs are handled on several workers and may arrive out of order */
+	do {
+		old = READ_ONCE(psk->snd_window);
+		if (!hss_window_after(window, old))
+			goto out;
+	} while (cmpxchg(&psk->snd_window, old, window) != old);
+
+	sk->sk_write_space(sk);
+out:
+	rcu_read_unlock();
+}
+
+/**
+ * hss_sock_consumed - Records data read from a socket's read cache
+ *
+ * @psk The socket that was read
+ * @len The number of bytes read
+ * @drained Nothing is left to read
+ *
+ * Returns: The window to send the host, or 0 if it is not worth an ACK yet.
+ *
+ * Note: Caller must hold the sock lock
+ */
+static u32 hss_sock_consumed(struct hss_pinfo *psk, int len, bool drained)
+{
+	u32 window;
+
+	psk->rcv_consumed += len;
+	window = psk->rcv_consumed + HSS_INITIAL_WINDOW;
+
+	/*
+	 * Batch updates so a reader taking a few bytes at a time is cheap.
+	 * Once drained the whole window is opened, the host may be holding a
+	 * datagram that only fits in all of it.
+	 */
+	if (!hss_sock_credits() || window == psk->rcv_advertised ||
+		(!drained &&
+		(s32)(window - psk->rcv_advertised) < HSS_INITIAL_WINDOW / 4))
+		return 0;
+
+	psk->rcv_advertised = window;
+	return window;
+}
+
+/**
+ * hss_sock_find_opt - Looks up an option the host can set
+ *
+ * @sk The socket the option is for
+ * @level The level given to setsockopt or getsockopt
+ * @optname The name given to setsockopt or getsockopt
+ *
+ * Returns: The option or NULL if it is not passed on for @sk
+ */
+static const struct hss_sock_opt *hss_sock_find_opt(struct sock *sk,
+	int level, int optname)
+{
+	int i;
+
+	if (!(hss_proxy_get_features(g_proxy_context) & HSS_FEATURE_SOCKOPT))
+		return NULL;
+
+	for (i = 0; i < ARRAY_SIZE(hss_sock_opts); i++)
+		if (hss_sock_opts[i].level == level &&
+			hss_sock_opts[i].optname == optname)
+			break;
+	if (i == ARRAY_SIZE(hss_sock_opts) ||
+		(hss_sock_opts[i].stream_only && sk->sk_type != SOCK_STREAM))
+		return NULL;
+	return &hss_sock_opts[i];
+}
+
+/**
+ * hss_sock_flush_opts - Sends the options set before the host had a socket
+ *
+ * @psk The socket, which the host now has
+ */
+static void hss_sock_flush_opts(struct hss_pinfo *psk)
+{
+	int opt;
+
+	for_each_set_bit(opt, &psk->opt_pending, HSS_SOCKOPT_NUM)
+		if (test_and_clear_bit(opt, &psk->opt_pending))
+			hss_proxy_sockopt_socket(psk->local_id,
+				HSS_OP_SETSOCKOPT, opt,
+				READ_ONCE(psk->opt_val[opt]),
+				&psk->opt_msg_id[opt], g_proxy_context);
+}
+
+/**
+ * hss_sock_sockopt_ack - Caches what the host says an option is
+ *
+ * @sock_id The socket the option is of
+ * @ack The ACK to a SETSOCKOPT or GETSOCKOPT
+ *
+ * Only the ACK to the latest command for an option is used, so a value set
+ * while an older command is in flight is never overwritten by its answer.
+ * A refused option is dropped from the cache. Readers waiting on the host
+ * are woken.
+ *
+ * Note: Called in an atomic context
+ */
+void hss_sock_sockopt_ack(int sock_id, struct hss_packet *ack)
+{
+	struct hss_pinfo *psk;
+	struct sock *sk;
+	int opt = ack->ack.sockopt.option;
+
+	if (opt >= HSS_SOCKOPT_NUM)
+		return;
+
+	rcu_read_lock();
+	sk = hss_get_sock(sock_id);
+	psk = (struct hss_pinfo *)sk;
+	if (!psk || READ_ONCE(psk->opt_msg_id[opt]) != ack->hdr.msg_id)
+		goto out;
+
+	if (ack->ack.code == HSS_E_SUCCESS) {
+		WRITE_ONCE(psk->opt_val[opt], ack->ack.sockopt.value);
+		/* The value is in place before it is marked usable */
+		smp_mb__before_atomic();
+		set_bit(opt, &psk->opt_known);
+	} else {
+		clear_bit(opt, &psk->opt_known);
+		if (ack->ack.code == HSS_E_TIMEDOUT)
+			set_bit(opt, &psk->opt_timedout);
+		else
+			clear_bit(opt, &psk->opt_timedout);
+		set_bit(opt, &psk->opt_failed);
+	}
+	wake_up_interruptible_all(sk_sleep(sk));
+out:
+	rcu_read_unlock();
+}
+
 /**
  * Function for connecting a socket
  */
@@ -207,6 +462,10 @@ void hss_sock_connect_ack(int sock_id, struct hss_packet *packet)
 	
 	wq = rcu_dereference(sk->sk_wq);
 
+	/* Options set before the host had the socket can go now */
+	if (packet->ack.code == HSS_E_SUCCESS)
+		hss_sock_flush_opts(psk);
+
 	/* Let the sock know we got a response */
 	psk->wait_ack = packet;
 	atomic_set(&psk->state, HSS_SYN_RECV);
@@ -277,7 +536,72 @@ static size_t hss_realloc_shift(void **p, size_t new_size, gfp_t flags,
 	return new_size;
 }
 
-void hss_sock_transmit(int sock_id, void *data, int len)
+/**
+ * hss_sock_queue_datagram - Queues a datagram from the host on its socket
+ *
+ * @sk The datagram socket
+ * @from Where the datagram came from, NULL if the socket is connected
+ * @from_len The length of @from
+ * @data The datagram
+ * @len The length of @data
+ *
+ * The datagram is charged to the socket like any other received skb. One
+ * that doesn't fit in `sk_rcvbuf` is dropped and counted in `sk_drops`, as
+ * UDP does. A dropped datagram still moves the host's window on, it will
+ * never be read.
+ */
+static void hss_sock_queue_datagram(struct sock *sk, struct sockaddr *from,
+	int from_len, void *data, int len)
+{
+	struct hss_pinfo *psk = (struct hss_pinfo *)sk;
+	struct sk_buff *skb;
+	u32 window;
+	int ret;
+
+	BUILD_BUG_ON(sizeof(union hss_sock_addr) > sizeof(skb->cb));
+
+	skb = alloc_skb(len, GFP_KERNEL);
+	if (!skb) {
+		atomic_inc(&sk->sk_drops);
+		goto drop;
+	}
+	memcpy(skb_put(skb, len), data, len);
+
+	memset(HSS_SKB_ADDR(skb), 0, sizeof(union hss_sock_addr));
+	if (from)
+		memcpy(HSS_SKB_ADDR(skb), from,
+			min_t(int, from_len, sizeof(union hss_sock_addr)));
+
+	/* Wakes the reader once queued */
+	ret = sock_queue_rcv_skb(sk, skb);
+	if (!ret)
+		return;
+	kfree_skb(skb);
+
+drop:
+	pr_err_ratelimited("%s: Dropping a datagram, %d so far\n", __func__,
+		atomic_read(&sk->sk_drops));
+
+	lock_sock(sk);
+	window = hss_sock_consumed(psk, len,
+		skb_queue_empty(&sk->sk_receive_queue));
+	release_sock(sk);
+
+	if (window)
+		hss_proxy_send_credit(psk->local_id, window, g_proxy_context);
+}
+
+/**
+ * hss_sock_transmit - Hands data from the host to a socket
+ *
+ * @sock_id The socket the data is for
+ * @from Where a datagram came from, or NULL
+ * @from_len The length of @from
+ * @data The data, one whole datagram on a datagram socket
+ * @len The length of @data
+ */
+void hss_sock_transmit(int sock_id, struct sockaddr *from, int from_len,
+	void *data, int len)
 {
 	struct hss_pinfo *psk;
 	struct sock *sk;
@@ -295,6 +619,12 @@ void hss_sock_transmit(int sock_id, void *data, int len)
 
 	sk = &psk->sk;
 
+	/* Each datagram keeps its boundaries */
+	if (sk->sk_type == SOCK_DGRAM) {
+		hss_sock_queue_datagram(sk, from, from_len, data, len);
+		return;
+	}
+
 	lock_sock(sk);
 
 	/* How much space is currently in the buffer? */
@@ -335,21 +665,30 @@ void hss_sock_transmit(int sock_id, void *data, int len)
 }
 
 /**
- * Funciton for sending a CONNECT
+ * hss_sock_connect_locked - Connects a socket, opening it on the host first
+ * if that was held back
+ *
+ * @sk The socket to connect
+ * @addr The address to connect to, or a struct sockaddr_hss for a name
+ *	the host resolves
+ * @alen The length of @addr
+ * @data Data to send along with the connect, may be NULL
+ * @data_len The length of @data, set to the number of bytes sent
+ * @flags O_NONBLOCK to not wait for the connect to finish
+ *
+ * Returns: 0 once connected, -EINPROGRESS if not waiting or an error code
+ *
+ * Note: Caller must hold the sock lock
  */
-static int hss_sock_connect(struct socket *sock, struct sockaddr *addr,
-	int alen, int flags)
+static int hss_sock_connect_locked(struct sock *sk, struct sockaddr *addr,
+	int alen, void *data, int *data_len, int flags)
 {
 	struct hss_pinfo *psk;
-	struct sock *sk;
 	int state;
 	int ret = -1;
 
-	sk = sock->sk;
 	psk = (struct hss_pinfo *)sk;
 
-	lock_sock(sk);
-
 	state = atomic_read(&psk->state);
 
 	if (state == HSS_SYN_SENT) {
@@ -360,9 +699,44 @@ static int hss_sock_connect(struct socket *sock, struct sockaddr *addr,
 		int new_status;
 		long timeo = sock_sndtimeo(sk, flags & O_NONBLOCK);
 
+		/* Names are only resolved for streams */
+		if (addr->sa_family == AF_HSS && sk->sk_type != SOCK_STREAM) {
+			ret = -EAFNOSUPPORT;
+			goto out;
+		}
+
 		atomic_set(&psk->state, HSS_SYN_SENT);
-		hss_proxy_connect_socket(psk->local_id, addr, alen,
-			g_proxy_context);
+		if (addr->sa_family == AF_HSS) {
+			/* The host resolves the name and opens if needed */
+			ret = hss_proxy_connect_name_socket(psk->local_id,
+				addr, alen, g_proxy_context);
+			if (ret < 0) {
+				atomic_set(&psk->state, state);
+				goto out;
+			}
+			*data_len = 0;
+			psk->opened = true;
+		} else if (psk->opened) {
+			ret = hss_proxy_connect_socket(psk->local_id, addr,
+				alen, g_proxy_context);
+			if (ret < 0) {
+				atomic_set(&psk->state, state);
+				goto out;
+			}
+			*data_len = 0;
+		} else {
+			/* One command opens, connects and carries data */
+			ret = hss_proxy_open_connect_socket(psk->local_id,
+				sk->sk_type, addr, alen, data, *data_len,
+				g_proxy_context);
+			if (ret < 0) {
+				atomic_set(&psk->state, state);
+				goto out;
+			}
+			*data_len = ret;
+			psk->snd_sent += ret;
+			psk->opened = true;
+		}
 
 		/* Exit immediately if asked not to block */
 		if (!timeo || !hss_wait_for_connect(sk, timeo)) {
@@ -396,6 +770,187 @@ static int hss_sock_connect(struct socket *sock, struct sockaddr *addr,
 	}
 
 out:
+	return ret;
+}
+
+/**
+ * Funciton for sending a CONNECT
+ */
+static int hss_sock_connect(struct socket *sock, struct sockaddr *addr,
+	int alen, int flags)
+{
+	struct sock *sk = sock->sk;
+	int data_len = 0;
+	int ret;
+
+	lock_sock(sk);
+	ret = hss_sock_connect_locked(sk, addr, alen, NULL, &data_len, flags);
+	release_sock(sk);
+	return ret;
+}
+
+/**
+ * hss_sock_sendmsg_fastopen - Connects a socket with its first data
+ *
+ * @sk The socket, which the host has not opened yet
+ * @msg The message, `msg_name` holds the address to connect to
+ * @len The length of the message
+ *
+ * Like TCP Fast Open, the first bytes ride along with the OPEN_CONNECT.
+ *
+ * Returns: The number of bytes sent or an error code
+ *
+ * Note: Caller must hold the sock lock
+ */
+static int hss_sock_sendmsg_fastopen(struct sock *sk, struct msghdr *msg,
+	size_t len)
+{
+	void *data;
+	int data_len;
+	int ret;
+
+	if (msg->msg_namelen < sizeof(sa_family_t))
+		return -EINVAL;
+
+	/* A command never carries more than one transfer */
+	data_len = min_t(size_t, len, HSS_MAX_TRANSFER);
+	data = kmalloc(data_len, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	data_len = copy_from_iter(data, data_len, &msg->msg_iter);
+
+	ret = hss_sock_connect_locked(sk, msg->msg_name, msg->msg_namelen,
+		data, &data_len,
+		(msg->msg_flags & MSG_DONTWAIT) ? O_NONBLOCK : 0);
+	kfree(data);
+
+	/* Data that went out with the connect counts even if it is pending */
+	if ((!ret || ret == -EINPROGRESS) && data_len)
+		ret = data_len;
+	return ret;
+}
+
+static long hss_sock_wait_for_credit(struct sock *sk, int min_credit,
+	long timeo)
+{
+	struct hss_pinfo *psk = (struct hss_pinfo *)sk;
+	DEFINE_WAIT_FUNC(wait, woken_wake_function);
+
+	add_wait_queue(sk_sleep(sk), &wait);
+
+	while (hss_sock_send_credit(psk) < min_credit &&
+		!(sk->sk_shutdown & SEND_SHUTDOWN)) {
+		release_sock(sk);
+		timeo = wait_woken(&wait, TASK_INTERRUPTIBLE, timeo);
+		lock_sock(sk);
+
+		if (signal_pending(current) || !timeo)
+			break;
+	}
+
+	remove_wait_queue(sk_sleep(sk), &wait);
+	return timeo;
+}
+
+/* Gets the length of an IPv4 or IPv6 address, 0 for other families */
+static int hss_sock_ip_addr_len(struct sockaddr *addr)
+{
+	if (addr->sa_family == AF_INET)
+		return sizeof(struct sockaddr_in);
+	if (addr->sa_family == AF_INET6)
+		return sizeof(struct sockaddr_in6);
+	return 0;
+}
+
+/**
+ * hss_sock_sendmsg_dgram - Sends one datagram
+ *
+ * @sk The datagram socket
+ * @msg The message, `msg_name` may hold the address to send to
+ * @len The length of the message
+ *
+ * The datagram goes to the host whole, as one TRANSMIT to the connected
+ * address or one SENDTO. It waits until the host's window has room for all
+ * of it.
+ *
+ * Returns: @len or an error code
+ *
+ * Note: Caller must hold the sock lock, which is released before returning
+ */
+static int hss_sock_sendmsg_dgram(struct sock *sk, struct msghdr *msg,
+	size_t len)
+{
+	struct hss_pinfo *psk = (struct hss_pinfo *)sk;
+	void *data;
+	long timeo;
+	int ret;
+
+	if (!msg->msg_name && atomic_read(&psk->state) != HSS_ESTABLISHED) {
+		ret = -EDESTADDRREQ;
+		goto out_release;
+	}
+
+	/* The host only sends to IP addresses */
+	if (msg->msg_name) {
+		ret = hss_sock_ip_addr_len(msg->msg_name);
+		if (!ret || msg->msg_namelen < ret) {
+			ret = ret ? -EINVAL : -EAFNOSUPPORT;
+			goto out_release;
+		}
+	}
+
+	if (len > hss_proxy_max_datagram(g_proxy_context)) {
+		ret = -EMSGSIZE;
+		goto out_release;
+	}
+
+	if (hss_sock_send_credit(psk) < len) {
+		timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
+		if (timeo)
+			timeo = hss_sock_wait_for_credit(sk, len, timeo);
+
+		/* If interrupted the error is either -ERESTARTSYS or -EINTR */
+		if (signal_pending(current)) {
+			ret = sock_intr_errno(timeo);
+			goto out_release;
+		}
+
+		if (sk->sk_shutdown & SEND_SHUTDOWN) {
+			ret = -EPIPE;
+			goto out_release;
+		}
+
+		if (hss_sock_send_credit(psk) < len) {
+			ret = -EAGAIN;
+			goto out_release;
+		}
+	}
+
+	data = kmalloc(len, GFP_KERNEL);
+	if (!data) {
+		ret = -ENOMEM;
+		goto out_release;
+	}
+	if (copy_from_iter(data, len, &msg->msg_iter) != len) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+	psk->snd_sent += len;
+
+	/* This operation can be lengthy and we don't need the lock */
+	release_sock(sk);
+	if (msg->msg_name)
+		ret = hss_proxy_sendto_socket(psk->local_id, msg->msg_name,
+			msg->msg_namelen, data, len, g_proxy_context);
+	else
+		ret = hss_proxy_write_socket(psk->local_id, data, len,
+			g_proxy_context);
+	kfree(data);
+	return ret;
+
+out_free:
+	kfree(data);
+out_release:
 	release_sock(sk);
 	return ret;
 }
@@ -409,6 +964,8 @@ static int hss_sock_sendmsg(struct socket *sock,
 	void *data;
 	int bytes_copied;
 	int bytes_sent;
+	int credit;
+	long timeo;
 	struct hss_pinfo *psk;
 	struct sock *sk;
 
@@ -429,15 +986,55 @@ static int hss_sock_sendmsg(struct socket *sock,
 		goto out_release;
 	}
 
+	if (sk->sk_type == SOCK_DGRAM) {
+		bytes_sent = hss_sock_sendmsg_dgram(sk, msg, len);
+		goto out_nolock;
+	}
+
+	/* Open and connect in one go if the host was never told of the sock */
+	if ((msg->msg_flags & MSG_FASTOPEN) && msg->msg_name && !psk->opened) {
+		bytes_sent = hss_sock_sendmsg_fastopen(sk, msg, len);
+		goto out_release;
+	}
+
 	/* If not connected */
 	if (atomic_read(&psk->state) != HSS_ESTABLISHED) {
 		bytes_sent = -ENOTCONN;
 		goto out_release;
 	}
 
+	/* Wait for the host to have room for some of the data */
+	credit = hss_sock_send_credit(psk);
+	if (!credit) {
+		timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
+		if (timeo)
+			timeo = hss_sock_wait_for_credit(sk, 1, timeo);
+
+		/* If interrupted the error is either -ERESTARTSYS or -EINTR */
+		if (signal_pending(current)) {
+			bytes_sent = sock_intr_errno(timeo);
+			goto out_release;
+		}
+
+		if (sk->sk_shutdown & SEND_SHUTDOWN) {
+			bytes_sent = -EPIPE;
+			goto out_release;
+		}
+
+		credit = hss_sock_send_credit(psk);
+		if (!credit) {
+			bytes_sent = -EAGAIN;
+			goto out_release;
+		}
+	}
+
+	/* Stream sockets may send less than asked */
+	len = min_t(size_t, len, credit);
+
 	/* Copy the data over */
 	data = kmalloc(len, GFP_KERNEL);
 	bytes_copied = copy_from_iter(data, len, &msg->msg_iter);
+	psk->snd_sent += bytes_copied;
 
 	/* This operation can be lengthy and we don't need the lock */
 	release_sock(sk);
@@ -452,6 +1049,20 @@ out_nolock:
 	return bytes_sent;
 }
 
+/*
+ * Whether a reader waiting for @min_bytes may go on. A datagram reader goes
+ * on for any datagram or once the host has shut the socket down.
+ */
+static bool hss_sock_rx_ready(struct hss_pinfo *psk, int min_bytes)
+{
+	struct sock *sk = &psk->sk;
+
+	if (sk->sk_type == SOCK_DGRAM)
+		return !skb_queue_empty(&sk->sk_receive_queue) ||
+			(sk->sk_shutdown & RCV_SHUTDOWN);
+	return psk->read_cache_bytes_used >= min_bytes;
+}
+
 static int hss_sock_wait_for_data(struct socket *sock,
 	int min_bytes, int timeo)
 {
@@ -464,7 +1075,7 @@ static int hss_sock_wait_for_data(struct socket *sock,
 	DEFINE_WAIT_FUNC(wait, woken_wake_function);
 	add_wait_queue(sk_sleep(sk), &wait);
 
-	while (psk->read_cache_bytes_used < min_bytes) {
+	while (!hss_sock_rx_ready(psk, min_bytes)) {
 		release_sock(sk);
 		timeo = wait_woken(&wait, TASK_INTERRUPTIBLE, timeo);
 		lock_sock(sk);
@@ -477,6 +1088,90 @@ static int hss_sock_wait_for_data(struct socket *sock,
 	return timeo;
 }
 
+/**
+ * hss_sock_recvmsg_dgram - Receives one datagram
+ *
+ * @sock The datagram socket
+ * @msg The message to fill, `msg_name` gets the source if asked for
+ * @size The room in @msg
+ * @flags MSG_DONTWAIT, MSG_PEEK and MSG_TRUNC are honored
+ *
+ * The rest of a datagram longer than @size is dropped and MSG_TRUNC set.
+ *
+ * Returns: The bytes copied, or the length of the datagram with MSG_TRUNC,
+ * 0 once the host has shut the socket down or an error code
+ */
+static int hss_sock_recvmsg_dgram(struct socket *sock, struct msghdr *msg,
+	size_t size, int flags)
+{
+	struct sock *sk = sock->sk;
+	struct hss_pinfo *psk = (struct hss_pinfo *)sk;
+	union hss_sock_addr *from;
+	struct sk_buff *skb;
+	u32 window = 0;
+	long timeo;
+	int copied;
+	int ret = 0;
+
+	lock_sock(sk);
+
+	if (skb_queue_empty(&sk->sk_receive_queue)) {
+		if (sk->sk_shutdown & RCV_SHUTDOWN)
+			goto out;
+
+		timeo = sock_rcvtimeo(sk, flags & MSG_DONTWAIT);
+		if (!timeo) {
+			ret = -EWOULDBLOCK;
+			goto out;
+		}
+		timeo = hss_sock_wait_for_data(sock, 1, timeo);
+
+		/* If interrupted the error is either -ERESTARTSYS or -EINTR */
+		if (signal_pending(current)) {
+			ret = sock_intr_errno(timeo);
+			goto out;
+		}
+	}
+
+	if (flags & MSG_PEEK)
+		skb = skb_peek(&sk->sk_receive_queue);
+	else
+		skb = skb_dequeue(&sk->sk_receive_queue);
+	if (!skb) {
+		ret = (sk->sk_shutdown & RCV_SHUTDOWN) ? 0 : -EAGAIN;
+		goto out;
+	}
+
+	copied = min_t(size_t, size, skb->len);
+	ret = skb_copy_datagram_msg(skb, 0, msg, copied);
+	if (ret)
+		goto out_free;
+	if (copied < skb->len)
+		msg->msg_flags |= MSG_TRUNC;
+
+	from = HSS_SKB_ADDR(skb);
+	if (msg->msg_name && from->sa.sa_family != AF_UNSPEC) {
+		msg->msg_namelen = hss_sock_ip_addr_len(&from->sa);
+		memcpy(msg->msg_name, from, msg->msg_namelen);
+	}
+
+	ret = (flags & MSG_TRUNC) ? skb->len : copied;
+
+out_free:
+	if (!(flags & MSG_PEEK)) {
+		window = hss_sock_consumed(psk, skb->len,
+			skb_queue_empty(&sk->sk_receive_queue));
+		kfree_skb(skb);
+	}
+out:
+	release_sock(sk);
+
+	/* Let the host send into the space that was just freed */
+	if (window)
+		hss_proxy_send_credit(psk->local_id, window, g_proxy_context);
+	return ret;
+}
+
 /**
  * Function for recv msg from the socket
  */
@@ -487,11 +1182,15 @@ static int hss_sock_recvmsg(struct socket *sock,
 	int target;
 	long timeo;
 	struct sock *sk;
+	u32 window = 0;
 	int ret = 0;
 
 	sk = sock->sk;
 	psk = (struct hss_pinfo *)sk;
 
+	if (sk->sk_type == SOCK_DGRAM)
+		return hss_sock_recvmsg_dgram(sock, msg, size, flags);
+
 	lock_sock(sock->sk);
 
 	timeo = sock_sndtimeo(sk, flags & MSG_DONTWAIT);
@@ -523,13 +1222,196 @@ static int hss_sock_recvmsg(struct socket *sock,
 			ret, &msg->msg_iter);
 		psk->read_cache_bytes_used -= ret;
 		psk->read_cache_offset += ret;
+		window = hss_sock_consumed(psk, ret, false);
 	}
 
 out:
 	release_sock(sock->sk);
+
+	/* Let the host send into the space that was just freed */
+	if (window)
+		hss_proxy_send_credit(psk->local_id, window, g_proxy_context);
 	return ret;
 }
 
+/**
+ * hss_sock_setsockopt - Sets an option of the host socket
+ *
+ * @sock The socket
+ * @level The level of the option
+ * @optname The option, only those in hss_sock_opts are known
+ * @optval The value, an int
+ * @optlen The length of @optval
+ *
+ * The value is cached at once and the SETSOCKOPT is not waited on. Its ACK
+ * replaces the cached value with the one the host socket ended up with, such
+ * as a buffer size the host doubled. Options set before the host has the
+ * socket are sent once it is connected.
+ *
+ * SOL_SOCKET options come here as well, see hss_sock_create. They are set on
+ * the local sock first, which is where getsockopt reads them back from, and
+ * the ones in hss_sock_opts are then passed on.
+ *
+ * Returns: 0 or an error code
+ */
+static int hss_sock_setsockopt(struct socket *sock, int level, int optname,
+	char __user *optval, unsigned int optlen)
+{
+	struct sock *sk = sock->sk;
+	struct hss_pinfo *psk = (struct hss_pinfo *)sk;
+	const struct hss_sock_opt *o;
+	int ret = 0;
+	int val;
+
+	if (level == SOL_SOCKET) {
+		ret = sock_setsockopt(sock, level, optname, optval, optlen);
+		if (ret)
+			return ret;
+	}
+
+	o = hss_sock_find_opt(sk, level, optname);
+	if (!o)
+		return level == SOL_SOCKET ? 0 : -ENOPROTOOPT;
+
+	if (optlen < sizeof(int))
+		return -EINVAL;
+	if (get_user(val, (int __user *)optval))
+		return -EFAULT;
+	if (val < 0)
+		return -EINVAL;
+	if (o->flag)
+		val = !!val;
+
+	lock_sock(sk);
+	WRITE_ONCE(psk->opt_val[o->opt], val);
+	clear_bit(o->opt, &psk->opt_failed);
+	set_bit(o->opt, &psk->opt_known);
+	if (psk->opened)
+		ret = hss_proxy_sockopt_socket(psk->local_id,
+			HSS_OP_SETSOCKOPT, o->opt, val,
+			&psk->opt_msg_id[o->opt], g_proxy_context);
+	else
+		set_bit(o->opt, &psk->opt_pending);
+	release_sock(sk);
+
+	return ret;
+}
+
+static long hss_sock_wait_for_opt(struct sock *sk, int opt, long timeo)
+{
+	struct hss_pinfo *psk = (struct hss_pinfo *)sk;
+	DEFINE_WAIT_FUNC(wait, woken_wake_function);
+
+	add_wait_queue(sk_sleep(sk), &wait);
+
+	while (!test_bit(opt, &psk->opt_known) &&
+		!test_bit(opt, &psk->opt_failed)) {
+		release_sock(sk);
+		timeo = wait_woken(&wait, TASK_INTERRUPTIBLE, timeo);
+		lock_sock(sk);
+
+		if (signal_pending(current) || !timeo)
+			break;
+	}
+
+	remove_wait_queue(sk_sleep(sk), &wait);
+	return timeo;
+}
+
+/**
+ * hss_sock_fetch_opt - Caches an option that was never set or answered
+ *
+ * @sk The socket
+ * @o The option
+ *
+ * Asks the host with a GETSOCKOPT and waits for the answer. Before the host
+ * has the socket only options known to start at 0 can be given.
+ *
+ * Returns: 0 once the option is cached or an error code
+ *
+ * Note: Caller must hold the sock lock
+ */
+static int hss_sock_fetch_opt(struct sock *sk, const struct hss_sock_opt *o)
+{
+	struct hss_pinfo *psk = (struct hss_pinfo *)sk;
+	long timeo;
+	int ret;
+
+	if (!psk->opened) {
+		if (!o->zero_default)
+			return -ENOTCONN;
+		WRITE_ONCE(psk->opt_val[o->opt], 0);
+		set_bit(o->opt, &psk->opt_known);
+		return 0;
+	}
+
+	clear_bit(o->opt, &psk->opt_failed);
+	ret = hss_proxy_sockopt_socket(psk->local_id, HSS_OP_GETSOCKOPT,
+		o->opt, 0, &psk->opt_msg_id[o->opt], g_proxy_context);
+	if (ret)
+		return ret;
+
+	timeo = hss_sock_wait_for_opt(sk, o->opt, sk->sk_sndtimeo);
+
+	/* If interrupted the error is either -ERESTARTSYS or -EINTR */
+	if (signal_pending(current))
+		return sock_intr_errno(timeo);
+
+	if (test_bit(o->opt, &psk->opt_known))
+		return 0;
+	if (test_bit(o->opt, &psk->opt_failed) &&
+		!test_bit(o->opt, &psk->opt_timedout))
+		return -ENOPROTOOPT;
+	return -ETIMEDOUT;
+}
+
+/**
+ * hss_sock_getsockopt - Gets an option of the host socket
+ *
+ * @sock The socket
+ * @level The level of the option
+ * @optname The option, only those in hss_sock_opts are known
+ * @optval Set to the value, an int
+ * @optlen The room in @optval, set to the length written
+ *
+ * Answered from the socket's cache, the host is only asked about options
+ * that were never set.
+ *
+ * Returns: 0 or an error code
+ */
+static int hss_sock_getsockopt(struct socket *sock, int level, int optname,
+	char __user *optval, int __user *optlen)
+{
+	struct sock *sk = sock->sk;
+	struct hss_pinfo *psk = (struct hss_pinfo *)sk;
+	const struct hss_sock_opt *o;
+	int ret = 0;
+	int val;
+	int len;
+
+	o = hss_sock_find_opt(sk, level, optname);
+	if (!o)
+		return -ENOPROTOOPT;
+
+	if (get_user(len, optlen))
+		return -EFAULT;
+	if (len < 0)
+		return -EINVAL;
+
+	lock_sock(sk);
+	if (!test_bit(o->opt, &psk->opt_known))
+		ret = hss_sock_fetch_opt(sk, o);
+	val = READ_ONCE(psk->opt_val[o->opt]);
+	release_sock(sk);
+	if (ret)
+		return ret;
+
+	len = min_t(unsigned int, len, sizeof(int));
+	if (put_user(len, optlen) || copy_to_user(optval, &val, len))
+		return -EFAULT;
+	return 0;
+}
+
 static unsigned int hss_sock_poll(struct file *file, struct socket *socket,
 	poll_table *wait)
 {
@@ -555,11 +1437,17 @@ static unsigned int hss_sock_poll(struct file *file, struct socket *socket,
 		mask |= POLLIN | POLLRDNORM | POLLRDHUP;
 
 	/* Decide readability */
-	if (psk->read_cache_bytes_used > 0)
+	if (psk->read_cache_bytes_used > 0 ||
+		!skb_queue_empty(&sk->sk_receive_queue))
 		mask |= POLLIN | POLLRDNORM;
 
-	/* Connected sockets are always writable */
-	if (state == HSS_ESTABLISHED)
+	/*
+	 * Connected sockets, and open datagram sockets which can send to any
+	 * address, are writable while the host has room
+	 */
+	if ((state == HSS_ESTABLISHED ||
+		(sk->sk_type == SOCK_DGRAM && psk->opened)) &&
+		hss_sock_send_credit(psk))
 		mask |= POLLOUT | POLLWRNORM | POLLWRBAND;
 
 	return mask;
@@ -580,8 +1468,8 @@ static const struct proto_ops hss_ops = {
 	.getname	= sock_no_getname,
 	.sendmsg	= hss_sock_sendmsg,
 	.recvmsg	= hss_sock_recvmsg,
-	.setsockopt	= sock_no_setsockopt,
-	.getsockopt	= sock_no_getsockopt,
+	.setsockopt	= hss_sock_setsockopt,
+	.getsockopt	= hss_sock_getsockopt,
 	.ioctl		= sock_no_ioctl,
 	.poll		= hss_sock_poll,
 	.socketpair	= sock_no_socketpair,
@@ -614,7 +1502,8 @@ static struct sock *hss_sock_alloc(struct net *net, struct socket *sock,
 	sk->sk_destruct = NULL;
 	sk->sk_sndtimeo = HSS_SK_SND_TIMEO;
 	sk->sk_sndbuf = HSS_SK_BUFF_SIZE;
-	sk->sk_rcvbuf = HSS_SK_BUFF_SIZE;
+	sk->sk_rcvbuf = sock->type == SOCK_DGRAM ? HSS_SK_DGRAM_RCVBUF :
+		HSS_SK_BUFF_SIZE;
 
 	refcount_set(&sk->sk_refcnt, 1);
 
@@ -657,9 +1546,19 @@ static int hss_sock_create(struct net *net, struct socket *sock, int protocol,
 	int ret;
 	long timeo;
 
+	/* Datagram sockets need the host to keep their boundaries */
+	if (sock->type == SOCK_DGRAM &&
+		!(hss_proxy_get_features(g_proxy_context) & HSS_FEATURE_DGRAM))
+		return -EPROTONOSUPPORT;
+	if (sock->type != SOCK_STREAM && sock->type != SOCK_DGRAM)
+		return -ESOCKTNOSUPPORT;
+
 	sock->state = SS_UNCONNECTED;
 	sock->ops = &hss_ops;
 
+	/* Lets SOL_SOCKET options be passed on by hss_sock_setsockopt */
+	set_bit(SOCK_CUSTOM_SOCKOPT, &sock->flags);
+
 	sk = hss_sock_alloc(net, sock, protocol, GFP_ATOMIC, kern);
 	if (!sk) {
 		pr_err("hss_proxy: ENOMEM when creating socket\n");
@@ -669,15 +1568,33 @@ static int hss_sock_create(struct net *net, struct socket *sock, int protocol,
 
 	psk =  (struct hss_pinfo *)sk;
 	atomic_set(&psk->state, HSS_UNOPEN);
+	psk->snd_window = HSS_INITIAL_WINDOW;
+	psk->rcv_advertised = HSS_INITIAL_WINDOW;
 
 	/* Create the socks entry in our table */
 	psk->local_id = atomic_inc_return(&g_sock_id);
 	rhashtable_lookup_insert_fast(&g_hss_socket_table,
 		&psk->hash, ht_parms);
+
+	/*
+	 * The host opens a stream when it is connected. Datagram sockets
+	 * may send without ever connecting so they are opened now.
+	 */
+	if (sock->type == SOCK_STREAM &&
+		(hss_proxy_get_features(g_proxy_context) &
+		HSS_FEATURE_OPEN_CONNECT)) {
+		ret = 0;
+		goto out;
+	}
 	atomic_set(&psk->state, HSS_CLOSE);
 
 	/* Send the OPEN command to the proxy */
-	hss_proxy_open_socket(psk->local_id, g_proxy_context);
+	ret = hss_proxy_open_socket(psk->local_id, sock->type, g_proxy_context);
+	if (ret) {
+		rhashtable_remove_fast(&g_hss_socket_table, &psk->hash,
+			ht_parms);
+		goto out;
+	}
 
 	/* Block until we get an ACK */
 	/* Blocking it assumed to be allowed for the time being */
@@ -701,6 +1618,10 @@ static int hss_sock_create(struct net *net, struct socket *sock, int protocol,
 		pr_err("hss_proxy: Host failed OPEN with code %d", ret);
 		rhashtable_remove_fast(&g_hss_socket_table, &psk->hash,
 			ht_parms);
+		/* The proxy gives up on an OPEN the host never answers */
+		ret = ret == HSS_E_TIMEDOUT ? -ETIMEDOUT : -EIO;
+	} else {
+		psk->opened = true;
 	}
 
 	/* The proxy expects us to free the buffer */
@@ -733,11 +1654,13 @@ void hss_sock_open_ack(int sock_id, struct hss_packet *ack)
 	if (!psk) {
 		pr_err("%s: Sock %d not found\n",
 			__func__, sock_id);
+		kfree(ack);
 		return;
 	}
 	if (psk->wait_ack) {
 		pr_err("%s: Sock %d busy\n",
 			__func__, sock_id);
+		kfree(ack);
 		return;
 	}
 
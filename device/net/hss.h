@@ -1,4 +1,15 @@
-int hss_proxy_open_socket(int local_id, void *context);
+int hss_proxy_open_socket(int local_id, int type, void *context);
 int hss_proxy_connect_socket(int local_id, struct sockaddr *addr, int alen, void *context);
+int hss_proxy_open_connect_socket(int local_id, int type,
+	struct sockaddr *addr, int alen, void *data, int len, void *context);
+int hss_proxy_connect_name_socket(int local_id, struct sockaddr *addr,
+	int alen, void *context);
 void hss_proxy_close_socket(int local_id, void *context);
-int hss_proxy_write_socket(int sock_id, void *msg, int len, void *context);
\ No newline at end of file
+int hss_proxy_write_socket(int sock_id, void *msg, int len, void *context);
+int hss_proxy_sendto_socket(int sock_id, struct sockaddr *addr, int alen,
+	void *data, int len, void *context);
+int hss_proxy_max_datagram(void *context);
+int hss_proxy_sockopt_socket(int local_id, int opcode, int opt, u32 value,
+	u16 *msg_id, void *context);
+void hss_proxy_send_credit(int local_id, u32 window, void *context);
+u32 hss_proxy_get_features(void *context);
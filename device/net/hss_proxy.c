@@ -2,6 +2,8 @@
 #include <linux/module.h>
 #include <linux/device.h>
 #include <linux/usb/composite.h>
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
 #include <linux/mutex.h>
 #include <linux/net.h>
 #include <linux/hss.h>
@@ -9,17 +11,58 @@
 #include <net/sock.h>
 #include <net/hss.h>
 
+/*
+ * Bounds on how long a command the host answers at once waits for its ACK.
+ * Until the first round trip is measured the RTO is a second, as RFC 6298
+ * starts out. Times are in milliseconds.
+ */
+#define HSS_RTO_INIT 1000
+#define HSS_RTO_MIN 50
+#define HSS_ACK_TIMEOUT 10000
+
+/**
+ * struct hss_proxy_pending - A command waiting for its ACK
+ *
+ * @node On the proxy's `pending` table, by @msg_id
+ * @msg_id The message ID the ACK carries
+ * @sock_id The socket the ACK names
+ * @opcode The command
+ * @option The enum hss_sockopt of a SETSOCKOPT or GETSOCKOPT
+ * @sent When the command was handed to the USB driver
+ * @expires When the command is given up in jiffies, or 0 for one the host
+ *	only answers once the network has, such as a CONNECT
+ */
+struct hss_proxy_pending {
+	struct hlist_node node;
+	u16 msg_id;
+	u32 sock_id;
+	enum hss_opcode opcode;
+	int option;
+	ktime_t sent;
+	unsigned long expires;
+};
+
 /* HSS Proxy internal functions */
 struct hss_proxy_inst {
 	void *usb_context;
 	struct hss_usb_descriptor *usb_intf;
 	atomic_t hss_msg_id;
-	spinlock_t ack_list_lock;
 	struct workqueue_struct *ack_wq;
 	struct workqueue_struct *data_wq;
-	struct list_head ack_list;
+	/* Commands waiting for an ACK, see struct hss_proxy_pending */
+	spinlock_t pending_lock;
+	DECLARE_HASHTABLE(pending, 6);
+	struct delayed_work expire_work;
+	unsigned long expire_at; /* When `expire_work` is due, 0 if it is not */
+	/* Command round trip estimates as in RFC 6298, under `pending_lock` */
+	u32 srtt_us;
+	u32 rttvar_us;
+	u32 rto_us;
+	atomic_t cmd_timeouts; /* Commands given up on */
 	char *carry_pkt; /* A persistent holder for a single HSS packet that has been split into multiple USB transfers */
 	int carry_pkt_len;
+	int max_transfer; /* Largest packet the host will take, set by the USB driver */
+	u32 features; /* HSS_FEATURE_* flags enabled by the host */
 };
 
 struct hss_proxy_work {
@@ -51,6 +94,322 @@ static int hss_proxy_get_msg_id(struct hss_proxy_inst *proxy_context)
 	return id;
 }
 
+/**
+ * hss_proxy_send_cmd - Sends a command to the host
+ *
+ * @proxy_inst The HSS proxy context
+ * @cmd The serialized command
+ * @len The length of @cmd
+ *
+ * With HSS_FEATURE_INBAND_CMD the command is queued on the bulk channel
+ * behind any TRANSMITs already sent, otherwise it goes out on the interrupt
+ * channel.
+ */
+static void hss_proxy_send_cmd(struct hss_proxy_inst *proxy_inst, char *cmd,
+	size_t len)
+{
+	if (hss_proxy_get_features(proxy_inst) & HSS_FEATURE_INBAND_CMD)
+		proxy_inst->usb_intf->hss_transfer(cmd, len, NULL, 0,
+			proxy_inst->usb_context);
+	else
+		proxy_inst->usb_intf->hss_cmd(cmd, len,
+			proxy_inst->usb_context);
+}
+
+/**
+ * hss_proxy_rtt_sample - Folds a command round trip into the estimates
+ *
+ * @proxy_inst The HSS proxy context
+ * @rtt_us The time from sending a command to its ACK
+ *
+ * As for TCP in RFC 6298 the RTO is the smoothed RTT plus four times its
+ * variation, within HSS_RTO_MIN and HSS_ACK_TIMEOUT.
+ *
+ * Note: Caller must hold `pending_lock`
+ */
+static void hss_proxy_rtt_sample(struct hss_proxy_inst *proxy_inst,
+	u32 rtt_us)
+{
+	u32 srtt = proxy_inst->srtt_us;
+	u32 rttvar = proxy_inst->rttvar_us;
+	u32 rto;
+
+	if (!srtt) {
+		srtt = max(rtt_us, 1U);
+		rttvar = rtt_us / 2;
+	} else {
+		rttvar = rttvar - rttvar / 4 +
+			(srtt > rtt_us ? srtt - rtt_us : rtt_us - srtt) / 4;
+		srtt = srtt - srtt / 8 + rtt_us / 8;
+	}
+	rto = clamp_t(u32, srtt + 4 * rttvar, HSS_RTO_MIN * USEC_PER_MSEC,
+		HSS_ACK_TIMEOUT * USEC_PER_MSEC);
+
+	WRITE_ONCE(proxy_inst->srtt_us, srtt);
+	WRITE_ONCE(proxy_inst->rttvar_us, rttvar);
+	WRITE_ONCE(proxy_inst->rto_us, rto);
+}
+
+/**
+ * hss_proxy_track - Records a command that is about to be sent
+ *
+ * @proxy_inst The HSS proxy context
+ * @packet The command
+ * @sock_id The socket its ACK will name
+ *
+ * OPEN, CLOSE, SETSOCKOPT and GETSOCKOPT are answered by the host at once.
+ * Their round trips feed the RTO and they are given up once it passes.
+ * Connects are only answered once the host's connect finishes, so they are
+ * left to the socket's own timeout.
+ *
+ * Returns: 0 or -ENOMEM
+ */
+static int hss_proxy_track(struct hss_proxy_inst *proxy_inst,
+	struct hss_packet *packet, u32 sock_id)
+{
+	struct hss_proxy_pending *pending;
+	unsigned long flags;
+	unsigned long rto;
+
+	pending = kmalloc(sizeof(*pending), GFP_KERNEL);
+	if (!pending)
+		return -ENOMEM;
+
+	pending->msg_id = packet->hdr.msg_id;
+	pending->sock_id = sock_id;
+	pending->opcode = packet->hdr.opcode;
+	pending->option = 0;
+	pending->expires = 0;
+	if (packet->hdr.opcode == HSS_OP_SETSOCKOPT ||
+		packet->hdr.opcode == HSS_OP_GETSOCKOPT)
+		pending->option = packet->sockopt.option;
+
+	spin_lock_irqsave(&proxy_inst->pending_lock, flags);
+	switch (packet->hdr.opcode) {
+	case HSS_OP_OPEN:
+	case HSS_OP_CLOSE:
+	case HSS_OP_SETSOCKOPT:
+	case HSS_OP_GETSOCKOPT:
+		rto = max(usecs_to_jiffies(proxy_inst->rto_us), 1UL);
+		pending->expires = jiffies + rto;
+
+		/* A fresh sample can make this due before the queued work */
+		if (!proxy_inst->expire_at ||
+			time_before(pending->expires, proxy_inst->expire_at)) {
+			proxy_inst->expire_at = pending->expires;
+			mod_delayed_work(proxy_inst->ack_wq,
+				&proxy_inst->expire_work, rto);
+		}
+		break;
+	default:
+		break;
+	}
+	pending->sent = ktime_get();
+	hash_add(proxy_inst->pending, &pending->node, pending->msg_id);
+	spin_unlock_irqrestore(&proxy_inst->pending_lock, flags);
+
+	return 0;
+}
+
+/**
+ * hss_proxy_untrack - Matches an ACK to the command it answers
+ *
+ * @proxy_inst The HSS proxy context
+ * @ack The ACK
+ *
+ * Returns: true if the command was waiting, it no longer is
+ *
+ * Note: May be called in an atomic context
+ */
+static bool hss_proxy_untrack(struct hss_proxy_inst *proxy_inst,
+	struct hss_packet *ack)
+{
+	struct hss_proxy_pending *pending;
+	unsigned long flags;
+	bool found = false;
+
+	spin_lock_irqsave(&proxy_inst->pending_lock, flags);
+	hash_for_each_possible(proxy_inst->pending, pending, node,
+		ack->hdr.msg_id) {
+		if (pending->msg_id != ack->hdr.msg_id ||
+			pending->opcode != ack->ack.orig_opcode ||
+			pending->sock_id != ack->hdr.sock_id)
+			continue;
+
+		hash_del(&pending->node);
+		if (pending->expires)
+			hss_proxy_rtt_sample(proxy_inst, ktime_us_delta(
+				ktime_get(), pending->sent));
+		found = true;
+		break;
+	}
+	spin_unlock_irqrestore(&proxy_inst->pending_lock, flags);
+
+	if (found)
+		kfree(pending);
+	return found;
+}
+
+/**
+ * hss_proxy_untrack_socket - Forgets every command sent for a socket
+ *
+ * @proxy_inst The HSS proxy context
+ * @sock_id The socket, which is going away
+ */
+static void hss_proxy_untrack_socket(struct hss_proxy_inst *proxy_inst,
+	u32 sock_id)
+{
+	struct hss_proxy_pending *pending;
+	struct hlist_node *tmp;
+	unsigned long flags;
+	HLIST_HEAD(done);
+	int bkt;
+
+	spin_lock_irqsave(&proxy_inst->pending_lock, flags);
+	hash_for_each_safe(proxy_inst->pending, bkt, tmp, pending, node) {
+		if (pending->sock_id != sock_id)
+			continue;
+		hash_del(&pending->node);
+		hlist_add_head(&pending->node, &done);
+	}
+	spin_unlock_irqrestore(&proxy_inst->pending_lock, flags);
+
+	hlist_for_each_entry_safe(pending, tmp, &done, node)
+		kfree(pending);
+}
+
+/**
+ * hss_proxy_give_up - Fails a command whose ACK never came
+ *
+ * @proxy_inst The HSS proxy context
+ * @pending The command, no longer tracked
+ *
+ * Whoever waits on the command is handed an ACK with HSS_E_TIMEDOUT in place
+ * of the host's.
+ */
+static void hss_proxy_give_up(struct hss_proxy_inst *proxy_inst,
+	struct hss_proxy_pending *pending)
+{
+	struct hss_packet *ack;
+
+	pr_err("%s: No ACK to op %d on socket %u after %lld us\n", __func__,
+		pending->opcode, pending->sock_id,
+		ktime_us_delta(ktime_get(), pending->sent));
+
+	if (pending->opcode != HSS_OP_OPEN &&
+		pending->opcode != HSS_OP_SETSOCKOPT &&
+		pending->opcode != HSS_OP_GETSOCKOPT)
+		return;
+
+	ack = kzalloc(sizeof(*ack), GFP_KERNEL);
+	if (!ack)
+		return;
+	hss_fill_packet(ack, HSS_OP_ACK, pending->sock_id, pending->msg_id);
+	ack->hdr.payload_len = HSS_FIXED_LEN_ACK - HSS_HDR_LEN;
+	ack->ack.orig_opcode = pending->opcode;
+	ack->ack.code = HSS_E_TIMEDOUT;
+
+	if (pending->opcode == HSS_OP_OPEN) {
+		/* The socket keeps the ACK */
+		hss_sock_open_ack(pending->sock_id, ack);
+		return;
+	}
+
+	ack->ack.sockopt.option = pending->option;
+	hss_sock_sockopt_ack(pending->sock_id, ack);
+	kfree(ack);
+}
+
+/**
+ * hss_proxy_expire_work - Gives up on commands past their RTO
+ *
+ * @work The proxy's `expire_work`
+ *
+ * The RTO is doubled for every round that gives up on something, as TCP
+ * backs off, until an ACK brings a new sample. The work runs again when
+ * the next command is due, hss_proxy_track brings that forward for a
+ * command due sooner.
+ */
+static void hss_proxy_expire_work(struct work_struct *work)
+{
+	struct hss_proxy_inst *proxy_inst = container_of(to_delayed_work(work),
+		struct hss_proxy_inst, expire_work);
+	struct hss_proxy_pending *pending;
+	struct hlist_node *tmp;
+	unsigned long next = 0;
+	unsigned long flags;
+	HLIST_HEAD(expired);
+	int bkt;
+
+	spin_lock_irqsave(&proxy_inst->pending_lock, flags);
+	hash_for_each_safe(proxy_inst->pending, bkt, tmp, pending, node) {
+		if (!pending->expires)
+			continue;
+
+		if (time_after_eq(jiffies, pending->expires)) {
+			hash_del(&pending->node);
+			hlist_add_head(&pending->node, &expired);
+		} else if (!next || time_before(pending->expires, next)) {
+			next = pending->expires;
+		}
+	}
+
+	if (!hlist_empty(&expired))
+		WRITE_ONCE(proxy_inst->rto_us, min_t(u32,
+			proxy_inst->rto_us * 2,
+			HSS_ACK_TIMEOUT * USEC_PER_MSEC));
+	proxy_inst->expire_at = next;
+	if (next)
+		mod_delayed_work(proxy_inst->ack_wq,
+			&proxy_inst->expire_work, next - jiffies);
+	spin_unlock_irqrestore(&proxy_inst->pending_lock, flags);
+
+	hlist_for_each_entry_safe(pending, tmp, &expired, node) {
+		atomic_inc(&proxy_inst->cmd_timeouts);
+		hss_proxy_give_up(proxy_inst, pending);
+		kfree(pending);
+	}
+}
+
+/**
+ * hss_proxy_get_rtt - Gets the command round trip estimates
+ *
+ * @rtt Filled with the estimates, srtt_us is 0 until a round trip is
+ *	measured
+ * @context The HSS proxy context
+ */
+void hss_proxy_get_rtt(struct hss_proxy_rtt *rtt, void *context)
+{
+	struct hss_proxy_inst *proxy_inst = context;
+
+	rtt->srtt_us = READ_ONCE(proxy_inst->srtt_us);
+	rtt->rttvar_us = READ_ONCE(proxy_inst->rttvar_us);
+	rtt->rto_us = READ_ONCE(proxy_inst->rto_us);
+	rtt->timeouts = atomic_read(&proxy_inst->cmd_timeouts);
+}
+EXPORT_SYMBOL_GPL(hss_proxy_get_rtt);
+
+/*
+ * An OPEN that was given up on may still have made a socket on the host,
+ * it is closed again
+ */
+static void hss_proxy_process_late_open(struct work_struct *work)
+{
+	struct hss_proxy_work *work_data;
+	struct hss_packet packet;
+	char hss_out[HSS_FIXED_LEN_CLOSE];
+
+	work_data = (struct hss_proxy_work *)work;
+	hss_packet_fill_close(&packet, work_data->packet->hdr.sock_id,
+		hss_proxy_get_msg_id(work_data->proxy_context));
+	hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
+	hss_proxy_send_cmd(work_data->proxy_context, hss_out,
+		HSS_FIXED_LEN_CLOSE);
+
+	kfree(work_data->packet);
+	kfree(work_data);
+}
+
 static void hss_proxy_process_open_ack(struct work_struct *work)
 {
 	struct hss_proxy_work *work_data;
@@ -93,9 +452,61 @@ static void hss_proxy_process_transmit(struct work_struct *work)
 	struct hss_proxy_work *work_data;
 
 	work_data = (struct hss_proxy_work *)work;
-	hss_sock_transmit(work_data->packet->hdr.sock_id,
+	hss_sock_transmit(work_data->packet->hdr.sock_id, NULL, 0,
 		&work_data->packet->hss_payload_none,
 		work_data->packet->hdr.payload_len);
+
+	/* The socket keeps its own copy of the data */
+	kfree(work_data->packet);
+	kfree(work_data);
+}
+
+/**
+ * hss_proxy_process_sendto - Hands a datagram and its source to the socket
+ *
+ * @work The hss_proxy_work for the SENDTO
+ *
+ * hss_proxy_rcv_data left the datagram right after the packet struct.
+ */
+static void hss_proxy_process_sendto(struct work_struct *work)
+{
+	struct hss_proxy_work *work_data;
+	struct hss_payload_connect_ip *src;
+	struct hss_packet *packet;
+	union {
+		struct sockaddr_in in4;
+		struct sockaddr_in6 in6;
+	} from = {};
+	int from_len;
+	int fixed_len;
+
+	work_data = (struct hss_proxy_work *)work;
+	packet = work_data->packet;
+	src = &packet->sendto;
+
+	if (src->family == HSS_FAM_IP6) {
+		from.in6.sin6_family = AF_INET6;
+		from.in6.sin6_port = src->port;
+		from.in6.sin6_flowinfo = src->addr.ip6.flow_info;
+		from.in6.sin6_scope_id = src->addr.ip6.scope_id;
+		memcpy(&from.in6.sin6_addr, src->addr.ip6.ip_addr,
+			sizeof(from.in6.sin6_addr));
+		from_len = sizeof(from.in6);
+		fixed_len = HSS_FIXED_LEN_SENDTO_IP6;
+	} else {
+		from.in4.sin_family = AF_INET;
+		from.in4.sin_port = src->port;
+		from.in4.sin_addr.s_addr = src->addr.ip4.ip_addr;
+		from_len = sizeof(from.in4);
+		fixed_len = HSS_FIXED_LEN_SENDTO_IP4;
+	}
+
+	hss_sock_transmit(packet->hdr.sock_id, (struct sockaddr *)&from,
+		from_len, packet + 1,
+		HSS_HDR_LEN + packet->hdr.payload_len - fixed_len);
+
+	kfree(packet);
+	kfree(work_data);
 }
 
 /**
@@ -127,6 +538,25 @@ static void hss_proxy_process_transmit(struct work_struct *work)
 	new_work->proxy_context = proxy_inst;
 	new_work->packet = packet;
 
+	/*
+	 * Window updates answer TRANSMITs, which are not tracked. Anything
+	 * else must answer a command still waiting, a late answer to one that
+	 * was given up on is only acted on to undo an OPEN.
+	 */
+	if (packet->ack.orig_opcode != HSS_OP_TRANSMIT &&
+		!hss_proxy_untrack(proxy_inst, packet)) {
+		if (packet->ack.orig_opcode == HSS_OP_OPEN &&
+			packet->ack.code == HSS_E_SUCCESS) {
+			INIT_WORK(&new_work->work,
+				hss_proxy_process_late_open);
+			queue_work(proxy_inst->ack_wq, &new_work->work);
+			goto out;
+		}
+		kfree(new_work);
+		ret = 1;
+		goto out;
+	}
+
 	/* Queue a work item to handle the incoming packet */
 	switch (packet->ack.orig_opcode) {
 	case HSS_OP_OPEN:
@@ -134,9 +564,30 @@ static void hss_proxy_process_transmit(struct work_struct *work)
 		queue_work(proxy_inst->ack_wq, &new_work->work);
 		break;
 	case HSS_OP_CONNECT:
+	case HSS_OP_OPEN_CONNECT:
+	case HSS_OP_CONNECT_NAME:
 		INIT_WORK(&new_work->work, hss_proxy_process_connect_ack);
 		queue_work(proxy_inst->ack_wq, &new_work->work);
 		break;
+	case HSS_OP_TRANSMIT:
+		/*
+		 * Only window updates matter, they are cheap enough to apply
+		 * here. The window is cumulative so it is also correct when
+		 * one ACK covers several TRANSMITs.
+		 */
+		if (packet->ack.code == HSS_E_CREDIT)
+			hss_sock_transmit_credit(packet->hdr.sock_id,
+				packet->ack.window);
+		kfree(new_work);
+		ret = 1;
+		break;
+	case HSS_OP_SETSOCKOPT:
+	case HSS_OP_GETSOCKOPT:
+		/* Only updates the socket's cache, cheap enough for here */
+		hss_sock_sockopt_ack(packet->hdr.sock_id, packet);
+		kfree(new_work);
+		ret = 1;
+		break;
 	case HSS_OP_CLOSE: /* Device does not care if the host ACKs */
 	default:
 		kfree(new_work);
@@ -150,12 +601,12 @@ out:
 
 
 /**
- * hss_proxy_recv_transmit - Recieves an TRANSMIT message
+ * hss_proxy_recv_transmit - Recieves an TRANSMIT or SENDTO message
  *
  * @packet The packet to process
  * @context The HSS proxy context
  *
- * Processes an HSS TRANSMIT packet.
+ * Processes an HSS TRANSMIT or SENDTO packet.
  *
  */
 int hss_proxy_recv_transmit(struct hss_packet *packet, void *inst)
@@ -178,7 +629,10 @@ int hss_proxy_recv_transmit(struct hss_packet *packet, void *inst)
 	new_work->proxy_context = proxy_inst;
 	new_work->packet = packet;
 
-	INIT_WORK(&new_work->work, hss_proxy_process_transmit);
+	if (packet->hdr.opcode == HSS_OP_SENDTO)
+		INIT_WORK(&new_work->work, hss_proxy_process_sendto);
+	else
+		INIT_WORK(&new_work->work, hss_proxy_process_transmit);
 	queue_work(proxy_inst->data_wq, &new_work->work);
 
 out:
@@ -245,17 +699,21 @@ void *hss_proxy_init(void *usb_context, struct hss_usb_descriptor *intf)
 	if (!proxy_inst)
 		return NULL;
 	proxy_inst->usb_context = usb_context;
+	proxy_inst->max_transfer = HSS_MIN_TRANSFER;
 
 	snprintf(hss_wq_name, sizeof(hss_wq_name), "hss_wq_%d",
 		atomic_inc_return(&g_proxy_counter));
-	snprintf(hss_wq_name, sizeof(hss_wq_name), "hss_data_wq_%d",
+	snprintf(hss_data_wq_name, sizeof(hss_data_wq_name), "hss_data_wq_%d",
 		atomic_inc_return(&g_proxy_counter));
 
 	proxy_inst->ack_wq = create_workqueue(hss_wq_name);
 	proxy_inst->data_wq = create_workqueue(hss_data_wq_name);
 
-	spin_lock_init(&proxy_inst->ack_list_lock);
-	INIT_LIST_HEAD(&proxy_inst->ack_list);
+	spin_lock_init(&proxy_inst->pending_lock);
+	hash_init(proxy_inst->pending);
+	INIT_DELAYED_WORK(&proxy_inst->expire_work, hss_proxy_expire_work);
+	proxy_inst->rto_us = HSS_RTO_INIT * USEC_PER_MSEC;
+	atomic_set(&proxy_inst->cmd_timeouts, 0);
 
 	proxy_inst->usb_intf = intf;
 
@@ -266,6 +724,54 @@ void *hss_proxy_init(void *usb_context, struct hss_usb_descriptor *intf)
 }
 EXPORT_SYMBOL_GPL(hss_proxy_init);
 
+/**
+ * hss_proxy_set_max_transfer - Sets the transfer size agreed with the host
+ *
+ * @max_transfer The largest transfer in bytes
+ * @context The HSS proxy context
+ *
+ * Outgoing TRANSMITs are split so no packet is larger than @max_transfer.
+ *
+ * Note: May be called in an atomic context
+ */
+void hss_proxy_set_max_transfer(int max_transfer, void *context)
+{
+	struct hss_proxy_inst *proxy_inst = context;
+
+	WRITE_ONCE(proxy_inst->max_transfer, max_transfer);
+}
+EXPORT_SYMBOL_GPL(hss_proxy_set_max_transfer);
+
+/**
+ * hss_proxy_set_features - Sets the optional features enabled by the host
+ *
+ * @features A bitmap of HSS_FEATURE_* flags
+ * @context The HSS proxy context
+ *
+ * Note: May be called in an atomic context
+ */
+void hss_proxy_set_features(u32 features, void *context)
+{
+	struct hss_proxy_inst *proxy_inst = context;
+
+	WRITE_ONCE(proxy_inst->features, features);
+}
+EXPORT_SYMBOL_GPL(hss_proxy_set_features);
+
+/**
+ * hss_proxy_get_features - Gets the optional features enabled by the host
+ *
+ * @context The HSS proxy context
+ *
+ * Returns: A bitmap of HSS_FEATURE_* flags
+ */
+u32 hss_proxy_get_features(void *context)
+{
+	struct hss_proxy_inst *proxy_inst = context;
+
+	return READ_ONCE(proxy_inst->features);
+}
+
 /**
  * hss_proxy_connect_socket - Connect an HSS socket
  *
@@ -276,7 +782,7 @@ EXPORT_SYMBOL_GPL(hss_proxy_init);
  *
  * Sends a command to the device to connect an HSS socket to a given address.
  *
- * Returns: 0 on success or returned HSS error code.
+ * Returns: 0 on success or -ENOMEM
  *
  */
 int hss_proxy_connect_socket(int local_id, struct sockaddr *addr, int alen,
@@ -292,40 +798,189 @@ int hss_proxy_connect_socket(int local_id, struct sockaddr *addr, int alen,
 		addr);
 	hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
 
-	proxy_inst->usb_intf->hss_cmd(hss_out,
-		HSS_HDR_LEN + packet.hdr.payload_len,
-		proxy_inst->usb_context);
+	if (hss_proxy_track(proxy_inst, &packet, local_id))
+		return -ENOMEM;
+	hss_proxy_send_cmd(proxy_inst, hss_out,
+		HSS_HDR_LEN + packet.hdr.payload_len);
 
 	return 0;
 }
 
 /**
- * hss_proxy_open_socket - Open an HSS socket
+ * hss_proxy_open_connect_socket - Open and connect an HSS socket at once
  *
  * @local_id The ID of the new socket
+ * @type The socket type, only SOCK_STREAM is opened this way
+ * @addr The socket address
+ * @alen Address length in bytes
+ * @data The first bytes to send once connected, may be NULL
+ * @len The length of @data
+ * @context The HSS proxy context
+ *
+ * Sends one HSS_OP_OPEN_CONNECT in place of an OPEN and a CONNECT. As much
+ * of @data as fits in a command is carried along with it. The host answers
+ * with a single ACK which is handled like a CONNECT ACK.
+ *
+ * Datagram sockets are opened by hss_proxy_open_socket when they are
+ * created, their data goes out as SENDTOs rather than with the connect.
+ *
+ * Returns: The number of bytes of @data sent, -EOPNOTSUPP for a socket that
+ * is not a stream or another negative error code.
+ *
+ * Note: Only valid once the host has enabled HSS_FEATURE_OPEN_CONNECT
+ */
+int hss_proxy_open_connect_socket(int local_id, int type,
+	struct sockaddr *addr, int alen, void *data, int len, void *context)
+{
+	struct hss_packet packet;
+	struct hss_proxy_inst *proxy_inst;
+	size_t fixed_len;
+	int max_len;
+	char *hss_out;
+
+	proxy_inst = context;
+
+	if (type != SOCK_STREAM)
+		return -EOPNOTSUPP;
+
+	/* In-band commands may fill a whole transfer */
+	if (hss_proxy_get_features(proxy_inst) & HSS_FEATURE_INBAND_CMD)
+		max_len = READ_ONCE(proxy_inst->max_transfer);
+	else
+		max_len = HSS_CMD_MAX_LEN;
+
+	hss_out = kmalloc(max_len, GFP_KERNEL);
+	if (!hss_out)
+		return -ENOMEM;
+
+	hss_packet_fill_open_connect(&packet,
+		addr->sa_family == AF_INET6 ? HSS_FAM_IP6 : HSS_FAM_IP,
+		HSS_PROTO_TCP, HSS_TYPE_STREAM, local_id, addr, 0,
+		hss_proxy_get_msg_id(proxy_inst));
+	fixed_len = HSS_HDR_LEN + packet.hdr.payload_len;
+
+	len = data ? min_t(int, len, max_len - fixed_len) : 0;
+	packet.hdr.payload_len += len;
+	hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
+	if (len)
+		memcpy(hss_out + fixed_len, data, len);
+
+	if (hss_proxy_track(proxy_inst, &packet, local_id)) {
+		len = -ENOMEM;
+		goto out;
+	}
+	hss_proxy_send_cmd(proxy_inst, hss_out, fixed_len + len);
+out:
+	kfree(hss_out);
+
+	return len;
+}
+
+/**
+ * hss_proxy_connect_name_socket - Connect an HSS socket to a host name
+ *
+ * @local_id The ID of the socket
+ * @addr The struct sockaddr_hss naming the host
+ * @alen Address length in bytes
  * @context The HSS proxy context
  *
- * Sends a command to the device to open an HSS socket.
+ * Sends one HSS_OP_CONNECT_NAME. The host opens the socket if it has not
+ * yet, resolves the name and answers with a single ACK which is handled like
+ * a CONNECT ACK.
  *
- * Returns: 0 on success or returned HSS error code. Writes the new sockets
- * local ID to *local_id
+ * Returns: 0 on success or a negative error code.
  *
+ * Note: Only valid once the host has enabled HSS_FEATURE_CONNECT_NAME
  */
-int hss_proxy_open_socket(int local_id, void *context)
+int hss_proxy_connect_name_socket(int local_id, struct sockaddr *addr,
+	int alen, void *context)
 {
+	struct sockaddr_hss *hss_addr = (struct sockaddr_hss *)addr;
 	struct hss_packet packet;
+	struct hss_proxy_inst *proxy_inst;
+	int name_len;
+	int max_len;
+	char *hss_out;
 	int ret;
+
+	proxy_inst = context;
+
+	if (!(hss_proxy_get_features(proxy_inst) & HSS_FEATURE_CONNECT_NAME))
+		return -EOPNOTSUPP;
+
+	if (alen <= offsetof(struct sockaddr_hss, shss_name))
+		return -EINVAL;
+	name_len = strnlen(hss_addr->shss_name,
+		min_t(int, alen - offsetof(struct sockaddr_hss, shss_name),
+			sizeof(hss_addr->shss_name)));
+	if (!name_len || name_len > HSS_NAME_MAX)
+		return -EINVAL;
+
+	/* In-band commands may fill a whole transfer */
+	if (hss_proxy_get_features(proxy_inst) & HSS_FEATURE_INBAND_CMD)
+		max_len = READ_ONCE(proxy_inst->max_transfer);
+	else
+		max_len = HSS_CMD_MAX_LEN;
+	if (HSS_FIXED_LEN_CONN_NAME + name_len > max_len)
+		return -ENAMETOOLONG;
+
+	hss_out = kmalloc(HSS_FIXED_LEN_CONN_NAME + name_len, GFP_KERNEL);
+	if (!hss_out)
+		return -ENOMEM;
+
+	hss_packet_fill_connect_name(&packet, HSS_FAM_IP, HSS_PROTO_TCP,
+		HSS_TYPE_STREAM, local_id, hss_addr->shss_port, name_len,
+		hss_proxy_get_msg_id(proxy_inst));
+	hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
+	memcpy(hss_out + HSS_FIXED_LEN_CONN_NAME, hss_addr->shss_name,
+		name_len);
+
+	ret = hss_proxy_track(proxy_inst, &packet, local_id);
+	if (!ret)
+		hss_proxy_send_cmd(proxy_inst, hss_out,
+			HSS_FIXED_LEN_CONN_NAME + name_len);
+	kfree(hss_out);
+
+	return ret;
+}
+
+/**
+ * hss_proxy_open_socket - Open an HSS socket
+ *
+ * @local_id The ID of the new socket
+ * @type SOCK_STREAM or SOCK_DGRAM
+ * @context The HSS proxy context
+ *
+ * Sends a command to the device to open an HSS socket. Stream sockets are
+ * TCP over IPv4. Datagram sockets are UDP over IPv6, which the host makes
+ * dual-stack so they can reach IPv4 too.
+ *
+ * The ACK is passed to hss_sock_open_ack. If it does not come within the
+ * RTO the socket is given one with HSS_E_TIMEDOUT.
+ *
+ * Returns: 0 on success or -ENOMEM
+ */
+int hss_proxy_open_socket(int local_id, int type, void *context)
+{
+	struct hss_packet packet;
 	struct hss_proxy_inst *proxy_inst;
 	char hss_send[HSS_FIXED_LEN_OPEN];
 
 	proxy_inst = context;
 
-	hss_packet_fill_open(&packet, HSS_FAM_IP, HSS_PROTO_TCP, HSS_TYPE_STREAM,
-		local_id, hss_proxy_get_msg_id(proxy_inst));
+	if (type == SOCK_DGRAM)
+		hss_packet_fill_open(&packet, HSS_FAM_IP6, HSS_PROTO_UDP,
+			HSS_TYPE_DGRAM, local_id,
+			hss_proxy_get_msg_id(proxy_inst));
+	else
+		hss_packet_fill_open(&packet, HSS_FAM_IP, HSS_PROTO_TCP,
+			HSS_TYPE_STREAM, local_id,
+			hss_proxy_get_msg_id(proxy_inst));
 	hss_packet_to_buf(&packet, hss_send, HSS_COPY_FIELDS);
 
-	proxy_inst->usb_intf->hss_cmd(hss_send, HSS_FIXED_LEN_OPEN,
-		proxy_inst->usb_context);
+	if (hss_proxy_track(proxy_inst, &packet, local_id))
+		return -ENOMEM;
+	hss_proxy_send_cmd(proxy_inst, hss_send, HSS_FIXED_LEN_OPEN);
 
 	return 0;
 }
@@ -338,23 +993,152 @@ int hss_proxy_open_socket(int local_id, void *context)
  * @local_id The ID of the socket to close
  * @context The HSS proxy context
  *
- * Sends a command to the device to close a HSS socket.
- *
+ * Sends a command to the device to close a HSS socket. Commands still
+ * waiting on the socket's ACKs are forgotten, nothing waits for them now.
  */
 void hss_proxy_close_socket(int local_id, void *context)
 {
-	struct hss_packet *ack;
 	struct hss_packet packet;
 	struct hss_proxy_inst *proxy_inst;
 	char hss_out[HSS_FIXED_LEN_CLOSE];
 
 	proxy_inst = context;
 
+	hss_proxy_untrack_socket(proxy_inst, local_id);
+
 	hss_packet_fill_close(&packet, local_id, hss_proxy_get_msg_id(context));
 	hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
 
-	proxy_inst->usb_intf->hss_cmd(hss_out, HSS_FIXED_LEN_CLOSE,
+	/* The socket goes either way, the CLOSE is only timed if it can be */
+	hss_proxy_track(proxy_inst, &packet, local_id);
+	hss_proxy_send_cmd(proxy_inst, hss_out, HSS_FIXED_LEN_CLOSE);
+}
+
+/**
+ * hss_proxy_send_credit - Moves the window the host may send a socket
+ *
+ * @local_id The ID of the socket with room to read
+ * @window The new window, see struct hss_payload_ack
+ * @context The HSS proxy context
+ *
+ * Sends an unsolicited HSS_E_CREDIT ACK so a host waiting on the socket's
+ * window can send again.
+ */
+void hss_proxy_send_credit(int local_id, u32 window, void *context)
+{
+	struct hss_packet packet;
+	struct hss_proxy_inst *proxy_inst;
+	char hss_out[HSS_FIXED_LEN_ACK_CREDIT];
+
+	proxy_inst = context;
+
+	hss_packet_fill_ack_credit(&packet, local_id, window,
+		hss_proxy_get_msg_id(proxy_inst));
+	hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
+
+	hss_proxy_send_cmd(proxy_inst, hss_out, HSS_FIXED_LEN_ACK_CREDIT);
+}
+
+/**
+ * hss_proxy_sockopt_socket - Sets or reads an option of a host socket
+ *
+ * @local_id The ID of the socket
+ * @opcode HSS_OP_SETSOCKOPT or HSS_OP_GETSOCKOPT
+ * @opt The enum hss_sockopt
+ * @value The value to set, ignored by a GETSOCKOPT
+ * @msg_id Set to the message ID before the command goes out, the host's ACK
+ *	carries it
+ * @context The HSS proxy context
+ *
+ * The ACK is passed to hss_sock_sockopt_ack. If it does not come within the
+ * RTO the socket is given one with HSS_E_TIMEDOUT.
+ *
+ * Returns: 0 on success, -ENOMEM or -EOPNOTSUPP if the host has not enabled
+ * HSS_FEATURE_SOCKOPT
+ */
+int hss_proxy_sockopt_socket(int local_id, int opcode, int opt, u32 value,
+	u16 *msg_id, void *context)
+{
+	struct hss_packet packet;
+	struct hss_proxy_inst *proxy_inst;
+	char hss_out[HSS_FIXED_LEN_SOCKOPT];
+	u16 id;
+
+	proxy_inst = context;
+
+	if (!(hss_proxy_get_features(proxy_inst) & HSS_FEATURE_SOCKOPT))
+		return -EOPNOTSUPP;
+
+	id = hss_proxy_get_msg_id(proxy_inst);
+	WRITE_ONCE(*msg_id, id);
+
+	hss_packet_fill_sockopt(&packet, opcode, local_id, opt,
+		opcode == HSS_OP_SETSOCKOPT ? value : 0, id);
+	hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
+
+	if (hss_proxy_track(proxy_inst, &packet, local_id))
+		return -ENOMEM;
+	hss_proxy_send_cmd(proxy_inst, hss_out, HSS_FIXED_LEN_SOCKOPT);
+
+	return 0;
+}
+
+/**
+ * hss_proxy_max_datagram - Gets the longest datagram the host takes
+ *
+ * @context The HSS proxy context
+ *
+ * Returns: The most bytes one TRANSMIT or SENDTO may carry on a datagram
+ * socket
+ */
+int hss_proxy_max_datagram(void *context)
+{
+	struct hss_proxy_inst *proxy_inst = context;
+
+	return READ_ONCE(proxy_inst->max_transfer) - HSS_FIXED_LEN_SENDTO_IP6;
+}
+
+/**
+ * hss_proxy_sendto_socket - Sends a datagram to an address
+ *
+ * @sock_id The ID of the datagram socket
+ * @addr The IPv4 or IPv6 address the datagram goes to
+ * @alen Address length in bytes
+ * @data The datagram
+ * @len The length of @data, at most hss_proxy_max_datagram
+ * @context The HSS proxy context
+ *
+ * Sends one HSS_OP_SENDTO on the bulk channel, in order with the TRANSMITs.
+ *
+ * Returns: @len on success or a negative error code.
+ *
+ * Note: Only valid once the host has enabled HSS_FEATURE_DGRAM
+ */
+int hss_proxy_sendto_socket(int sock_id, struct sockaddr *addr, int alen,
+	void *data, int len, void *context)
+{
+	struct hss_packet packet;
+	struct hss_proxy_inst *proxy_inst;
+	char hss_out[HSS_FIXED_LEN_SENDTO_IP6];
+	size_t fixed_len;
+
+	proxy_inst = context;
+
+	if ((addr->sa_family != AF_INET || alen < sizeof(struct sockaddr_in)) &&
+		(addr->sa_family != AF_INET6 ||
+			alen < sizeof(struct sockaddr_in6)))
+		return -EAFNOSUPPORT;
+	if (len > hss_proxy_max_datagram(proxy_inst))
+		return -EMSGSIZE;
+
+	hss_packet_fill_sendto(&packet, sock_id, addr, len,
+		hss_proxy_get_msg_id(proxy_inst));
+	fixed_len = hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
+
+	proxy_inst->usb_intf->hss_transfer(hss_out, fixed_len, data, len,
 		proxy_inst->usb_context);
+
+	return len;
 }
 
 int hss_proxy_write_socket(int sock_id, void *msg, int len, void *context)
@@ -362,50 +1146,61 @@ int hss_proxy_write_socket(int sock_id, void *msg, int len, void *context)
 	struct hss_proxy_inst *proxy_inst;
 	struct hss_packet packet;
 	char hss_out[HSS_FIXED_LEN_TRANSMIT];
+	int max_payload;
+	int sent = 0;
+	int seg_len;
 
 	proxy_inst = context;
+	max_payload = READ_ONCE(proxy_inst->max_transfer) -
+		HSS_FIXED_LEN_TRANSMIT;
 
-	hss_packet_fill_transmit(&packet, sock_id, NULL, len,
-		hss_proxy_get_msg_id(context));
-	hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
+	/* The host receives each packet into a single transfer */
+	do {
+		seg_len = min(len - sent, max_payload);
+
+		hss_packet_fill_transmit(&packet, sock_id, NULL, seg_len,
+			hss_proxy_get_msg_id(context));
+		hss_packet_to_buf(&packet, hss_out, HSS_COPY_FIELDS);
+
+		proxy_inst->usb_intf->hss_transfer(hss_out,
+			HSS_FIXED_LEN_TRANSMIT, (char *)msg + sent, seg_len,
+			proxy_inst->usb_context);
+		sent += seg_len;
+	} while (sent < len);
 
-	proxy_inst->usb_intf->hss_transfer(hss_out, HSS_FIXED_LEN_TRANSMIT,
-		(char*)msg, len, proxy_inst->usb_context);
 	return len;
 }
 
 
 
 /*
- * Reads HSS command from the host
+ * Parses and dispatches one HSS command from the host, from either the
+ * interrupt channel or the bulk channel.
  * Note: Called in an atomic context
  */
-void hss_proxy_rcv_cmd(char *buf, size_t len,
+static void hss_proxy_handle_cmd(char *buf, size_t len,
 	void *proxy_context)
 {
 	struct hss_packet *packet;
+	int fixed_len;
 
 	/* Make sure at least a header came in */
 	if (!buf || len < HSS_HDR_LEN)
 		return;
 
-	packet = kmalloc(HSS_HDR_LEN, GFP_ATOMIC);
-	hss_packet_from_buf(packet, buf, HSS_COPY_HDR);
+	/* Room for the fields of any command and whatever follows them */
+	packet = kmalloc(sizeof(*packet) + len, GFP_ATOMIC);
+	if (!packet)
+		return;
 
-	/* Make sure the entire packet came in */
-	if(len != HSS_HDR_LEN + packet->hdr.payload_len)
+	/* Make sure the entire packet came in with the fields it calls for */
+	fixed_len = hss_packet_from_buf(packet, buf, len, HSS_COPY_FIELDS);
+	if (fixed_len < 0 || hss_packet_len(&packet->hdr, len) != len)
 		goto out_free;
 
-	if (len > HSS_HDR_LEN) {
-		packet = krealloc(packet, HSS_HDR_LEN + packet->hdr.payload_len,
-			GFP_ATOMIC);
-		hss_packet_from_buf(packet, buf, HSS_COPY_FIELDS);
-
-		/* ACK is the only command op that can have an arbitrary payload */
-		if (packet->hdr.opcode == HSS_OP_ACK)
-			memcpy(packet->ack.empty, buf + HSS_FIXED_LEN_ACK,
-				packet->hdr.payload_len - HSS_FIXED_LEN_ACK + HSS_HDR_LEN);
-	}
+	/* ACK is the only command op that can have an arbitrary payload */
+	if (packet->hdr.opcode == HSS_OP_ACK && len > fixed_len)
+		memcpy(packet->ack.empty, buf + fixed_len, len - fixed_len);
 
 	/* Incoming command is either a close notificaiton or ACK */
 	switch (packet->hdr.opcode) {
@@ -430,6 +1225,16 @@ out_free:
 out:
 	return;
 }
+
+/*
+ * Reads HSS command from the host
+ * Note: Called in an atomic context
+ */
+void hss_proxy_rcv_cmd(char *buf, size_t len,
+	void *proxy_context)
+{
+	hss_proxy_handle_cmd(buf, len, proxy_context);
+}
 EXPORT_SYMBOL_GPL(hss_proxy_rcv_cmd);
 
 static void hss_proxy_carry(struct hss_proxy_inst *proxy_inst, char *buf, int len)
@@ -449,15 +1254,56 @@ static void hss_proxy_end_carry(struct hss_proxy_inst *proxy_inst)
 	proxy_inst->carry_pkt_len = 0;
 }
 
+/*
+ * Copies a SENDTO out of a transfer. The datagram goes right after the
+ * packet struct where hss_proxy_process_sendto looks for it.
+ * Note: Called in an atomic context
+ */
+static struct hss_packet *hss_proxy_copy_sendto(char *buf, size_t pkt_len)
+{
+	struct hss_packet *packet;
+	struct hss_packet fields;
+	int fixed_len;
+
+	/* The family decides how long the address fields are */
+	fixed_len = hss_packet_from_buf(&fields, buf, pkt_len,
+		HSS_COPY_FIELDS);
+	if (fixed_len < 0 || (fields.sendto.family != HSS_FAM_IP &&
+		fields.sendto.family != HSS_FAM_IP6))
+		goto bad;
+
+	packet = kmalloc(sizeof(*packet) + pkt_len - fixed_len, GFP_ATOMIC);
+	if (!packet)
+		return NULL;
+	*packet = fields;
+	memcpy(packet + 1, buf + fixed_len, pkt_len - fixed_len);
+	return packet;
+
+bad:
+	pr_err("%s dropping malformed SENDTO", __func__);
+	return NULL;
+}
+
+/**
+ * hss_proxy_rcv_data - Handles a transfer from the bulk channel
+ *
+ * @buf The transfer
+ * @len The length of @buf
+ * @proxy_context The HSS proxy context
+ *
+ * A transfer may hold several packets, the host packs small datagrams
+ * together, and the last one may run on into the next transfer. What is
+ * there of it is carried over until the rest comes in.
+ */
 void hss_proxy_rcv_data(char *buf, size_t len,
 	void *proxy_context)
 {
 	struct hss_packet *packet;
+	struct hss_packet hdr;
 	struct hss_proxy_inst *proxy_inst;
-	/* Our `buf` param may be replaced by a persisent buffer so an original is
-	 * useful in many-HSS to one-USB scenarios where the original buffer is
-	 * required*/
-	char *param_buf = buf;
+	size_t pkt_len;
+	char *carry;
+	int ret;
 
 	if (!buf)
 		return;
@@ -473,61 +1319,71 @@ void hss_proxy_rcv_data(char *buf, size_t len,
 		len  = proxy_inst->carry_pkt_len;
 	}
 
-	/* Make sure at least a header has come in before continuing */
-	if(len < HSS_HDR_LEN) {
-		/* Start a carryover if not already in one */
-		if (!proxy_inst->carry_pkt) {
-			hss_proxy_carry(proxy_inst, buf, len);
+	/* Handle every packet that has come in completely */
+	while (len >= HSS_HDR_LEN) {
+		hss_packet_from_buf(&hdr, buf, len, HSS_COPY_HDR);
+
+		/* Nothing after a bad length can be trusted, drop the stream */
+		ret = hss_packet_len(&hdr.hdr,
+			READ_ONCE(proxy_inst->max_transfer));
+		if (ret < 0) {
+			pr_err("%s dropping %zu bytes after a bad header",
+				__func__, len);
+			len = 0;
+			break;
 		}
-		goto out;
-	}
-
-	packet = kmalloc(sizeof(struct hss_packet), GFP_ATOMIC);
-	hss_packet_from_buf(packet, buf, HSS_COPY_HDR);
-
-	/* Make sure the entire packet has come through */
-	if(len < HSS_HDR_LEN + packet->hdr.payload_len) {
-		/* Start a carryover if not already in one */
-		if (!proxy_inst->carry_pkt) {
-			hss_proxy_carry(proxy_inst, buf, len);
+		pkt_len = ret;
+		if (len < pkt_len)
+			break;
+
+		switch (hdr.hdr.opcode) {
+		case HSS_OP_TRANSMIT:
+			/* A buffer with enough space to copy the payload */
+			packet = kmalloc(pkt_len, GFP_ATOMIC);
+			if (!packet)
+				break;
+			packet->hdr = hdr.hdr;
+			memcpy(packet->hss_payload_none, buf + HSS_HDR_LEN,
+				hdr.hdr.payload_len);
+
+			/* Shedule handling of this operation */
+			if (hss_proxy_recv_transmit(packet, proxy_context) == 1)
+				kfree(packet);
+			break;
+		case HSS_OP_SENDTO:
+			packet = hss_proxy_copy_sendto(buf, pkt_len);
+			if (packet &&
+				hss_proxy_recv_transmit(packet, proxy_context) == 1)
+				kfree(packet);
+			break;
+		case HSS_OP_ACK:
+		case HSS_OP_CLOSE:
+			/* In-band commands share the stream with TRANSMITs */
+			if (hss_proxy_get_features(proxy_inst) & HSS_FEATURE_INBAND_CMD)
+				hss_proxy_handle_cmd(buf, pkt_len, proxy_context);
+			else
+				pr_err("%s got command %d without in-band commands",
+					__func__, hdr.hdr.opcode);
+			break;
+		default:
+			pr_err("%s got opcode %d", __func__, hdr.hdr.opcode);
+			break;
 		}
-		goto out_free;
-	}
 
-	switch (packet->hdr.opcode) {
-	case HSS_OP_TRANSMIT:
-		/* Reallocate the header to a buffer with enough space to copy the payload */
-		packet = krealloc(packet,
-			HSS_HDR_LEN + packet->hdr.payload_len, GFP_ATOMIC);
-		memcpy(packet->hss_payload_none, buf + HSS_HDR_LEN, packet->hdr.payload_len);
-
-		/* Shedule handling of this operation */
-		if (hss_proxy_recv_transmit(packet, proxy_context) == 1)
-			goto out_free;
-		break;
-	default:
-		pr_err("%s got opcode %d", __func__, packet->hdr.opcode);
-		goto out_free;
-		break;
+		buf += pkt_len;
+		len -= pkt_len;
 	}
 
-	/* If there is leftover data at the end of the buffer it is another HSS packet */
-	/* TODO This copy is dangerous if the caller is inconsistent with the size of buf in between calls.
-	 * This is what ring buffers are great for */
-	len -= HSS_HDR_LEN + packet->hdr.payload_len;
-	if (len) {
-		memcpy(param_buf, buf + HSS_HDR_LEN + packet->hdr.payload_len, len);
+	/* Keep a partial packet until the rest of it arrives */
+	if (len && buf != proxy_inst->carry_pkt) {
+		carry = kmemdup(buf, len, GFP_ATOMIC);
 		hss_proxy_end_carry(proxy_inst);
-		hss_proxy_rcv_data(param_buf, len, proxy_context);
-	} else {
-		/* If this is a terminal condition stop any carry over before exiting */
+		if (carry) {
+			proxy_inst->carry_pkt = carry;
+			proxy_inst->carry_pkt_len = len;
+		}
+	} else if (!len) {
 		hss_proxy_end_carry(proxy_inst);
 	}
-
-	goto out;
-out_free:
-	kfree(packet);
-out:
-	return;
 }
 EXPORT_SYMBOL_GPL(hss_proxy_rcv_data);
@@ -24,8 +24,12 @@
 #ifndef _XAPRC00X_BACKPORTS_H
 #define _XAPRC00X_BACKPORTS_H
 
+#include <linux/dns_resolver.h>
+#include <linux/net.h>
 #include <linux/usb.h>
 #include <linux/version.h>
+#include <net/net_namespace.h>
+#include <net/sock.h>
 
 #if KERNEL_VERSION(4, 12, 0) > LINUX_VERSION_CODE
 int __must_check
@@ -36,4 +40,41 @@ usb_find_common_endpoints(struct usb_host_interface *alt,
 			  struct usb_endpoint_descriptor **int_out);
 #endif
 
+/* dns_query gained `invalidate` in 5.0 and a namespace in 5.3 */
+static inline int hss_dns_query(const char *name, size_t len, char **result,
+	time64_t *expiry)
+{
+#if !IS_ENABLED(CONFIG_DNS_RESOLVER)
+	return -EOPNOTSUPP;
+#elif KERNEL_VERSION(5, 3, 0) <= LINUX_VERSION_CODE
+	return dns_query(&init_net, NULL, name, len, NULL, result, expiry,
+		false);
+#elif KERNEL_VERSION(5, 0, 0) <= LINUX_VERSION_CODE
+	return dns_query(NULL, name, len, NULL, result, expiry, false);
+#else
+	return dns_query(NULL, name, len, NULL, result, NULL);
+#endif
+}
+
+/* kernel_setsockopt went away in 5.8 and options took a sockptr_t in 5.9 */
+#define HSS_HAVE_SETSOCKOPT (KERNEL_VERSION(5, 8, 0) > LINUX_VERSION_CODE || \
+	KERNEL_VERSION(5, 9, 0) <= LINUX_VERSION_CODE)
+
+static inline int hss_sock_setsockopt(struct socket *sock, int level,
+	int optname, int val)
+{
+#if KERNEL_VERSION(5, 9, 0) <= LINUX_VERSION_CODE
+	if (level == SOL_SOCKET)
+		return sock_setsockopt(sock, level, optname,
+			KERNEL_SOCKPTR(&val), sizeof(val));
+	return sock->ops->setsockopt(sock, level, optname,
+		KERNEL_SOCKPTR(&val), sizeof(val));
+#elif KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+	return -EOPNOTSUPP;
+#else
+	return kernel_setsockopt(sock, level, optname, (char *)&val,
+		sizeof(val));
+#endif
+}
+
 #endif /* _XAPRC00X_BACKPORTS_H */
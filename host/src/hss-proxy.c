@@ -6,44 +6,221 @@
  */
 
 #include <linux/circ_buf.h>
-#include <linux/kthread.h>
+#include <linux/mempool.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
 #include <linux/socket.h>
 #include <linux/net.h>
+#include <linux/mm.h>
 #include <linux/workqueue.h>
 #include <net/sock.h>
 #include "hss.h"
 #include "hss-proxy.h"
+#include "hss-resolver.h"
 #include "hss-sockets.h"
 #include "hss-usb.h"
 #include "hss-ring.h"
 
-/* NOTE: Size must be a power of 2 for circ_buf */
-static const int READ_CACHE_SIZE = 1<<13; /* 8kb */
+/*
+ * The read cache is split into slots of the transfer size agreed with the
+ * device, which bulk-in URBs are received into directly. A slot is only
+ * partially filled when the transfer was short.
+ */
+#define READ_CACHE_MIN_SLOTS 4
+#define READ_CACHE_MAX_SIZE (1 << 24)
+
+/* NOTE: Rounded up to a power of 2 for circ_buf */
+static int hss_read_cache_size = 1<<18; /* 256kb */
+module_param_named(read_cache_size, hss_read_cache_size, int, 0444);
+MODULE_PARM_DESC(read_cache_size,
+	"Bytes of read cache for each device, 4 transfers to 16MiB (default 262144)");
+
+/* Messages read from one socket before it yields its rx worker */
+#define HSS_SOCK_RX_BUDGET 16
+
+/* Datagrams are packed several to a transfer so more are read at a time */
+#define HSS_SOCK_RX_DGRAM_BUDGET 64
+
+/* Maximum number of packets handled by one run of the data poller */
+static int hss_data_budget = 64;
+module_param_named(data_budget, hss_data_budget, int, 0644);
+MODULE_PARM_DESC(data_budget,
+	"Maximum HSS packets drained from the read cache per poll (default 64)");
+
+/*
+ * With cumulative ACKs a socket's TRANSMITs are ACKed once this many payload
+ * bytes have arrived or `ack_delay_us` after the first unACKed one.
+ */
+static int hss_ack_bytes = 1<<14; /* 16kb */
+module_param_named(ack_bytes, hss_ack_bytes, int, 0644);
+MODULE_PARM_DESC(ack_bytes,
+	"TRANSMIT bytes covered by one cumulative ACK (default 16384)");
+
+static int hss_ack_delay_us = 1000;
+module_param_named(ack_delay_us, hss_ack_delay_us, int, 0644);
+MODULE_PARM_DESC(ack_delay_us,
+	"Longest a cumulative ACK is held back in microseconds (default 1000)");
+
+/*
+ * How long a connect to a resolved name has before the next address is tried
+ * alongside it, the Connection Attempt Delay of RFC 8305
+ */
+static int hss_happy_eyeballs_ms = 250;
+module_param_named(happy_eyeballs_ms, hss_happy_eyeballs_ms, int, 0644);
+MODULE_PARM_DESC(happy_eyeballs_ms,
+	"Milliseconds before a name connect also tries the next address, 0 tries one at a time (default 250)");
+
+/*
+ * Command work items kept in reserve for each device so commands still make
+ * progress under memory pressure.
+ */
+#define HSS_PROXY_CMD_RESERVE 16
+
+/*
+ * Socket reads that can wait for bulk-out at once for each device. Their
+ * buffers are allocated with the proxy, a socket that finds none free is
+ * parked until one is sent.
+ */
+#define HSS_PROXY_TX_BUFS 16
+
+/* Sockets that can have a cumulative ACK held back at once */
+#define HSS_PROXY_ACK_SLOTS 16
+
+/**
+ * struct hss_proxy_pending_ack - TRANSMITs not yet ACKed for one socket
+ *
+ * @sock_id The socket the TRANSMITs were for
+ * @msg_id The msg_id of the newest TRANSMIT, which the ACK carries
+ * @bytes The payload bytes received since the last ACK
+ * @seq When the slot was taken, from the proxy's `ack_seq`
+ * @used Set while the slot holds a socket
+ */
+struct hss_proxy_pending_ack {
+	int sock_id;
+	u16 msg_id;
+	int bytes;
+	u32 seq;
+	bool used;
+};
+
+/**
+ * struct hss_proxy_txbuf - A message read from a socket, waiting for bulk-out
+ *
+ * @list Entry on the proxy's `egress_list`, or `tx_free` while unused
+ * @len The length of @msg, 0 to send a CLOSE for @sock_id instead
+ * @sock_id The socket that was read
+ * @skb Set when the payload is still in this clone of a received skb, only
+ *	the header is in @msg
+ * @skb_offset The offset of the payload from `skb->data`
+ * @msg The message, room for `max_transfer` bytes
+ */
+struct hss_proxy_txbuf {
+	struct list_head list;
+	int len;
+	int sock_id;
+	struct sk_buff *skb;
+	int skb_offset;
+	char msg[];
+};
 
 struct hss_proxy_context {
 	u16 proxy_id;
 	struct workqueue_struct *proxy_wq;
 	struct workqueue_struct *proxy_data_wq;
-	struct rhashtable *socket_table;
+	struct workqueue_struct *resolve_wq; /* May block on DNS */
+	struct workqueue_struct *egress_wq; /* Waits on bulk-out for the rx pool */
+	struct work_struct data_work;
+	struct work_struct egress_work;
+	/* Socket reads waiting for `egress_work`, under `egress_lock` */
+	spinlock_t egress_lock;
+	struct list_head egress_list;
+	struct list_head tx_free; /* Idle hss_proxy_txbufs, under `egress_lock` */
+	bool egress_stopped; /* Sockets are no longer resumed */
+	struct hss_socket_mgr *socket_mgr;
 	void *usb_context;
-	struct circ_buf read_cache ____cacheline_aligned_in_smp;
+	int max_transfer; /* Agreed with the device, also the slot size */
+	bool credits; /* HSS_FEATURE_CREDITS was agreed with the device */
+	bool cumulative_ack; /* HSS_FEATURE_CUMULATIVE_ACK was agreed */
+	bool inband_cmd; /* HSS_FEATURE_INBAND_CMD was agreed */
+	struct hss_ring read_cache ____cacheline_aligned_in_smp;
+	int rx_reserve; /* Offset of the next slot handed to the USB driver */
+	int *rx_fill; /* Bytes received into each slot */
+	/* Only touched on `proxy_data_wq` so they need no lock */
+	struct delayed_work ack_work;
+	struct hss_proxy_pending_ack pending_ack[HSS_PROXY_ACK_SLOTS];
+	u32 ack_seq; /* Orders the slots in `pending_ack` by age */
+	struct hss_host_socket *tx_socket; /* See hss_proxy_tx_socket */
+	int tx_sock_id;
+	/* Dedicated caches so the hot path never hits the kmalloc caches */
+	struct kmem_cache *cmd_cache;
+	mempool_t *cmd_pool;
+	char cmd_cache_name[sizeof("hss_cmd_65535")];
+	atomic_t cmd_drops; /* Commands dropped for lack of a work item */
+};
+
+/*
+ * A command from the device and the ACK built for it. The ACK is followed by
+ * room for the largest payload a command can carry. `extra` points at any
+ * bytes after the fixed fields of `data`, either in `extra_buf` for a command
+ * from the interrupt pipe or in the read cache for one from the bulk stream,
+ * which may fill a whole transfer.
+ */
+struct hss_proxy_cmd {
+	struct hss_packet ack;
+	char ack_payload[HSS_CMD_MAX_LEN];
+	struct hss_packet data;
+	char *extra;
+	int extra_len;
+	char extra_buf[HSS_CMD_MAX_LEN];
 };
 
 struct work_data_t {
 	struct work_struct work;
 	struct hss_proxy_context *context;
-	struct hss_packet data;
+	struct hss_proxy_cmd cmd;
 };
 
-struct listen_data {
-	int sock_id;
+/* A CONNECT_NAME waiting on `resolve_wq` for its name to be resolved */
+struct hss_proxy_resolve {
+	struct work_struct work;
 	struct hss_proxy_context *context;
+	struct hss_packet cmd;
+	int len;
+	char name[HSS_NAME_MAX];
 };
 
+/*
+ * The cookie given to a non-blocking connect, so the ACK sent when it
+ * finishes names the command that started it.
+ */
+#define HSS_PROXY_CONNECT_COOKIE(opcode, msg_id) \
+	(((u32)(opcode) << 16) | (msg_id))
+
 /* Forward declarations */
 static void hss_proxy_process_cmd(struct work_struct *work);
 static void hss_proxy_process_data(struct work_struct *work);
-int hss_proxy_listen_socket(void *param);
+static void hss_proxy_ack_work(struct work_struct *work);
+static void hss_proxy_resolve_work(struct work_struct *work);
+static void hss_proxy_egress_work(struct work_struct *work);
+static int hss_proxy_txbuf_alloc(struct hss_proxy_context *context);
+static void hss_proxy_txbuf_free(struct hss_proxy_context *context);
+static int hss_proxy_socket_readable(struct hss_host_socket *socket,
+	int sock_id, void *context);
+static void hss_proxy_socket_window(int sock_id, u32 window, void *context);
+static void hss_proxy_socket_connected(struct hss_host_socket *socket,
+	int sock_id, u32 cookie, int result, void *context);
+static void hss_proxy_socket_reaped(int sock_id, void *context);
+static void hss_proxy_socket_reset(int sock_id, void *context);
+static void hss_proxy_send_ack(struct hss_packet *packet,
+	struct hss_proxy_context *proxy_context);
+
+static const struct hss_socket_ops hss_proxy_socket_ops = {
+	.readable = hss_proxy_socket_readable,
+	.window = hss_proxy_socket_window,
+	.connected = hss_proxy_socket_connected,
+	.reaped = hss_proxy_socket_reaped,
+	.reset = hss_proxy_socket_reset,
+};
 
 static u16 hss_dev_counter;
 static atomic_t g_msg_id;
@@ -66,10 +243,12 @@ void *hss_proxy_init(void *usb_context)
 	struct hss_proxy_context *context = NULL;
 
 	/* Make the name large enough to hold the largest possible value */
-	char name[sizeof("hss_data_wq_4294967296")];
+	char name[sizeof("hss_resolve_wq_4294967296")];
 
 	struct workqueue_struct *wq = NULL;
 	struct workqueue_struct *data_wq = NULL;
+	struct workqueue_struct *resolve_wq = NULL;
+	struct workqueue_struct *egress_wq = NULL;
 	int dev = hss_dev_counter++;
 
 	/* Name and allocate the workqueue */
@@ -78,38 +257,104 @@ void *hss_proxy_init(void *usb_context)
 	if (!wq)
 		goto exit;
 
+	/* The data poller must be the only consumer of the read cache */
 	snprintf(name, sizeof(name), "hss_data_wq_%d", dev);
-	data_wq = create_workqueue(name);
+	data_wq = alloc_ordered_workqueue(name, 0);
 	if (!data_wq)
 		goto free_wq;
 
-	context = kmalloc(sizeof(*context), GFP_KERNEL);
+	snprintf(name, sizeof(name), "hss_resolve_wq_%d", dev);
+	resolve_wq = alloc_workqueue(name, WQ_UNBOUND, 0);
+	if (!resolve_wq)
+		goto free_data_wq;
+
+	/* Keeps socket reads in the order they were made */
+	snprintf(name, sizeof(name), "hss_egress_wq_%d", dev);
+	egress_wq = alloc_ordered_workqueue(name, 0);
+	if (!egress_wq)
+		goto free_resolve_wq;
+
+	context = kzalloc(sizeof(*context), GFP_KERNEL);
 
 	if (!context)
-		goto free_data_wq;
+		goto free_egress_wq;
 	context->proxy_id = dev;
+	atomic_set(&context->cmd_drops, 0);
+	context->max_transfer = hss_get_max_transfer(usb_context);
+	context->credits =
+		!!(hss_get_features(usb_context) & HSS_FEATURE_CREDITS);
+	context->cumulative_ack =
+		!!(hss_get_features(usb_context) & HSS_FEATURE_CUMULATIVE_ACK);
+	context->inband_cmd =
+		!!(hss_get_features(usb_context) & HSS_FEATURE_INBAND_CMD);
 	context->proxy_wq = wq;
 	context->proxy_data_wq = data_wq;
+	context->resolve_wq = resolve_wq;
+	context->egress_wq = egress_wq;
 	context->usb_context = usb_context;
-
-	context->read_cache.buf = kmalloc(READ_CACHE_SIZE, GFP_KERNEL);
-	if (!context->read_cache.buf)
+	INIT_WORK(&context->data_work, hss_proxy_process_data);
+	INIT_WORK(&context->egress_work, hss_proxy_egress_work);
+	spin_lock_init(&context->egress_lock);
+	INIT_LIST_HEAD(&context->egress_list);
+	INIT_LIST_HEAD(&context->tx_free);
+	INIT_DELAYED_WORK(&context->ack_work, hss_proxy_ack_work);
+
+	/* Page backed so bulk-in URBs can be mapped for DMA directly */
+	ret = hss_ring_alloc(&context->read_cache,
+		clamp(hss_read_cache_size,
+			READ_CACHE_MIN_SLOTS * context->max_transfer,
+			READ_CACHE_MAX_SIZE),
+		hss_get_bulk_in_chunk(usb_context));
+	if (ret)
 		goto free_context;
-	context->read_cache.head = 0;
-	context->read_cache.tail = 0;
+	context->rx_reserve = 0;
+
+	context->rx_fill = kcalloc(
+		context->read_cache.size / context->max_transfer,
+		sizeof(*context->rx_fill), GFP_KERNEL);
+	if (!context->rx_fill)
+		goto free_read_cache;
+
+	snprintf(context->cmd_cache_name, sizeof(context->cmd_cache_name),
+		"hss_cmd_%u", context->proxy_id);
+	context->cmd_cache = kmem_cache_create(context->cmd_cache_name,
+		sizeof(struct work_data_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!context->cmd_cache)
+		goto free_rx_fill;
+
+	context->cmd_pool = mempool_create_slab_pool(HSS_PROXY_CMD_RESERVE,
+		context->cmd_cache);
+	if (!context->cmd_pool)
+		goto free_cmd_cache;
+
+	if (hss_proxy_txbuf_alloc(context))
+		goto free_tx_bufs;
 
 	/* Initialize the proxy */
-	ret = hss_socket_mgr_init(&context->socket_table);
+	ret = hss_socket_mgr_init(&context->socket_mgr,
+		&hss_proxy_socket_ops, context, context->proxy_id);
 	if (ret)
-		goto free_read_cache;
+		goto free_tx_bufs;
 
 	goto exit;
 
+free_tx_bufs:
+	hss_proxy_txbuf_free(context);
+free_cmd_pool:
+	mempool_destroy(context->cmd_pool);
+free_cmd_cache:
+	kmem_cache_destroy(context->cmd_cache);
+free_rx_fill:
+	kfree(context->rx_fill);
 free_read_cache:
-	kfree(context->read_cache.buf);
+	hss_ring_free(&context->read_cache);
 free_context:
 	kfree(context);
 	context = NULL;
+free_egress_wq:
+	destroy_workqueue(egress_wq);
+free_resolve_wq:
+	destroy_workqueue(resolve_wq);
 free_data_wq:
 	destroy_workqueue(data_wq);
 free_wq:
@@ -122,9 +367,26 @@ void hss_proxy_destroy(void *context)
 {
 	struct hss_proxy_context *proxy = context;
 
-	kfree(proxy->read_cache.buf);
+	cancel_work_sync(&proxy->data_work);
+	cancel_delayed_work_sync(&proxy->ack_work);
+	destroy_workqueue(proxy->proxy_data_wq);
 	destroy_workqueue(proxy->proxy_wq);
-	hss_socket_mgr_destroy(proxy->socket_table);
+	destroy_workqueue(proxy->resolve_wq);
+	kfree(proxy->rx_fill);
+	hss_ring_free(&proxy->read_cache);
+
+	/* The manager is going away, don't let egress resume its sockets */
+	spin_lock(&proxy->egress_lock);
+	proxy->egress_stopped = true;
+	spin_unlock(&proxy->egress_lock);
+	hss_socket_mgr_destroy(proxy->socket_mgr);
+
+	/* Nothing reads sockets any more, send what was read */
+	destroy_workqueue(proxy->egress_wq);
+	hss_proxy_txbuf_free(proxy);
+	mempool_destroy(proxy->cmd_pool);
+	kmem_cache_destroy(proxy->cmd_cache);
+	kfree(proxy);
 }
 
 static int hss_family_to_host(enum hss_family dev_fam)
@@ -164,541 +426,1808 @@ static enum hss_type hss_type_to_host(enum hss_type dev_type)
 }
 
 /**
- * hss_proxy_process_open - Process an OPEN packet
+ * hss_proxy_create_socket - Creates the socket an OPEN asks for
  *
- * @packet The packet sent by the device
- * @dev The device ID requesting this operation
- * @ack The ACK packet to populate
+ * @open The OPEN fields sent by the device
+ * @context The proxy context
  *
+ * Returns: 0 on success or an error code
  */
-void hss_proxy_process_open(struct hss_packet *packet, u16 dev,
-	struct hss_packet *ack, struct hss_proxy_context *context)
+static int hss_proxy_create_socket(struct hss_payload_open *open,
+	struct hss_proxy_context *context)
 {
-
-	int ret;
 	int family, type, protocol;
-	struct hss_payload_open payload;
-
-	hss_get_payload_open(packet, &payload);
+	int ret;
 
 	/* Translate the HSS parameters to ones the socket interface */
-	family = hss_family_to_host(payload.addr_family);
-	if (family < 0) {
-		ret = -EINVAL;
-		goto fill_ack;
-	}
+	family = hss_family_to_host(open->addr_family);
+	protocol = hss_protocol_to_host(open->protocol);
+	type = hss_type_to_host(open->type);
+	if (family < 0 || protocol < 0 || type < 0)
+		return -EINVAL;
+
+	ret = hss_socket_create(open->handle, family, type, protocol,
+		context->socket_mgr);
+
+	/* Dual-stack datagram sockets fall back to IPv4 on hosts without IPv6 */
+	if (ret == -EAFNOSUPPORT && family == PF_INET6 && type == SOCK_DGRAM)
+		ret = hss_socket_create(open->handle, PF_INET, type, protocol,
+			context->socket_mgr);
+	return ret;
+}
 
-	protocol = hss_protocol_to_host(payload.protocol);
-	if (protocol < 0) {
-		ret = -EINVAL;
-		goto fill_ack;
-	}
+/**
+ * hss_proxy_start_rx - Starts reading a socket named by the device
+ *
+ * @sock_id The socket
+ * @context The proxy context
+ */
+static void hss_proxy_start_rx(int sock_id, struct hss_proxy_context *context)
+{
+	struct hss_host_socket *socket;
 
-	type = hss_type_to_host(payload.type);
-	if (type < 0) {
-		ret = -EINVAL;
-		goto fill_ack;
+	socket = hss_socket_get(sock_id, context->socket_mgr);
+	if (socket) {
+		hss_socket_start_rx(socket);
+		hss_socket_put(socket);
 	}
-	ret = hss_socket_create(payload.handle, family, type, protocol,
-		context->socket_table);
-
-fill_ack:
-	/* If creation succeded return created ID without the device */
-	hss_packet_fill_ack_open(packet, ack, ret, payload.handle);
 }
 
 /**
- * hss_proxy_process_connect - Process an CONNECT packet
+ * hss_proxy_process_open - Process an OPEN packet
  *
  * @packet The packet sent by the device
  * @dev The device ID requesting this operation
  * @ack The ACK packet to populate
  *
- * Performs an CONNECT operation based on an incoming HSS packet.
  */
-void hss_proxy_process_connect(struct hss_packet *packet, u16 dev,
+void hss_proxy_process_open(struct hss_packet *packet, u16 dev,
 	struct hss_packet *ack, struct hss_proxy_context *context)
 {
 	int ret;
-	struct hss_payload_connect_ip payload;
-	struct hss_packet_hdr hdr; 
-	int id;
 
-	hss_get_header(packet, &hdr);
-	hss_get_payload_connect(packet, &payload);
-	id = hdr.sock_id;
+	ret = hss_proxy_create_socket(&packet->open, context);
+
+	/* Datagrams can arrive once the socket has sent, connected or not */
+	if (!ret && packet->open.type == HSS_TYPE_DGRAM)
+		hss_proxy_start_rx(packet->open.handle, context);
+
+	/* If creation succeded return created ID without the device */
+	hss_packet_fill_ack_open(packet, ack, ret, packet->open.handle);
+}
+
+/**
+ * hss_proxy_connect_socket - Starts the connect a CONNECT asks for
+ *
+ * @id The socket to connect
+ * @payload The CONNECT fields sent by the device
+ * @data Early data for TCP Fast Open, or NULL
+ * @len The length of @data
+ * @cookie Passed back to hss_proxy_socket_connected
+ * @context The proxy context
+ *
+ * Returns: 0 if connected, -EINPROGRESS if hss_proxy_socket_connected will
+ * be called with the result or an error code.
+ */
+static int hss_proxy_connect_socket(int id,
+	struct hss_payload_connect_ip *payload, char *data, int len,
+	u32 cookie, struct hss_proxy_context *context)
+{
+	int ret;
 
-	switch (payload.family) {
+	switch (payload->family) {
 	case HSS_FAM_IP:
 		pr_info("Connecting IPv4");
 		ret = hss_socket_connect_in4(
 			id,
-			(char *)&(payload.addr.ip4.ip_addr),
-			sizeof(payload.addr.ip4.ip_addr),
-			payload.port,
-			0,
-			context->socket_table);
+			(char *)&(payload->addr.ip4.ip_addr),
+			sizeof(payload->addr.ip4.ip_addr),
+			payload->port,
+			data,
+			len,
+			cookie,
+			context->socket_mgr);
 		break;
 	case HSS_FAM_IP6:
 		pr_info("Connecting IPv6");
 		ret = hss_socket_connect_in6(
 			id,
-			(char *)&(payload.addr.ip6.ip_addr),
-			sizeof(payload.addr.ip6.ip_addr),
-			payload.port,
-			payload.addr.ip6.flow_info,
-			payload.addr.ip6.scope_id,
-			0,
-			context->socket_table);
+			(char *)&(payload->addr.ip6.ip_addr),
+			sizeof(payload->addr.ip6.ip_addr),
+			payload->port,
+			payload->addr.ip6.flow_info,
+			payload->addr.ip6.scope_id,
+			data,
+			len,
+			cookie,
+			context->socket_mgr);
 		break;
 	default:
 		pr_info("Connecting inval");
 		ret = -EINVAL;
 		break;
 	}
-	hss_packet_fill_ack_connect(packet, ack, ret);
-
-	/* Start reading from the socket if we are connected */
-	if (!ret) {
-		struct task_struct *new_thread;
-		/* Spawned thread is expected to free */
-		struct listen_data *params =
-			kmalloc(sizeof(struct listen_data), GFP_KERNEL);
-		params->sock_id = id;
-		params->context = context;
-
-		new_thread = kthread_create(
-			hss_proxy_listen_socket,
-			params,
-			"hss_sk_%d",
-			id);
-		if (new_thread)
-			wake_up_process(new_thread);
-	}
+	return ret;
 }
 
 /**
- * Helper funciton to form a CLOSE packet for a given socket and send it
+ * hss_proxy_process_connect - Process an CONNECT packet
  *
- * @sock_id The ID of the sock to close
- * @usb_context A pointer to the USB context
+ * @packet The packet sent by the device
+ * @dev The device ID requesting this operation
+ * @ack The ACK packet to populate
  *
- * Note: Close packets have no payload so the send size will always be
- * sizeof(struct hss_packet_hdr). Msg is expected to be of sufficient length.
+ * Performs an CONNECT operation based on an incoming HSS packet. The connect
+ * never blocks. If it can't finish at once the ACK is sent later by
+ * hss_proxy_socket_connected.
+ *
+ * Returns: 0 if @ack was filled, 1 if the ACK will be sent later.
  */
-static void hss_send_close(
-	int sock_id,
-	void *usb_context)
+int hss_proxy_process_connect(struct hss_packet *packet, u16 dev,
+	struct hss_packet *ack, struct hss_proxy_context *context)
 {
-	struct hss_packet close_packet;
-	char *proxy_cmd_buf;
+	int ret;
+	struct hss_payload_connect_ip payload;
+	struct hss_packet_hdr hdr; 
+	int id;
 
-	/* Send a close to the device */
-	hss_packet_fill_close(&close_packet, sock_id, atomic_inc_return(&g_msg_id));
-	proxy_cmd_buf = hss_get_ack_buf(usb_context);
-	hss_packet_to_buf(&close_packet, proxy_cmd_buf, HSS_COPY_FIELDS);
-	hss_cmd_out(usb_context, proxy_cmd_buf, HSS_FIXED_LEN_CLOSE);
+	hss_get_header(packet, &hdr);
+	hss_get_payload_connect(packet, &payload);
+	id = hdr.sock_id;
+
+	ret = hss_proxy_connect_socket(id, &payload, NULL, 0,
+		HSS_PROXY_CONNECT_COOKIE(HSS_OP_CONNECT, hdr.msg_id), context);
+	if (ret == -EINPROGRESS)
+		return 1;
+
+	hss_packet_fill_ack_connect(packet, ack, ret);
+
+	/* Start reading from the socket if we are connected */
+	if (!ret)
+		hss_proxy_start_rx(id, context);
+	return 0;
 }
 
 /**
- * Fills and sends a TRANSMIT packet for a given sock. Msg must be a unfilled
- * HSS packet header with the payload appended afterwards.
+ * hss_proxy_process_open_connect - Process an OPEN_CONNECT packet
  *
- * @msg The HSS packet to send, already have payload appended
- * @payload_len The length of the payload
- * @usb_context A pointer to the USB context
+ * @cmd The command sent by the device, `extra` holds any early data
+ * @context The proxy context
  *
- * Note: To avoid excessive memory copying callers should allocate a send
- * buffer large enough for both the header and payload data then write the
- * actual payload data starting at offset sizeof(struct hss_packet_hdr)
+ * Creates the socket and connects it without blocking, as an OPEN followed
+ * by a CONNECT would. Early data goes out with the SYN when TCP Fast Open is
+ * enabled for the device, otherwise it is queued on the socket until the
+ * handshake is done. One ACK with the result of both steps is sent, later by
+ * hss_proxy_socket_connected if the connect can't finish at once.
+ *
+ * Returns: 0 if `cmd->ack` was filled, 1 if the ACK will be sent later.
  */
-static void hss_send_transmit(
-	char *msg,
-	int payload_len,
-	int sock_id,
-	void *usb_context)
+static int hss_proxy_process_open_connect(struct hss_proxy_cmd *cmd,
+	struct hss_proxy_context *context)
 {
-	int bulk_ret;
-	struct hss_packet pkt;
-	int packet_len = payload_len + HSS_FIXED_LEN_TRANSMIT;
-
-	hss_packet_fill_transmit(&pkt, sock_id, NULL, payload_len, atomic_inc_return(&g_msg_id));
-	hss_packet_to_buf(&pkt, msg, HSS_COPY_FIELDS);
+	struct hss_packet *packet = &cmd->data;
+	int id = packet->open_connect.open.handle;
+	bool fastopen = hss_get_tcp_fastopen(context->usb_context);
+	struct hss_host_socket *socket;
+	int ret;
 
-	bulk_ret = hss_bulk_out(usb_context, msg, packet_len);
+	ret = hss_proxy_create_socket(&packet->open_connect.open, context);
+	if (ret)
+		goto fill_ack;
 
-	/* Bulk_out should only return send length requested */
-	if (bulk_ret != packet_len)
-		pr_err("%s bulk_out send %d, returned %d\n",
-			__func__, packet_len, bulk_ret);
-}
+	ret = hss_proxy_connect_socket(id, &packet->open_connect.connect,
+		fastopen ? cmd->extra : NULL, cmd->extra_len,
+		HSS_PROXY_CONNECT_COOKIE(HSS_OP_OPEN_CONNECT,
+			packet->hdr.msg_id),
+		context);
+	if (ret && ret != -EINPROGRESS) {
+		/* The device only gets the failed ACK, not a socket to close */
+		hss_socket_close(id, context->socket_mgr);
+		goto fill_ack;
+	}
 
-/* Continually listen to a socket and pass its data over USB */
-int hss_proxy_listen_socket(void *param)
-{
-	struct listen_data *ld = param;
-	int max_msg_len = XAPRC00X_BULK_OUT_BUF_SIZE;
-	int max_read_len = max_msg_len - HSS_FIXED_LEN_TRANSMIT;
-	char *msg = kzalloc(max_msg_len, GFP_KERNEL);
-	int sock_read_len;
-	void *usb_context = ld->context->usb_context;
-
-	while (1) {
-		/* Read data from our socket. To save on excessive memory copies we will write
-		 * to the location it will be on the outgoing packet. */
-		sock_read_len = hss_socket_read(
-			ld->sock_id,
-			msg + HSS_FIXED_LEN_TRANSMIT,
-			max_read_len,
-			0,
-			ld->context->socket_table);
-
-		/* Close and exit on a zero-read */
-		if (sock_read_len <= 0) {
-			hss_send_close(
-				ld->sock_id,
-				usb_context);
-			break;
-		}
+	/* Counted against the initial window like any TRANSMIT */
+	if (!fastopen && cmd->extra_len > 0) {
+		socket = hss_socket_get(id, context->socket_mgr);
+		if (!socket || hss_socket_write(socket, cmd->extra,
+			cmd->extra_len) < 0)
+			pr_err("%s sock %d lost %d bytes of early data\n",
+				__func__, id, cmd->extra_len);
+		if (socket)
+			hss_socket_put(socket);
+	}
 
-		hss_send_transmit(
-			msg,
-			sock_read_len,
-			ld->sock_id,
-			usb_context);
+	if (ret == -EINPROGRESS)
+		return 1;
 
-		/* Zero out the packet (not the payload, though) */
-		memset(msg, 0, sizeof(*msg));
-	}
-	kfree(msg);
-	kfree(param);
-	return sock_read_len;
+	hss_proxy_start_rx(id, context);
+fill_ack:
+	/* The ACK is for the socket the device named */
+	packet->hdr.sock_id = id;
+	hss_packet_fill_ack_connect(packet, &cmd->ack, ret);
+	return 0;
 }
 
 /**
- * hss_proxy_process_close - Process an CLOSE packet
+ * hss_proxy_connect_addrs - Connects a CONNECT_NAME to what its name resolved
  *
- * @packet The packet sent by the device
- * @dev The device ID requesting this operation
- * @ack The ACK packet to populate
+ * @packet The CONNECT_NAME
+ * @addrs The addresses the name resolved to, ports unset
+ * @count The number of @addrs
+ * @context The proxy context
  *
- * Performs an CLOSE operation based on an incoming HSS packet.
+ * The addresses are raced as the happy_eyeballs_ms parameter says.
+ *
+ * Returns: -EINPROGRESS if hss_proxy_socket_connected will be called with
+ * the result or an error code.
  */
-void hss_proxy_process_close(struct hss_packet *packet, u16 dev,
-	struct hss_packet *ack, struct hss_proxy_context *context)
+static int hss_proxy_connect_addrs(struct hss_packet *packet,
+	union hss_socket_addr *addrs, int count,
+	struct hss_proxy_context *context)
 {
-	struct hss_packet_hdr hdr;
+	int i;
 
-	hss_get_header(packet, &hdr);
-
-	hss_socket_close(hdr.sock_id, context->socket_table);
+	for (i = 0; i < count; i++) {
+		if (addrs[i].sa.sa_family == AF_INET6)
+			addrs[i].in6.sin6_port = packet->connect_name.port;
+		else
+			addrs[i].in4.sin_port = packet->connect_name.port;
+	}
 
-	/* Close ACKs do not contain status data. */
-	hss_packet_fill_ack(&hdr, ack);
+	return hss_socket_connect_race(packet->hdr.sock_id, addrs, count,
+		max(READ_ONCE(hss_happy_eyeballs_ms), 0),
+		HSS_PROXY_CONNECT_COOKIE(HSS_OP_CONNECT_NAME,
+			packet->hdr.msg_id),
+		context->socket_mgr);
 }
 
 /**
- * hss_proxy_rcv_cmd - Receives and begins processing an HSS packet
+ * hss_proxy_process_connect_name - Process a CONNECT_NAME packet
  *
- * @context A pointer to the proxy instance
- * @packet A pointer to the packet to process
- * @packet_len The length of the packet
+ * @cmd The command sent by the device, `extra` holds the name
+ * @context The proxy context
  *
- * Notes:
- * Packet can be modified or freed after this function returns.
- * This function may be called in an atomic context.
+ * Opens the socket unless the device already has, then connects it to the
+ * name. A name in the shared resolver cache is connected to at once, others
+ * are resolved on `resolve_wq` first so a slow lookup holds up no other
+ * command. The ACK is sent by hss_proxy_socket_connected unless something
+ * fails before the connect starts.
+ *
+ * Returns: 0 if `cmd->ack` was filled, 1 if the ACK will be sent later.
  */
-void hss_proxy_rcv_cmd(char *packet,
-	int packet_len, void *context)
+static int hss_proxy_process_connect_name(struct hss_proxy_cmd *cmd,
+	struct hss_proxy_context *context)
 {
-	struct work_data_t *newwork;
-	struct hss_proxy_context *proxy_ctx =
-		(struct hss_proxy_context *) context;
+	union hss_socket_addr addrs[HSS_SOCKET_RACE_MAX];
+	struct hss_packet *packet = &cmd->data;
+	struct hss_proxy_resolve *resolve;
+	int ret;
 
-	/* Allocate for a work_data_t that can fit the largest possible CMD packet */
-	newwork = kmalloc(sizeof(struct work_data_t) + 64 - HSS_HDR_LEN, GFP_ATOMIC);
+	/* The ACK is for the socket the device named */
+	packet->hdr.sock_id = packet->connect_name.open.handle;
 
-	newwork->context = proxy_ctx;
+	if (cmd->extra_len <= 0 || cmd->extra_len > HSS_NAME_MAX ||
+		memchr(cmd->extra, '\0', cmd->extra_len)) {
+		ret = -EINVAL;
+		goto fill_ack;
+	}
 
-	/* Copy the header so the entire packet can be evaluated */
-	if (packet_len < HSS_HDR_LEN)
-		return;
-	hss_packet_from_buf(&newwork->data, packet, HSS_COPY_HDR);
+	ret = hss_proxy_create_socket(&packet->connect_name.open, context);
+	if (ret && ret != -EEXIST)
+		goto fill_ack;
 
-	/* Make sure the length sent is correct and copy any given payload */
-	if (packet_len != newwork->data.hdr.payload_len + HSS_HDR_LEN ||
-			newwork->data.hdr.payload_len > 64 - HSS_HDR_LEN)
-		return;
-	else if (newwork->data.hdr.payload_len > 0 )
-		hss_packet_from_buf(&newwork->data, packet, HSS_COPY_FIELDS);
+	ret = hss_resolver_lookup(cmd->extra, cmd->extra_len, addrs,
+		ARRAY_SIZE(addrs));
+	if (ret > 0) {
+		ret = hss_proxy_connect_addrs(packet, addrs, ret, context);
+	} else if (ret == -ENOENT) {
+		resolve = kmalloc(sizeof(*resolve), GFP_KERNEL);
+		if (!resolve) {
+			ret = -ENOMEM;
+			goto fill_ack;
+		}
+		INIT_WORK(&resolve->work, hss_proxy_resolve_work);
+		resolve->context = context;
+		resolve->cmd = *packet;
+		resolve->len = cmd->extra_len;
+		memcpy(resolve->name, cmd->extra, cmd->extra_len);
+		queue_work(context->resolve_wq, &resolve->work);
+		return 1;
+	}
+	if (ret == -EINPROGRESS)
+		return 1;
 
-	INIT_WORK(&newwork->work, hss_proxy_process_cmd);
-	queue_work(proxy_ctx->proxy_wq, &newwork->work);
+fill_ack:
+	hss_packet_fill_ack_connect(packet, &cmd->ack, ret);
+	return 0;
 }
 
 /**
- * hss_proxy_rcv_bulk - Receives and begins processing an HSS packet
+ * hss_proxy_resolve_work - Resolves the name of a CONNECT_NAME
  *
- * @context A pointer to the proxy instance
- * @packet A pointer to the packet to process
- * @packet_len The length of the packet
+ * @work The `work` of a struct hss_proxy_resolve, freed here
  *
- * Notes:
- * Packet can be modified or freed after this function returns.
- * This function may be called in an atomic context.
- * Other threads may modify ring->tail during this operation.
+ * Connects to the addresses found or sends the ACK for the failure.
  */
-int hss_proxy_rcv_data(void *data, int len, void *context)
+static void hss_proxy_resolve_work(struct work_struct *work)
 {
-	struct work_data_t *newwork;
-	struct hss_proxy_context *proxy_ctx =
-		(struct hss_proxy_context *) context;
-	struct circ_buf *ring = &proxy_ctx->read_cache;
-	int did_copy;
-
-	did_copy = hss_ring_write(ring, READ_CACHE_SIZE, data, len);
-
-	newwork = kmalloc(sizeof(struct work_data_t), GFP_ATOMIC);
+	struct hss_proxy_resolve *resolve =
+		container_of(work, struct hss_proxy_resolve, work);
+	struct hss_proxy_context *context = resolve->context;
+	union hss_socket_addr addrs[HSS_SOCKET_RACE_MAX];
+	struct hss_packet ack;
+	int ret;
 
-	if(newwork) {
-		newwork->context = proxy_ctx;
+	ret = hss_resolve(resolve->name, resolve->len, addrs,
+		ARRAY_SIZE(addrs));
+	if (ret > 0)
+		ret = hss_proxy_connect_addrs(&resolve->cmd, addrs, ret,
+			context);
 
-		INIT_WORK(&newwork->work, hss_proxy_process_data);
-		queue_work(proxy_ctx->proxy_data_wq, &newwork->work);
-	} else {
-		pr_err("%s could not allocate work item.\n", __func__);
+	if (ret != -EINPROGRESS) {
+		hss_packet_fill_ack_connect(&resolve->cmd, &ack, ret);
+		hss_proxy_send_ack(&ack, context);
 	}
-
-	return did_copy;
+	kfree(resolve);
 }
 
 /**
- * hss_proxy_run_host_cmd -
- * Helper function for hss_proxy_process_cmd
- *
- * @packet The packet to process
- * @ack The ACK packet to reply with
- * @proxy_context The proxy context
+ * hss_proxy_socket_connected - Sends the ACK for a finished connect
  *
- * Returns: A buffer containing an ACK message or NULL if no ACK.
+ * @socket The socket that was connecting
+ * @sock_id Its ID
+ * @cookie The HSS_PROXY_CONNECT_COOKIE of the CONNECT, OPEN_CONNECT or
+ *	CONNECT_NAME
+ * @result 0 or the error the connect failed with
+ * @context A pointer to the proxy instance
  *
- * Notes:
- * Any returned ACK buffer is owned by the USB driver and should not be freed
- * or used outside hss_proxy_process_cmd.
+ * Called from the socket manager's tx pool.
  */
-static struct hss_packet *hss_proxy_run_host_cmd(
-	struct hss_packet *packet,
-	struct hss_proxy_context *context)
-{
-	int dev = context->proxy_id;
-	struct hss_packet *ack = kmalloc(sizeof(*ack) + 64, GFP_KERNEL);
-
-	switch (packet->hdr.opcode) {
-	case HSS_OP_OPEN:
-		hss_proxy_process_open(packet, dev, ack, context);
-		break;
-	case HSS_OP_CONNECT:
-		hss_proxy_process_connect(packet, dev, ack, context);
-		break;
-	case HSS_OP_CLOSE:
-		hss_proxy_process_close(packet, dev, ack, context);
-		break;
-	case HSS_OP_ACK:
-	case HSS_OP_ACKDATA:
-	case HSS_OP_SHUTDOWN:
-	case HSS_OP_TRANSMIT:
-	default:
-		pr_err("%s default %d\n", __func__, packet->hdr.opcode);
-		ack = NULL;
-		break;
-	}
-	return ack;
-}
-
-
-static void hss_proxy_send_ack(struct hss_packet *packet, struct hss_proxy_context *proxy_context)
+static void hss_proxy_socket_connected(struct hss_host_socket *socket,
+	int sock_id, u32 cookie, int result, void *context)
 {
-	char *proxy_cmd_buf;
-
-	proxy_cmd_buf =
-		hss_get_ack_buf(proxy_context->usb_context);
+	struct hss_proxy_context *proxy_ctx = context;
+	struct hss_packet connect;
+	struct hss_packet ack;
 
-	/* Copy the fixed part of the ACK */
-	hss_packet_to_buf(packet, proxy_cmd_buf, HSS_COPY_FIELDS);
-
-	/* Copy the arbitrary payload if applicable */
-	if (packet->hdr.payload_len + HSS_HDR_LEN > HSS_FIXED_LEN_ACK)
-		memcpy(
-				proxy_cmd_buf + HSS_FIXED_LEN_ACK,
-				&packet->hss_payload_none,
-				packet->hdr.payload_len - HSS_FIXED_LEN_ACK + HSS_HDR_LEN);
+	hss_fill_packet(&connect, cookie >> 16, sock_id, cookie & 0xFFFF);
+	hss_packet_fill_ack_connect(&connect, &ack, result);
+	hss_proxy_send_ack(&ack, proxy_ctx);
 
-	/* Send the ACK over USB */
-	hss_cmd_out(proxy_context->usb_context, proxy_cmd_buf,
-		HSS_HDR_LEN + packet->hdr.payload_len);
+	if (!result)
+		hss_socket_start_rx(socket);
 }
 
 /**
- * hss_proxy_process_cmd - Bottom half of hss_proxy_rcv_cmd
+ * hss_proxy_send_cmd - Sends a command to the device
  *
- * @work Work item to process
+ * @context The proxy context
+ * @cmd The serialized command
+ * @len The length of @cmd, at most HSS_CMD_MAX_LEN or `max_transfer` with
+ *	HSS_FEATURE_INBAND_CMD
+ *
+ * With HSS_FEATURE_INBAND_CMD the command is queued on the bulk pipe behind
+ * any TRANSMITs already sent, otherwise it goes out on the interrupt pipe.
  *
  * Notes:
- * Work struct is expected to be of type work_data_t and be tailed with
- * `work->packet_len` bytes for the actual packet.
+ * May sleep.
  */
-static void hss_proxy_process_cmd(struct work_struct *work)
+static void hss_proxy_send_cmd(struct hss_proxy_context *context,
+	char *cmd, int len)
 {
-	struct work_data_t *work_data;
-	struct hss_proxy_context *proxy_context;
-	struct hss_packet *packet;
-	struct hss_packet *ack;
-
-	work_data = (struct work_data_t *) work;
-	proxy_context = work_data->context;
-	packet = (struct hss_packet *)&work_data->data;
-
-	ack = hss_proxy_run_host_cmd(packet, proxy_context);
+	char *proxy_cmd_buf;
 
-	if (ack) {
-		hss_proxy_send_ack(ack, proxy_context);
-		kfree(ack);
+	if (context->inband_cmd) {
+		hss_bulk_out(context->usb_context, cmd, len);
+		return;
 	}
 
-	kfree(work);
+	proxy_cmd_buf = hss_get_ack_buf(context->usb_context);
+	memcpy(proxy_cmd_buf, cmd, len);
+	hss_cmd_out(context->usb_context, proxy_cmd_buf, len);
 }
 
-static int hss_proxy_transmit_send(
-	struct circ_buf *ring,
-	struct hss_packet_hdr *packet_hdr,
-	struct hss_proxy_context *context)
-{
-	char *payload;
-	struct hss_ring_section section;
-	int ret = 1;
+/**
+ * Helper funciton to form a CLOSE packet for a given socket and send it
+ *
+ * @sock_id The ID of the sock to close
+ * @context The proxy context
+ *
+ * Note: Close packets have no payload so the send size will always be
+ * sizeof(struct hss_packet_hdr).
+ */
+static void hss_send_close(
+	int sock_id,
+	struct hss_proxy_context *context)
+{
+	struct hss_packet close_packet;
+	char cmd[HSS_FIXED_LEN_CLOSE];
+
+	/* Send a close to the device */
+	hss_packet_fill_close(&close_packet, sock_id, atomic_inc_return(&g_msg_id));
+	hss_packet_to_buf(&close_packet, cmd, HSS_COPY_FIELDS);
+	hss_proxy_send_cmd(context, cmd, HSS_FIXED_LEN_CLOSE);
+}
+
+/**
+ * hss_proxy_txbuf_alloc - Allocates the buffers for socket reads
+ *
+ * @context The proxy context, with `max_transfer` agreed
+ *
+ * Each of the HSS_PROXY_TX_BUFS buffers holds a whole message, which would
+ * take high-order pages from slab. They are allocated once here and may be
+ * virtually contiguous, nothing maps them for DMA.
+ *
+ * Returns: 0 on success or -ENOMEM. Free even a partial set with
+ * hss_proxy_txbuf_free.
+ */
+static int hss_proxy_txbuf_alloc(struct hss_proxy_context *context)
+{
+	struct hss_proxy_txbuf *buf;
+	int i;
+
+	for (i = 0; i < HSS_PROXY_TX_BUFS; i++) {
+		buf = kvmalloc(sizeof(*buf) + context->max_transfer,
+			GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		list_add(&buf->list, &context->tx_free);
+	}
+
+	return 0;
+}
+
+/* Frees the buffers, every one must be back on `tx_free` */
+static void hss_proxy_txbuf_free(struct hss_proxy_context *context)
+{
+	struct hss_proxy_txbuf *buf;
+	struct hss_proxy_txbuf *next;
+
+	list_for_each_entry_safe(buf, next, &context->tx_free, list)
+		kvfree(buf);
+	INIT_LIST_HEAD(&context->tx_free);
+}
+
+/**
+ * hss_proxy_txbuf_get - Takes a buffer to read a socket into
+ *
+ * @context The proxy context
+ * @socket The socket about to be read
+ *
+ * Only HSS_PROXY_TX_BUFS buffers can wait for bulk-out at once. When they
+ * are all taken @socket is parked until hss_proxy_txbuf_put frees one, so a
+ * slow USB link holds up socket reads without holding up the rx pool.
+ *
+ * Returns: A buffer with room for `max_transfer` bytes or NULL
+ *
+ * Notes: Never sleeps. Only called from the `readable` op.
+ */
+static struct hss_proxy_txbuf *hss_proxy_txbuf_get(
+	struct hss_proxy_context *context, struct hss_host_socket *socket)
+{
+	struct hss_proxy_txbuf *buf;
+
+	spin_lock(&context->egress_lock);
+	buf = list_first_entry_or_null(&context->tx_free,
+		struct hss_proxy_txbuf, list);
+	if (buf) {
+		list_del(&buf->list);
+		buf->skb = NULL;
+	} else
+		hss_socket_rx_stall(socket);
+	spin_unlock(&context->egress_lock);
+
+	return buf;
+}
+
+/**
+ * hss_proxy_txbuf_put - Frees a buffer from hss_proxy_txbuf_get
+ *
+ * @context The proxy context
+ * @buf The buffer
+ *
+ * Sockets parked for want of a buffer are queued to be read again.
+ */
+static void hss_proxy_txbuf_put(struct hss_proxy_context *context,
+	struct hss_proxy_txbuf *buf)
+{
+	if (buf->skb)
+		consume_skb(buf->skb);
+
+	spin_lock(&context->egress_lock);
+	list_add(&buf->list, &context->tx_free);
+	if (!context->egress_stopped)
+		hss_socket_rx_resume(context->socket_mgr);
+	spin_unlock(&context->egress_lock);
+}
+
+/**
+ * hss_proxy_egress_queue - Queues a socket read to be sent to the device
+ *
+ * @context The proxy context
+ * @buf The buffer holding the read
+ * @len The bytes of `buf->msg` to send, 0 to send a CLOSE for `buf->sock_id`
+ *
+ * `egress_work` sends it, and frees @buf, after everything queued earlier.
+ */
+static void hss_proxy_egress_queue(struct hss_proxy_context *context,
+	struct hss_proxy_txbuf *buf, int len)
+{
+	buf->len = len;
+
+	spin_lock(&context->egress_lock);
+	list_add_tail(&buf->list, &context->egress_list);
+	spin_unlock(&context->egress_lock);
+
+	queue_work(context->egress_wq, &context->egress_work);
+}
+
+/**
+ * hss_proxy_egress_transmit - Queues a TRANSMIT read from a socket
+ *
+ * @context The proxy context
+ * @buf The buffer with the payload already read in behind the header
+ * @sock_id The socket that was read
+ * @payload_len The length of the payload
+ */
+static void hss_proxy_egress_transmit(struct hss_proxy_context *context,
+	struct hss_proxy_txbuf *buf, int sock_id, int payload_len)
+{
+	struct hss_packet pkt;
+
+	hss_packet_fill_transmit(&pkt, sock_id, NULL, payload_len,
+		atomic_inc_return(&g_msg_id));
+	hss_packet_to_buf(&pkt, buf->msg, HSS_COPY_FIELDS);
+	hss_proxy_egress_queue(context, buf, HSS_FIXED_LEN_TRANSMIT +
+		payload_len);
+}
+
+/**
+ * hss_proxy_egress_close - Queues a CLOSE behind a socket's last read
+ *
+ * @context The proxy context
+ * @buf A buffer from hss_proxy_txbuf_get
+ * @sock_id The socket that closed
+ */
+static void hss_proxy_egress_close(struct hss_proxy_context *context,
+	struct hss_proxy_txbuf *buf, int sock_id)
+{
+	buf->sock_id = sock_id;
+	hss_proxy_egress_queue(context, buf, 0);
+}
+
+/**
+ * hss_proxy_egress_send - Sends one socket read to the device
+ *
+ * @context The proxy context
+ * @buf The read, with a TRANSMIT or SENDTO header at the start of `msg`
+ *
+ * A payload still in an skb is mapped straight into a bulk-out URB behind
+ * the header. If the controller or skb layout doesn't allow that it is
+ * copied in behind the header and sent like any other.
+ */
+static void hss_proxy_egress_send(struct hss_proxy_context *context,
+	struct hss_proxy_txbuf *buf)
+{
+	int payload_len = buf->len - HSS_FIXED_LEN_TRANSMIT;
+	int ret;
+
+	if (buf->skb) {
+		ret = hss_bulk_out_skb(context->usb_context, buf->msg,
+			HSS_FIXED_LEN_TRANSMIT, buf->skb, buf->skb_offset,
+			payload_len);
+		if (ret >= 0)
+			return;
+
+		skb_copy_bits(buf->skb, buf->skb_offset,
+			buf->msg + HSS_FIXED_LEN_TRANSMIT, payload_len);
+	}
+
+	ret = hss_bulk_out(context->usb_context, buf->msg, buf->len);
+	if (ret != buf->len)
+		pr_err("%s bulk_out send %d, returned %d\n", __func__,
+			buf->len, ret);
+}
+
+/**
+ * hss_proxy_egress_work - Sends socket reads to the device
+ *
+ * @work The proxy contexts `egress_work`
+ *
+ * Runs on the ordered `egress_wq` so the rx pool never waits on bulk-out.
+ */
+static void hss_proxy_egress_work(struct work_struct *work)
+{
+	struct hss_proxy_context *context = container_of(work,
+		struct hss_proxy_context, egress_work);
+	struct hss_proxy_txbuf *buf;
+	struct hss_proxy_txbuf *next;
+	LIST_HEAD(list);
+
+	spin_lock(&context->egress_lock);
+	list_splice_init(&context->egress_list, &list);
+	spin_unlock(&context->egress_lock);
+
+	list_for_each_entry_safe(buf, next, &list, list) {
+		if (buf->len)
+			hss_proxy_egress_send(context, buf);
+		else
+			hss_send_close(buf->sock_id, context);
+		hss_proxy_txbuf_put(context, buf);
+	}
+}
+
+/**
+ * struct hss_proxy_egress - A stream being read with hss_proxy_egress_skb
+ *
+ * @context The proxy context
+ * @socket The socket being read
+ * @sock_id Its ID
+ * @buf The buffer for the next section, NULL once it is used
+ */
+struct hss_proxy_egress {
+	struct hss_proxy_context *context;
+	struct hss_host_socket *socket;
+	int sock_id;
+	struct hss_proxy_txbuf *buf;
+};
+
+/**
+ * hss_proxy_egress_skb - Queues a section of a received skb as a TRANSMIT
+ *
+ * @skb The skb on the socket's receive queue
+ * @offset The offset of the data from skb->data
+ * @len The length of the data
+ * @arg The hss_proxy_egress for the socket being read
+ *
+ * Runs under the socket's lock, so nothing here sleeps and nothing is sent.
+ * The section is held by a clone of the skb until `egress_work` sends it,
+ * or is copied out straight away if there is no memory for the clone. The
+ * clones are bounded by HSS_PROXY_TX_BUFS like any other read.
+ *
+ * The first section goes in the buffer the reader passed in, the read stops
+ * early if there is no free buffer for a later one.
+ *
+ * Returns: The number of bytes queued
+ */
+static int hss_proxy_egress_skb(struct sk_buff *skb, unsigned int offset,
+	size_t len, void *arg)
+{
+	struct hss_proxy_egress *egress = arg;
+	struct hss_proxy_context *context = egress->context;
+	struct hss_proxy_txbuf *buf = egress->buf;
+
+	if (!buf)
+		buf = hss_proxy_txbuf_get(context, egress->socket);
+	if (!buf)
+		return 0;
+	egress->buf = NULL;
+
+	len = min_t(size_t, len,
+		context->max_transfer - HSS_FIXED_LEN_TRANSMIT);
+
+	buf->skb = skb_clone(skb, GFP_ATOMIC);
+	buf->skb_offset = offset;
+	if (!buf->skb)
+		skb_copy_bits(skb, offset, buf->msg + HSS_FIXED_LEN_TRANSMIT,
+			len);
+	hss_proxy_egress_transmit(context, buf, egress->sock_id, len);
+
+	return len;
+}
+
+/**
+ * hss_proxy_dgram_readable - Passes a datagram socket's datagrams over USB
+ *
+ * @socket The socket with datagrams to read
+ * @sock_id Its ID
+ * @proxy_ctx The proxy instance
+ *
+ * Each datagram becomes one TRANSMIT, or a SENDTO naming its source when the
+ * socket is not connected. As many as fit are packed into one transfer, so a
+ * burst of small datagrams costs one URB rather than one each. A datagram
+ * longer than a transfer allows is truncated as recv would.
+ *
+ * With credits a datagram is only read once the device's window has room
+ * for all of it.
+ *
+ * Returns: As for hss_proxy_socket_readable
+ */
+static int hss_proxy_dgram_readable(struct hss_host_socket *socket,
+	int sock_id, struct hss_proxy_context *proxy_ctx)
+{
+	int max_msg_len = proxy_ctx->max_transfer;
+	int budget = HSS_SOCK_RX_DGRAM_BUDGET;
+	struct hss_proxy_txbuf *buf;
+	union hss_socket_addr from;
+	struct hss_packet pkt;
+	int fixed_len;
+	int off = 0;
+	int len;
+	char *msg;
+	int ret = 1;
+
+	buf = hss_proxy_txbuf_get(proxy_ctx, socket);
+	if (!buf)
+		return 0;
+	msg = buf->msg;
+
+	while (budget-- > 0) {
+		len = hss_socket_peek_dgram(socket, &from);
+		if (len == -EAGAIN) {
+			ret = 0;
+			break;
+		}
+
+		/* Errors like ICMP unreachables are reported once, go on */
+		if (len < 0)
+			continue;
+
+		if (from.sa.sa_family == AF_INET6)
+			fixed_len = HSS_FIXED_LEN_SENDTO_IP6;
+		else if (from.sa.sa_family == AF_INET)
+			fixed_len = HSS_FIXED_LEN_SENDTO_IP4;
+		else
+			fixed_len = HSS_FIXED_LEN_TRANSMIT;
+		len = min(len, max_msg_len - fixed_len);
+
+		if (proxy_ctx->credits && len > hss_socket_rx_credit(socket)) {
+			ret = 0;
+			break;
+		}
+
+		/* Send what is packed so far if this one doesn't fit behind */
+		if (off + fixed_len + len > max_msg_len) {
+			hss_proxy_egress_queue(proxy_ctx, buf, off);
+			off = 0;
+
+			/* The datagram was only peeked, it waits for a buffer */
+			buf = hss_proxy_txbuf_get(proxy_ctx, socket);
+			if (!buf) {
+				ret = 0;
+				break;
+			}
+			msg = buf->msg;
+		}
+
+		len = hss_socket_read(socket, msg + off + fixed_len, len,
+			MSG_DONTWAIT);
+		if (len == -EAGAIN) {
+			ret = 0;
+			break;
+		}
+		if (len < 0)
+			continue;
+
+		if (fixed_len == HSS_FIXED_LEN_TRANSMIT)
+			hss_packet_fill_transmit(&pkt, sock_id, NULL, len,
+				atomic_inc_return(&g_msg_id));
+		else
+			hss_packet_fill_sendto(&pkt, sock_id, &from.sa, len,
+				atomic_inc_return(&g_msg_id));
+		hss_packet_to_buf(&pkt, msg + off, HSS_COPY_FIELDS);
+		off += fixed_len + len;
+
+		if (proxy_ctx->credits)
+			hss_socket_rx_spend(socket, len);
+	}
+
+	if (off)
+		hss_proxy_egress_queue(proxy_ctx, buf, off);
+	else if (buf)
+		hss_proxy_txbuf_put(proxy_ctx, buf);
+	return ret;
+}
+
+/**
+ * hss_proxy_socket_readable - Passes a socket's data over USB
+ *
+ * @socket The socket with data to read
+ * @sock_id Its ID
+ * @context A pointer to the proxy instance
+ *
+ * Called from the socket manager's rx pool whenever the socket reports data.
+ * Reads without blocking until the socket is drained or HSS_SOCK_RX_BUDGET
+ * messages have been sent, so one busy socket can't hold a worker.
+ *
+ * When the controller supports it, stream data is taken straight off the
+ * socket's receive queue with hss_proxy_egress_skb. Other sockets are
+ * copied out with hss_socket_read. Either way the data is sent from
+ * `egress_work`, and a socket is parked until the next free buffer when
+ * every buffer is waiting there.
+ *
+ * With credits the socket is left unread once the device's window is used
+ * up. hss_socket_rx_grant queues the socket again when the window moves.
+ *
+ * Datagram sockets are read by hss_proxy_dgram_readable.
+ *
+ * Returns: 1 if the socket may still have data, 0 once it is drained, out
+ * of credit or parked or -1 once it has closed.
+ */
+static int hss_proxy_socket_readable(struct hss_host_socket *socket,
+	int sock_id, void *context)
+{
+	struct hss_proxy_context *proxy_ctx = context;
+	int max_msg_len = proxy_ctx->max_transfer;
+	int max_read_len = max_msg_len - HSS_FIXED_LEN_TRANSMIT;
+	int budget = HSS_SOCK_RX_BUDGET;
+	struct hss_proxy_egress egress;
+	struct hss_proxy_txbuf *buf;
+	bool zero_copy;
+	int sock_read_len;
+	int read_len;
+	int ret = 1;
+
+	if (hss_socket_type(socket) == SOCK_DGRAM)
+		return hss_proxy_dgram_readable(socket, sock_id, proxy_ctx);
+
+	/* Every read has a buffer in hand, if only to queue the CLOSE in */
+	buf = hss_proxy_txbuf_get(proxy_ctx, socket);
+	if (!buf)
+		return 0;
+
+	egress.context = proxy_ctx;
+	egress.socket = socket;
+	egress.sock_id = sock_id;
+	zero_copy = hss_bulk_out_can_sg(proxy_ctx->usb_context);
+
+	while (budget-- > 0) {
+		read_len = max_read_len;
+		if (proxy_ctx->credits) {
+			read_len = min(read_len,
+				hss_socket_rx_credit(socket));
+			if (!read_len) {
+				ret = 0;
+				break;
+			}
+		}
+
+		/* The data is queued from inside the read */
+		if (zero_copy) {
+			egress.buf = buf;
+			sock_read_len = hss_socket_read_skbs(
+				socket,
+				read_len,
+				hss_proxy_egress_skb,
+				&egress);
+			zero_copy = (sock_read_len != -EOPNOTSUPP);
+		}
+
+		/* Read data from our socket. To save on excessive memory copies
+		 * we will write to the location it will be on the outgoing
+		 * packet. */
+		if (!zero_copy)
+			sock_read_len = hss_socket_read(
+				socket,
+				buf->msg + HSS_FIXED_LEN_TRANSMIT,
+				read_len,
+				MSG_DONTWAIT);
+
+		/* Wait for the next data ready callback */
+		if (sock_read_len == -EAGAIN) {
+			ret = 0;
+			break;
+		}
+
+		/* Close and stop reading on a zero-read */
+		if (sock_read_len <= 0) {
+			hss_proxy_egress_close(proxy_ctx, buf, sock_id);
+			buf = NULL;
+			ret = -1;
+			break;
+		}
+
+		if (proxy_ctx->credits)
+			hss_socket_rx_spend(socket, sock_read_len);
+
+		/* A read that returned data always queued the buffer */
+		if (!zero_copy)
+			hss_proxy_egress_transmit(proxy_ctx, buf, sock_id,
+				sock_read_len);
+		buf = hss_proxy_txbuf_get(proxy_ctx, socket);
+		if (!buf) {
+			ret = 0;
+			break;
+		}
+	}
+
+	if (buf)
+		hss_proxy_txbuf_put(proxy_ctx, buf);
+	return ret;
+}
+
+/**
+ * hss_proxy_process_ack - Process an ACK packet
+ *
+ * @packet The packet sent by the device
+ * @context The proxy context
+ *
+ * The device only ACKs to move the window it granted for a socket.
+ */
+static void hss_proxy_process_ack(struct hss_packet *packet,
+	struct hss_proxy_context *context)
+{
+	if (packet->ack.orig_opcode == HSS_OP_TRANSMIT &&
+		packet->ack.code == HSS_E_CREDIT)
+		hss_socket_rx_grant(packet->hdr.sock_id, packet->ack.window,
+			context->socket_mgr);
+}
+
+/**
+ * hss_proxy_process_close - Process an CLOSE packet
+ *
+ * @packet The packet sent by the device
+ * @dev The device ID requesting this operation
+ * @ack The ACK packet to populate
+ *
+ * Performs an CLOSE operation based on an incoming HSS packet.
+ */
+void hss_proxy_process_close(struct hss_packet *packet, u16 dev,
+	struct hss_packet *ack, struct hss_proxy_context *context)
+{
+	struct hss_packet_hdr hdr;
+
+	hss_get_header(packet, &hdr);
+
+	hss_socket_close(hdr.sock_id, context->socket_mgr);
+
+	/* Close ACKs do not contain status data. */
+	hss_packet_fill_ack(&hdr, ack);
+}
+
+/**
+ * hss_proxy_process_sockopt - Process a SETSOCKOPT or GETSOCKOPT packet
+ *
+ * @packet The packet sent by the device
+ * @ack The ACK packet to populate
+ * @context The proxy context
+ *
+ * Either way the ACK carries the value the socket has once done, so the
+ * device can cache it.
+ */
+static void hss_proxy_process_sockopt(struct hss_packet *packet,
+	struct hss_packet *ack, struct hss_proxy_context *context)
+{
+	u32 val = 0;
+	int ret;
+
+	if (packet->hdr.opcode == HSS_OP_SETSOCKOPT)
+		ret = hss_socket_setsockopt(packet->hdr.sock_id,
+			packet->sockopt.option, packet->sockopt.value, &val,
+			context->socket_mgr);
+	else
+		ret = hss_socket_getsockopt(packet->hdr.sock_id,
+			packet->sockopt.option, &val, context->socket_mgr);
+
+	hss_packet_fill_ack_sockopt(packet, ack, ret, val);
+}
+
+/**
+ * hss_proxy_parse_cmd - Reads a command packet from the device
+ *
+ * @buf The serialized packet
+ * @len The length of @buf
+ * @max_len The longest command the channel carries, HSS_CMD_MAX_LEN on the
+ *	interrupt pipe or `max_transfer` in the bulk stream
+ * @cmd The command to fill
+ *
+ * `cmd->extra` is pointed at any bytes in @buf after the fixed fields.
+ *
+ * Returns: 0 on success, -EMSGSIZE if @len is over @max_len or -EINVAL if
+ * the packet is malformed
+ */
+static int hss_proxy_parse_cmd(char *buf, int len, int max_len,
+	struct hss_proxy_cmd *cmd)
+{
+	struct hss_packet *packet = &cmd->data;
+	int fixed_len;
+
+	if (len > max_len)
+		return -EMSGSIZE;
+
+	/* Copy the header so the entire packet can be evaluated */
+	if (hss_packet_from_buf(packet, buf, len, HSS_COPY_HDR) < 0)
+		return -EINVAL;
+
+	/* Make sure the length sent is correct and copy any given payload */
+	if (hss_packet_len(&packet->hdr, len) != len)
+		return -EINVAL;
+
+	fixed_len = hss_packet_from_buf(packet, buf, len, HSS_COPY_FIELDS);
+	if (fixed_len < 0)
+		return -EINVAL;
+
+	cmd->extra = buf + fixed_len;
+	cmd->extra_len = len - fixed_len;
+	return 0;
+}
+
+/**
+ * hss_proxy_rcv_cmd - Receives and begins processing an HSS packet
+ *
+ * @context A pointer to the proxy instance
+ * @packet A pointer to the packet to process
+ * @packet_len The length of the packet
+ *
+ * Notes:
+ * Packet can be modified or freed after this function returns.
+ * This function may be called in an atomic context. If no work item can be
+ * had the command is dropped and counted, the device times it out.
+ */
+void hss_proxy_rcv_cmd(char *packet,
+	int packet_len, void *context)
+{
+	struct work_data_t *newwork;
+	struct hss_proxy_context *proxy_ctx =
+		(struct hss_proxy_context *) context;
+
+	/* Check the length before taking a work item */
+	if (packet_len < HSS_HDR_LEN || packet_len > HSS_CMD_MAX_LEN)
+		return;
+
+	newwork = mempool_alloc(proxy_ctx->cmd_pool, GFP_ATOMIC);
+	if (!newwork) {
+		atomic_inc(&proxy_ctx->cmd_drops);
+		pr_err_ratelimited("%s dropped a command, %d so far\n",
+			__func__, atomic_read(&proxy_ctx->cmd_drops));
+		return;
+	}
+
+	newwork->context = proxy_ctx;
+
+	if (hss_proxy_parse_cmd(packet, packet_len, HSS_CMD_MAX_LEN,
+		&newwork->cmd))
+		goto free_work;
+
+	/* `packet` is reused once this returns */
+	memcpy(newwork->cmd.extra_buf, newwork->cmd.extra,
+		newwork->cmd.extra_len);
+	newwork->cmd.extra = newwork->cmd.extra_buf;
+
+	INIT_WORK(&newwork->work, hss_proxy_process_cmd);
+	queue_work(proxy_ctx->proxy_wq, &newwork->work);
+	return;
+
+free_work:
+	mempool_free(newwork, proxy_ctx->cmd_pool);
+}
+
+/**
+ * hss_proxy_get_rx_slot - Reserves the next read cache slot for a bulk-in URB
+ *
+ * @context A pointer to the proxy instance
+ * @sg The scatterlist to describe the slot in
+ * @nents The number of entries in @sg
+ *
+ * Returns: The number of entries describing the slot's `max_transfer` bytes
+ * or 0 if the read cache is full.
+ *
+ * Notes:
+ * Slots must be returned with hss_proxy_rcv_slot in the order they were
+ * reserved. The entries are safe to map for DMA and an entry never crosses
+ * a chunk of the size given by hss_get_bulk_in_chunk.
+ * This function may be called in an atomic context.
+ */
+int hss_proxy_get_rx_slot(void *context, struct scatterlist *sg, int nents)
+{
+	struct hss_proxy_context *proxy_ctx = context;
+	struct hss_ring *ring = &proxy_ctx->read_cache;
+	int reserve = proxy_ctx->rx_reserve;
+	int tail = smp_load_acquire(&ring->circ.tail);
+	int n;
+
+	if (CIRC_SPACE(reserve, tail, ring->size) < proxy_ctx->max_transfer)
+		return 0;
+
+	n = hss_ring_dma_sg(ring, reserve, proxy_ctx->max_transfer, sg, nents);
+	if (WARN_ON_ONCE(n < 0))
+		return 0;
+
+	proxy_ctx->rx_reserve = (reserve + proxy_ctx->max_transfer) &
+		(ring->size - 1);
+	return n;
+}
+
+/**
+ * hss_proxy_cancel_rx_slot - Returns the most recently reserved slot unused
+ *
+ * @context A pointer to the proxy instance
+ *
+ * For a bulk-in URB that was given a slot but could not be submitted.
+ *
+ * Notes:
+ * Must be called before any other slot is reserved.
+ * This function may be called in an atomic context.
+ */
+void hss_proxy_cancel_rx_slot(void *context)
+{
+	struct hss_proxy_context *proxy_ctx = context;
+	struct hss_ring *ring = &proxy_ctx->read_cache;
+
+	proxy_ctx->rx_reserve =
+		(proxy_ctx->rx_reserve - proxy_ctx->max_transfer) &
+		(ring->size - 1);
+}
+
+/**
+ * hss_proxy_rcv_slot - Publishes a read cache slot filled by a bulk-in URB
+ *
+ * @len The number of bytes received into the slot
+ * @context A pointer to the proxy instance
+ *
+ * The ring head is moved past the entire slot. The unused remainder of a
+ * short slot is skipped by the consumer. The device ends every message with
+ * a short packet or ZLP, so a URB completes at the end of a message and a
+ * packet never continues from one slot into the next.
+ *
+ * Notes:
+ * This function may be called in an atomic context.
+ */
+void hss_proxy_rcv_slot(int len, void *context)
+{
+	struct hss_proxy_context *proxy_ctx = context;
+	struct hss_ring *ring = &proxy_ctx->read_cache;
+	int head = ring->circ.head;
 
-	section = hss_consumer_section(ring, READ_CACHE_SIZE,
-		packet_hdr->payload_len);
-	payload = ring->buf + section.start;
+	hss_ring_dma_complete(ring, head, len);
+	proxy_ctx->rx_fill[head / proxy_ctx->max_transfer] = len;
+	smp_store_release(&ring->circ.head,
+		(head + proxy_ctx->max_transfer) & (ring->size - 1));
+
+	queue_work(proxy_ctx->proxy_data_wq, &proxy_ctx->data_work);
+}
+
+/**
+ * hss_proxy_run_host_cmd -
+ * Helper function for hss_proxy_process_cmd
+ *
+ * @cmd The command to process and the ACK to reply with
+ * @proxy_context The proxy context
+ *
+ * Returns: True if `cmd->ack` was filled and should be sent
+ */
+static bool hss_proxy_run_host_cmd(
+	struct hss_proxy_cmd *cmd,
+	struct hss_proxy_context *context)
+{
+	struct hss_packet *packet = &cmd->data;
+	struct hss_packet *ack = &cmd->ack;
+	int dev = context->proxy_id;
+	bool send_ack = true;
+
+	switch (packet->hdr.opcode) {
+	case HSS_OP_OPEN:
+		hss_proxy_process_open(packet, dev, ack, context);
+		break;
+	case HSS_OP_CONNECT:
+		if (hss_proxy_process_connect(packet, dev, ack, context))
+			send_ack = false;
+		break;
+	case HSS_OP_CLOSE:
+		hss_proxy_process_close(packet, dev, ack, context);
+		break;
+	case HSS_OP_OPEN_CONNECT:
+		if (hss_proxy_process_open_connect(cmd, context))
+			send_ack = false;
+		break;
+	case HSS_OP_CONNECT_NAME:
+		if (hss_proxy_process_connect_name(cmd, context))
+			send_ack = false;
+		break;
+	case HSS_OP_SETSOCKOPT:
+	case HSS_OP_GETSOCKOPT:
+		hss_proxy_process_sockopt(packet, ack, context);
+		break;
+	case HSS_OP_ACK:
+		hss_proxy_process_ack(packet, context);
+		send_ack = false;
+		break;
+	case HSS_OP_ACKDATA:
+	case HSS_OP_SHUTDOWN:
+	case HSS_OP_TRANSMIT:
+	default:
+		pr_err("%s default %d\n", __func__, packet->hdr.opcode);
+		send_ack = false;
+		break;
+	}
+	return send_ack;
+}
+
+
+static void hss_proxy_send_ack(struct hss_packet *packet, struct hss_proxy_context *proxy_context)
+{
+	char proxy_cmd_buf[HSS_CMD_MAX_LEN];
+	size_t fixed_len;
+
+	if (packet->hdr.payload_len + HSS_HDR_LEN > HSS_CMD_MAX_LEN) {
+		pr_err("%s ACK too long %d\n", __func__, packet->hdr.payload_len);
+		return;
+	}
+
+	/* Copy the fixed part of the ACK */
+	fixed_len = hss_packet_to_buf(packet, proxy_cmd_buf, HSS_COPY_FIELDS);
+
+	/* Copy the arbitrary payload if applicable */
+	if (packet->hdr.payload_len + HSS_HDR_LEN > fixed_len)
+		memcpy(
+				proxy_cmd_buf + fixed_len,
+				packet->ack.empty,
+				packet->hdr.payload_len + HSS_HDR_LEN - fixed_len);
+
+	/* Send the ACK over USB */
+	hss_proxy_send_cmd(proxy_context, proxy_cmd_buf,
+		HSS_HDR_LEN + packet->hdr.payload_len);
+}
+
+/**
+ * hss_proxy_socket_window - Tells the device a socket has room again
+ *
+ * @sock_id The socket whose queue drained
+ * @window The new window, see struct hss_payload_ack
+ * @context A pointer to the proxy instance
+ *
+ * Called from the socket manager's tx pool.
+ */
+static void hss_proxy_socket_window(int sock_id, u32 window, void *context)
+{
+	struct hss_proxy_context *proxy_ctx = context;
+	struct hss_packet ack;
+
+	if (!proxy_ctx->credits)
+		return;
+
+	hss_packet_fill_ack_credit(&ack, sock_id, window,
+		atomic_inc_return(&g_msg_id));
+	hss_proxy_send_ack(&ack, context);
+}
+
+/**
+ * hss_proxy_socket_reaped - Tells the device an idle socket was closed
+ *
+ * @sock_id The socket the idle reaper closed
+ * @context A pointer to the proxy instance
+ *
+ * The device sees it as a remote close and sends its own CLOSE, which finds
+ * nothing left to close.
+ */
+static void hss_proxy_socket_reaped(int sock_id, void *context)
+{
+	hss_send_close(sock_id, context);
+}
+
+/**
+ * hss_proxy_socket_reset - Tells the device a stream lost data and was reset
+ *
+ * @sock_id The socket that was reset
+ * @context A pointer to the proxy instance
+ *
+ * The TRANSMIT that failed is still ACKed with an error, the CLOSE makes
+ * sure the device's socket doesn't carry on as if the data had arrived.
+ */
+static void hss_proxy_socket_reset(int sock_id, void *context)
+{
+	pr_err_ratelimited("%s sock %d lost data, resetting\n", __func__,
+		sock_id);
+	hss_send_close(sock_id, context);
+}
+
+/**
+ * hss_proxy_socket_stats - Gets what a device's sockets are using
+ *
+ * @context The proxy context
+ * @stats Filled with the counts, see struct hss_socket_stats
+ */
+void hss_proxy_socket_stats(void *context, struct hss_socket_stats *stats)
+{
+	struct hss_proxy_context *proxy_ctx = context;
+
+	hss_socket_mgr_stats(proxy_ctx->socket_mgr, stats);
+}
+
+/**
+ * hss_proxy_process_cmd - Bottom half of hss_proxy_rcv_cmd
+ *
+ * @work Work item to process
+ *
+ * Notes:
+ * Work struct is expected to be a work_data_t from the proxy's `cmd_pool`.
+ * It is returned to the pool here.
+ */
+static void hss_proxy_process_cmd(struct work_struct *work)
+{
+	struct work_data_t *work_data;
+	struct hss_proxy_context *proxy_context;
+
+	work_data = container_of(work, struct work_data_t, work);
+	proxy_context = work_data->context;
+
+	if (hss_proxy_run_host_cmd(&work_data->cmd, proxy_context))
+		hss_proxy_send_ack(&work_data->cmd.ack, proxy_context);
+
+	mempool_free(work_data, proxy_context->cmd_pool);
+}
+
+/**
+ * hss_proxy_tx_socket - Resolves the socket a TRANSMIT or SENDTO is for
+ *
+ * @context The proxy context
+ * @sock_id The socket
+ *
+ * Runs of packets for one socket are the norm, so the last socket resolved
+ * is kept until hss_proxy_tx_socket_drop rather than looked up per packet.
+ *
+ * Returns: The socket or NULL if the device has no such socket open
+ *
+ * Notes: Only called on `proxy_data_wq`.
+ */
+static struct hss_host_socket *hss_proxy_tx_socket(
+	struct hss_proxy_context *context, int sock_id)
+{
+	struct hss_host_socket *socket = context->tx_socket;
+
+	if (socket && context->tx_sock_id == sock_id &&
+		!hss_socket_closed(socket))
+		return socket;
+
+	if (socket)
+		hss_socket_put(socket);
+	socket = hss_socket_get(sock_id, context->socket_mgr);
+	context->tx_socket = socket;
+	context->tx_sock_id = sock_id;
+	return socket;
+}
+
+/* Lets go of the socket kept by hss_proxy_tx_socket */
+static void hss_proxy_tx_socket_drop(struct hss_proxy_context *context)
+{
+	if (context->tx_socket)
+		hss_socket_put(context->tx_socket);
+	context->tx_socket = NULL;
+}
+
+static int hss_proxy_transmit_send(
+	struct hss_ring *ring,
+	struct hss_packet_hdr *packet_hdr,
+	struct hss_proxy_context *context)
+{
+	char *payload;
+	struct hss_ring_section section;
+	struct hss_host_socket *socket;
+	int ret = -EINVAL;
+
+	section = hss_consumer_section(ring, packet_hdr->payload_len);
+	payload = ring->circ.buf + section.start;
 
 	if (section.start > -1) {
-		/* Write the sequential portion of the payload */
-		hss_socket_write(
-			packet_hdr->sock_id,
-			payload,
-			section.len,
-			context->socket_table);
-
-		/* If any of the payload wraps around the buffer */
-		hss_socket_write(
-			packet_hdr->sock_id,
-			ring->buf,
-			section.wrap,
-			context->socket_table);
-
-		hss_ring_consume(ring, READ_CACHE_SIZE, section);
-
-		ret = 0;
+		/*
+		 * The ring is mirrored so the payload is always contiguous.
+		 * The write never blocks, a busy socket queues what it can't
+		 * take so it doesn't hold up the rest of the read cache.
+		 */
+		socket = hss_proxy_tx_socket(context, packet_hdr->sock_id);
+		ret = socket ? hss_socket_write(socket, payload, section.len) :
+			-EEXIST;
+
+		hss_ring_consume(ring, section);
+	}
+	return ret;
+}
+
+/**
+ * hss_proxy_sendto_send - Sends the datagram of a SENDTO from the device
+ *
+ * @ring The read cache holding the payload
+ * @packet_hdr The header of the SENDTO, already consumed
+ * @context The proxy context
+ *
+ * Returns: The length of the datagram or an error code
+ */
+static int hss_proxy_sendto_send(
+	struct hss_ring *ring,
+	struct hss_packet_hdr *packet_hdr,
+	struct hss_proxy_context *context)
+{
+	struct hss_payload_connect_ip dst = {};
+	struct hss_ring_section section;
+	struct hss_host_socket *socket;
+	union hss_socket_addr addr = {};
+	char *payload;
+	int fixed_len;
+	int ret = -EINVAL;
+
+	section = hss_consumer_section(ring, packet_hdr->payload_len);
+	if (section.start < 0)
+		return ret;
+	payload = ring->circ.buf + section.start;
+
+	fixed_len = hss_connect_from_buf(&dst, payload, section.len);
+	if (fixed_len < 0)
+		goto consume;
+
+	switch (dst.family) {
+	case HSS_FAM_IP:
+		addr.in4.sin_family = AF_INET;
+		addr.in4.sin_port = dst.port;
+		addr.in4.sin_addr.s_addr = dst.addr.ip4.ip_addr;
+		break;
+	case HSS_FAM_IP6:
+		addr.in6.sin6_family = AF_INET6;
+		addr.in6.sin6_port = dst.port;
+		addr.in6.sin6_flowinfo = dst.addr.ip6.flow_info;
+		addr.in6.sin6_scope_id = dst.addr.ip6.scope_id;
+		memcpy(&addr.in6.sin6_addr, dst.addr.ip6.ip_addr,
+			sizeof(addr.in6.sin6_addr));
+		break;
+	default:
+		goto consume;
 	}
+
+	socket = hss_proxy_tx_socket(context, packet_hdr->sock_id);
+	ret = socket ? hss_socket_sendto(socket, &addr, payload + fixed_len,
+		section.len - fixed_len) : -EEXIST;
+consume:
+	hss_ring_consume(ring, section);
 	return ret;
 }
 
+/**
+ * hss_proxy_fill_transmit_ack - Fills the ACK for one or more TRANSMITs
+ *
+ * @context The proxy context
+ * @ack The ACK packet to populate
+ * @sock_id The socket the TRANSMITs were for
+ * @msg_id The msg_id of the newest TRANSMIT being ACKed
+ * @ret The result of writing the newest TRANSMIT to the socket
+ */
+static void hss_proxy_fill_transmit_ack(struct hss_proxy_context *context,
+	struct hss_packet *ack, int sock_id, u16 msg_id, int ret)
+{
+	struct hss_packet_hdr hdr = {
+		.opcode = HSS_OP_TRANSMIT,
+		.msg_id = msg_id,
+		.sock_id = sock_id,
+	};
+	struct hss_host_socket *socket;
+
+	hss_packet_fill_ack(&hdr, ack);
+	ack->ack.code = (ret < 0) ? HSS_E_HOSTERR : HSS_E_SUCCESS;
+
+	/* Tell the device how much more the socket will take */
+	if (ret >= 0 && context->credits) {
+		socket = hss_proxy_tx_socket(context, sock_id);
+		hss_packet_fill_ack_credit(ack, sock_id,
+			socket ? hss_socket_tx_window(socket) : 0, msg_id);
+	}
+}
+
+/**
+ * hss_proxy_flush_ack - Sends a held back cumulative ACK
+ *
+ * @context The proxy context
+ * @pending The slot to send, which is freed
+ */
+static void hss_proxy_flush_ack(struct hss_proxy_context *context,
+	struct hss_proxy_pending_ack *pending)
+{
+	struct hss_packet ack;
+
+	hss_proxy_fill_transmit_ack(context, &ack, pending->sock_id,
+		pending->msg_id, 0);
+	hss_proxy_send_ack(&ack, context);
+	pending->used = false;
+}
+
+/**
+ * hss_proxy_ack_work - Sends every held back cumulative ACK
+ *
+ * @work The proxy contexts `ack_work`
+ */
+static void hss_proxy_ack_work(struct work_struct *work)
+{
+	struct hss_proxy_context *context = container_of(to_delayed_work(work),
+		struct hss_proxy_context, ack_work);
+	int i;
+
+	for (i = 0; i < HSS_PROXY_ACK_SLOTS; i++)
+		if (context->pending_ack[i].used)
+			hss_proxy_flush_ack(context, &context->pending_ack[i]);
+	hss_proxy_tx_socket_drop(context);
+}
+
+/**
+ * hss_proxy_ack_transmit - ACKs a TRANSMIT from the device
+ *
+ * @context The proxy context
+ * @packet_hdr The header of the TRANSMIT
+ * @ret The result of writing the payload to the socket
+ *
+ * Without cumulative ACKs every TRANSMIT is ACKed straight away. With them a
+ * successful TRANSMIT only updates its socket's pending ACK, which covers
+ * every TRANSMIT on the socket up to its msg_id. It is sent once `ack_bytes`
+ * have arrived or from `ack_work`. Failures are always ACKed at once, after
+ * the pending ACK for the data before them. SENDTOs are ACKed the same way,
+ * as TRANSMITs.
+ */
+static void hss_proxy_ack_transmit(struct hss_proxy_context *context,
+	struct hss_packet_hdr *packet_hdr, int ret)
+{
+	struct hss_proxy_pending_ack *pending = NULL;
+	struct hss_proxy_pending_ack *free_slot = NULL;
+	struct hss_proxy_pending_ack *oldest = NULL;
+	struct hss_proxy_pending_ack *slot;
+	struct hss_packet ack;
+	int i;
+
+	if (context->cumulative_ack) {
+		for (i = 0; i < HSS_PROXY_ACK_SLOTS && !pending; i++) {
+			slot = &context->pending_ack[i];
+			if (!slot->used) {
+				if (!free_slot)
+					free_slot = slot;
+			} else if (slot->sock_id == packet_hdr->sock_id) {
+				pending = slot;
+			} else if (!oldest || (s32)(slot->seq - oldest->seq) < 0) {
+				oldest = slot;
+			}
+		}
+	}
+
+	if (!context->cumulative_ack || ret < 0) {
+		if (pending)
+			hss_proxy_flush_ack(context, pending);
+		hss_proxy_fill_transmit_ack(context, &ack, packet_hdr->sock_id,
+			packet_hdr->msg_id, ret);
+		hss_proxy_send_ack(&ack, context);
+		return;
+	}
+
+	if (!pending) {
+		/* Make room by sending the oldest slot early */
+		pending = free_slot;
+		if (!pending) {
+			pending = oldest;
+			hss_proxy_flush_ack(context, pending);
+		}
+		pending->sock_id = packet_hdr->sock_id;
+		pending->bytes = 0;
+		pending->seq = context->ack_seq++;
+		pending->used = true;
+	}
+	pending->msg_id = packet_hdr->msg_id;
+	pending->bytes += packet_hdr->payload_len;
+
+	if (pending->bytes >= hss_ack_bytes)
+		hss_proxy_flush_ack(context, pending);
+	else
+		queue_delayed_work(context->proxy_data_wq, &context->ack_work,
+			usecs_to_jiffies(hss_ack_delay_us));
+}
+
+/**
+ * hss_proxy_inband_cmd - Runs a command sent in the bulk stream
+ *
+ * @packet_hdr The header of the command, still on the ring
+ * @ring The read cache holding the command
+ * @context the hss proxy context
+ *
+ * The whole command, header included, is consumed from the ring. It runs on
+ * the data poller so it is handled in order with the TRANSMITs around it and
+ * its ACK is sent before the next packet is read.
+ */
+static void hss_proxy_inband_cmd(
+	struct hss_packet_hdr *packet_hdr,
+	struct hss_ring *ring,
+	struct hss_proxy_context *context)
+{
+	struct hss_proxy_cmd cmd;
+	struct hss_ring_section section;
+
+	section = hss_consumer_section(ring,
+		HSS_HDR_LEN + packet_hdr->payload_len);
+	if (section.start < 0)
+		return;
+
+	/* Early data is written to the socket straight from the ring */
+	if (hss_proxy_parse_cmd(ring->circ.buf + section.start, section.len,
+		context->max_transfer, &cmd))
+		pr_err("%s bad command op %d", __func__, packet_hdr->opcode);
+	else if (hss_proxy_run_host_cmd(&cmd, context))
+		hss_proxy_send_ack(&cmd.ack, context);
+
+	hss_ring_consume(ring, section);
+}
+
 /**
  * hss_proxy_transmit_and_consume - Handles inbound (from device)
  * data type commands
  *
- * @packet The packet to process
+ * @packet_hdr The header of the packet to process
+ * @ring The read cache holding the payload
  * @context the hss proxy context
- *
- * Notes:
- * Returns a newly allocated ACK or NULL. Caller must free
  */
-static struct hss_packet *hss_proxy_transmit_and_consume(
+static void hss_proxy_transmit_and_consume(
 	struct hss_packet_hdr *packet_hdr,
-	struct circ_buf *ring,
+	struct hss_ring *ring,
 	struct hss_proxy_context *context)
 {
-	struct hss_packet *ack;
+	int ret;
 
 	switch (packet_hdr->opcode) {
 	case HSS_OP_TRANSMIT:
-		ack = kmalloc(sizeof(struct hss_packet), GFP_KERNEL);
-		hss_proxy_transmit_send(ring, packet_hdr, context);
-
-		/* TODO Positive flow codes */
-		hss_packet_fill_ack(packet_hdr, ack);
-		ack->ack.code = HSS_E_SUCCESS;
+		ret = hss_proxy_transmit_send(ring, packet_hdr, context);
+		hss_proxy_ack_transmit(context, packet_hdr, ret);
+		break;
+	case HSS_OP_SENDTO:
+		ret = hss_proxy_sendto_send(ring, packet_hdr, context);
+		hss_proxy_ack_transmit(context, packet_hdr, ret);
 		break;
 	default:
-		ack = NULL;
 		pr_err("%s default op %d", __func__, packet_hdr->opcode);
 		break;
 	}
-	return ack;
 }
 
 /**
- * hss_proxy_process_data - Handles inbound (from device)
- * data type packets
+ * hss_proxy_skip_slot_gaps - Moves the tail past unfilled slot space
  *
- * @work The work struct, expected type `struct hss_proxy_context`
+ * @context The proxy context
  *
- * Notes: Other threads may modify ring->head during this operation.
+ * Only called between packets. A short slot ends a USB transfer so the tail
+ * reaching the end of its data means the rest of the slot is unused.
  */
-static void hss_proxy_process_data(struct work_struct *work)
+static void hss_proxy_skip_slot_gaps(struct hss_proxy_context *context)
 {
-	struct hss_proxy_context *proxy_context;
-	struct circ_buf *ring;
-	int packet_len;
-	int circ_cnt;
-	struct hss_packet *ack = NULL;
-	struct hss_packet packet;
-	char cont_hdr_space[HSS_HDR_LEN];
-	struct hss_ring_section section;
+	struct hss_ring *ring = &context->read_cache;
+	int head = smp_load_acquire(&ring->circ.head);
+	int tail = ring->circ.tail;
+	int fill;
+
+	while (tail != head) {
+		fill = context->rx_fill[tail / context->max_transfer];
+		if (fill == context->max_transfer ||
+			(tail & (context->max_transfer - 1)) != fill)
+			break;
 
-	/* Unpack the work data */
-	proxy_context = ((struct work_data_t *) work)->context;
-	ring = &proxy_context->read_cache;
+		tail = (round_down(tail, context->max_transfer) +
+			context->max_transfer) & (ring->size - 1);
+	}
 
-	/* Get the section we can read from the buffer */
-	section = hss_consumer_section(
-		ring,
-		READ_CACHE_SIZE,
-		HSS_HDR_LEN);
+	if (tail != ring->circ.tail)
+		smp_store_release(&ring->circ.tail, tail);
+}
 
-	/* If theres not a headers worth of data in the buffer */
-	if (section.start == -1)
-		goto exit;
+/**
+ * hss_proxy_resync_slot - Drops the rest of a read cache slot
+ *
+ * @context The proxy context owning the read cache
+ * @start Where the malformed packet starts on the ring
+ *
+ * Every transfer starts on a slot boundary, so the next slot starts with a
+ * packet again.
+ */
+static void hss_proxy_resync_slot(struct hss_proxy_context *context,
+	int start)
+{
+	struct hss_ring *ring = &context->read_cache;
+	int rest = context->max_transfer -
+		(start & (context->max_transfer - 1));
+
+	pr_err_ratelimited("%s dropping %d bytes after a bad header\n",
+		__func__, rest);
+
+	/* The head only ever moves past whole slots */
+	hss_ring_consume(ring, hss_consumer_section(ring, rest));
+}
+
+/**
+ * hss_proxy_peek_packet - Reads the header of the next packet on the ring
+ *
+ * @context The proxy context owning the read cache
+ * @packet The packet to write the header to
+ * @section The ring section holding the header
+ *
+ * The device terminates each message it sends with a short packet or ZLP,
+ * so a bulk-in URB never completes partway through a packet and the whole
+ * packet is there once its header is. A packet whose header or payload
+ * would cross the end of the data its slot received is malformed. There is
+ * no telling where the next packet in that slot would start, so the stream
+ * is resynced at the next slot instead of being parsed past it.
+ *
+ * Returns: 0 if the entire packet is on the ring, 1 otherwise
+ *
+ * Notes: Nothing but unused slot space and malformed packets is consumed
+ * from the ring.
+ */
+static int hss_proxy_peek_packet(struct hss_proxy_context *context,
+	struct hss_packet *packet, struct hss_ring_section *section)
+{
+	struct hss_ring *ring = &context->read_cache;
+	int offset;
+	int avail;
 
-	/* Copy the header to a contiguous buffer */
-	memcpy(cont_hdr_space, ring->buf + section.start, section.len);
-	memcpy(((char *) cont_hdr_space) + section.len, ring->buf, section.wrap);
+retry:
+	hss_proxy_skip_slot_gaps(context);
 
-	/* Convert the contiguous buffer to a readable packet */
-	hss_packet_from_buf(&packet, cont_hdr_space, HSS_COPY_HDR);
+	/* Get the section we can read from the buffer */
+	*section = hss_consumer_section(ring, HSS_HDR_LEN);
 
-	/* Compare the amount of data ready to be read against the stated length of the packet */
-	circ_cnt = CIRC_CNT(
-		READ_ONCE(ring->head),
-		READ_ONCE(ring->tail),
-		READ_CACHE_SIZE);
-	packet_len = packet.hdr.payload_len + HSS_HDR_LEN;
+	/* If theres not a headers worth of data in the buffer */
+	if (section->start == -1)
+		return 1;
+
+	/* What the slot holding the header received from here on */
+	offset = section->start & (context->max_transfer - 1);
+	avail = context->rx_fill[section->start / context->max_transfer] -
+		offset;
+
+	/* The header must not cross the end of the slot's data */
+	if (avail < HSS_HDR_LEN) {
+		hss_proxy_resync_slot(context, section->start);
+		goto retry;
+	}
 
-	/* Do not continue if the entire payload hasn't arrived */
-	if (packet_len > circ_cnt)
-		goto exit;
+	/*
+	 * Nor may the payload it announces. A slot is a quarter of the ring
+	 * at most, so no packet can ever wait on more data than the ring holds.
+	 */
+	hss_packet_from_buf(packet, ring->circ.buf + section->start, avail,
+		HSS_COPY_HDR);
+	if (hss_packet_len(&packet->hdr, avail) < 0) {
+		hss_proxy_resync_slot(context, section->start);
+		goto retry;
+	}
+	return 0;
+}
 
-	/* If the entire packet can be read consume the header */
-	hss_ring_consume(ring, READ_CACHE_SIZE, section);
+/**
+ * hss_proxy_process_data - Handles inbound (from device)
+ * data type packets
+ *
+ * @work The proxy contexts `data_work`
+ *
+ * Drains every complete packet on the read cache, up to `data_budget`
+ * packets. If the budget runs out while complete packets are still waiting
+ * the work item requeues itself so other work can run in between.
+ *
+ * Notes: Other threads may modify ring->head during this operation. This is
+ * the only consumer of the read cache.
+ */
+static void hss_proxy_process_data(struct work_struct *work)
+{
+	struct hss_proxy_context *proxy_context;
+	struct hss_ring *ring;
+	struct hss_packet packet;
+	struct hss_ring_section section;
+	int budget = max(hss_data_budget, 1);
 
-	/* Transmit and consume the payload data */
-	ack = hss_proxy_transmit_and_consume(&packet.hdr, ring, proxy_context);
+	proxy_context = container_of(work, struct hss_proxy_context,
+		data_work);
+	ring = &proxy_context->read_cache;
 
-	/* Send an ACK if applicable */
-	if (ack) {
-		hss_proxy_send_ack(ack, proxy_context);
-		kfree(ack);
+	while (budget-- > 0) {
+		if (hss_proxy_peek_packet(proxy_context, &packet, &section))
+			goto out;
+
+		if (proxy_context->inband_cmd &&
+			packet.hdr.opcode != HSS_OP_TRANSMIT &&
+			packet.hdr.opcode != HSS_OP_SENDTO) {
+			hss_proxy_inband_cmd(&packet.hdr, ring, proxy_context);
+		} else {
+			/* If the entire packet can be read consume the header */
+			hss_ring_consume(ring, section);
+
+			/* Transmit and consume the payload, ACKing as needed */
+			hss_proxy_transmit_and_consume(&packet.hdr, ring,
+				proxy_context);
+		}
 	}
-exit:
-	kfree(work);
+
+	/* Out of budget, only re-arm if another packet is ready */
+	if (!hss_proxy_peek_packet(proxy_context, &packet, &section))
+		queue_work(proxy_context->proxy_data_wq, work);
+out:
+	hss_proxy_tx_socket_drop(proxy_context);
+
+	/* Restart the device if it was held back by a full cache */
+	hss_bulk_in_resume(proxy_context->usb_context);
 }
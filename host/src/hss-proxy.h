@@ -7,17 +7,25 @@
 #define XAPRC00x_PROXY_H
 
 #include <linux/net.h>
+#include <linux/scatterlist.h>
 #include <linux/socket.h>
 #include <linux/workqueue.h>
 #include <net/sock.h>
 #include "hss.h"
+#include "hss-sockets.h"
 
 void *hss_proxy_init(void *context);
 
 void hss_proxy_rcv_cmd(char *packet,
 	int packet_len, void *context);
 
-int hss_proxy_rcv_data(void *data, int len, void *context);
+int hss_proxy_get_rx_slot(void *context, struct scatterlist *sg, int nents);
+
+void hss_proxy_cancel_rx_slot(void *context);
+
+void hss_proxy_rcv_slot(int len, void *context);
+
+void hss_proxy_socket_stats(void *context, struct hss_socket_stats *stats);
 
 void hss_proxy_destroy(void *context);
 #endif
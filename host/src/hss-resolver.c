@@ -0,0 +1,343 @@
+// SPDX-License-Identifier: GPL-2.0+
+/**
+ * @file hss-resolver.c
+ * @brief Resolves the names devices connect to with the kernel DNS resolver.
+ *	Answers are cached for every device on the host, devices behind one
+ *	host tend to reach the same few names.
+ */
+
+#include <linux/ctype.h>
+#include <linux/hashtable.h>
+#include <linux/inet.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+#include "hss.h"
+#include "hss-backports.h"
+#include "hss-resolver.h"
+
+/* Seconds an answer is kept at most, records with a shorter TTL go sooner */
+static int hss_dns_ttl = 60;
+module_param_named(dns_ttl, hss_dns_ttl, int, 0644);
+MODULE_PARM_DESC(dns_ttl,
+	"Longest a resolved name is cached in seconds, 0 disables the cache (default 60)");
+
+/* Names cached before the least recently used one is dropped */
+static int hss_dns_cache_size = 256;
+module_param_named(dns_cache_size, hss_dns_cache_size, int, 0644);
+MODULE_PARM_DESC(dns_cache_size,
+	"Names kept in the resolver cache, at least 1 (default 256)");
+
+/**
+ * struct hss_resolver_entry - A cached answer
+ *
+ * @node On `hss_resolver_cache`
+ * @lru On `hss_resolver_lru`
+ * @expires The jiffies the answer is good until
+ * @hash The hash of @name
+ * @count The number of @addrs
+ * @addrs The addresses, ports unset, in the order they should be tried
+ * @len The length of @name
+ * @name The name in lower case, not NUL terminated
+ */
+struct hss_resolver_entry {
+	struct hlist_node node;
+	struct list_head lru;
+	unsigned long expires;
+	u32 hash;
+	int count;
+	union hss_socket_addr addrs[HSS_SOCKET_RACE_MAX];
+	int len;
+	char name[];
+};
+
+static DEFINE_HASHTABLE(hss_resolver_cache, 6);
+static LIST_HEAD(hss_resolver_lru); /* Most recently used first */
+static DEFINE_SPINLOCK(hss_resolver_lock);
+static int hss_resolver_entries;
+
+/**
+ * hss_resolver_key - Folds a name to the form it is cached under
+ *
+ * @name The name
+ * @len The length of @name
+ * @key Filled with @len bytes, @name in lower case
+ *
+ * Returns: The hash of @key
+ */
+static u32 hss_resolver_key(const char *name, int len, char *key)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		key[i] = tolower(name[i]);
+	return jhash(key, len, 0);
+}
+
+/**
+ * hss_resolver_find - Finds a cached name
+ *
+ * @key The name as given by hss_resolver_key
+ * @len The length of @key
+ * @hash The hash of @key
+ *
+ * Returns: The entry or NULL
+ *
+ * Notes: Caller must hold `hss_resolver_lock`.
+ */
+static struct hss_resolver_entry *hss_resolver_find(const char *key, int len,
+	u32 hash)
+{
+	struct hss_resolver_entry *entry;
+
+	hash_for_each_possible(hss_resolver_cache, entry, node, hash)
+		if (entry->hash == hash && entry->len == len &&
+			!memcmp(entry->name, key, len))
+			return entry;
+	return NULL;
+}
+
+/* Caller must hold `hss_resolver_lock` */
+static void hss_resolver_drop(struct hss_resolver_entry *entry)
+{
+	hash_del(&entry->node);
+	list_del(&entry->lru);
+	hss_resolver_entries--;
+	kfree(entry);
+}
+
+/**
+ * hss_resolver_insert - Caches an answer
+ *
+ * @entry The answer, replacing any older one for the same name
+ *
+ * The least recently used names are dropped to stay within dns_cache_size.
+ */
+static void hss_resolver_insert(struct hss_resolver_entry *entry)
+{
+	struct hss_resolver_entry *old;
+	int limit = max(READ_ONCE(hss_dns_cache_size), 1);
+
+	spin_lock(&hss_resolver_lock);
+	old = hss_resolver_find(entry->name, entry->len, entry->hash);
+	if (old)
+		hss_resolver_drop(old);
+
+	hash_add(hss_resolver_cache, &entry->node, entry->hash);
+	list_add(&entry->lru, &hss_resolver_lru);
+	hss_resolver_entries++;
+
+	while (hss_resolver_entries > limit)
+		hss_resolver_drop(list_last_entry(&hss_resolver_lru,
+			struct hss_resolver_entry, lru));
+	spin_unlock(&hss_resolver_lock);
+}
+
+/**
+ * hss_resolver_parse - Reads the addresses from a DNS resolver answer
+ *
+ * @result The comma separated addresses from dns_query
+ * @len The length of @result
+ * @addrs Filled with the addresses found
+ * @max The most addresses to read
+ *
+ * Returns: The number of addresses found
+ */
+static int hss_resolver_parse(const char *result, int len,
+	union hss_socket_addr *addrs, int max)
+{
+	const char *end = result + len;
+	const char *next;
+	int count = 0;
+
+	while (result < end && count < max) {
+		union hss_socket_addr *addr = &addrs[count];
+
+		memset(addr, 0, sizeof(*addr));
+		if (in4_pton(result, end - result,
+			(u8 *)&addr->in4.sin_addr.s_addr, ',', &next)) {
+			addr->in4.sin_family = AF_INET;
+			count++;
+		} else if (in6_pton(result, end - result,
+			addr->in6.sin6_addr.s6_addr, ',', &next)) {
+			addr->in6.sin6_family = AF_INET6;
+			count++;
+		} else {
+			next = memchr(result, ',', end - result) ?: end;
+		}
+		result = next + 1;
+	}
+	return count;
+}
+
+/* Finds the next address of @family from *@pos on and moves *@pos past it */
+static int hss_resolver_next(union hss_socket_addr *addrs, int count,
+	int *pos, sa_family_t family)
+{
+	while (*pos < count)
+		if (addrs[(*pos)++].sa.sa_family == family)
+			return *pos - 1;
+	return -1;
+}
+
+/**
+ * hss_resolver_interleave - Orders addresses for connecting
+ *
+ * @addrs The addresses, reordered in place
+ * @count The number of @addrs
+ *
+ * IPv6 goes first and the families then alternate as RFC 8305 suggests, so
+ * a race reaches the other family quickly when one is broken.
+ */
+static void hss_resolver_interleave(union hss_socket_addr *addrs, int count)
+{
+	union hss_socket_addr sorted[HSS_SOCKET_RACE_MAX];
+	int pos[2] = {0, 0};
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		int v4 = i & 1;
+
+		j = hss_resolver_next(addrs, count, &pos[v4],
+			v4 ? AF_INET : AF_INET6);
+		if (j < 0)
+			j = hss_resolver_next(addrs, count, &pos[!v4],
+				v4 ? AF_INET6 : AF_INET);
+		sorted[i] = addrs[j];
+	}
+	memcpy(addrs, sorted, count * sizeof(*addrs));
+}
+
+/**
+ * hss_resolver_lookup - Looks a name up in the cache only
+ *
+ * @name The name, not NUL terminated
+ * @len The length of @name
+ * @addrs Filled with the addresses in the order they should be tried, ports
+ *	unset
+ * @max The most addresses to return
+ *
+ * Returns: The number of addresses, -ENOENT if the name is not cached or
+ * -EINVAL if it is not a valid length.
+ *
+ * Notes: Never sleeps.
+ */
+int hss_resolver_lookup(const char *name, int len,
+	union hss_socket_addr *addrs, int max)
+{
+	struct hss_resolver_entry *entry;
+	char key[HSS_NAME_MAX];
+	int ret = -ENOENT;
+	u32 hash;
+
+	if (len <= 0 || len > HSS_NAME_MAX)
+		return -EINVAL;
+
+	hash = hss_resolver_key(name, len, key);
+
+	spin_lock(&hss_resolver_lock);
+	entry = hss_resolver_find(key, len, hash);
+	if (entry && time_before(jiffies, entry->expires)) {
+		ret = min(entry->count, max);
+		memcpy(addrs, entry->addrs, ret * sizeof(*addrs));
+		list_move(&entry->lru, &hss_resolver_lru);
+	} else if (entry) {
+		hss_resolver_drop(entry);
+	}
+	spin_unlock(&hss_resolver_lock);
+	return ret;
+}
+
+/**
+ * hss_resolve - Resolves a name
+ *
+ * @name The name, not NUL terminated
+ * @len The length of @name
+ * @addrs Filled with the addresses in the order they should be tried, ports
+ *	unset
+ * @max The most addresses to return
+ *
+ * Answers from the cache if it can, otherwise asks the kernel DNS resolver,
+ * which asks the resolvers in the hosts /etc/resolv.conf through its
+ * request-key upcall. The answer is cached for the shorter of its TTL and
+ * the dns_ttl parameter.
+ *
+ * Returns: The number of addresses, -ENODATA if the name does not resolve
+ * or another error code.
+ *
+ * Notes: May sleep for as long as the upcall takes.
+ */
+int hss_resolve(const char *name, int len, union hss_socket_addr *addrs,
+	int max)
+{
+	struct hss_resolver_entry *entry;
+	time64_t expiry = 0;
+	char *result = NULL;
+	long ttl;
+	int ret;
+
+	ret = hss_resolver_lookup(name, len, addrs, max);
+	if (ret != -ENOENT)
+		return ret;
+
+	entry = kzalloc(sizeof(*entry) + len, GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+	entry->len = len;
+	entry->hash = hss_resolver_key(name, len, entry->name);
+
+	ret = hss_dns_query(entry->name, len, &result, &expiry);
+	if (ret < 0) {
+		/* Other than running out of memory the name is unknown */
+		if (ret != -ENOMEM && ret != -EOPNOTSUPP)
+			ret = -ENODATA;
+		goto free_entry;
+	}
+
+	entry->count = hss_resolver_parse(result, ret, entry->addrs,
+		HSS_SOCKET_RACE_MAX);
+	kfree(result);
+	if (!entry->count) {
+		ret = -ENODATA;
+		goto free_entry;
+	}
+	hss_resolver_interleave(entry->addrs, entry->count);
+
+	ret = min(entry->count, max);
+	memcpy(addrs, entry->addrs, ret * sizeof(*addrs));
+
+	ttl = READ_ONCE(hss_dns_ttl);
+	if (expiry)
+		ttl = min_t(time64_t, ttl,
+			expiry - ktime_get_real_seconds());
+	if (ttl <= 0)
+		goto free_entry;
+
+	entry->expires = jiffies + ttl * HZ;
+	hss_resolver_insert(entry);
+	return ret;
+
+free_entry:
+	kfree(entry);
+	return ret;
+}
+
+/**
+ * hss_resolver_flush - Empties the cache
+ *
+ * Notes: Called once no device is left on module unload.
+ */
+void hss_resolver_flush(void)
+{
+	struct hss_resolver_entry *entry, *tmp;
+
+	spin_lock(&hss_resolver_lock);
+	list_for_each_entry_safe(entry, tmp, &hss_resolver_lru, lru)
+		hss_resolver_drop(entry);
+	spin_unlock(&hss_resolver_lock);
+}
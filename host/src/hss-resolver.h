@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/**
+ * @file hss-resolver.h
+ * @brief Host name resolution shared by every HSS device
+ */
+#ifndef __XAPRC00X_RESOLVER_H
+#define __XAPRC00X_RESOLVER_H
+
+#include "hss-sockets.h"
+
+int hss_resolver_lookup(const char *name, int len,
+	union hss_socket_addr *addrs, int max);
+
+int hss_resolve(const char *name, int len, union hss_socket_addr *addrs,
+	int max);
+
+void hss_resolver_flush(void);
+
+#endif /* __XAPRC00X_RESOLVER_H */
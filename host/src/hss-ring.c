@@ -7,10 +7,166 @@
 
 #include <linux/circ_buf.h>
 #include <linux/compiler.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <asm/barrier.h>
+#include <asm/cacheflush.h>
 #include "hss-ring.h"
 
+/**
+ * hss_ring_alloc - Allocates a mirrored ring
+ *
+ * @ring The ring to initialize
+ * @size The requested length of the ring
+ * @chunk The longest run of the ring that must be physically contiguous
+ *
+ * Allocates the ring a chunk at a time and maps the pages twice, back to
+ * back, so the byte after the end of the ring is the first byte of the ring
+ * again. Readers never have to handle a section that wraps.
+ *
+ * Returns: 0 on success or an error code
+ *
+ * Notes:
+ * @chunk is rounded up to a power of 2 of at least PAGE_SIZE and @size to a
+ * power of 2 of at least @chunk. A @chunk of PAGE_SIZE never needs more
+ * than an order 0 allocation, however fragmented memory is.
+ */
+int hss_ring_alloc(struct hss_ring *ring, int size, int chunk)
+{
+	int npages;
+	int order;
+	int i;
+	int j;
+	int ret = 0;
+
+	chunk = roundup_pow_of_two(max_t(int, chunk, PAGE_SIZE));
+	size = roundup_pow_of_two(max(size, chunk));
+	npages = size >> PAGE_SHIFT;
+	order = get_order(chunk);
+
+	ring->pages = kcalloc(npages * 2, sizeof(*ring->pages), GFP_KERNEL);
+	if (!ring->pages) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	ring->size = size;
+	ring->chunk = chunk;
+
+	for (i = 0; i < npages; i += 1 << order) {
+		ring->pages[i] = alloc_pages(GFP_KERNEL | __GFP_NOWARN, order);
+		if (!ring->pages[i]) {
+			ret = -ENOMEM;
+			goto free_pages;
+		}
+
+		for (j = 0; j < 1 << order; j++) {
+			ring->pages[i + j] = ring->pages[i] + j;
+			ring->pages[i + j + npages] = ring->pages[i] + j;
+		}
+	}
+
+	ring->circ.buf = vmap(ring->pages, npages * 2, VM_MAP, PAGE_KERNEL);
+	if (!ring->circ.buf) {
+		ret = -ENOMEM;
+		goto free_pages;
+	}
+
+	ring->circ.head = 0;
+	ring->circ.tail = 0;
+	goto exit;
+
+free_pages:
+	ring->circ.buf = NULL;
+	hss_ring_free(ring);
+exit:
+	return ret;
+}
+
+/**
+ * hss_ring_free - Frees a ring allocated with hss_ring_alloc
+ *
+ * @ring The ring to free
+ *
+ * Notes:
+ * Also cleans up after a partially allocated ring.
+ */
+void hss_ring_free(struct hss_ring *ring)
+{
+	int npages = ring->size >> PAGE_SHIFT;
+	int order = get_order(ring->chunk);
+	int i;
+
+	/* vunmap ignores NULL */
+	vunmap(ring->circ.buf);
+	for (i = 0; i < npages; i += 1 << order)
+		if (ring->pages[i])
+			__free_pages(ring->pages[i], order);
+	kfree(ring->pages);
+	ring->circ.buf = NULL;
+	ring->pages = NULL;
+}
+
+/**
+ * hss_ring_dma_sg - Describes a section of the ring for DMA
+ *
+ * @ring The ring
+ * @start The offset of the section
+ * @len The length of the section, which must not wrap
+ * @sg The scatterlist to fill
+ * @nents The number of entries in @sg
+ *
+ * The mirrored mapping cannot be handed to DMA, so the section is described
+ * by the pages behind it instead, one entry for each chunk it covers.
+ *
+ * Returns: The number of entries used or -EINVAL if @sg is too short
+ */
+int hss_ring_dma_sg(struct hss_ring *ring, int start, int len,
+	struct scatterlist *sg, int nents)
+{
+	int n = 0;
+	int seg;
+
+	sg_init_table(sg, nents);
+	while (len > 0) {
+		if (n == nents)
+			return -EINVAL;
+
+		seg = min(len, ring->chunk - (start & (ring->chunk - 1)));
+		sg_set_page(&sg[n++], ring->pages[start >> PAGE_SHIFT], seg,
+			start & ~PAGE_MASK);
+		start += seg;
+		len -= seg;
+	}
+	sg_mark_end(&sg[n - 1]);
+
+	return n;
+}
+
+/**
+ * hss_ring_dma_complete - Makes data written by DMA visible
+ *
+ * @ring The ring written to
+ * @start The offset DMA started at
+ * @len The number of bytes written
+ *
+ * Devices write to the ring through the pages' linear mapping. On CPUs with
+ * aliasing caches the mirrored mapping may still hold stale lines for the
+ * same memory, so those are dropped before the data is published.
+ */
+void hss_ring_dma_complete(struct hss_ring *ring, int start, int len)
+{
+	invalidate_kernel_vmap_range(ring->circ.buf + start, len);
+	invalidate_kernel_vmap_range(ring->circ.buf + ring->size + start, len);
+}
+
 /**
  * hss_ring_section - Gives the caller parameters to consume data from a
  * ring buffer.
@@ -20,37 +176,34 @@
  * buffer they can safely read. This structure may then be passed to []
  * to actually move the ring forward upon completion.
  *
- * @ring A pointer to the circ_buf object to manipulate
- * @ring_len The length of the circ_buf buffer
+ * @ring A pointer to the ring to manipulate
  * @len The length to consume from the ring buffer
  *
  * Returns: {-1,-,-} on failure, the copy parameters if the entire length can
  * be served. On success the first member (start) is the offset on the buffer
  * to begin reading, the second (len) is the length to read from start. The
- * final member (wrap) is the number of bytes to read from the beginning of
- * the buffer.
+ * ring is mirrored so the final member (wrap) is always 0.
  *
  * Notes:
  * This only returns information on where to read from the buffer, it does not
  * reserve or restrict other consumers from using this data.
  */
-struct hss_ring_section hss_consumer_section(
-	struct circ_buf *ring, int ring_len, int len)
+struct hss_ring_section hss_consumer_section(struct hss_ring *ring, int len)
 {
 	int head;
 	int tail;
 	struct hss_ring_section ret = {-1, 0, 0};
 
-	head = READ_ONCE(ring->head);
-	tail = READ_ONCE(ring->tail);
+	/* Pairs with the release of head by the producer */
+	head = smp_load_acquire(&ring->circ.head);
+	tail = READ_ONCE(ring->circ.tail);
 
 	/* If there is not enough data to return */
-	if (CIRC_CNT(head, tail, ring_len) < len)
+	if (CIRC_CNT(head, tail, ring->size) < len)
 		goto exit;
 
-	ret.len = min(len, CIRC_CNT_TO_END(head, tail, ring_len));
+	ret.len = len;
 	ret.start = tail;
-	ret.wrap = len - ret.len;
 
 exit:
 	return ret;
@@ -63,26 +216,24 @@ exit:
  * this function should be called to free the data in the structure. Once
  * called the memory described in this section is no longer safe to read.
  *
- * @ring A pointer to the circ_buf object to manipulate
- * @ring_len The length of the circ_buf buffer
+ * @ring A pointer to the ring to manipulate
  * @section The section of memory to consume
  */
 void hss_ring_consume(
-	struct circ_buf *ring,
-	int ring_len,
+	struct hss_ring *ring,
 	struct hss_ring_section section)
 {
 	int newtail =
-		(section.start + section.len + section.wrap) & (ring_len - 1);
-	WRITE_ONCE(ring->tail, newtail);
+		(section.start + section.len + section.wrap) & (ring->size - 1);
+
+	/* Finish reading the section before the producer may reuse it */
+	smp_store_release(&ring->circ.tail, newtail);
 }
 
 /**
- * hss_ring_write - Place an arbitrary number of bytes on a circ_buf
- * structure
+ * hss_ring_write - Place an arbitrary number of bytes on a ring
  *
- * @ring A pointer to the circ_buf object to manipulate
- * @ring_len The length of the circ_buf buffer
+ * @ring A pointer to the ring to manipulate
  * @buf A pointer to the incoming data
  * @len The length to place from buf onto the ring
  *
@@ -90,32 +241,27 @@ void hss_ring_consume(
  *
  * Notes:
  * If the entire requested buffer cannot be inserted then nothing will be
- * ring_len must be a power-of-two. See the documentation for circ_buf for info
- * dst must already be allocated with space for a `n` byte copy
- * This function may modify ring->head to fill the buffer
+ * This function may modify ring->circ.head to fill the buffer
  */
-int hss_ring_write(struct circ_buf *ring, int ring_len, char *buf, int len)
+int hss_ring_write(struct hss_ring *ring, char *buf, int len)
 {
 	int head;
 	int tail;
-	int space_to_end;
 	int ret = 0;
 
 	/* Make sure there is enough space to perform the operation */
-	head = READ_ONCE(ring->head);
-	tail = READ_ONCE(ring->tail);
-	if (CIRC_SPACE(head, tail, ring_len) < len) {
+	head = READ_ONCE(ring->circ.head);
+	tail = smp_load_acquire(&ring->circ.tail);
+	if (CIRC_SPACE(head, tail, ring->size) < len) {
 		ret = 1;
 		goto exit;
 	}
 
-	space_to_end = min(len, CIRC_SPACE_TO_END(head, tail, ring_len));
-
-	memcpy(ring->buf + head, buf, space_to_end);
-	memcpy(ring->buf, buf + space_to_end, len - space_to_end);
+	/* The mirror takes care of any wrap */
+	memcpy(ring->circ.buf + head, buf, len);
 
-	/* Update the circ buffer head */
-	WRITE_ONCE(ring->head, (head + len) & (ring_len - 1));
+	/* Update the circ buffer head once the data is in place */
+	smp_store_release(&ring->circ.head, (head + len) & (ring->size - 1));
 exit:
 	return ret;
 }
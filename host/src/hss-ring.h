@@ -7,6 +7,26 @@
 #define XAPRC00X_RING_H
 
 #include <linux/circ_buf.h>
+#include <linux/mm_types.h>
+#include <linux/scatterlist.h>
+
+/**
+ * struct hss_ring - A circ_buf whose pages are mapped twice back to back
+ *
+ * @circ The circ_buf. `circ.buf` points at the mirrored mapping so any
+ *	section of up to `size` bytes starting inside the ring is contiguous.
+ * @size The length of the ring, a power of 2 and a multiple of @chunk
+ * @chunk The length of each physically contiguous run of pages, a power of 2
+ *	of at least PAGE_SIZE
+ * @pages The pages backing the ring, listed twice in the order they are
+ *	mapped
+ */
+struct hss_ring {
+	struct circ_buf circ;
+	int size;
+	int chunk;
+	struct page **pages;
+};
 
 struct hss_ring_section {
 	int start;
@@ -14,13 +34,15 @@ struct hss_ring_section {
 	int wrap;
 };
 
-int hss_ring_write(
-	struct circ_buf *ring,
-	int buf_len, char *buf,
-	int len);
+int hss_ring_alloc(struct hss_ring *ring, int size, int chunk);
+void hss_ring_free(struct hss_ring *ring);
+int hss_ring_dma_sg(struct hss_ring *ring, int start, int len,
+	struct scatterlist *sg, int nents);
+void hss_ring_dma_complete(struct hss_ring *ring, int start, int len);
+int hss_ring_write(struct hss_ring *ring, char *buf, int len);
 struct hss_ring_section hss_consumer_section(
-	struct circ_buf *ring, int buf_len, int len);
+	struct hss_ring *ring, int len);
 void hss_ring_consume(
-	struct circ_buf *ring, int buf_size, struct hss_ring_section section);
+	struct hss_ring *ring, struct hss_ring_section section);
 
 #endif
@@ -6,322 +6,2081 @@
  *	device.
  */
 
-#include <linux/rhashtable.h>
+#include <linux/idr.h>
+#include <linux/in.h>
+#include <linux/jiffies.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/skbuff.h>
 #include <linux/socket.h>
+#include <linux/spinlock.h>
 #include <linux/net.h>
+#include <linux/workqueue.h>
+#include <net/inet_sock.h>
+#include <net/ipv6.h>
 #include <net/sock.h>
+#include <net/tcp.h>
+#include "hss.h"
+#include "hss-backports.h"
+#include "hss-sockets.h"
 
+/*
+ * Bytes a single socket may hold back while its remote is not reading. This
+ * is also the window advertised to devices using credits, so it is never
+ * less than the HSS_INITIAL_WINDOW those devices start with. Lowering it only
+ * shrinks windows not yet handed out, hss_socket_send still takes everything
+ * up to `tx_advertised`.
+ */
+static int hss_sock_tx_limit = 1<<16; /* 64kb */
+module_param_named(sock_tx_limit, hss_sock_tx_limit, int, 0644);
+MODULE_PARM_DESC(sock_tx_limit,
+	"Bytes queued per host socket before writes are refused, at least 65536 (default 65536)");
+
+/*
+ * Bytes all of a device's sockets may hold back together. Past it each socket
+ * is only offered HSS_SOCKET_TX_FLOOR beyond what its sock has taken, so a
+ * device with many stalled remotes cannot pin sock_tx_limit for each.
+ */
+static int hss_dev_tx_limit = 1<<22; /* 4mb */
+module_param_named(dev_tx_limit, hss_dev_tx_limit, int, 0644);
+MODULE_PARM_DESC(dev_tx_limit,
+	"Bytes queued across a device's sockets before their windows shrink, 0 for no limit (default 4194304)");
+
+/* Sockets a single device may have open */
+static int hss_max_sockets = 1024;
+module_param_named(max_sockets, hss_max_sockets, int, 0644);
+MODULE_PARM_DESC(max_sockets,
+	"Sockets each device may have open, 0 for no limit (default 1024)");
+
+/* As RFC 5382 asks of NATs for established connections, 2 hours 4 minutes */
+static int hss_sock_idle_timeout = 7440;
+module_param_named(sock_idle_timeout, hss_sock_idle_timeout, int, 0644);
+MODULE_PARM_DESC(sock_idle_timeout,
+	"Seconds a socket may go without traffic before it is closed, 0 to keep idle sockets (default 7440)");
+
+/* Upper bound on sockets being read at once for each device */
+static int hss_rx_workers = 4;
+module_param_named(rx_workers, hss_rx_workers, int, 0444);
+MODULE_PARM_DESC(rx_workers,
+	"Concurrent socket readers for each device (default 4)");
+
+/* Connects a race keeps going at once, RFC 8305 staggers two families */
+#define HSS_RACE_ATTEMPTS 2
+
+/* Window a socket is always offered past what its sock took, see dev_tx_limit */
+#define HSS_SOCKET_TX_FLOOR 4096
+
+/* Longest the idle reaper sleeps, so a changed sock_idle_timeout applies */
+#define HSS_IDLE_SCAN_MAX (60 * HZ)
+
+/**
+ * struct hss_socket_mgr - The sockets of one device
+ *
+ * @sockets The sockets by the ID the device gave them. Looked up under RCU,
+ *	each holds a reference on its socket.
+ * @lock Serializes changes to @sockets
+ * @nr_sockets The number of @sockets, under @lock
+ * @refused Sockets not created for the max_sockets limit
+ * @reaped Sockets closed by @idle_work
+ * @tx_queued Bytes on the `tx_queue` of every socket, see dev_tx_limit
+ * @idle_work Closes sockets that went sock_idle_timeout without traffic
+ * @rx_stalled Sockets parked by hss_socket_rx_stall, under @lock
+ */
+struct hss_socket_mgr {
+	struct idr sockets;
+	spinlock_t lock;
+	int nr_sockets;
+	struct list_head rx_stalled;
+	atomic_t refused;
+	atomic_t reaped;
+	atomic_t tx_queued;
+	struct delayed_work idle_work;
+	struct workqueue_struct *tx_wq;
+	struct workqueue_struct *rx_wq;
+	const struct hss_socket_ops *ops;
+	void *context;
+};
+
+/**
+ * struct hss_host_socket - A socket owned by the device
+ *
+ * @ref Held by the managers table and by whoever resolved the socket with
+ *	hss_socket_get. The last reference tears the socket down, so nothing
+ *	using it can see its sock released.
+ * @rcu Frees the socket once lookups that raced the last reference are done
+ * @closed Set once the device closed the socket and it left the table
+ * @last_active The jiffies data last moved either way
+ * @tx_queue Data the socket could not take yet, sent in order by `tx_work`
+ *	whenever the socket reports write space.
+ * @tx_queued Bytes on `tx_queue`, bounded by the sock_tx_limit parameter
+ * @tx_lock Serializes sends so queued data always goes out first
+ * @tx_done Bytes the sock has taken, wrapping. The window offered to the
+ *	device is `tx_done` plus the queue limit.
+ * @tx_advertised The last window handed out by hss_socket_tx_window or the
+ *	managers `window` op
+ * @rx_work Runs the managers `readable` op on the shared rx pool when the
+ *	sock reports data or a state change
+ * @rx_enabled Set once the socket is connected and cleared when `readable`
+ *	reports the socket is done
+ * @rx_stalled Entry on the managers `rx_stalled` list, under its `lock`
+ * @rx_sent Bytes sent on to the device, wrapping
+ * @rx_window The last window granted by the device
+ * @connecting Set while a non-blocking connect is outstanding. Whoever
+ *	clears it reports the result.
+ * @connect_cookie Passed back to the managers `connected` op
+ * @connect_work Runs the managers `connected` op once the connect finishes
+ * @race Set while hss_socket_connect_race is trying addresses, under
+ *	`tx_lock`
+ * @race_work Starts and collects the races connect attempts
+ * @opt_set Bitmap of the options the device set, by enum hss_sockopt, under
+ *	`tx_lock`
+ * @opt_val The values of the options in `opt_set`. Every sock a race tries
+ *	gets them too, so they survive the winner replacing `sock`.
+ */
 struct hss_host_socket {
 	int sock_id;
 	struct socket *sock;
-	struct rhash_head hash;
+	struct kref ref;
+	struct rcu_head rcu;
+	bool closed;
+	unsigned long last_active;
+	struct hss_socket_mgr *mgr;
+	struct work_struct tx_work;
+	struct mutex tx_lock;
+	struct sk_buff_head tx_queue;
+	int tx_queued;
+	u32 tx_done;
+	u32 tx_advertised;
+	struct work_struct rx_work;
+	bool rx_enabled;
+	struct list_head rx_stalled;
+	u32 rx_sent;
+	u32 rx_window;
+	atomic_t connecting;
+	u32 connect_cookie;
+	struct work_struct connect_work;
+	struct hss_socket_race *race;
+	struct delayed_work race_work;
+	unsigned long opt_set;
+	u32 opt_val[HSS_SOCKOPT_NUM];
+	void (*saved_write_space)(struct sock *sk);
+	void (*saved_data_ready)(struct sock *sk);
+	void (*saved_state_change)(struct sock *sk);
+};
+
+/**
+ * struct hss_socket_race - Connects to whichever of several addresses answers
+ *
+ * @addrs The addresses to try, in order
+ * @count The number of @addrs
+ * @next The index of the next address to try
+ * @attempts Socks with a connect outstanding, NULL for a free slot
+ * @saved_state_change The sk_state_change each attempt had before the race
+ * @delay Jiffies an attempt has before the next address is tried alongside
+ *	it, 0 to wait for it to fail
+ * @next_at When the next address is tried if @delay is set
+ * @error The error of the last failed attempt
+ * @cookie Passed back to the managers `connected` op
+ */
+struct hss_socket_race {
+	union hss_socket_addr addrs[HSS_SOCKET_RACE_MAX];
+	int count;
+	int next;
+	struct socket *attempts[HSS_RACE_ATTEMPTS];
+	void (*saved_state_change[HSS_RACE_ATTEMPTS])(struct sock *sk);
+	unsigned long delay;
+	unsigned long next_at;
+	int error;
+	u32 cookie;
 };
 
-static struct rhashtable_params ht_parms = {
-	.nelem_hint = 8,
-	.key_len = sizeof(int),
-	.key_offset = offsetof(struct hss_host_socket, sock_id),
-	.head_offset = offsetof(struct hss_host_socket, hash),
-};
+static void hss_socket_idle_work(struct work_struct *work);
+
+/**
+ * hss_socket_mgr_init - Creates a socket manager
+ *
+ * @mgr_out Set to the new manager on success
+ * @ops Callbacks for socket events, see struct hss_socket_ops
+ * @context Passed to every callback in @ops
+ * @id The device's proxy ID, which names the manager's workqueues
+ *
+ * Returns: 0 on success or an error code
+ */
+int hss_socket_mgr_init(struct hss_socket_mgr **mgr_out,
+	const struct hss_socket_ops *ops, void *context, int id)
+{
+	struct hss_socket_mgr *mgr;
+	int ret;
+
+	mgr = kzalloc(sizeof(struct hss_socket_mgr), GFP_KERNEL);
+	if (!mgr) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	/* Sends never block so one queue can serve every socket */
+	mgr->tx_wq = alloc_workqueue("hss_tx_wq_%d",
+		WQ_UNBOUND | WQ_MEM_RECLAIM, 0, id);
+	if (!mgr->tx_wq) {
+		ret = -ENOMEM;
+		goto free_mgr;
+	}
+
+	/* Readers are event driven so a few workers serve every socket */
+	mgr->rx_wq = alloc_workqueue("hss_rx_wq_%d",
+		WQ_UNBOUND | WQ_MEM_RECLAIM, max(hss_rx_workers, 1), id);
+	if (!mgr->rx_wq) {
+		ret = -ENOMEM;
+		goto free_tx_wq;
+	}
+	mgr->ops = ops;
+	mgr->context = context;
+	idr_init(&mgr->sockets);
+	spin_lock_init(&mgr->lock);
+	INIT_LIST_HEAD(&mgr->rx_stalled);
+	INIT_DELAYED_WORK(&mgr->idle_work, hss_socket_idle_work);
+	schedule_delayed_work(&mgr->idle_work, HSS_IDLE_SCAN_MAX);
+
+	*mgr_out = mgr;
+	ret = 0;
+	goto exit;
+
+free_tx_wq:
+	destroy_workqueue(mgr->tx_wq);
+free_mgr:
+	kfree(mgr);
+exit:
+	return ret;
+}
+
+static void hss_socket_detach(struct hss_host_socket *socket);
+static void hss_socket_race_end(struct hss_host_socket *socket);
+static void hss_socket_race_work(struct work_struct *work);
+
+/**
+ * hss_socket_release - Tears down a socket once its last reference is gone
+ *
+ * @ref The sockets `ref`
+ *
+ * Nothing can queue the sockets own work any more, so once the sock's
+ * callbacks are back what is queued is cancelled in the order the works
+ * queue each other.
+ *
+ * Notes: Sleeps. Never called from the sockets own work, which runs without
+ * a reference of its own.
+ */
+static void hss_socket_release(struct kref *ref)
+{
+	struct hss_host_socket *socket =
+		container_of(ref, struct hss_host_socket, ref);
+
+	/* A race may be about to swap in another sock */
+	mutex_lock(&socket->tx_lock);
+	hss_socket_race_end(socket);
+	mutex_unlock(&socket->tx_lock);
+	cancel_delayed_work_sync(&socket->race_work);
+
+	/* Stop sock callbacks before the work they queue goes away */
+	hss_socket_detach(socket);
+	spin_lock(&socket->mgr->lock);
+	list_del_init(&socket->rx_stalled);
+	spin_unlock(&socket->mgr->lock);
+	cancel_work_sync(&socket->connect_work);
+	cancel_work_sync(&socket->tx_work);
+	cancel_work_sync(&socket->rx_work);
+
+	skb_queue_purge(&socket->tx_queue);
+	atomic_sub(socket->tx_queued, &socket->mgr->tx_queued);
+	sock_release(socket->sock);
+
+	/* hss_socket_get may still be looking at it */
+	kfree_rcu(socket, rcu);
+}
+
+/**
+ * hss_socket_get - Resolves the ID the device gave a socket
+ *
+ * @socket_id The ID
+ * @mgr The manager the device's sockets are on
+ *
+ * The socket stays valid, and its sock open, until the reference taken here
+ * is dropped with hss_socket_put, even if the device closes it meanwhile.
+ *
+ * Returns: The socket or NULL if there is none with @socket_id
+ *
+ * Notes: Never sleeps.
+ */
+struct hss_host_socket *hss_socket_get(int socket_id,
+	struct hss_socket_mgr *mgr)
+{
+	struct hss_host_socket *socket;
+
+	rcu_read_lock();
+	socket = idr_find(&mgr->sockets, socket_id);
+	if (socket && !kref_get_unless_zero(&socket->ref))
+		socket = NULL;
+	rcu_read_unlock();
+	return socket;
+}
+
+/**
+ * hss_socket_put - Drops a reference taken by hss_socket_get
+ *
+ * @socket The socket
+ *
+ * Notes: May sleep, the last reference to a closed socket releases its sock.
+ */
+void hss_socket_put(struct hss_host_socket *socket)
+{
+	kref_put(&socket->ref, hss_socket_release);
+}
+
+/**
+ * hss_socket_closed - Checks if the device has closed a socket
+ *
+ * @socket The socket, resolved with hss_socket_get
+ *
+ * Returns: True once the socket is no longer found by its ID
+ */
+bool hss_socket_closed(struct hss_host_socket *socket)
+{
+	return READ_ONCE(socket->closed);
+}
+
+/**
+ * hss_socket_mgr_destroy - Deallocate a socket manager
+ *
+ * @mgr The manager returned by hss_socket_mgr_init
+ *
+ * Closes every socket still on the table and drops any data they had queued.
+ *
+ * Notes: Nothing may hold a reference from hss_socket_get any more.
+ */
+void hss_socket_mgr_destroy(struct hss_socket_mgr *mgr)
+{
+	struct hss_host_socket *socket;
+	int id;
+
+	cancel_delayed_work_sync(&mgr->idle_work);
+
+	/* Freeing a socket waits on its tx work so this may sleep */
+	idr_for_each_entry(&mgr->sockets, socket, id)
+		hss_socket_close(id, mgr);
+	idr_destroy(&mgr->sockets);
+	destroy_workqueue(mgr->rx_wq);
+	destroy_workqueue(mgr->tx_wq);
+	kfree(mgr);
+}
+
+int hss_socket_exists(int key, struct hss_socket_mgr *mgr)
+{
+	struct hss_host_socket *socket;
+
+	rcu_read_lock();
+	socket = idr_find(&mgr->sockets, key);
+	rcu_read_unlock();
+	return socket != NULL;
+}
+
+static int hss_socket_tx_limit(void)
+{
+	return max(READ_ONCE(hss_sock_tx_limit), HSS_INITIAL_WINDOW);
+}
+
+/**
+ * hss_socket_window - Works out the window a socket can offer now
+ *
+ * @socket The socket
+ *
+ * Up to sock_tx_limit bytes may wait past what the sock has taken, fewer once
+ * the device's sockets hold dev_tx_limit between them. It never drops below
+ * HSS_SOCKET_TX_FLOOR so every socket can still make progress.
+ *
+ * Returns: The window, which may be behind one already handed out
+ *
+ * Notes: Caller must hold `tx_lock`.
+ */
+static u32 hss_socket_window(struct hss_host_socket *socket)
+{
+	int allowed = hss_socket_tx_limit();
+	int dev_limit = READ_ONCE(hss_dev_tx_limit);
+
+	if (dev_limit > 0)
+		allowed = clamp(dev_limit + socket->tx_queued -
+			atomic_read(&socket->mgr->tx_queued),
+			HSS_SOCKET_TX_FLOOR, allowed);
+	return socket->tx_done + allowed;
+}
+
+/* Records traffic on a socket for the idle reaper */
+static void hss_socket_touch(struct hss_host_socket *socket)
+{
+	WRITE_ONCE(socket->last_active, jiffies);
+}
+
+/*
+ * Where a datagram waiting on `tx_queue` goes, kept in the skb's cb. The
+ * family is AF_UNSPEC for the connected address.
+ */
+#define HSS_SOCKET_TX_ADDR(skb) ((union hss_socket_addr *)(skb)->cb)
+
+/**
+ * hss_socket_addr_len - Gets the length of an address
+ *
+ * @addr The address
+ *
+ * Returns: The size of the sockaddr for the addresses family
+ */
+static int hss_socket_addr_len(union hss_socket_addr *addr)
+{
+	if (addr->sa.sa_family == AF_INET6)
+		return sizeof(struct sockaddr_in6);
+	return sizeof(struct sockaddr_in);
+}
+
+
+/**
+ * hss_socket_push - Sends as much queued data as the socket will take
+ *
+ * @socket The socket to drain
+ *
+ * Returns: 0 once the queue is empty, -EAGAIN if the socket is full or
+ * an error code.
+ *
+ * Notes: Caller must hold `tx_lock`.
+ */
+static int hss_socket_push(struct hss_host_socket *socket)
+{
+	struct msghdr msg = {.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL};
+	struct sk_buff *skb;
+	struct kvec vec;
+	int ret = 0;
+
+	while ((skb = skb_peek(&socket->tx_queue))) {
+		union hss_socket_addr *addr = HSS_SOCKET_TX_ADDR(skb);
+
+		msg.msg_name = addr->sa.sa_family ? addr : NULL;
+		msg.msg_namelen = hss_socket_addr_len(addr);
+		vec.iov_base = skb->data;
+		vec.iov_len = skb->len;
+		ret = kernel_sendmsg(socket->sock, &msg, &vec, 1, skb->len);
+
+		/* Only a full socket holds back the datagrams behind one */
+		if (ret < 0 && ret != -EAGAIN &&
+			socket->sock->type == SOCK_DGRAM) {
+			pr_debug("%s sock %d dropped a datagram: %d\n",
+				__func__, socket->sock_id, ret);
+			ret = skb->len;
+		}
+		if (ret < 0)
+			break;
+
+		socket->tx_queued -= ret;
+		atomic_sub(ret, &socket->mgr->tx_queued);
+		socket->tx_done += ret;
+		hss_socket_touch(socket);
+
+		/* Keep the unsent tail for the next write space callback */
+		if (ret < skb->len) {
+			skb_pull(skb, ret);
+			ret = -EAGAIN;
+			break;
+		}
+
+		skb_unlink(skb, &socket->tx_queue);
+		consume_skb(skb);
+		ret = 0;
+	}
+	return ret;
+}
+
+/**
+ * hss_socket_queue - Queues bytes the socket could not take yet
+ *
+ * @socket The socket being written
+ * @buf The bytes to queue
+ * @len The length of @buf, may be 0
+ * @addr Where the datagram in @buf goes, NULL for a stream or the connected
+ *	address
+ *
+ * A datagram is queued whole, even when empty.
+ *
+ * Returns: 0 on success or -ENOMEM
+ *
+ * Notes: Caller must hold `tx_lock`.
+ */
+static int hss_socket_queue(struct hss_host_socket *socket, char *buf,
+	int len, union hss_socket_addr *addr)
+{
+	struct sk_buff *skb;
+
+	BUILD_BUG_ON(sizeof(*addr) > sizeof(skb->cb));
+
+	if (len <= 0 && socket->sock->type == SOCK_STREAM)
+		return 0;
+
+	skb = alloc_skb(len, GFP_KERNEL);
+	if (!skb)
+		return -ENOMEM;
+	memcpy(skb_put(skb, len), buf, len);
+	if (addr)
+		*HSS_SOCKET_TX_ADDR(skb) = *addr;
+	else
+		HSS_SOCKET_TX_ADDR(skb)->sa.sa_family = AF_UNSPEC;
+	skb_queue_tail(&socket->tx_queue, skb);
+	socket->tx_queued += len;
+	atomic_add(len, &socket->mgr->tx_queued);
+
+	/* Space may have opened before the skb was queued */
+	queue_work(socket->mgr->tx_wq, &socket->tx_work);
+	return 0;
+}
+
+/**
+ * hss_socket_tx_work - Drains a sockets queue after it reported write space
+ *
+ * @work The sockets `tx_work`
+ *
+ * Once a quarter of the queue limit has drained since the device last heard
+ * about the window, or the queue is empty, the new one is passed to the
+ * managers `window` op. A device waiting for credit has nothing in flight to
+ * be ACKed so this is the only way it learns of the space.
+ */
+static void hss_socket_tx_work(struct work_struct *work)
+{
+	struct hss_host_socket *socket =
+		container_of(work, struct hss_host_socket, tx_work);
+	struct hss_socket_mgr *mgr = socket->mgr;
+	u32 window = 0;
+	bool update = false;
+	int limit = hss_socket_tx_limit();
+	s32 grown;
+	int ret;
+
+	mutex_lock(&socket->tx_lock);
+	ret = hss_socket_push(socket);
+	if (ret && ret != -EAGAIN) {
+		pr_err("%s sock %d dropping %d queued bytes: %d\n", __func__,
+			socket->sock_id, socket->tx_queued, ret);
+		skb_queue_purge(&socket->tx_queue);
+		atomic_sub(socket->tx_queued, &mgr->tx_queued);
+		socket->tx_done += socket->tx_queued;
+		socket->tx_queued = 0;
+	}
+
+	/* A window held down by dev_tx_limit may never grow by a quarter */
+	window = hss_socket_window(socket);
+	grown = window - socket->tx_advertised;
+	if (mgr->ops->window &&
+		(grown >= limit / 4 || (grown > 0 && !socket->tx_queued))) {
+		socket->tx_advertised = window;
+		update = true;
+	}
+	mutex_unlock(&socket->tx_lock);
+
+	if (update)
+		mgr->ops->window(socket->sock_id, window, mgr->context);
+}
+
+/**
+ * hss_socket_tx_window - Gets the window to advertise to the device
+ *
+ * @socket The socket the device is sending on
+ *
+ * Returns: The total bytes the device may have written to the socket,
+ * wrapping at 2^32. Never behind a window handed out before.
+ */
+u32 hss_socket_tx_window(struct hss_host_socket *socket)
+{
+	u32 window;
+
+	mutex_lock(&socket->tx_lock);
+	window = hss_socket_window(socket);
+	if (hss_window_after(socket->tx_advertised, window))
+		window = socket->tx_advertised;
+	socket->tx_advertised = window;
+	mutex_unlock(&socket->tx_lock);
+	return window;
+}
+
+/**
+ * hss_socket_write_space - sk_write_space callback for owned sockets
+ *
+ * @sk The sock that has room to send again
+ *
+ * Notes: Called from softirq context.
+ */
+static void hss_socket_write_space(struct sock *sk)
+{
+	struct hss_host_socket *socket;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	socket = sk->sk_user_data;
+	if (socket) {
+		socket->saved_write_space(sk);
+		if (!skb_queue_empty(&socket->tx_queue))
+			queue_work(socket->mgr->tx_wq, &socket->tx_work);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/**
+ * hss_socket_rx_work - Hands a readable socket to the managers `readable` op
+ *
+ * @work The sockets `rx_work`
+ */
+static void hss_socket_rx_work(struct work_struct *work)
+{
+	struct hss_host_socket *socket =
+		container_of(work, struct hss_host_socket, rx_work);
+	struct hss_socket_mgr *mgr = socket->mgr;
+	int ret;
+
+	if (!READ_ONCE(socket->rx_enabled))
+		return;
+
+	ret = mgr->ops->readable(socket, socket->sock_id, mgr->context);
+	if (ret < 0)
+		WRITE_ONCE(socket->rx_enabled, false);
+	else if (ret > 0)
+		queue_work(mgr->rx_wq, work);
+}
+
+/**
+ * hss_socket_rx_event - Queues the socket on the rx pool
+ *
+ * @sk The sock that has data or changed state
+ *
+ * Notes: Caller must hold `sk_callback_lock`.
+ */
+static void hss_socket_rx_event(struct sock *sk)
+{
+	struct hss_host_socket *socket = sk->sk_user_data;
+
+	if (socket && READ_ONCE(socket->rx_enabled))
+		queue_work(socket->mgr->rx_wq, &socket->rx_work);
+}
+
+/**
+ * hss_socket_data_ready - sk_data_ready callback for owned sockets
+ *
+ * @sk The sock with data to read
+ *
+ * Notes: Called from softirq context.
+ */
+static void hss_socket_data_ready(struct sock *sk)
+{
+	read_lock_bh(&sk->sk_callback_lock);
+	hss_socket_rx_event(sk);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/**
+ * hss_socket_connect_work - Reports a finished non-blocking connect
+ *
+ * @work The sockets `connect_work`
+ *
+ * Data written while the handshake was running is sent once it succeeds. A
+ * remote that closed straight after accepting still counts as connected, its
+ * EOF is passed on by the reader.
+ */
+static void hss_socket_connect_work(struct work_struct *work)
+{
+	struct hss_host_socket *socket =
+		container_of(work, struct hss_host_socket, connect_work);
+	struct hss_socket_mgr *mgr = socket->mgr;
+	struct sock *sk = socket->sock->sk;
+	int ret;
+
+	ret = sock_error(sk);
+	if (!ret && sk->sk_state != TCP_ESTABLISHED &&
+		sk->sk_state != TCP_CLOSE_WAIT)
+		ret = -ECONNREFUSED;
+
+	mgr->ops->connected(socket, socket->sock_id, socket->connect_cookie,
+		ret, mgr->context);
+
+	if (!ret && !skb_queue_empty(&socket->tx_queue))
+		queue_work(mgr->tx_wq, &socket->tx_work);
+}
+
+/**
+ * hss_socket_state_change - sk_state_change callback for owned sockets
+ *
+ * @sk The sock that changed state
+ *
+ * Finishes an outstanding connect once the handshake has completed or
+ * failed, on the rx pool so it never waits behind queued sends. A remote
+ * close does not always come with a data ready callback so the reader is run
+ * here too to pick up the EOF.
+ *
+ * Notes: Called from softirq context.
+ */
+static void hss_socket_state_change(struct sock *sk)
+{
+	struct hss_host_socket *socket;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	socket = sk->sk_user_data;
+	if (socket) {
+		socket->saved_state_change(sk);
+		if (sk->sk_state != TCP_SYN_SENT &&
+			atomic_xchg(&socket->connecting, 0))
+			queue_work(socket->mgr->rx_wq, &socket->connect_work);
+	}
+	hss_socket_rx_event(sk);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/**
+ * hss_socket_attach - Takes over the callbacks of a sock
+ *
+ * @socket The socket the sock now backs
+ * @sock The sock
+ *
+ * Resume queued sends when the remote opens its window and read from the rx
+ * pool when data arrives.
+ */
+static void hss_socket_attach(struct hss_host_socket *socket,
+	struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	socket->sock = sock;
+	socket->saved_write_space = sk->sk_write_space;
+	socket->saved_data_ready = sk->sk_data_ready;
+	socket->saved_state_change = sk->sk_state_change;
+	sk->sk_user_data = socket;
+	sk->sk_write_space = hss_socket_write_space;
+	sk->sk_data_ready = hss_socket_data_ready;
+	sk->sk_state_change = hss_socket_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+/**
+ * hss_socket_detach - Gives a sock its own callbacks back
+ *
+ * @socket The socket whose sock to detach
+ */
+static void hss_socket_detach(struct hss_host_socket *socket)
+{
+	struct sock *sk = socket->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	sk->sk_write_space = socket->saved_write_space;
+	sk->sk_data_ready = socket->saved_data_ready;
+	sk->sk_state_change = socket->saved_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+/**
+ * hss_socket_start_rx - Starts passing a socket's events to the rx pool
+ *
+ * @socket The socket to read from
+ */
+void hss_socket_start_rx(struct hss_host_socket *socket)
+{
+	WRITE_ONCE(socket->rx_enabled, true);
+
+	/* Pick up anything that arrived before reading was enabled */
+	queue_work(socket->mgr->rx_wq, &socket->rx_work);
+}
+
+/**
+ * hss_socket_rx_stall - Parks a socket the `readable` op couldn't finish
+ *
+ * @socket The socket being read
+ *
+ * For a socket left unread for want of something other than data, so no
+ * sock event would bring it back. It is queued on the rx pool again by the
+ * next hss_socket_rx_resume.
+ *
+ * Notes: Only called from the managers `readable` op. Never sleeps.
+ */
+void hss_socket_rx_stall(struct hss_host_socket *socket)
+{
+	struct hss_socket_mgr *mgr = socket->mgr;
+
+	spin_lock(&mgr->lock);
+	if (list_empty(&socket->rx_stalled))
+		list_add_tail(&socket->rx_stalled, &mgr->rx_stalled);
+	spin_unlock(&mgr->lock);
+}
+
+/**
+ * hss_socket_rx_resume - Queues every socket parked by hss_socket_rx_stall
+ *
+ * @mgr The manager of the device's sockets
+ *
+ * Notes: Never sleeps.
+ */
+void hss_socket_rx_resume(struct hss_socket_mgr *mgr)
+{
+	struct hss_host_socket *socket;
+
+	spin_lock(&mgr->lock);
+	while (!list_empty(&mgr->rx_stalled)) {
+		socket = list_first_entry(&mgr->rx_stalled,
+			struct hss_host_socket, rx_stalled);
+		list_del_init(&socket->rx_stalled);
+		/* A socket being released is taken off the list first */
+		queue_work(mgr->rx_wq, &socket->rx_work);
+	}
+	spin_unlock(&mgr->lock);
+}
+
+/**
+ * hss_socket_rx_credit - Gets how much more may be sent to the device
+ *
+ * @socket The socket being read
+ *
+ * Returns: The bytes left in the window granted by the device or 0.
+ *
+ * Notes: Only called from the managers `readable` op.
+ */
+int hss_socket_rx_credit(struct hss_host_socket *socket)
+{
+	s32 credit = READ_ONCE(socket->rx_window) - socket->rx_sent;
+
+	return max(credit, 0);
+}
+
+/**
+ * hss_socket_rx_spend - Records data sent to the device
+ *
+ * @socket The socket that was read
+ * @len The bytes sent to the device
+ *
+ * Notes: Only called from the managers `readable` op.
+ */
+void hss_socket_rx_spend(struct hss_host_socket *socket, int len)
+{
+	socket->rx_sent += len;
+}
+
+/**
+ * hss_socket_rx_grant - Moves the window granted by the device
+ *
+ * @socket_id The socket the device has room for
+ * @window The window from the device's HSS_E_CREDIT ACK
+ * @mgr The manager the socket is on
+ *
+ * Windows older than the current one are ignored. A larger window restarts
+ * a reader that stopped for lack of credit.
+ */
+void hss_socket_rx_grant(int socket_id, u32 window,
+	struct hss_socket_mgr *mgr)
+{
+	struct hss_host_socket *socket;
+	u32 old;
+
+	socket = hss_socket_get(socket_id, mgr);
+	if (!socket)
+		return;
+
+	/* ACKs are handled on several workers and may arrive out of order */
+	do {
+		old = READ_ONCE(socket->rx_window);
+		if (!hss_window_after(window, old))
+			goto put;
+	} while (cmpxchg(&socket->rx_window, old, window) != old);
+
+	if (READ_ONCE(socket->rx_enabled))
+		queue_work(socket->mgr->rx_wq, &socket->rx_work);
+put:
+	hss_socket_put(socket);
+}
+
+/* Checks the max_sockets limit, exact under the managers `lock` */
+static bool hss_socket_mgr_full(struct hss_socket_mgr *mgr)
+{
+	int max = READ_ONCE(hss_max_sockets);
+
+	return max > 0 && READ_ONCE(mgr->nr_sockets) >= max;
+}
+
+/**
+ * hss_socket_create - Creates a sock for a given family and protocol
+ *
+ * @socket_id The socket id to connect
+ * @family The protocol family of the connection
+ * @protocol The protocol to connect with
+ *
+ * Creates a sock for a given family and protocol which can be referneced by
+ * the given sock_id
+ *
+ * Notes: Currently only supports INET and INET6 address families
+ * and TCP and UDP protocols. INET6 datagram sockets are dual-stack.
+ *
+ * Returns: 0 on successor an error code, -EMFILE if the device already has
+ * max_sockets open
+ */
+int hss_socket_create(int socket_id, int family, int type, int protocol,
+	struct hss_socket_mgr *mgr)
+{
+	int ret;
+	struct socket *sock = NULL;
+	struct hss_host_socket *hss_sock;
+
+	/* Prevent overwriting an existing socket */
+	if (hss_socket_exists(socket_id, mgr)) {
+		ret = -EEXIST;
+		goto exit;
+	}
+
+	/* Checked again once the socket goes on the table */
+	if (hss_socket_mgr_full(mgr)) {
+		atomic_inc(&mgr->refused);
+		ret = -EMFILE;
+		goto exit;
+	}
+
+	/* Create the outbound socket */
+	ret = sock_create_kern(&init_net, family, type, protocol,
+		&sock);
+	if (ret)
+		goto exit;
+
+	/* Datagram sockets reach IPv4 too, through IPv4-mapped addresses */
+	if (family == AF_INET6 && type == SOCK_DGRAM)
+		sock->sk->sk_ipv6only = false;
+
+	/* Register the socket on the table */
+	hss_sock = kzalloc(sizeof(struct hss_host_socket), GFP_ATOMIC);
+	if (!hss_sock) {
+		ret = -ENOMEM;
+		sock_release(sock);
+	} else {
+		hss_sock->sock_id = socket_id;
+		hss_sock->sock = sock;
+		kref_init(&hss_sock->ref);
+		hss_sock->mgr = mgr;
+		INIT_WORK(&hss_sock->tx_work, hss_socket_tx_work);
+		mutex_init(&hss_sock->tx_lock);
+		skb_queue_head_init(&hss_sock->tx_queue);
+		INIT_WORK(&hss_sock->rx_work, hss_socket_rx_work);
+		INIT_LIST_HEAD(&hss_sock->rx_stalled);
+		INIT_WORK(&hss_sock->connect_work, hss_socket_connect_work);
+		INIT_DELAYED_WORK(&hss_sock->race_work, hss_socket_race_work);
+		hss_sock->tx_advertised = hss_socket_tx_limit();
+		hss_sock->rx_window = HSS_INITIAL_WINDOW;
+		hss_sock->last_active = jiffies;
+		hss_socket_attach(hss_sock, sock);
+
+		/* The table takes the first reference */
+		idr_preload(GFP_KERNEL);
+		spin_lock(&mgr->lock);
+		if (hss_socket_mgr_full(mgr))
+			ret = -EMFILE;
+		else
+			ret = idr_alloc(&mgr->sockets, hss_sock, socket_id,
+				socket_id + 1, GFP_NOWAIT);
+		if (ret >= 0)
+			mgr->nr_sockets++;
+		spin_unlock(&mgr->lock);
+		idr_preload_end();
+
+		if (ret < 0) {
+			hss_socket_put(hss_sock);
+			if (ret == -EMFILE)
+				atomic_inc(&mgr->refused);
+			else if (ret == -ENOSPC)
+				ret = -EEXIST;
+		} else {
+			ret = 0;
+		}
+	}
+exit:
+	return ret;
+}
+
+/**
+ * hss_socket_unpublish - Takes a socket off its managers table
+ *
+ * @socket The socket, which the caller holds a reference to
+ *
+ * Drops the tables reference unless the device's close or the idle reaper
+ * got there first.
+ *
+ * Returns: True if the socket was still on the table
+ */
+static bool hss_socket_unpublish(struct hss_host_socket *socket)
+{
+	struct hss_socket_mgr *mgr = socket->mgr;
+	bool found;
+
+	spin_lock(&mgr->lock);
+	found = idr_find(&mgr->sockets, socket->sock_id) == socket;
+	if (found) {
+		idr_remove(&mgr->sockets, socket->sock_id);
+		mgr->nr_sockets--;
+	}
+	spin_unlock(&mgr->lock);
+
+	if (found) {
+		WRITE_ONCE(socket->closed, true);
+		hss_socket_put(socket);
+	}
+	return found;
+}
+
+/**
+ * hss_socket_close - Closes a sock
+ *
+ * @socket_id The socket id to close
+ * @mgr The manager the socket is on
+ *
+ * The socket can no longer be found by its ID. It is released once the last
+ * reference from hss_socket_get is dropped, straight away unless something
+ * is using it.
+ */
+void hss_socket_close(int socket_id, struct hss_socket_mgr *mgr)
+{
+	struct hss_host_socket *socket;
+
+	socket = hss_socket_get(socket_id, mgr);
+	if (socket) {
+		hss_socket_unpublish(socket);
+		hss_socket_put(socket);
+	}
+}
+
+/**
+ * hss_socket_idle_work - Closes the sockets of a device that went idle
+ *
+ * @work The managers `idle_work`
+ *
+ * A socket no data moved on for sock_idle_timeout seconds is closed and
+ * passed to the managers `reaped` op so the device hears of it. Runs at
+ * least every HSS_IDLE_SCAN_MAX.
+ */
+static void hss_socket_idle_work(struct work_struct *work)
+{
+	struct hss_socket_mgr *mgr = container_of(to_delayed_work(work),
+		struct hss_socket_mgr, idle_work);
+	struct hss_host_socket *socket;
+	int timeout = READ_ONCE(hss_sock_idle_timeout);
+	unsigned long period = HSS_IDLE_SCAN_MAX;
+	unsigned long idle;
+	int id;
+
+	if (timeout <= 0)
+		goto requeue;
+	idle = (unsigned long)timeout * HZ;
+	period = min(period, max(idle / 4, (unsigned long)HZ));
+
+	/* Closing sleeps, so the walk leaves RCU and picks up at the next ID */
+	rcu_read_lock();
+	idr_for_each_entry(&mgr->sockets, socket, id) {
+		if (time_before(jiffies, READ_ONCE(socket->last_active) +
+			idle) || !kref_get_unless_zero(&socket->ref))
+			continue;
+		rcu_read_unlock();
+
+		if (hss_socket_unpublish(socket)) {
+			atomic_inc(&mgr->reaped);
+			mgr->ops->reaped(id, mgr->context);
+		}
+		hss_socket_put(socket);
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+requeue:
+	schedule_delayed_work(&mgr->idle_work, period);
+}
+
+/**
+ * hss_socket_mgr_stats - Gets what a device's sockets are using
+ *
+ * @mgr The manager of the device's sockets
+ * @stats Filled with the counts
+ */
+void hss_socket_mgr_stats(struct hss_socket_mgr *mgr,
+	struct hss_socket_stats *stats)
+{
+	stats->sockets = READ_ONCE(mgr->nr_sockets);
+	stats->refused = atomic_read(&mgr->refused);
+	stats->reaped = atomic_read(&mgr->reaped);
+	stats->tx_queued = atomic_read(&mgr->tx_queued);
+}
+
+/**
+ * hss_addr_in4 - Assemble an in4 address
+ *
+ * @ip_addr The buffer containing the IPv4 address in network byte order.
+ * @ip_len The length of the address being passed
+ * @port The port to connect to
+ * @addr The in4 address to write to
+ *
+ * Populates an inet4 address
+ *
+ * Returns: 0 on success or an error code
+ */
+static int hss_addr_in4(char *ip_addr, int ip_len, __be16 port,
+	struct sockaddr_in *addr)
+{
+	int ret = -EINVAL;
+
+	if (addr && ip_addr && ip_len == sizeof(struct in_addr)) {
+		addr->sin_family = AF_INET;
+		addr->sin_port = port;
+		memcpy(&addr->sin_addr, ip_addr, ip_len);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * hss_addr_in6 - Assemble an in6 address
+ *
+ * @addrBuf The buffer containing the IPv6 address
+ * @addrLen The length of the address being passed
+ * @port The port to connect to
+ * @flow The flow information
+ * @scope The scope information
+ * @addr The in6 address to write to
+ *
+ * Populates an inet6 address
+ *
+ * Returns: 0 on success or an error code
+ */
+static int hss_addr_in6(char *ip_addr,
+	int ip_len, __be16 port, __be32 flow, __u32 scope,
+	struct sockaddr_in6 *addr)
+{
+	int ret = -EINVAL;
+
+	if (addr && ip_addr && ip_len == sizeof(struct in6_addr)) {
+		addr->sin6_family = AF_INET6;
+		addr->sin6_scope_id = scope;
+		addr->sin6_port = port;
+		addr->sin6_flowinfo = flow;
+		memcpy(&addr->sin6_addr, ip_addr, ip_len);
+		ret = 0;
+	}
+	return ret;
+}
+
+/**
+ * hss_socket_fastopen - Connects with TCP Fast Open
+ *
+ * @socket The socket to connect
+ * @addr The address to connect to
+ * @addr_len The length of @addr
+ * @data The early data
+ * @len The length of @data, more than 0
+ *
+ * The first write carries the address so the stack puts as much of @data in
+ * the SYN as the cached cookie for the remote allows. Without a cookie a
+ * plain SYN asking for one is sent and all of @data waits on `tx_queue` for
+ * the handshake, the next connect to that remote then saves the round trip.
+ *
+ * Returns: -EINPROGRESS if the connect was started, -EOPNOTSUPP if Fast Open
+ * is disabled on the host or an error code.
+ */
+static int hss_socket_fastopen(struct hss_host_socket *socket,
+	struct sockaddr *addr, int addr_len, char *data, int len)
+{
+	struct msghdr msg = {
+		.msg_name = addr,
+		.msg_namelen = addr_len,
+		.msg_flags = MSG_FASTOPEN | MSG_DONTWAIT | MSG_NOSIGNAL,
+	};
+	struct kvec vec = {.iov_base = data, .iov_len = len};
+	int ret;
+
+	mutex_lock(&socket->tx_lock);
+	ret = kernel_sendmsg(socket->sock, &msg, &vec, 1, len);
+	if (ret < 0 && ret != -EINPROGRESS)
+		goto unlock;
+
+	ret = max(ret, 0);
+	socket->tx_done += ret;
+	if (hss_socket_queue(socket, data + ret, len - ret, NULL))
+		pr_err("%s sock %d lost %d bytes of early data\n", __func__,
+			socket->sock_id, len - ret);
+	ret = -EINPROGRESS;
+unlock:
+	mutex_unlock(&socket->tx_lock);
+	return ret;
+}
+
+/**
+ * hss_socket_connect - Starts a non-blocking connect
+ *
+ * @socket The socket to connect
+ * @addr The address to connect to
+ * @addr_len The length of @addr
+ * @data Bytes to send in the SYN with TCP Fast Open, or NULL
+ * @len The length of @data
+ * @cookie Passed to the managers `connected` op
+ *
+ * Early data that can't go with the SYN, or all of it when the socket is not
+ * TCP or the host has Fast Open disabled, is sent once the handshake is done.
+ *
+ * Returns: 0 if the socket connected at once, -EINPROGRESS if the managers
+ * `connected` op will be called with the result or an error code.
+ */
+static int hss_socket_connect(struct hss_host_socket *socket,
+	struct sockaddr *addr, int addr_len, char *data, int len, u32 cookie)
+{
+	int ret = -EOPNOTSUPP;
+
+	/* The handshake may finish before kernel_connect returns */
+	socket->connect_cookie = cookie;
+	atomic_set(&socket->connecting, 1);
+
+	if (data && len > 0 && socket->sock->sk->sk_protocol == IPPROTO_TCP)
+		ret = hss_socket_fastopen(socket, addr, addr_len, data, len);
+
+	if (ret == -EOPNOTSUPP) {
+		ret = kernel_connect(socket->sock, addr, addr_len, O_NONBLOCK);
+		if ((!ret || ret == -EINPROGRESS) && data &&
+			hss_socket_write(socket, data, len) < 0)
+			pr_err("%s sock %d lost %d bytes of early data\n",
+				__func__, socket->sock_id, len);
+	}
+
+	/* If the state callback already took the result it reports it */
+	if (ret != -EINPROGRESS && !atomic_xchg(&socket->connecting, 0))
+		ret = -EINPROGRESS;
+	return ret;
+}
+
+/**
+ * hss_socket_connect_in4 - Connect an existing socket to an INET address
+ *
+ * @socket_id The socket id to connect
+ * @addr The inet address (4 bytes) to connect to, in network byte order
+ * @port The port to connect to in notwork byte order
+ * @data Early data to send with TCP Fast Open, or NULL
+ * @len The length of @data
+ * @cookie Passed to the managers `connected` op
+ *
+ * Connects a managed socket to a given address without blocking.
+ *
+ * Returns: Result from hss_socket_connect
+ */
+int hss_socket_connect_in4(int socket_id, char *ip_addr, int ip_len,
+	__be16 port, char *data, int len, u32 cookie,
+	struct hss_socket_mgr *mgr)
+{
+	struct sockaddr_in addr = {0};
+	struct hss_host_socket *socket;
+	int ret = 0;
+
+	socket = hss_socket_get(socket_id, mgr);
+	if (!socket) {
+		ret = -EEXIST;
+		goto exit;
+	}
+
+	ret = hss_addr_in4(ip_addr, ip_len, port, &addr);
+
+	if (!ret)
+		ret = hss_socket_connect(socket, (struct sockaddr *)&addr,
+			sizeof(struct sockaddr_in), data, len, cookie);
+	hss_socket_put(socket);
+exit:
+	return ret;
+}
+
+/**
+ * hss_socket_connect_in6 - Connect an existing socket to an INET6 address
+ *
+ * @socket_id The socket id to connect
+ * @addr The inet6 address (16 bytes) to connect to, in network byte order
+ * @port The port to connect to in notwork byte order
+ * @data Early data to send with TCP Fast Open, or NULL
+ * @len The length of @data
+ * @cookie Passed to the managers `connected` op
+ *
+ * Connects a managed socket to a given address without blocking.
+ *
+ * Returns: Result from hss_socket_connect
+ */
+int hss_socket_connect_in6(int socket_id, char *ip_addr, int ip_len,
+	__be16 port, __be32 flow, __u32 scope, char *data, int len,
+	u32 cookie, struct hss_socket_mgr *mgr)
+{
+	struct sockaddr_in6 addr = {0};
+	struct hss_host_socket *socket;
+	int ret = 0;
+
+	socket = hss_socket_get(socket_id, mgr);
+	if (!socket) {
+		ret = -EEXIST;
+		goto exit;
+	}
+
+	ret = hss_addr_in6(ip_addr, ip_len, port, flow, scope,
+		&addr);
+	if (!ret)
+		ret = hss_socket_connect(socket, (struct sockaddr *)&addr,
+			sizeof(struct sockaddr_in6), data, len, cookie);
+	hss_socket_put(socket);
+exit:
+	return ret;
+}
+
+/**
+ * hss_socket_apply_opt - Sets an option on a sock
+ *
+ * @sock The sock
+ * @opt The enum hss_sockopt
+ * @val The value
+ *
+ * Returns: 0 on success, -ENOPROTOOPT if the sock has no such option or an
+ * error code
+ */
+static int hss_socket_apply_opt(struct socket *sock, int opt, u32 val)
+{
+	struct sock *sk = sock->sk;
+	int ret;
+
+	if (val > INT_MAX)
+		return -EINVAL;
+
+	if (opt >= HSS_TCP_NODELAY && opt <= HSS_TCP_KEEPCNT &&
+		sk->sk_protocol != IPPROTO_TCP)
+		return -ENOPROTOOPT;
+
+	switch (opt) {
+	case HSS_SO_KEEPALIVE:
+		return hss_sock_setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE,
+			!!val);
+	case HSS_SO_SNDBUF:
+		return hss_sock_setsockopt(sock, SOL_SOCKET, SO_SNDBUF, val);
+	case HSS_SO_RCVBUF:
+		return hss_sock_setsockopt(sock, SOL_SOCKET, SO_RCVBUF, val);
+	case HSS_TCP_NODELAY:
+		return hss_sock_setsockopt(sock, SOL_TCP, TCP_NODELAY, !!val);
+	case HSS_TCP_CORK:
+		return hss_sock_setsockopt(sock, SOL_TCP, TCP_CORK, !!val);
+	case HSS_TCP_KEEPIDLE:
+		return hss_sock_setsockopt(sock, SOL_TCP, TCP_KEEPIDLE, val);
+	case HSS_TCP_KEEPINTVL:
+		return hss_sock_setsockopt(sock, SOL_TCP, TCP_KEEPINTVL, val);
+	case HSS_TCP_KEEPCNT:
+		return hss_sock_setsockopt(sock, SOL_TCP, TCP_KEEPCNT, val);
+	case HSS_IP_TOS:
+		if (sk->sk_family != AF_INET6)
+			return hss_sock_setsockopt(sock, SOL_IP, IP_TOS, val);
+
+		/* A dual-stack sock uses IP_TOS for IPv4 peers */
+		ret = hss_sock_setsockopt(sock, SOL_IPV6, IPV6_TCLASS, val);
+		if (!ret && !sk->sk_ipv6only)
+			ret = hss_sock_setsockopt(sock, SOL_IP, IP_TOS, val);
+		return ret;
+	default:
+		return -ENOPROTOOPT;
+	}
+}
+
+/**
+ * hss_socket_read_opt - Gets an option of a sock
+ *
+ * @sock The sock
+ * @opt The enum hss_sockopt
+ * @val Set to the value as getsockopt would give it
+ *
+ * Returns: 0 on success or -ENOPROTOOPT if the sock has no such option
+ */
+static int hss_socket_read_opt(struct socket *sock, int opt, u32 *val)
+{
+	struct sock *sk = sock->sk;
+	struct tcp_sock *tp = tcp_sk(sk);
+	int ret = 0;
+
+	if (opt >= HSS_TCP_NODELAY && opt <= HSS_TCP_KEEPCNT &&
+		sk->sk_protocol != IPPROTO_TCP)
+		return -ENOPROTOOPT;
+
+	lock_sock(sk);
+	switch (opt) {
+	case HSS_SO_KEEPALIVE:
+		*val = sock_flag(sk, SOCK_KEEPOPEN);
+		break;
+	case HSS_SO_SNDBUF:
+		*val = sk->sk_sndbuf;
+		break;
+	case HSS_SO_RCVBUF:
+		*val = sk->sk_rcvbuf;
+		break;
+	case HSS_TCP_NODELAY:
+		*val = !!(tp->nonagle & TCP_NAGLE_OFF);
+		break;
+	case HSS_TCP_CORK:
+		*val = !!(tp->nonagle & TCP_NAGLE_CORK);
+		break;
+	case HSS_TCP_KEEPIDLE:
+		*val = keepalive_time_when(tp) / HZ;
+		break;
+	case HSS_TCP_KEEPINTVL:
+		*val = keepalive_intvl_when(tp) / HZ;
+		break;
+	case HSS_TCP_KEEPCNT:
+		*val = keepalive_probes(tp);
+		break;
+	case HSS_IP_TOS:
+		*val = sk->sk_family == AF_INET6 ? inet6_sk(sk)->tclass :
+			inet_sk(sk)->tos;
+		break;
+	default:
+		ret = -ENOPROTOOPT;
+		break;
+	}
+	release_sock(sk);
+	return ret;
+}
+
+/**
+ * hss_socket_apply_opts - Sets every option the device set on a new sock
+ *
+ * @socket The socket the sock is for
+ * @sock The sock, not yet connected
+ *
+ * Notes: Caller must hold `tx_lock`.
+ */
+static void hss_socket_apply_opts(struct hss_host_socket *socket,
+	struct socket *sock)
+{
+	int opt;
+
+	for_each_set_bit(opt, &socket->opt_set, HSS_SOCKOPT_NUM)
+		hss_socket_apply_opt(sock, opt, socket->opt_val[opt]);
+}
 
-int hss_socket_mgr_init(struct rhashtable **table)
+/**
+ * hss_socket_race_state_change - sk_state_change callback for race attempts
+ *
+ * @sk The sock of an attempt
+ *
+ * Collects the attempt as soon as its handshake has finished or failed.
+ *
+ * Notes: Called from softirq context.
+ */
+static void hss_socket_race_state_change(struct sock *sk)
 {
-	struct rhashtable *new_table;
-	int ret;
+	struct hss_host_socket *socket;
 
-	new_table = kzalloc(sizeof(struct rhashtable), GFP_KERNEL);
-	/* Init a new hash table */
-	ret = rhashtable_init(new_table, &ht_parms);
-	if (!ret)
-		*table = new_table;
-	else
-		kfree(new_table);
-	return ret;
+	read_lock_bh(&sk->sk_callback_lock);
+	socket = sk->sk_user_data;
+	if (socket && sk->sk_state != TCP_SYN_SENT)
+		mod_delayed_work(socket->mgr->tx_wq, &socket->race_work, 0);
+	read_unlock_bh(&sk->sk_callback_lock);
 }
 
-static void hss_socket_free(struct hss_host_socket *socket)
+/**
+ * hss_socket_race_take - Removes an attempt from a race
+ *
+ * @race The race
+ * @slot The attempt to remove
+ *
+ * Returns: The attempt's sock, with its own callbacks back
+ */
+static struct socket *hss_socket_race_take(struct hss_socket_race *race,
+	int slot)
 {
-	sock_release(socket->sock);
-	kfree(socket);
+	struct socket *sock = race->attempts[slot];
+	struct sock *sk = sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	sk->sk_state_change = race->saved_state_change[slot];
+	write_unlock_bh(&sk->sk_callback_lock);
+
+	race->attempts[slot] = NULL;
+	return sock;
 }
 
 /**
- * hss_socket_mgr_destroy - Deallocate a socket
+ * hss_socket_race_end - Drops a race and any attempts it still has
  *
- * @table The table to search
- * @params The tables parameters
- * @key The key to search the table for
+ * @socket The socket racing, if it is
  *
- * Returns: Number of bytes received or an error code.
+ * Notes: Caller must hold `tx_lock`.
  */
-void hss_socket_mgr_destroy(struct rhashtable *socket_ht)
+static void hss_socket_race_end(struct hss_host_socket *socket)
 {
-	const struct bucket_table *tbl;
-	struct hss_host_socket *sk;
-	struct rhash_head *pos;
+	struct hss_socket_race *race = socket->race;
 	int i;
 
-	rcu_read_lock();
-	tbl = rht_dereference_rcu(socket_ht->tbl, socket_ht);
-	for (i = 0; i < tbl->size; i++) {
-		rht_for_each_entry_rcu(sk, pos, tbl, i, hash) {
-			hss_socket_free(sk);
-		}
-	}
-	rcu_read_unlock();
+	if (!race)
+		return;
 
-	/* Destroy and clear the hash table */
-	rhashtable_destroy(socket_ht);
-	kfree(socket_ht);
+	for (i = 0; i < HSS_RACE_ATTEMPTS; i++)
+		if (race->attempts[i])
+			sock_release(hss_socket_race_take(race, i));
+
+	socket->race = NULL;
+	kfree(race);
 }
 
 /**
- * hss_get_socket - Retrieves a stored socket
+ * hss_socket_race_start - Starts a connect to a races next address
  *
- * @table The table to search
- * @params The tables parameters
- * @key The key to search the table for
+ * @socket The socket racing
+ * @slot The free attempt slot to use
  *
- * Returns: Number of bytes received or an error code.
+ * Each attempt gets a new sock of the addresses family, of the same type
+ * and protocol as the one the socket was created with. An attempt that
+ * fails at once only records its error.
+ *
+ * Notes: Caller must hold `tx_lock`.
  */
-static struct hss_host_socket *hss_get_socket(int *key,
-	struct rhashtable *socket_ht)
+static void hss_socket_race_start(struct hss_host_socket *socket, int slot)
 {
-	return rhashtable_lookup_fast(socket_ht, key, ht_parms);
+	struct hss_socket_race *race = socket->race;
+	union hss_socket_addr *addr = &race->addrs[race->next++];
+	struct sock *orig = socket->sock->sk;
+	struct socket *sock;
+	struct sock *sk;
+	int ret;
+
+	race->next_at = jiffies + race->delay;
+
+	ret = sock_create_kern(sock_net(orig), addr->sa.sa_family,
+		orig->sk_type, orig->sk_protocol, &sock);
+	if (ret)
+		goto fail;
+	hss_socket_apply_opts(socket, sock);
+
+	sk = sock->sk;
+	write_lock_bh(&sk->sk_callback_lock);
+	race->saved_state_change[slot] = sk->sk_state_change;
+	sk->sk_user_data = socket;
+	sk->sk_state_change = hss_socket_race_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+	race->attempts[slot] = sock;
+
+	/* The handshake finishing is picked up by the race work */
+	ret = kernel_connect(sock, &addr->sa, hss_socket_addr_len(addr),
+		O_NONBLOCK);
+	if (ret && ret != -EINPROGRESS) {
+		sock_release(hss_socket_race_take(race, slot));
+		goto fail;
+	}
+	return;
+
+fail:
+	race->error = ret;
 }
 
-int hss_socket_exists(int key, struct rhashtable *socket_ht)
+/**
+ * hss_socket_race_work - Moves a race along
+ *
+ * @work The sockets `race_work`
+ *
+ * Runs when an attempt finishes and when the next address is due. Failed
+ * attempts are dropped and the next address is tried straight away if
+ * nothing else is running, or alongside the others once `delay` has passed.
+ * The first attempt to connect replaces the sock the socket was created with
+ * and the managers `connected` op is called. It is also called with the
+ * last error once every address has failed.
+ */
+static void hss_socket_race_work(struct work_struct *work)
 {
-	return (hss_get_socket(&key, socket_ht) != NULL);
+	struct hss_host_socket *socket = container_of(to_delayed_work(work),
+		struct hss_host_socket, race_work);
+	struct hss_socket_mgr *mgr = socket->mgr;
+	struct hss_socket_race *race;
+	struct socket *winner = NULL;
+	struct socket *old;
+	bool running;
+	int free_slot;
+	int ret = 0;
+	u32 cookie;
+	int i;
+
+	mutex_lock(&socket->tx_lock);
+	race = socket->race;
+	if (!race)
+		goto unlock;
+
+	for (;;) {
+		running = false;
+		free_slot = -1;
+		for (i = 0; i < HSS_RACE_ATTEMPTS; i++) {
+			struct socket *sock = race->attempts[i];
+
+			if (sock && sock->sk->sk_state == TCP_ESTABLISHED) {
+				winner = hss_socket_race_take(race, i);
+				break;
+			} else if (sock && sock->sk->sk_state != TCP_SYN_SENT) {
+				race->error = sock_error(sock->sk) ?:
+					-ECONNREFUSED;
+				sock_release(hss_socket_race_take(race, i));
+			}
+
+			if (race->attempts[i])
+				running = true;
+			else
+				free_slot = i;
+		}
+
+		if (winner || race->next == race->count || free_slot < 0)
+			break;
+
+		/* Wait for the running attempts a little before adding one */
+		if (running && (!race->delay ||
+			time_before(jiffies, race->next_at))) {
+			if (race->delay)
+				mod_delayed_work(mgr->tx_wq, &socket->race_work,
+					race->next_at - jiffies);
+			break;
+		}
+
+		hss_socket_race_start(socket, free_slot);
+	}
+
+	if (!winner && (running || race->next < race->count))
+		goto unlock;
+
+	cookie = race->cookie;
+	ret = winner ? 0 : race->error;
+	hss_socket_race_end(socket);
+
+	if (winner) {
+		old = socket->sock;
+		hss_socket_detach(socket);
+		hss_socket_attach(socket, winner);
+		sock_release(old);
+	}
+	mutex_unlock(&socket->tx_lock);
+
+	mgr->ops->connected(socket, socket->sock_id, cookie, ret,
+		mgr->context);
+
+	if (!ret && !skb_queue_empty(&socket->tx_queue))
+		queue_work(mgr->tx_wq, &socket->tx_work);
+	return;
+
+unlock:
+	mutex_unlock(&socket->tx_lock);
 }
 
 /**
- * hss_socket_create - Creates a sock for a given family and protocol
+ * hss_socket_connect_race - Connects to the first of several addresses
  *
  * @socket_id The socket id to connect
- * @family The protocol family of the connection
- * @protocol The protocol to connect with
- *
- * Creates a sock for a given family and protocol which can be referneced by
- * the given sock_id
+ * @addrs The addresses to try in order, with their ports set
+ * @count The number of @addrs, at most HSS_SOCKET_RACE_MAX
+ * @delay_ms How long an attempt has before the next address is tried
+ *	alongside it, as in RFC 8305. 0 to try one address at a time.
+ * @cookie Passed to the managers `connected` op
  *
- * Notes: Currently only supports INET and INET6 address families
- * and TCP protocols.
+ * The first attempt to finish its handshake is kept, the others are closed.
+ * Attempts use their own socks so the addresses may be of any family.
  *
- * Returns: 0 on successor an error code
+ * Returns: -EINPROGRESS if the managers `connected` op will be called with
+ * the result or an error code.
  */
-int hss_socket_create(int socket_id, int family, int type, int protocol,
-	struct rhashtable *socket_ht)
+int hss_socket_connect_race(int socket_id, union hss_socket_addr *addrs,
+	int count, unsigned int delay_ms, u32 cookie,
+	struct hss_socket_mgr *mgr)
 {
-	int ret;
-	struct socket *sock = NULL;
-	struct hss_host_socket *hss_sock;
+	struct hss_socket_race *race;
+	struct hss_host_socket *socket;
+	int ret = -EINPROGRESS;
 
-	/* Prevent overwriting an existing socket */
-	if (hss_get_socket(&socket_id, socket_ht)) {
-		ret = -EEXIST;
-		goto exit;
-	}
+	if (count <= 0 || count > HSS_SOCKET_RACE_MAX)
+		return -EINVAL;
 
-	/* Create the outbound socket */
-	ret = sock_create_kern(&init_net, family, type, protocol,
-		&sock);
-	if (ret)
-		goto exit;
+	socket = hss_socket_get(socket_id, mgr);
+	if (!socket)
+		return -EEXIST;
 
-	/* Register the socket on the table */
-	hss_sock = kzalloc(sizeof(struct hss_host_socket), GFP_ATOMIC);
-	if (!hss_sock) {
+	race = kzalloc(sizeof(*race), GFP_KERNEL);
+	if (!race) {
 		ret = -ENOMEM;
-		sock_release(sock);
+		goto put;
+	}
+	memcpy(race->addrs, addrs, count * sizeof(*addrs));
+	race->count = count;
+	race->delay = msecs_to_jiffies(delay_ms);
+	race->error = -ECONNREFUSED;
+	race->cookie = cookie;
+
+	mutex_lock(&socket->tx_lock);
+	if (socket->race || atomic_read(&socket->connecting)) {
+		kfree(race);
+		ret = -EALREADY;
 	} else {
-		hss_sock->sock_id = socket_id;
-		hss_sock->sock = sock;
-		rhashtable_lookup_insert_fast(socket_ht,
-			&hss_sock->hash, ht_parms);
-		ret = 0;
+		socket->race = race;
+		mod_delayed_work(socket->mgr->tx_wq, &socket->race_work, 0);
 	}
-exit:
+	mutex_unlock(&socket->tx_lock);
+put:
+	hss_socket_put(socket);
 	return ret;
 }
 
 /**
- * hss_socket_close - Closes a sock
+ * hss_socket_map_addr - Puts an address in the form a sock takes
  *
- * @socket_id The socket id to close
+ * @sk The sock being sent on
+ * @addr The address, an IPv4 one is rewritten as IPv4-mapped IPv6 for a
+ *	dual-stack sock
  */
-void hss_socket_close(int socket_id, struct rhashtable *socket_ht)
+static void hss_socket_map_addr(struct sock *sk, union hss_socket_addr *addr)
 {
-	struct hss_host_socket *socket;
+	struct sockaddr_in in4 = addr->in4;
 
-	/* Close and free the given socket if it can be found */
-	socket = hss_get_socket(&socket_id, socket_ht);
-	if (socket) {
-		rhashtable_remove_fast(socket_ht, &socket->hash, ht_parms);
-		hss_socket_free(socket);
+	if (sk->sk_family != AF_INET6 || in4.sin_family != AF_INET)
+		return;
+
+	memset(&addr->in6, 0, sizeof(addr->in6));
+	addr->in6.sin6_family = AF_INET6;
+	addr->in6.sin6_port = in4.sin_port;
+	ipv6_addr_set_v4mapped(in4.sin_addr.s_addr, &addr->in6.sin6_addr);
+}
+
+/**
+ * hss_socket_send - Sends without blocking, queueing what doesn't fit
+ *
+ * @socket The socket to send on
+ * @addr Where a datagram goes, NULL for a stream or the connected address
+ * @buf The bytes to send
+ * @len The length of @buf
+ *
+ * Returns: @len if sent or queued or an error code
+ */
+static int hss_socket_send(struct hss_host_socket *socket,
+	union hss_socket_addr *addr, void *buf, int len)
+{
+	struct msghdr msg = {.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL};
+	struct kvec vec;
+	int sent = 0;
+	u32 end;
+	int ret;
+
+	if (addr) {
+		hss_socket_map_addr(socket->sock->sk, addr);
+		msg.msg_name = addr;
+		msg.msg_namelen = hss_socket_addr_len(addr);
+	}
+
+	mutex_lock(&socket->tx_lock);
+
+	/* A window already handed out holds even past dev_tx_limit */
+	end = socket->tx_done + socket->tx_queued + len;
+	if (hss_window_after(end, hss_socket_window(socket)) &&
+		hss_window_after(end, socket->tx_advertised)) {
+		ret = -ENOBUFS;
+		goto unlock;
 	}
+	hss_socket_touch(socket);
+
+	/* Only go straight to the socket when nothing is waiting ahead */
+	if (skb_queue_empty(&socket->tx_queue)) {
+		vec.iov_len = len;
+		vec.iov_base = buf;
+		ret = kernel_sendmsg(socket->sock, &msg, &vec, 1, len);
+		if (ret < 0 && ret != -EAGAIN)
+			goto unlock;
+		sent = max(ret, 0);
+		socket->tx_done += sent;
+
+		/* A datagram goes out whole or not at all */
+		if (ret >= 0 && socket->sock->type == SOCK_DGRAM) {
+			ret = len;
+			goto unlock;
+		}
+	}
+
+	ret = hss_socket_queue(socket, (char *)buf + sent, len - sent, addr);
+	if (!ret)
+		ret = len;
+
+unlock:
+	mutex_unlock(&socket->tx_lock);
+	return ret;
 }
 
 /**
- * hss_addr_in4 - Assemble an in4 address
+ * hss_socket_reset - Resets a stream that lost bytes
  *
- * @ip_addr The buffer containing the IPv4 address in network byte order.
- * @ip_len The length of the address being passed
- * @port The port to connect to
- * @addr The in4 address to write to
+ * @socket The socket, which the caller holds a reference to
  *
- * Populates an inet4 address
+ * A stream can't skip over bytes it failed to take, so the connection is
+ * aborted instead. The sock is set to send a RST when it is released, the
+ * socket is closed and the manager's `reset` op tells the device.
+ */
+static void hss_socket_reset(struct hss_host_socket *socket)
+{
+	struct sock *sk;
+
+	/* A race may be about to swap in another sock */
+	mutex_lock(&socket->tx_lock);
+	sk = socket->sock->sk;
+	lock_sock(sk);
+	sock_set_flag(sk, SOCK_LINGER);
+	sk->sk_lingertime = 0;
+	release_sock(sk);
+	mutex_unlock(&socket->tx_lock);
+
+	if (hss_socket_unpublish(socket))
+		socket->mgr->ops->reset(socket->sock_id, socket->mgr->context);
+}
+
+/**
+ * hss_socket_write - Writes to a socket without blocking
  *
- * Returns: 0 on success or an error code
+ * @socket The socket to write to
+ * @buf The buffer to write
+ * @len The length in bytes of the buffer
+ *
+ * Whatever the socket cannot take immediately is copied onto the sockets own
+ * queue and sent from its write space callback, so a remote that stops
+ * reading only holds up its own socket. On a datagram socket @buf is one
+ * datagram to the connected address.
+ *
+ * Returns: Number of bytes accepted or an error code. -ENOBUFS if @buf
+ * goes past the socket's window, which a device using credits never causes.
+ *
+ * Notes:
+ * A stream that fails a write is reset with hss_socket_reset, the bytes are
+ * never dropped with the stream carrying on.
  */
-static int hss_addr_in4(char *ip_addr, int ip_len, __be16 port,
-	struct sockaddr_in *addr)
+int hss_socket_write(struct hss_host_socket *socket, void *buf, int len)
 {
-	int ret = -EINVAL;
+	int ret;
 
-	if (addr && ip_addr && ip_len == sizeof(struct in_addr)) {
-		addr->sin_family = AF_INET;
-		addr->sin_port = port;
-		memcpy(&addr->sin_addr, ip_addr, ip_len);
-		ret = 0;
-	}
+	/* Empty datagrams are still datagrams */
+	if (!len && socket->sock->type == SOCK_STREAM)
+		return 0;
 
+	ret = hss_socket_send(socket, NULL, buf, len);
+	if (ret < 0 && socket->sock->type == SOCK_STREAM)
+		hss_socket_reset(socket);
 	return ret;
 }
 
 /**
- * hss_addr_in6 - Assemble an in6 address
+ * hss_socket_sendto - Sends a datagram to an address without blocking
  *
- * @addrBuf The buffer containing the IPv6 address
- * @addrLen The length of the address being passed
- * @port The port to connect to
- * @flow The flow information
- * @scope The scope information
- * @addr The in6 address to write to
+ * @socket The datagram socket to send on
+ * @addr Where the datagram goes
+ * @buf The datagram
+ * @len The length of @buf
  *
- * Populates an inet6 address
+ * Queues like hss_socket_write if the socket is full. An IPv4 @addr is
+ * reached through a dual-stack IPv6 socket too.
  *
- * Returns: 0 on success or an error code
+ * Returns: @len or an error code
  */
-static int hss_addr_in6(char *ip_addr,
-	int ip_len, __be16 port, __be32 flow, __u32 scope,
-	struct sockaddr_in6 *addr)
+int hss_socket_sendto(struct hss_host_socket *socket,
+	union hss_socket_addr *addr, void *buf, int len)
 {
-	int ret = -EINVAL;
+	if (socket->sock->type != SOCK_DGRAM)
+		return -EOPNOTSUPP;
 
-	if (addr && ip_addr && ip_len == sizeof(struct in6_addr)) {
-		addr->sin6_family = AF_INET6;
-		addr->sin6_scope_id = scope;
-		addr->sin6_port = port;
-		addr->sin6_flowinfo = flow;
-		memcpy(&addr->sin6_addr, ip_addr, ip_len);
-		ret = 0;
+	return hss_socket_send(socket, addr, buf, len);
+}
+
+/**
+ * hss_socket_peek_dgram - Looks at the next datagram on a socket
+ *
+ * @socket The datagram socket to look at
+ * @from Set to where the datagram came from, or to AF_UNSPEC if the socket
+ *	is connected. IPv4-mapped addresses are given as IPv4.
+ *
+ * The datagram is left queued for hss_socket_read, which only takes one
+ * datagram at a time from a datagram socket.
+ *
+ * Returns: The length of the datagram, which may be 0, -EAGAIN if there is
+ * none or an error code. A pending error such as an ICMP port unreachable is
+ * returned, and cleared, as for recvmsg.
+ */
+int hss_socket_peek_dgram(struct hss_host_socket *socket,
+	union hss_socket_addr *from)
+{
+	struct msghdr msg = {.msg_name = from, .msg_namelen = sizeof(*from)};
+	struct kvec vec = {};
+	struct in6_addr in6;
+	int ret;
+
+	memset(from, 0, sizeof(*from));
+	ret = kernel_recvmsg(socket->sock, &msg, &vec, 0, 0,
+		MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+	if (ret < 0)
+		return ret;
+
+	if (socket->sock->sk->sk_state == TCP_ESTABLISHED) {
+		from->sa.sa_family = AF_UNSPEC;
+	} else if (from->sa.sa_family == AF_INET6 &&
+		ipv6_addr_v4mapped(&from->in6.sin6_addr)) {
+		in6 = from->in6.sin6_addr;
+		from->in4.sin_family = AF_INET;
+		from->in4.sin_addr.s_addr = in6.s6_addr32[3];
+		memset(from->in4.sin_zero, 0, sizeof(from->in4.sin_zero));
 	}
 	return ret;
 }
 
 /**
- * hss_socket_connect_in4 - Connect an existing socket to an INET address
+ * hss_socket_type - Gets the type of a socket
  *
- * @socket_id The socket id to connect
- * @addr The inet address (4 bytes) to connect to, in network byte order
- * @port The port to connect to in notwork byte order
- * @flags Flags to pass to kernel_connect
+ * @socket The socket
  *
- * Connects a managed socket to a given address.
+ * Returns: SOCK_STREAM or SOCK_DGRAM
+ */
+int hss_socket_type(struct hss_host_socket *socket)
+{
+	return socket->sock->type;
+}
+
+/**
+ * hss_socket_setsockopt - Sets an option of a socket
  *
- * Returns: Result from hss_socket_connect
+ * @socket_id The socket
+ * @opt The enum hss_sockopt
+ * @val The value, as setsockopt takes it
+ * @result Set to the value the socket ended up with, as getsockopt gives it
+ *
+ * The option is also set on any sock a connect race is trying and on those
+ * it tries later.
+ *
+ * Returns: 0 on success, -ENOPROTOOPT if the socket has no such option or an
+ * error code
  */
-int hss_socket_connect_in4(int socket_id, char *ip_addr, int ip_len,
-	__be16 port, int flags, struct rhashtable *socket_ht)
+int hss_socket_setsockopt(int socket_id, int opt, u32 val, u32 *result,
+	struct hss_socket_mgr *mgr)
 {
-	struct sockaddr_in addr = {0};
 	struct hss_host_socket *socket;
-	int ret = 0;
+	int ret;
+	int i;
 
-	socket = hss_get_socket(&socket_id, socket_ht);
-	if (!socket) {
-		ret = -EEXIST;
-		goto exit;
-	}
+	if (opt < 0 || opt >= HSS_SOCKOPT_NUM)
+		return -ENOPROTOOPT;
 
-	ret = hss_addr_in4(ip_addr, ip_len, port, &addr);
+	socket = hss_socket_get(socket_id, mgr);
+	if (!socket)
+		return -EEXIST;
 
-	if (!ret)
-		ret = kernel_connect(socket->sock, (struct sockaddr *)&addr,
-			sizeof(struct sockaddr_in), flags);
-exit:
+	mutex_lock(&socket->tx_lock);
+	ret = hss_socket_apply_opt(socket->sock, opt, val);
+	if (ret)
+		goto unlock;
+
+	set_bit(opt, &socket->opt_set);
+	socket->opt_val[opt] = val;
+	for (i = 0; socket->race && i < HSS_RACE_ATTEMPTS; i++)
+		if (socket->race->attempts[i])
+			hss_socket_apply_opt(socket->race->attempts[i], opt,
+				val);
+
+	ret = hss_socket_read_opt(socket->sock, opt, result);
+unlock:
+	mutex_unlock(&socket->tx_lock);
+	hss_socket_put(socket);
 	return ret;
 }
 
 /**
- * hss_socket_connect_in6 - Connect an existing socket to an INET6 address
- *
- * @socket_id The socket id to connect
- * @addr The inet6 address (16 bytes) to connect to, in network byte order
- * @port The port to connect to in notwork byte order
- * @flags Flags to pass to kernel_connect
+ * hss_socket_getsockopt - Gets an option of a socket
  *
- * Connects a managed socket to a given address.
+ * @socket_id The socket
+ * @opt The enum hss_sockopt
+ * @val Set to the value as getsockopt gives it
  *
- * Returns: 0 on success or an error code
+ * Returns: 0 on success, -ENOPROTOOPT if the socket has no such option or an
+ * error code
  */
-int hss_socket_connect_in6(int socket_id, char *ip_addr, int ip_len,
-	__be16 port, __be32 flow, __u32 scope, int flags,
-	struct rhashtable *socket_ht)
+int hss_socket_getsockopt(int socket_id, int opt, u32 *val,
+	struct hss_socket_mgr *mgr)
 {
-	struct sockaddr_in6 addr = {0};
 	struct hss_host_socket *socket;
-	int ret = 0;
+	int ret;
 
-	socket = hss_get_socket(&socket_id, socket_ht);
-	if (!socket) {
-		ret = -EEXIST;
-		goto exit;
+	if (opt < 0 || opt >= HSS_SOCKOPT_NUM)
+		return -ENOPROTOOPT;
+
+	socket = hss_socket_get(socket_id, mgr);
+	if (!socket)
+		return -EEXIST;
+
+	/* A race may be swapping in another sock */
+	mutex_lock(&socket->tx_lock);
+	ret = hss_socket_read_opt(socket->sock, opt, val);
+	mutex_unlock(&socket->tx_lock);
+	hss_socket_put(socket);
+	return ret;
+}
+
+struct hss_socket_skb_desc {
+	hss_socket_skb_fn fn;
+	void *arg;
+};
+
+static int hss_socket_read_actor(read_descriptor_t *desc, struct sk_buff *skb,
+	unsigned int offset, size_t len)
+{
+	struct hss_socket_skb_desc *skb_desc = desc->arg.data;
+	int ret;
+
+	ret = skb_desc->fn(skb, offset, min_t(size_t, len, desc->count),
+		skb_desc->arg);
+	if (ret < 0) {
+		desc->error = ret;
+		return 0;
 	}
 
-	ret = hss_addr_in6(ip_addr, ip_len, port, flow, scope,
-		&addr);
-	if (!ret)
-		ret = kernel_connect(socket->sock, (struct sockaddr *)&addr,
-			sizeof(struct in6_addr), flags);
-exit:
+	desc->count -= ret;
 	return ret;
 }
 
 /**
- * hss_socket_write - Writes to a socket
+ * hss_socket_read_skbs - Passes data on a socket's receive queue to a callback
  *
- * @socket_id The socket id to connect
- * @buf The buffer to write
- * @len The length in bytes of the buffer
+ * @socket The socket to read from
+ * @max_len The most bytes to consume
+ * @fn Called for each section of an skb, see hss_socket_skb_fn
+ * @arg Passed to every call of @fn
+ *
+ * Lets the caller hand the received skbs on without copying them out first.
+ * @fn is called under the socket lock, so must not sleep. It may take a
+ * reference to the skb but must not modify it. Never blocks.
  *
- * Returns: Number of bytes transmitted or an error code.
+ * Returns: Number of bytes consumed, 0 at EOF, -EAGAIN if there is nothing to
+ * read, -EOPNOTSUPP if the socket type has no read_sock or an error code.
  */
-int hss_socket_write(int socket_id, void *buf, int len,
-	struct rhashtable *socket_ht)
+int hss_socket_read_skbs(struct hss_host_socket *socket, int max_len,
+	hss_socket_skb_fn fn, void *arg)
 {
-	struct hss_host_socket *socket;
-	int ret = -EEXIST;
-	struct msghdr msg;
-	struct kvec vec;
+	struct hss_socket_skb_desc skb_desc = {.fn = fn, .arg = arg};
+	read_descriptor_t desc = {
+		.arg.data = &skb_desc,
+		.count = max_len,
+	};
+	struct sock *sk;
+	int ret;
 
-	if (!len) {
-		ret = 0;
+	if (!socket->sock->ops->read_sock) {
+		ret = -EOPNOTSUPP;
 		goto exit;
 	}
 
-	socket = hss_get_socket(&socket_id, socket_ht);
-	if (socket) {
-		msg.msg_control = NULL;
-		msg.msg_controllen = 0;
-		msg.msg_flags = 0;
-		vec.iov_len = len;
-		vec.iov_base = buf;
-
-		ret = kernel_sendmsg(socket->sock, &msg, &vec, len, len);
-	}
+	sk = socket->sock->sk;
+	lock_sock(sk);
+	ret = socket->sock->ops->read_sock(sk, &desc, hss_socket_read_actor);
+	if (desc.error)
+		ret = desc.error;
+	else if (ret == 0 && sk->sk_err)
+		ret = sock_error(sk);
+	else if (ret == 0 && !(sk->sk_shutdown & RCV_SHUTDOWN))
+		ret = -EAGAIN;
+	release_sock(sk);
 
+	if (ret > 0)
+		hss_socket_touch(socket);
 exit:
 	return ret;
 }
@@ -329,30 +2088,25 @@ exit:
 /**
  * hss_socket_read - Reads from a socket
  *
- * @socket_id The socket id to connect
+ * @socket The socket to read from
  * @buf The buffer to write
  * @len The length in bytes of the buffer
  * @flags Flags to pass to kernel_recvmsg
  *
  * Returns: Number of bytes received or an error code.
  */
-int hss_socket_read(int socket_id, void *buf, int len, int flags,
-	struct rhashtable *socket_ht)
+int hss_socket_read(struct hss_host_socket *socket, void *buf, int len,
+	int flags)
 {
-	struct hss_host_socket *socket;
 	struct msghdr msg = {};
 	struct kvec vec;
-	int ret = -EEXIST;
+	int ret;
 
-	socket = hss_get_socket(&socket_id, socket_ht);
-	if (socket) {
-		msg.msg_control = NULL;
-		msg.msg_controllen = 0;
-		msg.msg_flags = 0;
-		vec.iov_len = len;
-		vec.iov_base = buf;
+	vec.iov_len = len;
+	vec.iov_base = buf;
 
-		ret = kernel_recvmsg(socket->sock, &msg, &vec, 1, len, 0);
-	}
+	ret = kernel_recvmsg(socket->sock, &msg, &vec, 1, len, flags);
+	if (ret > 0)
+		hss_socket_touch(socket);
 	return ret;
 }
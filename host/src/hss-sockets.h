@@ -6,32 +6,150 @@
 #ifndef __XAPRC00X_SOCKETS_H
 #define __XAPRC00X_SOCKETS_H
 
-int hss_socket_mgr_init(struct rhashtable **table);
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/socket.h>
 
-void hss_socket_mgr_destroy(struct rhashtable *socket_hash_table);
+struct sk_buff;
 
-int hss_socket_create(int socket_id, unsigned short int family, int type,
-	int protocol, struct rhashtable *socket_hash_table);
+/* Most addresses hss_socket_connect_race takes */
+#define HSS_SOCKET_RACE_MAX 8
 
-void hss_socket_close(int socket_id,
-	struct rhashtable *socket_hash_table);
+/* An IPv4 or IPv6 address to connect to */
+union hss_socket_addr {
+	struct sockaddr sa;
+	struct sockaddr_in in4;
+	struct sockaddr_in6 in6;
+};
 
-void hss_socket_shutdown(int socket_id, int dir,
-	struct rhashtable *socket_hash_table);
+/*
+ * A manager holds the sockets of one device. The device names them by the
+ * IDs it gave them, hss_socket_get resolves those to a struct
+ * hss_host_socket once so the data paths are not looking them up again.
+ */
+struct hss_socket_mgr;
+struct hss_host_socket;
+
+/**
+ * struct hss_socket_ops - Socket events passed on by a socket manager
+ *
+ * @readable Called from the rx pool when a started socket has data or
+ *	changed state. Returns >0 to be called again, <0 once the socket should
+ *	no longer be read. @socket stays valid for the call. A socket it can't
+ *	read for now is parked with hss_socket_rx_stall.
+ * @window Called from the tx pool with the new window when a socket's queue
+ *	drains, for sending to the device unasked. May be NULL.
+ * @connected Called from the tx pool when a connect that returned
+ *	-EINPROGRESS finishes, with the cookie given to the connect and 0 or an
+ *	error code. @socket stays valid for the call.
+ * @reaped Called from the idle reaper after it closed a socket the device
+ *	still had open.
+ * @reset Called after a stream was reset because a write to it failed,
+ *	from the context of the write.
+ */
+struct hss_socket_ops {
+	int (*readable)(struct hss_host_socket *socket, int socket_id,
+		void *context);
+	void (*window)(int socket_id, u32 window, void *context);
+	void (*connected)(struct hss_host_socket *socket, int socket_id,
+		u32 cookie, int result, void *context);
+	void (*reaped)(int socket_id, void *context);
+	void (*reset)(int socket_id, void *context);
+};
+
+/**
+ * struct hss_socket_stats - What the sockets of one device are using
+ *
+ * @sockets Sockets open
+ * @refused Sockets the device could not open for the max_sockets limit
+ * @reaped Sockets closed for going sock_idle_timeout without traffic
+ * @tx_queued Bytes waiting on the sockets for their remotes
+ */
+struct hss_socket_stats {
+	int sockets;
+	int refused;
+	int reaped;
+	int tx_queued;
+};
+
+int hss_socket_mgr_init(struct hss_socket_mgr **mgr,
+	const struct hss_socket_ops *ops, void *context, int id);
+
+void hss_socket_mgr_destroy(struct hss_socket_mgr *mgr);
+
+void hss_socket_mgr_stats(struct hss_socket_mgr *mgr,
+	struct hss_socket_stats *stats);
+
+struct hss_host_socket *hss_socket_get(int socket_id,
+	struct hss_socket_mgr *mgr);
+
+void hss_socket_put(struct hss_host_socket *socket);
+
+bool hss_socket_closed(struct hss_host_socket *socket);
+
+int hss_socket_create(int socket_id, int family, int type,
+	int protocol, struct hss_socket_mgr *mgr);
+
+void hss_socket_close(int socket_id, struct hss_socket_mgr *mgr);
 
 int hss_socket_connect_in4(int socket_id, char *addr, int addrlen,
-	__be16 port, int flags, struct rhashtable *socket_hash_table);
+	__be16 port, char *data, int len, u32 cookie,
+	struct hss_socket_mgr *mgr);
 
 int hss_socket_connect_in6(int socket_id, char *addr, int addrlen,
-	__be16 port, __be32 flow, __u32 scope, int flags,
-	struct rhashtable *socket_hash_table);
+	__be16 port, __be32 flow, __u32 scope, char *data, int len,
+	u32 cookie, struct hss_socket_mgr *mgr);
+
+int hss_socket_connect_race(int socket_id, union hss_socket_addr *addrs,
+	int count, unsigned int delay_ms, u32 cookie,
+	struct hss_socket_mgr *mgr);
 
-int hss_socket_write(int socket_id, void *const buf, int len,
-	struct rhashtable *socket_hash_table);
+int hss_socket_setsockopt(int socket_id, int opt, u32 val, u32 *result,
+	struct hss_socket_mgr *mgr);
+
+int hss_socket_getsockopt(int socket_id, int opt, u32 *val,
+	struct hss_socket_mgr *mgr);
+
+void hss_socket_rx_grant(int socket_id, u32 window,
+	struct hss_socket_mgr *mgr);
+
+void hss_socket_rx_resume(struct hss_socket_mgr *mgr);
+
+int hss_socket_exists(int key, struct hss_socket_mgr *mgr);
+
+/* Called with a socket resolved by hss_socket_get or passed to an op */
+
+int hss_socket_write(struct hss_host_socket *socket, void *buf, int len);
+
+int hss_socket_sendto(struct hss_host_socket *socket,
+	union hss_socket_addr *addr, void *buf, int len);
+
+int hss_socket_peek_dgram(struct hss_host_socket *socket,
+	union hss_socket_addr *from);
+
+int hss_socket_type(struct hss_host_socket *socket);
+
+u32 hss_socket_tx_window(struct hss_host_socket *socket);
+
+void hss_socket_start_rx(struct hss_host_socket *socket);
+
+int hss_socket_rx_credit(struct hss_host_socket *socket);
+
+void hss_socket_rx_spend(struct hss_host_socket *socket, int len);
+
+void hss_socket_rx_stall(struct hss_host_socket *socket);
+
+/*
+ * Called for each skb section taken off a socket's receive queue with
+ * hss_socket_read_skbs. Returns the bytes it consumed or an error code.
+ */
+typedef int (*hss_socket_skb_fn)(struct sk_buff *skb, unsigned int offset,
+	size_t len, void *arg);
 
-int hss_socket_read(int socket_id, void *buf, int size, int flags,
-	struct rhashtable *socket_hash_table);
+int hss_socket_read_skbs(struct hss_host_socket *socket, int max_len,
+	hss_socket_skb_fn fn, void *arg);
 
-int hss_socket_exists(int key, struct rhashtable *socket_hash_table);
+int hss_socket_read(struct hss_host_socket *socket, void *buf, int size,
+	int flags);
 
 #endif /* __XAPRC00X_SOCKETS_H */
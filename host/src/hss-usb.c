@@ -6,19 +6,25 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/bitmap.h>
 #include <linux/errno.h>
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/scatterlist.h>
+#include <linux/skbuff.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/usb/cdc.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 
 #include "hss-usb.h"
 #include "hss-backports.h"
 #include "hss-proxy.h"
+#include "hss-resolver.h"
 #include "hss.h"
 
 /* Match on vendor ID, interface class and interface subclass only. */
@@ -32,26 +38,89 @@ static const struct usb_device_id hss_device_table[] = {
 };
 MODULE_DEVICE_TABLE(usb, hss_device_table);
 
+/* Largest transfer offered to the device, it may pick something smaller */
+static int hss_max_transfer = HSS_MAX_TRANSFER;
+module_param_named(max_transfer, hss_max_transfer, int, 0444);
+MODULE_PARM_DESC(max_transfer,
+	"Largest USB transfer offered to devices in bytes (default 65536)");
+
+/* Optional protocol features this driver implements */
+#define HSS_FEATURES_SUPPORTED \
+	(HSS_FEATURE_CREDITS | HSS_FEATURE_CUMULATIVE_ACK | \
+	HSS_FEATURE_INBAND_CMD | HSS_FEATURE_OPEN_CONNECT | \
+	HSS_FEATURE_CONNECT_NAME | HSS_FEATURE_DGRAM | HSS_FEATURE_SOCKOPT)
+
+/* Commands can share the bulk pipes when the device supports it */
+static bool hss_inband_cmds = true;
+module_param_named(inband_cmds, hss_inband_cmds, bool, 0444);
+MODULE_PARM_DESC(inband_cmds,
+	"Send commands in the bulk streams if the device can (default Y)");
+
+/* Initial value of each device's tcp_fastopen attribute */
+static bool hss_tcp_fastopen;
+module_param_named(tcp_fastopen, hss_tcp_fastopen, bool, 0444);
+MODULE_PARM_DESC(tcp_fastopen,
+	"Send device early data with TCP Fast Open by default (default N)");
+
+/* Bulk-in URBs each device keeps posted to the host controller */
+static int hss_rx_urbs = 4;
+module_param_named(rx_urbs, hss_rx_urbs, int, 0444);
+MODULE_PARM_DESC(rx_urbs, "Bulk-in URBs posted for each device (default 4)");
+
+/* Bulk-out URBs each device can have in flight at once */
+static int hss_tx_urbs = 8;
+module_param_named(tx_urbs, hss_tx_urbs, int, 0444);
+MODULE_PARM_DESC(tx_urbs, "Bulk-out URBs in flight for each device (default 8)");
+
+/* Interrupt-out URBs each device can have in flight at once */
+static int hss_cmd_urbs = 16;
+module_param_named(cmd_urbs, hss_cmd_urbs, int, 0444);
+MODULE_PARM_DESC(cmd_urbs,
+	"Command URBs in flight for each device (default 16)");
+
+/* How long a bulk-in URB the controller refused waits to be submitted again */
+#define HSS_BULK_IN_RETRY (HZ / 10)
+
 /* Structure to hold all of our device specific stuff */
 struct usb_hss {
 	struct usb_device	*udev;
 	struct usb_interface	*interface;
-	struct semaphore	int_out_sem;
 	struct semaphore	bulk_out_sem;
+	spinlock_t		bulk_in_lock;
+	bool			bulk_in_stopped;
+	struct usb_anchor	bulk_in_submitted;
+	struct usb_anchor	bulk_in_parked;
+	atomic_t		bulk_in_stalls;
+	struct delayed_work	bulk_in_retry;
+	struct urb		**bulk_in_urbs;
+	struct scatterlist	*bulk_in_sg;
+	int			bulk_in_count;
+	int			bulk_in_chunk;
+	int			bulk_in_nents;
+	struct usb_anchor	bulk_out_idle;
+	struct usb_anchor	bulk_out_submitted;
+	wait_queue_head_t	bulk_out_wait;
+	struct urb		**bulk_out_urbs;
+	int			bulk_out_count;
+	unsigned long		*cmd_out_busy;
+	struct urb		**cmd_out_urbs;
+	int			cmd_out_count;
+	char			*cmd_out_buffers;
+	dma_addr_t		cmd_out_dma;
+	struct usb_anchor	cmd_out_submitted;
+	wait_queue_head_t	cmd_out_wait;
+	atomic_t		cmd_out_errors;
 	__u8			bulk_in_endpointAddr;
 	__u8			bulk_out_endpointAddr;
 	__u8			cmd_in_endpointAddr;
 	__u8			cmd_out_endpointAddr;
 	int			cmd_interval;
+	int			max_transfer;
+	u32			features;
+	bool			tcp_fastopen;
 	struct kref		kref;
 	char			*cmd_in_buffer;
-	char			*cmd_out_buffer;
-	char			*bulk_in_buffer;
-	char			*bulk_out_buffer;
 	struct urb		*cmd_in_urb;
-	struct urb		*cmd_out_urb;
-	struct urb		*bulk_in_urb;
-	struct urb		*bulk_out_urb;
 	void			*proxy_context;
 };
 
@@ -59,19 +128,373 @@ struct usb_hss {
 
 /* Forward declarations */
 static int hss_read_cmd(struct usb_hss *dev);
+static int hss_submit_bulk_in(struct usb_hss *dev, struct urb *urb);
+static void hss_bulk_in_retry(struct work_struct *work);
+static void hss_write_bulk_callback(struct urb *urb);
+static void hss_cmd_out_callback(struct urb *urb);
 
 /********************************************************************
  * USB Driver Operations
  ********************************************************************/
 
+/**
+ * hss_alloc_bulk_in_pool - Allocates the bulk-in URBs
+ *
+ * @dev The HSS device
+ *
+ * The URBs have no buffer of their own, each submission is filled with the
+ * next read cache slot. Each URB keeps a scatterlist for its slot in
+ * `urb->sg`. When the host controller can gather, slots only need to be
+ * contiguous a page at a time, which keeps the read cache out of high order
+ * allocations.
+ *
+ * Returns: 0 on success or -ENOMEM
+ *
+ * Notes:
+ * Anything allocated before a failure is released by hss_free_bulk_in_pool.
+ */
+static int hss_alloc_bulk_in_pool(struct usb_hss *dev)
+{
+	int i;
+
+	dev->bulk_in_chunk = dev->max_transfer;
+	if (dev->max_transfer > PAGE_SIZE &&
+		dev->udev->bus->sg_tablesize >= dev->max_transfer >> PAGE_SHIFT)
+		dev->bulk_in_chunk = PAGE_SIZE;
+	dev->bulk_in_nents = dev->max_transfer / dev->bulk_in_chunk;
+
+	dev->bulk_in_count = max(hss_rx_urbs, 1);
+	dev->bulk_in_urbs = kcalloc(dev->bulk_in_count,
+		sizeof(*dev->bulk_in_urbs), GFP_KERNEL);
+	if (!dev->bulk_in_urbs)
+		return -ENOMEM;
+
+	dev->bulk_in_sg = kcalloc(dev->bulk_in_count * dev->bulk_in_nents,
+		sizeof(*dev->bulk_in_sg), GFP_KERNEL);
+	if (!dev->bulk_in_sg)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->bulk_in_count; i++) {
+		dev->bulk_in_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!dev->bulk_in_urbs[i])
+			return -ENOMEM;
+		dev->bulk_in_urbs[i]->sg =
+			&dev->bulk_in_sg[i * dev->bulk_in_nents];
+	}
+
+	return 0;
+}
+
+/**
+ * hss_free_bulk_in_pool - Frees the bulk-in URBs
+ *
+ * @dev The HSS device
+ *
+ * Notes:
+ * No bulk-in URB may be in flight.
+ */
+static void hss_free_bulk_in_pool(struct usb_hss *dev)
+{
+	int i;
+
+	if (!dev->bulk_in_urbs)
+		return;
+
+	usb_scuttle_anchored_urbs(&dev->bulk_in_parked);
+
+	/* usb_free_urb ignores NULL */
+	for (i = 0; i < dev->bulk_in_count; i++)
+		usb_free_urb(dev->bulk_in_urbs[i]);
+
+	kfree(dev->bulk_in_urbs);
+	kfree(dev->bulk_in_sg);
+	dev->bulk_in_urbs = NULL;
+	dev->bulk_in_sg = NULL;
+}
+
+/**
+ * hss_alloc_bulk_out_pool - Allocates the bulk-out URBs and their buffers
+ *
+ * @dev The HSS device
+ *
+ * Every URB starts out idle, anchored on `bulk_out_idle`.
+ *
+ * Returns: 0 on success or -ENOMEM
+ *
+ * Notes:
+ * Anything allocated before a failure is released by hss_free_bulk_out_pool.
+ */
+static int hss_alloc_bulk_out_pool(struct usb_hss *dev)
+{
+	struct urb *urb;
+	int i;
+
+	dev->bulk_out_count = max(hss_tx_urbs, 1);
+	dev->bulk_out_urbs = kcalloc(dev->bulk_out_count,
+		sizeof(*dev->bulk_out_urbs), GFP_KERNEL);
+	if (!dev->bulk_out_urbs)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->bulk_out_count; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			return -ENOMEM;
+		dev->bulk_out_urbs[i] = urb;
+
+		urb->transfer_buffer = usb_alloc_coherent(dev->udev,
+			dev->max_transfer, GFP_KERNEL,
+			&urb->transfer_dma);
+		if (!urb->transfer_buffer)
+			return -ENOMEM;
+
+		usb_fill_bulk_urb(urb,
+			dev->udev,
+			usb_sndbulkpipe(dev->udev,
+				dev->bulk_out_endpointAddr),
+			urb->transfer_buffer,
+			dev->max_transfer,
+			hss_write_bulk_callback,
+			dev);
+		/*
+		 * The device's OUT request is HSS_MAX_TRANSFER long, only a short
+		 * packet or ZLP completes it before that fills
+		 */
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP | URB_ZERO_PACKET;
+
+		usb_anchor_urb(urb, &dev->bulk_out_idle);
+	}
+
+	return 0;
+}
+
+/**
+ * hss_free_bulk_out_pool - Frees the bulk-out URBs and their buffers
+ *
+ * @dev The HSS device
+ *
+ * Notes:
+ * No bulk-out URB may be in flight.
+ */
+static void hss_free_bulk_out_pool(struct usb_hss *dev)
+{
+	struct urb *urb;
+	int i;
+
+	if (!dev->bulk_out_urbs)
+		return;
+
+	usb_scuttle_anchored_urbs(&dev->bulk_out_idle);
+
+	for (i = 0; i < dev->bulk_out_count; i++) {
+		urb = dev->bulk_out_urbs[i];
+		if (!urb)
+			continue;
+
+		if (urb->transfer_buffer)
+			usb_free_coherent(dev->udev,
+				dev->max_transfer,
+				urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+	}
+
+	kfree(dev->bulk_out_urbs);
+	dev->bulk_out_urbs = NULL;
+}
+
+/**
+ * hss_alloc_cmd_out_pool - Allocates the command URBs and their buffers
+ *
+ * @dev The HSS device
+ *
+ * Every URB gets a fixed HSS_CMD_MAX_LEN slice of one coherent buffer. Bit i
+ * of `cmd_out_busy` is set while URB i is handed out or in flight.
+ *
+ * Returns: 0 on success or -ENOMEM
+ *
+ * Notes:
+ * Anything allocated before a failure is released by hss_free_cmd_out_pool.
+ */
+static int hss_alloc_cmd_out_pool(struct usb_hss *dev)
+{
+	struct urb *urb;
+	int i;
+
+	dev->cmd_out_count = max(hss_cmd_urbs, 1);
+	dev->cmd_out_urbs = kcalloc(dev->cmd_out_count,
+		sizeof(*dev->cmd_out_urbs), GFP_KERNEL);
+	dev->cmd_out_busy = bitmap_zalloc(dev->cmd_out_count, GFP_KERNEL);
+	if (!dev->cmd_out_urbs || !dev->cmd_out_busy)
+		return -ENOMEM;
+
+	dev->cmd_out_buffers = usb_alloc_coherent(dev->udev,
+		dev->cmd_out_count * HSS_CMD_MAX_LEN, GFP_KERNEL,
+		&dev->cmd_out_dma);
+	if (!dev->cmd_out_buffers)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->cmd_out_count; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			return -ENOMEM;
+		dev->cmd_out_urbs[i] = urb;
+
+		usb_fill_int_urb(urb,
+			dev->udev,
+			usb_sndintpipe(dev->udev,
+				dev->cmd_out_endpointAddr),
+			dev->cmd_out_buffers + i * HSS_CMD_MAX_LEN,
+			HSS_CMD_MAX_LEN,
+			hss_cmd_out_callback,
+			dev,
+			dev->cmd_interval);
+		urb->transfer_dma = dev->cmd_out_dma + i * HSS_CMD_MAX_LEN;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+
+	return 0;
+}
+
+/**
+ * hss_free_cmd_out_pool - Frees the command URBs and their buffers
+ *
+ * @dev The HSS device
+ *
+ * Notes:
+ * No command URB may be in flight.
+ */
+static void hss_free_cmd_out_pool(struct usb_hss *dev)
+{
+	int i;
+
+	if (dev->cmd_out_urbs)
+		for (i = 0; i < dev->cmd_out_count; i++)
+			usb_free_urb(dev->cmd_out_urbs[i]);
+
+	if (dev->cmd_out_buffers)
+		usb_free_coherent(dev->udev,
+			dev->cmd_out_count * HSS_CMD_MAX_LEN,
+			dev->cmd_out_buffers, dev->cmd_out_dma);
+
+	bitmap_free(dev->cmd_out_busy);
+	kfree(dev->cmd_out_urbs);
+	dev->cmd_out_urbs = NULL;
+	dev->cmd_out_buffers = NULL;
+	dev->cmd_out_busy = NULL;
+}
+
 static void hss_driver_delete(struct kref *kref)
 {
 	struct usb_hss *dev = to_hss_dev(kref);
 
+	hss_free_bulk_in_pool(dev);
+	hss_free_bulk_out_pool(dev);
+	hss_free_cmd_out_pool(dev);
 	usb_put_dev(dev->udev);
 	kfree(dev);
 }
 
+/********************************************************************
+ * Sysfs Attributes
+ ********************************************************************/
+
+/* Number of times a bulk-in URB was parked because the read cache was full */
+static ssize_t rx_stalls_show(struct device *d,
+	struct device_attribute *attr, char *buf)
+{
+	struct usb_hss *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n", atomic_read(&dev->bulk_in_stalls));
+}
+static DEVICE_ATTR_RO(rx_stalls);
+
+/* Number of command transfers that could not be submitted or failed */
+static ssize_t cmd_errors_show(struct device *d,
+	struct device_attribute *attr, char *buf)
+{
+	struct usb_hss *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n", atomic_read(&dev->cmd_out_errors));
+}
+static DEVICE_ATTR_RO(cmd_errors);
+
+/* Number of command transfers handed out or in flight right now */
+static ssize_t cmd_inflight_show(struct device *d,
+	struct device_attribute *attr, char *buf)
+{
+	struct usb_hss *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n",
+		bitmap_weight(dev->cmd_out_busy, dev->cmd_out_count));
+}
+static DEVICE_ATTR_RO(cmd_inflight);
+
+/*
+ * Whether early data from OPEN_CONNECT is sent in the SYN. The host stack
+ * caches the Fast Open cookies and needs the client bit of the
+ * net.ipv4.tcp_fastopen sysctl, without it connects fall back to the plain
+ * handshake.
+ */
+static ssize_t tcp_fastopen_show(struct device *d,
+	struct device_attribute *attr, char *buf)
+{
+	struct usb_hss *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n", READ_ONCE(dev->tcp_fastopen));
+}
+
+static ssize_t tcp_fastopen_store(struct device *d,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_hss *dev = usb_get_intfdata(to_usb_interface(d));
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(dev->tcp_fastopen, enable);
+	return count;
+}
+static DEVICE_ATTR_RW(tcp_fastopen);
+
+/*
+ * What the device's host sockets are using, see struct hss_socket_stats. The
+ * attributes only exist while the proxy does.
+ */
+#define HSS_SOCKET_STAT_ATTR(_name, _field) \
+static ssize_t _name##_show(struct device *d, \
+	struct device_attribute *attr, char *buf) \
+{ \
+	struct usb_hss *dev = usb_get_intfdata(to_usb_interface(d)); \
+	struct hss_socket_stats stats; \
+	\
+	hss_proxy_socket_stats(dev->proxy_context, &stats); \
+	return sprintf(buf, "%d\n", stats._field); \
+} \
+static DEVICE_ATTR_RO(_name)
+
+HSS_SOCKET_STAT_ATTR(sockets, sockets);
+HSS_SOCKET_STAT_ATTR(sockets_refused, refused);
+HSS_SOCKET_STAT_ATTR(sockets_reaped, reaped);
+HSS_SOCKET_STAT_ATTR(tx_queued, tx_queued);
+
+static struct attribute *hss_attrs[] = {
+	&dev_attr_rx_stalls.attr,
+	&dev_attr_cmd_errors.attr,
+	&dev_attr_cmd_inflight.attr,
+	&dev_attr_tcp_fastopen.attr,
+	&dev_attr_sockets.attr,
+	&dev_attr_sockets_refused.attr,
+	&dev_attr_sockets_reaped.attr,
+	&dev_attr_tx_queued.attr,
+	NULL,
+};
+
+static const struct attribute_group hss_attr_group = {
+	.attrs = hss_attrs,
+};
+
 /**
  * hss_assign_endpoints - Find common bulk and int endpoints
  *
@@ -110,6 +533,146 @@ static int hss_assign_endpoints(struct usb_hss *dev)
 	return error;
 }
 
+/**
+ * hss_negotiate_config - Agrees on transfer parameters with the device
+ *
+ * @dev The device to configure
+ *
+ * Offers the device the largest transfer this driver was loaded with and
+ * stores the size it answers with. Of the features the device offers, those
+ * this driver also implements are enabled with HSS_USB_REQ_SET_FEATURES.
+ * Devices that don't know HSS_USB_REQ_CONFIG stall it and are run with
+ * HSS_MIN_TRANSFER and no features.
+ */
+static void hss_negotiate_config(struct usb_hss *dev)
+{
+	struct hss_usb_config *config;
+	u32 features;
+	int offer;
+	int agreed;
+	int ret;
+
+	dev->max_transfer = HSS_MIN_TRANSFER;
+	dev->features = 0;
+
+	offer = rounddown_pow_of_two(clamp(hss_max_transfer,
+		HSS_MIN_TRANSFER, HSS_MAX_TRANSFER));
+
+	/* Control transfer buffers must be DMA-able */
+	config = kzalloc(sizeof(*config), GFP_KERNEL);
+	if (!config)
+		return;
+
+	ret = usb_control_msg(dev->udev,
+		usb_rcvctrlpipe(dev->udev, 0),
+		HSS_USB_REQ_CONFIG,
+		USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
+		offer / 1024,
+		dev->interface->cur_altsetting->desc.bInterfaceNumber,
+		config,
+		sizeof(*config),
+		USB_CTRL_GET_TIMEOUT);
+	if (ret != sizeof(*config)) {
+		dev_info(&dev->interface->dev,
+			"No transfer config from device (%d), using %d bytes",
+			ret, dev->max_transfer);
+		goto free_config;
+	}
+
+	agreed = le32_to_cpu(config->max_transfer);
+	if (is_power_of_2(agreed) && agreed >= HSS_MIN_TRANSFER &&
+		agreed <= offer)
+		dev->max_transfer = agreed;
+
+	features = le32_to_cpu(config->features) & HSS_FEATURES_SUPPORTED;
+	if (!hss_inband_cmds)
+		features &= ~HSS_FEATURE_INBAND_CMD;
+	/* Names can only be resolved with the kernel DNS resolver */
+	if (!IS_ENABLED(CONFIG_DNS_RESOLVER))
+		features &= ~HSS_FEATURE_CONNECT_NAME;
+	if (!HSS_HAVE_SETSOCKOPT)
+		features &= ~HSS_FEATURE_SOCKOPT;
+	ret = usb_control_msg(dev->udev,
+		usb_sndctrlpipe(dev->udev, 0),
+		HSS_USB_REQ_SET_FEATURES,
+		USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
+		features,
+		dev->interface->cur_altsetting->desc.bInterfaceNumber,
+		NULL,
+		0,
+		USB_CTRL_SET_TIMEOUT);
+	if (ret < 0)
+		dev_warn(&dev->interface->dev,
+			"Device refused features 0x%x (%d)", features, ret);
+	else
+		dev->features = features;
+
+	dev_info(&dev->interface->dev, "Transfer size %d features 0x%x",
+		dev->max_transfer, dev->features);
+
+free_config:
+	kfree(config);
+}
+
+/**
+ * hss_get_max_transfer - Gets the transfer size agreed with the device
+ *
+ * @context The HSS device
+ *
+ * Returns: The largest transfer, and so HSS packet, either side may send.
+ * Always a power of 2.
+ */
+int hss_get_max_transfer(void *context)
+{
+	struct usb_hss *dev = context;
+
+	return dev->max_transfer;
+}
+
+/**
+ * hss_get_bulk_in_chunk - Gets how much of a read cache slot must be
+ * physically contiguous
+ *
+ * @context The HSS device
+ *
+ * Returns: PAGE_SIZE if the host controller can gather a bulk-in transfer
+ * from single pages, otherwise the transfer size
+ */
+int hss_get_bulk_in_chunk(void *context)
+{
+	struct usb_hss *dev = context;
+
+	return dev->bulk_in_chunk;
+}
+
+/**
+ * hss_get_features - Gets the optional features enabled on the device
+ *
+ * @context The HSS device
+ *
+ * Returns: A bitmap of HSS_FEATURE_* flags both sides have agreed to use
+ */
+u32 hss_get_features(void *context)
+{
+	struct usb_hss *dev = context;
+
+	return dev->features;
+}
+
+/**
+ * hss_get_tcp_fastopen - Gets whether early data uses TCP Fast Open
+ *
+ * @context The HSS device
+ *
+ * Returns: The device's tcp_fastopen attribute, which may change at any time
+ */
+bool hss_get_tcp_fastopen(void *context)
+{
+	struct usb_hss *dev = context;
+
+	return READ_ONCE(dev->tcp_fastopen);
+}
+
 /**
  * Probe function called when device with correct vendor / productid is found
  */
@@ -129,11 +692,25 @@ static int hss_driver_probe(struct usb_interface *interface,
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = interface;
 
+	spin_lock_init(&dev->bulk_in_lock);
+	init_usb_anchor(&dev->bulk_in_submitted);
+	init_usb_anchor(&dev->bulk_in_parked);
+	INIT_DELAYED_WORK(&dev->bulk_in_retry, hss_bulk_in_retry);
+	init_usb_anchor(&dev->bulk_out_idle);
+	init_usb_anchor(&dev->bulk_out_submitted);
+	init_waitqueue_head(&dev->bulk_out_wait);
+	init_usb_anchor(&dev->cmd_out_submitted);
+	init_waitqueue_head(&dev->cmd_out_wait);
+	atomic_set(&dev->cmd_out_errors, 0);
+
 	/* Set up the bulk and interrupt endpoints */
 	retval = hss_assign_endpoints(dev);
 	if (retval)
 		goto error;
 
+	/* Every transfer buffer below is sized from this */
+	hss_negotiate_config(dev);
+
 	dev->cmd_in_urb = usb_alloc_urb(0, GFP_KERNEL);
 	if (!dev->cmd_in_urb) {
 		retval = -ENOMEM;
@@ -141,24 +718,15 @@ static int hss_driver_probe(struct usb_interface *interface,
 		goto error;
 	}
 
-	dev->cmd_out_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!dev->cmd_out_urb) {
-		retval = -ENOMEM;
-		dev_err(&dev->interface->dev, "Error for cmd_out_urb");
+	retval = hss_alloc_cmd_out_pool(dev);
+	if (retval) {
+		dev_err(&dev->interface->dev, "Error for cmd_out_urbs");
 		goto error_free_in_urb;
 	}
 
-	dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!dev->bulk_in_urb) {
-		retval = -ENOMEM;
-		dev_err(&dev->interface->dev, "Error for bulk_in_urb");
-		goto error;
-	}
-
-	dev->bulk_out_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!dev->bulk_out_urb) {
-		retval = -ENOMEM;
-		dev_err(&dev->interface->dev, "Error for bulk_out_urb");
+	retval = hss_alloc_bulk_in_pool(dev);
+	if (retval) {
+		dev_err(&dev->interface->dev, "Error for bulk_in_urbs");
 		goto error_free_in_urb;
 	}
 
@@ -167,65 +735,51 @@ static int hss_driver_probe(struct usb_interface *interface,
 		&dev->cmd_in_urb->transfer_dma);
 	if (!dev->cmd_in_buffer) {
 		retval = -ENOMEM;
-		goto error_free_out_urb;
+		goto error_free_in_urb;
 	}
 
-	dev->cmd_out_buffer = usb_alloc_coherent(dev->udev,
-		sizeof(struct hss_packet), GFP_KERNEL,
-		&dev->cmd_out_urb->transfer_dma);
-	if (!dev->cmd_out_buffer) {
-		retval = -ENOMEM;
+	retval = hss_alloc_bulk_out_pool(dev);
+	if (retval) {
+		dev_err(&dev->interface->dev, "Error for bulk_out_urbs");
 		goto error_free_in_buf;
 	}
 
-	dev->bulk_in_buffer = usb_alloc_coherent(dev->udev,
-		XAPRC00X_BULK_IN_BUF_SIZE,
-		GFP_KERNEL, &dev->bulk_in_urb->transfer_dma);
-	if (!dev->bulk_in_buffer) {
-		retval = -ENOMEM;
-		goto error_free_in_buf;
-	}
+	atomic_set(&dev->bulk_in_stalls, 0);
+	dev->tcp_fastopen = hss_tcp_fastopen;
 
-	dev->bulk_out_buffer = usb_alloc_coherent(dev->udev,
-		XAPRC00X_BULK_OUT_BUF_SIZE,
-		GFP_KERNEL, &dev->bulk_out_urb->transfer_dma);
-	if (!dev->bulk_out_buffer) {
-		retval = -ENOMEM;
+	/* Initialize the host proxy and hold on to its instance */
+	dev->proxy_context = hss_proxy_init(dev);
+	if (!dev->proxy_context) {
+		retval = -ENODEV;
 		goto error_free_in_buf;
 	}
 
-	/* Zero fill the out buffer */
-	memset(dev->cmd_out_buffer, 0, sizeof(struct hss_packet) + 64);
+	sema_init(&dev->bulk_out_sem, 1);
 
 	/* Tell the USB interface where our device data is located */
 	usb_set_intfdata(interface, dev);
 
-	/* let the user know what node this device is now attached to */
-	dev_info(&interface->dev, "HSS Driver now attached.");
-
-	/* Initialize the host proxy and hold on to its instance */
-	dev->proxy_context = hss_proxy_init(dev);
-	if (!dev->proxy_context) {
-		retval = -ENODEV;
-		goto error_free_out_buf;
+	/* The attributes read the proxy, only publish them once it is up */
+	retval = sysfs_create_group(&interface->dev.kobj, &hss_attr_group);
+	if (retval) {
+		dev_err(&interface->dev, "Could not create sysfs attributes");
+		goto error_destroy_proxy;
 	}
 
-	sema_init(&dev->int_out_sem, 1);
-	sema_init(&dev->bulk_out_sem, 1);
+	/* let the user know what node this device is now attached to */
+	dev_info(&interface->dev, "HSS Driver now attached.");
 
 	/* Start listening for commands */
 	hss_read_cmd(dev);
 
 	return 0;
 
-error_free_out_buf:
-	usb_free_coherent(dev->udev, sizeof(struct hss_packet),
-		dev->cmd_out_buffer, dev->cmd_out_urb->transfer_dma);
+error_destroy_proxy:
+	usb_set_intfdata(interface, NULL);
+	hss_proxy_destroy(dev->proxy_context);
 error_free_in_buf:
 	usb_free_coherent(dev->udev, sizeof(struct hss_packet),
 		dev->cmd_in_buffer, dev->cmd_in_urb->transfer_dma);
-error_free_out_urb:
-	usb_free_urb(dev->cmd_out_urb);
 error_free_in_urb:
 	usb_free_urb(dev->cmd_in_urb);
 error:
@@ -241,20 +795,18 @@ static void hss_read_cmd_callback(struct urb *urb)
 	if (urb->status == 0) {
 		hss_proxy_rcv_cmd(dev->cmd_in_buffer,
 			urb->actual_length, dev->proxy_context);
-		usb_submit_urb(urb, GFP_KERNEL);
+		usb_submit_urb(urb, GFP_ATOMIC);
 	}
 }
 
 static void hss_read_bulk_callback(struct urb *urb)
 {
 	struct usb_hss *dev = urb->context;
+	int len = urb->actual_length;
 
 	switch (urb->status) {
 	/* Success */
 	case 0:
-		hss_proxy_rcv_data(dev->bulk_in_buffer,
-			urb->actual_length, dev->proxy_context);
-		usb_submit_urb(urb, GFP_KERNEL);
 		break;
 	/* Unrecoverable errors */
 	case -ECONNRESET:
@@ -263,19 +815,150 @@ static void hss_read_bulk_callback(struct urb *urb)
 		dev_err(&dev->interface->dev,
 			"Bulk listen CB urb terminated, status: %d\n",
 			urb->status);
-		break;
+		return;
 	/* Recoverable errors */
 	default:
 		dev_info(&dev->interface->dev,
 			"Bulk listen CB urb error, status: %d. Continuing.\n",
 			urb->status);
-		usb_submit_urb(urb, GFP_KERNEL);
+		len = 0;
 		break;
 	}
+
+	/* A reserved slot is always returned to keep the read cache in order */
+	hss_proxy_rcv_slot(len, dev->proxy_context);
+
+	hss_submit_bulk_in(dev, urb);
+}
+
+/**
+ * hss_submit_bulk_in - Submits a bulk-in URB
+ *
+ * @dev The HSS device
+ * @urb The bulk-in URB to submit
+ *
+ * The URB receives straight into a read cache slot so the data is never
+ * copied. If the read cache has no free slot the URB is parked instead of
+ * being submitted, which makes the device hold its data until the data
+ * poller frees a slot and calls hss_bulk_in_resume.
+ *
+ * Slots are reserved in submission order and the host controller completes
+ * URBs on an endpoint in the same order, so completions always land on the
+ * read cache head.
+ *
+ * A URB the host controller refuses is parked too and submitted again
+ * from `bulk_in_retry`, so the pool never loses it.
+ *
+ * Returns: The result of usb_submit_urb, 1 if the URB was parked or
+ * -ESHUTDOWN once the device is going away
+ *
+ * Notes:
+ * Caller must hold bulk_in_lock.
+ */
+static int __hss_submit_bulk_in(struct usb_hss *dev, struct urb *urb)
+{
+	int nents;
+	int ret;
+
+	if (dev->bulk_in_stopped)
+		return -ESHUTDOWN;
+
+	nents = hss_proxy_get_rx_slot(dev->proxy_context, urb->sg,
+		dev->bulk_in_nents);
+	if (!nents) {
+		usb_anchor_urb(urb, &dev->bulk_in_parked);
+		atomic_inc(&dev->bulk_in_stalls);
+		return 1;
+	}
+
+	/* A slot in one piece is mapped like any other buffer */
+	usb_fill_bulk_urb(urb,
+		dev->udev,
+		usb_rcvbulkpipe(dev->udev,
+			dev->bulk_in_endpointAddr),
+		nents == 1 ? sg_virt(urb->sg) : NULL,
+		dev->max_transfer,
+		hss_read_bulk_callback,
+		dev);
+	urb->num_sgs = nents > 1 ? nents : 0;
+
+	usb_anchor_urb(urb, &dev->bulk_in_submitted);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret) {
+		/* Nothing was reserved after this slot, hand it back */
+		usb_unanchor_urb(urb);
+		hss_proxy_cancel_rx_slot(dev->proxy_context);
+		pr_err_ratelimited("%s submit failed ret=%d\n", __func__, ret);
+
+		usb_anchor_urb(urb, &dev->bulk_in_parked);
+		if (ret != -ENODEV && ret != -ESHUTDOWN)
+			schedule_delayed_work(&dev->bulk_in_retry,
+				HSS_BULK_IN_RETRY);
+	}
+
+	return ret;
+}
+
+static int hss_submit_bulk_in(struct usb_hss *dev, struct urb *urb)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&dev->bulk_in_lock, flags);
+	ret = __hss_submit_bulk_in(dev, urb);
+	spin_unlock_irqrestore(&dev->bulk_in_lock, flags);
+
+	return ret;
+}
+
+/**
+ * hss_bulk_in_resume - Resubmits parked bulk-in URBs
+ *
+ * @context The HSS device
+ *
+ * Called by the proxy after it consumes from the read cache. Does nothing
+ * unless a URB is parked.
+ */
+void hss_bulk_in_resume(void *context)
+{
+	struct usb_hss *dev = context;
+	unsigned long flags;
+	struct urb *urb;
+	int parked;
+
+	if (usb_anchor_empty(&dev->bulk_in_parked))
+		return;
+
+	spin_lock_irqsave(&dev->bulk_in_lock, flags);
+	while (!dev->bulk_in_stopped &&
+		(urb = usb_get_from_anchor(&dev->bulk_in_parked))) {
+		parked = __hss_submit_bulk_in(dev, urb);
+		usb_put_urb(urb);
+
+		/* Stop if the read cache filled up again or the submit failed */
+		if (parked)
+			break;
+	}
+	spin_unlock_irqrestore(&dev->bulk_in_lock, flags);
+}
+
+/**
+ * hss_bulk_in_retry - Resubmits bulk-in URBs the host controller refused
+ *
+ * @work The devices `bulk_in_retry`
+ */
+static void hss_bulk_in_retry(struct work_struct *work)
+{
+	struct usb_hss *dev = container_of(to_delayed_work(work),
+		struct usb_hss, bulk_in_retry);
+
+	hss_bulk_in_resume(dev);
 }
 
 static int hss_read_cmd(struct usb_hss *dev)
 {
+	int i;
+
 	/* Start listening for commands */
 	usb_fill_int_urb(dev->cmd_in_urb,
 		dev->udev,
@@ -289,114 +972,383 @@ static int hss_read_cmd(struct usb_hss *dev)
 	dev->cmd_in_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	usb_submit_urb(dev->cmd_in_urb, GFP_ATOMIC);
 
-	/* Start listening for data */
-	usb_fill_bulk_urb(dev->bulk_in_urb,
-		dev->udev,
-		usb_rcvbulkpipe(dev->udev,
-			dev->bulk_in_endpointAddr),
-		dev->bulk_in_buffer,
-		XAPRC00X_BULK_IN_BUF_SIZE,
-		hss_read_bulk_callback,
-		dev);
-	dev->bulk_in_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_submit_urb(dev->bulk_in_urb, GFP_ATOMIC);
+	/* Keep every bulk-in URB posted so the device never waits on us */
+	for (i = 0; i < dev->bulk_in_count; i++)
+		hss_submit_bulk_in(dev, dev->bulk_in_urbs[i]);
 
 	return 0;
 }
 
-/* Returns the ACK buf and lowers a semaphore to prevent concurrent access */
+/**
+ * hss_cmd_out_claim - Marks a free command URB as in use
+ *
+ * @dev The HSS device
+ *
+ * Returns: The index of the claimed URB or `cmd_out_count` if all are busy
+ */
+static int hss_cmd_out_claim(struct usb_hss *dev)
+{
+	int slot;
+
+	do {
+		slot = find_first_zero_bit(dev->cmd_out_busy,
+			dev->cmd_out_count);
+		if (slot >= dev->cmd_out_count)
+			break;
+	} while (test_and_set_bit_lock(slot, dev->cmd_out_busy));
+
+	return slot;
+}
+
+static void hss_cmd_out_release(struct usb_hss *dev, int slot)
+{
+	clear_bit_unlock(slot, dev->cmd_out_busy);
+	smp_mb__after_atomic();
+	wake_up(&dev->cmd_out_wait);
+}
+
+static int hss_cmd_out_slot(struct usb_hss *dev, void *buf)
+{
+	return ((char *)buf - dev->cmd_out_buffers) / HSS_CMD_MAX_LEN;
+}
+
+/**
+ * hss_get_ack_buf - Claims a command URB and returns its buffer
+ *
+ * @dev The HSS device
+ *
+ * Claiming is lock free, so any number of callers can build commands at
+ * once. Only when every command URB is in flight does this wait for one to
+ * complete. The buffer is HSS_CMD_MAX_LEN bytes and must be passed to
+ * hss_cmd_out.
+ *
+ * Returns: The buffer of a command URB
+ */
 void *hss_get_ack_buf(struct usb_hss *dev)
 {
-	down(&dev->int_out_sem);
-	return dev->cmd_out_buffer;
+	int slot;
+
+	wait_event(dev->cmd_out_wait,
+		(slot = hss_cmd_out_claim(dev)) < dev->cmd_out_count);
+	return dev->cmd_out_urbs[slot]->transfer_buffer;
 }
 
 static void hss_cmd_out_callback(struct urb *urb)
 {
 	struct usb_hss *dev = urb->context;
 
-	if (urb->status != 0)
+	if (urb->status != 0) {
+		atomic_inc(&dev->cmd_out_errors);
 		pr_info("Cmd failed status=%d", urb->status);
+	}
 
-	up(&dev->int_out_sem);
+	hss_cmd_out_release(dev, hss_cmd_out_slot(dev, urb->transfer_buffer));
 }
 
+/**
+ * hss_cmd_out - Sends a command on the interrupt-out endpoint
+ *
+ * @context The HSS device
+ * @msg A buffer returned by hss_get_ack_buf holding the command
+ * @msg_len The length of the command
+ *
+ * Never sleeps. The URB is returned to the pool when it completes or if it
+ * could not be submitted.
+ *
+ * Returns: 0 on success, -EINVAL if @msg_len is over HSS_CMD_MAX_LEN or an
+ * error code
+ */
 int hss_cmd_out(void *context, char *msg, int msg_len)
 {
-	int ret;
 	struct usb_hss *dev = context;
+	int slot = hss_cmd_out_slot(dev, msg);
+	struct urb *urb = dev->cmd_out_urbs[slot];
+	int ret;
 
-	usb_fill_int_urb(dev->cmd_out_urb,
-		dev->udev,
-		usb_sndintpipe(dev->udev,
-			dev->cmd_out_endpointAddr),
-		msg,
-		msg_len,
-		hss_cmd_out_callback,
-		dev,
-		dev->cmd_interval);
-	dev->cmd_out_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-
-	ret = usb_submit_urb(dev->cmd_out_urb, GFP_ATOMIC);
+	/* The buffer from hss_get_ack_buf holds no more than this */
+	if (WARN_ON_ONCE(msg_len > HSS_CMD_MAX_LEN)) {
+		hss_cmd_out_release(dev, slot);
+		return -EINVAL;
+	}
+	urb->transfer_buffer_length = msg_len;
+
+	usb_anchor_urb(urb, &dev->cmd_out_submitted);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret) {
+		usb_unanchor_urb(urb);
+		atomic_inc(&dev->cmd_out_errors);
+		hss_cmd_out_release(dev, slot);
+	}
 
 	return ret;
 }
 
+static void hss_write_bulk_callback(struct urb *urb)
+{
+	struct usb_hss *dev = urb->context;
+
+	switch (urb->status) {
+	case 0:
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		break;
+	default:
+		pr_err("%s bulk out failed status=%d\n", __func__,
+			urb->status);
+		break;
+	}
+
+	/* Recycle the URB for the next segment */
+	usb_anchor_urb(urb, &dev->bulk_out_idle);
+	wake_up(&dev->bulk_out_wait);
+}
+
+/**
+ * hss_bulk_out - Queues a message on the bulk-out pipe
+ *
+ * @context The HSS device
+ * @msg The message to send
+ * @msg_len The length of the message
+ *
+ * The message is copied into idle bulk-out URBs, one segment each, which are
+ * submitted without waiting for the previous segment to complete. `msg` may
+ * be reused as soon as this returns.
+ *
+ * Returns: The number of bytes queued
+ *
+ * Notes:
+ * Only sleeps while every URB in the pool is in flight.
+ */
 int hss_bulk_out(void *context, char *msg, int msg_len)
 {
-	int ret = -1;
 	struct usb_hss *dev = context;
+	struct urb *urb;
 	int sent_len = 0;
-	int actual_len = 0;
+	int seg_len;
+	int ret;
 
-	/* Only one sock at a time */
+	/* Keep the segments of one message together on the pipe */
 	down(&dev->bulk_out_sem);
 
 	while (sent_len != msg_len) {
-		/* Send as much of the remaining message as possible */
-		int seg_len = min(msg_len-sent_len, XAPRC00X_BULK_OUT_BUF_SIZE);
-
-		memcpy(dev->bulk_out_buffer, (msg + sent_len), seg_len);
+		wait_event(dev->bulk_out_wait,
+			(urb = usb_get_from_anchor(&dev->bulk_out_idle)) != NULL);
 
-		/* Send a bulk message to the device and wait for a reply */
-		ret = usb_bulk_msg(
-			dev->udev,
-			usb_sndbulkpipe(dev->udev,
-				dev->bulk_out_endpointAddr),
-			dev->bulk_out_buffer,
-			seg_len,
-			&actual_len,
-			0);
-
-		/* Increment the sent length if the call worked */
-		if (ret == 0) {
-			sent_len += actual_len;
-		} else {
+		/* Send as much of the remaining message as possible */
+		seg_len = min(msg_len - sent_len, dev->max_transfer);
+		memcpy(urb->transfer_buffer, msg + sent_len, seg_len);
+		urb->transfer_buffer_length = seg_len;
+
+		usb_anchor_urb(urb, &dev->bulk_out_submitted);
+		ret = usb_submit_urb(urb, GFP_KERNEL);
+		if (ret) {
+			usb_unanchor_urb(urb);
+			usb_anchor_urb(urb, &dev->bulk_out_idle);
+			usb_put_urb(urb);
+			pr_err("%s submit failed ret=%d\n", __func__, ret);
 			break;
 		}
+
+		/* The anchor and the host controller hold their own refs */
+		usb_put_urb(urb);
+		sent_len += seg_len;
 	}
 
 	up(&dev->bulk_out_sem);
 
-	/* Either return the number of bytes sent or negative error code */
 	return sent_len;
 }
 
+/**
+ * struct hss_sg_tx - A bulk-out transfer mapped straight from an skb
+ *
+ * @dev The HSS device
+ * @skb The skb holding the data until the transfer completes
+ * @buffer The pool URB's own buffer, put back once the transfer completes
+ * @sg The header followed by the skb's fragments
+ * @hdr The HSS header sent ahead of the skb data
+ */
+struct hss_sg_tx {
+	struct usb_hss *dev;
+	struct sk_buff *skb;
+	void *buffer;
+	struct scatterlist sg[MAX_SKB_FRAGS + 2];
+	char hdr[];
+};
+
+/**
+ * hss_bulk_out_can_sg - Checks if hss_bulk_out_skb can be used
+ *
+ * @context The HSS device
+ *
+ * The header in front of the skb data is not a multiple of the endpoint's
+ * max packet size so scatter-gather is only used on controllers without that
+ * constraint, such as xHCI.
+ */
+bool hss_bulk_out_can_sg(void *context)
+{
+	struct usb_hss *dev = context;
+
+	return dev->udev->bus->sg_tablesize > 0 &&
+		dev->udev->bus->no_sg_constraint;
+}
+
+/**
+ * hss_sg_tx_finish - Returns a pool URB used by hss_bulk_out_skb
+ *
+ * @urb The URB, still set up for scatter-gather
+ *
+ * Puts the URB back as hss_bulk_out expects it and frees the transfer.
+ */
+static void hss_sg_tx_finish(struct urb *urb)
+{
+	struct hss_sg_tx *tx = urb->context;
+	struct usb_hss *dev = tx->dev;
+
+	urb->sg = NULL;
+	urb->num_sgs = 0;
+	urb->transfer_buffer = tx->buffer;
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	urb->complete = hss_write_bulk_callback;
+	urb->context = dev;
+
+	consume_skb(tx->skb);
+	kfree(tx);
+
+	usb_anchor_urb(urb, &dev->bulk_out_idle);
+	wake_up(&dev->bulk_out_wait);
+}
+
+static void hss_write_sg_callback(struct urb *urb)
+{
+	if (urb->status && urb->status != -ECONNRESET &&
+		urb->status != -ENOENT && urb->status != -ESHUTDOWN)
+		pr_err("%s bulk out failed status=%d\n", __func__,
+			urb->status);
+
+	hss_sg_tx_finish(urb);
+}
+
+/**
+ * hss_bulk_out_skb - Queues a header and skb data on the bulk-out pipe
+ *
+ * @context The HSS device
+ * @hdr The header to send ahead of the data
+ * @hdr_len The length of @hdr
+ * @skb The skb holding the data
+ * @offset The offset of the data from skb->data
+ * @len The length of the data
+ *
+ * The skb's pages are mapped into an idle pool URB behind a copy of @hdr so
+ * the data itself is never copied. A reference to @skb is held until the
+ * transfer completes, so the skb must not be changed by anyone else. Pass a
+ * clone of an skb still on a socket.
+ *
+ * Returns: @len on success, -EOPNOTSUPP if the controller can't take the
+ * transfer (see hss_bulk_out_can_sg), -EMSGSIZE if the skb has too many
+ * fragments or another error code. Nothing is sent on failure.
+ *
+ * Notes:
+ * Only sleeps while every URB in the pool is in flight, like hss_bulk_out.
+ */
+int hss_bulk_out_skb(void *context, char *hdr, int hdr_len,
+	struct sk_buff *skb, int offset, int len)
+{
+	struct usb_hss *dev = context;
+	struct hss_sg_tx *tx;
+	struct urb *urb;
+	int nsg;
+	int ret;
+
+	if (!hss_bulk_out_can_sg(dev))
+		return -EOPNOTSUPP;
+
+	/* Fragment lists can need more entries than a hss_sg_tx holds */
+	if (skb_has_frag_list(skb))
+		return -EMSGSIZE;
+
+	tx = kmalloc(sizeof(*tx) + hdr_len, GFP_KERNEL);
+	if (!tx)
+		return -ENOMEM;
+
+	tx->dev = dev;
+	memcpy(tx->hdr, hdr, hdr_len);
+	sg_init_table(tx->sg, ARRAY_SIZE(tx->sg));
+	sg_set_buf(&tx->sg[0], tx->hdr, hdr_len);
+	nsg = skb_to_sgvec(skb, &tx->sg[1], offset, len);
+	if (nsg < 0) {
+		ret = -EMSGSIZE;
+		goto free_tx;
+	}
+	tx->skb = skb_get(skb);
+
+	/* Keep the transfer in order with the other messages */
+	down(&dev->bulk_out_sem);
+
+	wait_event(dev->bulk_out_wait,
+		(urb = usb_get_from_anchor(&dev->bulk_out_idle)) != NULL);
+
+	/* The pool URB takes the skb's pages until the transfer completes */
+	tx->buffer = urb->transfer_buffer;
+	urb->transfer_buffer = NULL;
+	urb->transfer_buffer_length = hdr_len + len;
+	urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+	urb->sg = tx->sg;
+	urb->num_sgs = nsg + 1;
+	urb->complete = hss_write_sg_callback;
+	urb->context = tx;
+
+	usb_anchor_urb(urb, &dev->bulk_out_submitted);
+	ret = usb_submit_urb(urb, GFP_KERNEL);
+	if (ret) {
+		usb_unanchor_urb(urb);
+		hss_sg_tx_finish(urb);
+	}
+
+	up(&dev->bulk_out_sem);
+
+	/* The anchor and the host controller hold their own refs */
+	usb_put_urb(urb);
+
+	if (ret) {
+		pr_err("%s submit failed ret=%d\n", __func__, ret);
+		return ret;
+	}
+	return len;
+
+free_tx:
+	kfree(tx);
+	return ret;
+}
+
 static void hss_driver_disconnect(struct usb_interface *interface)
 {
 	struct usb_hss *dev;
 
 	dev = usb_get_intfdata(interface);
+	sysfs_remove_group(&interface->dev.kobj, &hss_attr_group);
 	usb_set_intfdata(interface, NULL);
 
+	/* Stop receiving before the proxy the data is handed to goes away */
+	spin_lock_irq(&dev->bulk_in_lock);
+	dev->bulk_in_stopped = true;
+	spin_unlock_irq(&dev->bulk_in_lock);
+	cancel_delayed_work_sync(&dev->bulk_in_retry);
+	usb_kill_urb(dev->cmd_in_urb);
+	usb_kill_anchored_urbs(&dev->bulk_in_submitted);
+
+	/* The proxy is the only source of outbound transfers */
+	hss_proxy_destroy(dev->proxy_context);
+	usb_kill_anchored_urbs(&dev->bulk_out_submitted);
+	usb_kill_anchored_urbs(&dev->cmd_out_submitted);
+
 	/* prevent more I/O from starting */
 	dev->interface = NULL;
 
 	/* decrement our usage count */
 	kref_put(&dev->kref, hss_driver_delete);
 
-	hss_proxy_destroy(dev->proxy_context);
-
 	dev_info(&interface->dev, "HSS Driver now disconnected.");
 }
 
@@ -434,6 +1386,19 @@ static struct usb_driver hss_driver = {
 	.supports_autosuspend = 1,
 };
 
-module_usb_driver(hss_driver);
+static int __init hss_driver_init(void)
+{
+	return usb_register(&hss_driver);
+}
+module_init(hss_driver_init);
+
+static void __exit hss_driver_exit(void)
+{
+	usb_deregister(&hss_driver);
+
+	/* The resolver cache outlives every device */
+	hss_resolver_flush();
+}
+module_exit(hss_driver_exit);
 
 MODULE_LICENSE("GPL v2");
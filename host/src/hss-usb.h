@@ -11,12 +11,17 @@
 #define USB_SUBCLASS_HSS_XAPTUM   0xab
 
 struct usb_hss;
+struct sk_buff;
 int hss_cmd_out(void *context, char *msg, int msg_len);
 int hss_bulk_out(void *context, char *msg, int msg_len);
+bool hss_bulk_out_can_sg(void *context);
+int hss_bulk_out_skb(void *context, char *hdr, int hdr_len,
+	struct sk_buff *skb, int offset, int len);
 void *hss_get_ack_buf(struct usb_hss *dev);
-
-
-#define XAPRC00X_BULK_IN_BUF_SIZE 1024
-#define XAPRC00X_BULK_OUT_BUF_SIZE 1024
+void hss_bulk_in_resume(void *context);
+int hss_get_max_transfer(void *context);
+int hss_get_bulk_in_chunk(void *context);
+u32 hss_get_features(void *context);
+bool hss_get_tcp_fastopen(void *context);
 
 #endif
@@ -19,10 +19,86 @@
 #define HSS_FIXED_LEN_CLOSE HSS_HDR_LEN
 #define HSS_FIXED_LEN_TRANSMIT HSS_HDR_LEN
 #define HSS_FIXED_LEN_ACK HSS_HDR_LEN+3
+#define HSS_FIXED_LEN_ACK_CREDIT HSS_FIXED_LEN_ACK+4
 #define HSS_FIXED_LEN_REPLY HSS_FIXED_LEN_ACK
 #define HSS_FIXED_LEN_OPEN HSS_HDR_LEN+9
-#define HSS_FIXED_LEN_CONN_IP6 HSS_HDR_LEN+0x28
+#define HSS_FIXED_LEN_CONN_IP6 HSS_HDR_LEN+0x1C
 #define HSS_FIXED_LEN_CONN_IP4 HSS_HDR_LEN+8
+#define HSS_FIXED_LEN_OPEN_CONN_IP6 HSS_FIXED_LEN_OPEN+0x1C
+#define HSS_FIXED_LEN_OPEN_CONN_IP4 HSS_FIXED_LEN_OPEN+8
+#define HSS_FIXED_LEN_CONN_NAME HSS_FIXED_LEN_OPEN+2
+#define HSS_FIXED_LEN_SENDTO_IP6 HSS_FIXED_LEN_CONN_IP6
+#define HSS_FIXED_LEN_SENDTO_IP4 HSS_FIXED_LEN_CONN_IP4
+#define HSS_FIXED_LEN_SOCKOPT HSS_HDR_LEN+6
+#define HSS_FIXED_LEN_ACK_SOCKOPT HSS_FIXED_LEN_ACK+6
+
+/* Largest command packet either side takes on its interrupt endpoint */
+#define HSS_CMD_MAX_LEN 64
+
+/* Bounds on a single USB transfer, and so on a single HSS packet. Devices that
+ * don't answer HSS_USB_REQ_CONFIG are limited to HSS_MIN_TRANSFER. */
+#define HSS_MIN_TRANSFER 1024
+#define HSS_MAX_TRANSFER 65536
+
+/* Vendor control request sent by the host at probe. wValue carries the
+ * largest transfer the host can take in KiB. The device answers with a
+ * struct hss_usb_config holding the agreed values, which both sides then use
+ * for every transfer. */
+#define HSS_USB_REQ_CONFIG 0x01
+
+/* Vendor control request without a data stage sent by the host after
+ * HSS_USB_REQ_CONFIG. wValue holds the offered features the host will use.
+ * Devices only enable features named here. */
+#define HSS_USB_REQ_SET_FEATURES 0x02
+
+struct hss_usb_config {
+	__le32 max_transfer; /* Bytes, a power of 2 */
+	__le32 features; /* Bitmap of optional protocol features */
+} __attribute__((packed));
+
+/* Feature bits for struct hss_usb_config */
+#define HSS_FEATURE_CREDITS (1 << 0) /* Per-socket TRANSMIT windows */
+/* A successful TRANSMIT ACK covers every earlier TRANSMIT on its socket too,
+ * so the host only ACKs a socket every so many bytes or so often. Failed
+ * TRANSMITs are still ACKed one by one. */
+#define HSS_FEATURE_CUMULATIVE_ACK (1 << 1)
+/* Commands other than TRANSMIT may also travel in the bulk streams, in
+ * order with the TRANSMITs around them, instead of on the interrupt
+ * endpoints. Either side still accepts commands on its interrupt endpoint. */
+#define HSS_FEATURE_INBAND_CMD (1 << 2)
+/* The device may open and connect a socket with one HSS_OP_OPEN_CONNECT. Its
+ * payload is the OPEN fields followed by the CONNECT fields, then optionally
+ * the first bytes to send once connected. The host answers with one ACK
+ * carrying the connect result. */
+#define HSS_FEATURE_OPEN_CONNECT (1 << 3)
+/* The device may open a socket and connect it to a host name with one
+ * HSS_OP_CONNECT_NAME. Its payload is the OPEN fields and the port followed
+ * by the name, which is not NUL terminated. The host resolves the name and
+ * answers with one ACK carrying the connect result. A socket the device
+ * already opened is reused. */
+#define HSS_FEATURE_CONNECT_NAME (1 << 4)
+/* Datagram sockets, opened with HSS_TYPE_DGRAM. Every TRANSMIT on one
+ * carries exactly one datagram and is never split, so a datagram is at most
+ * a transfer less the fixed fields. HSS_OP_SENDTO carries one datagram along
+ * with the address it goes to, from the device, or came from, from the
+ * host. Its payload is the CONNECT fields followed by the datagram. SENDTOs
+ * count against the socket's window and are ACKed like TRANSMITs. Either
+ * side may pack several packets into one transfer. */
+#define HSS_FEATURE_DGRAM (1 << 5)
+/* The device may set and read a fixed set of options on its host sockets
+ * with HSS_OP_SETSOCKOPT and HSS_OP_GETSOCKOPT, see enum hss_sockopt. Both
+ * carry a struct hss_payload_sockopt, a GETSOCKOPT's value is ignored. The
+ * host answers each with an ACK carrying the option and the value the socket
+ * ended up with, which may differ from the one asked for. */
+#define HSS_FEATURE_SOCKOPT (1 << 6)
+
+/* The longest name HSS_OP_CONNECT_NAME may carry, as for DNS */
+#define HSS_NAME_MAX 253
+
+/* With HSS_FEATURE_CREDITS each side may send this many TRANSMIT payload
+ * bytes on a new socket before hearing from the receiver. After that the
+ * receiver moves the limit with HSS_E_CREDIT ACKs. */
+#define HSS_INITIAL_WINDOW 65536
 
 enum __attribute__ ((__packed__)) hss_opcode {
 	HSS_OP_OPEN	= 0x00,
@@ -32,6 +108,11 @@ enum __attribute__ ((__packed__)) hss_opcode {
 	HSS_OP_ACK	= 0x04,
 	HSS_OP_ACKDATA	= 0x05,
 	HSS_OP_CLOSE	= 0x06,
+	HSS_OP_OPEN_CONNECT	= 0x07,
+	HSS_OP_CONNECT_NAME	= 0x08,
+	HSS_OP_SENDTO	= 0x09,
+	HSS_OP_SETSOCKOPT	= 0x0A,
+	HSS_OP_GETSOCKOPT	= 0x0B,
 	HSS_OP_MAX	= 0xFFFF
 };
 
@@ -53,6 +134,21 @@ enum __attribute__ ((__packed__)) hss_type {
 	HSS_TYPE_MAX	= 0xFF
 };
 
+/* Socket options, values are as the host's getsockopt gives them */
+enum __attribute__ ((__packed__)) hss_sockopt {
+	HSS_SO_KEEPALIVE	= 0x00,
+	HSS_SO_SNDBUF		= 0x01,
+	HSS_SO_RCVBUF		= 0x02,
+	HSS_TCP_NODELAY		= 0x03,
+	HSS_TCP_CORK		= 0x04,
+	HSS_TCP_KEEPIDLE	= 0x05, /* Seconds */
+	HSS_TCP_KEEPINTVL	= 0x06, /* Seconds */
+	HSS_TCP_KEEPCNT		= 0x07,
+	HSS_IP_TOS		= 0x08, /* IP_TOS or IPV6_TCLASS, by family */
+	HSS_SOCKOPT_NUM, /* One past the last option */
+	HSS_SOCKOPT_MAX		= 0xFFFF
+};
+
 enum __attribute__ ((__packed__)) hss_error {
 	HSS_E_SUCCESS		= 0x00,
 	HSS_E_HOSTERR		= 0x01,
@@ -63,6 +159,9 @@ enum __attribute__ ((__packed__)) hss_error {
 	HSS_E_TIMEDOUT		= 0x06,
 	HSS_E_MISMATCH		= 0x07,
 	HSS_E_NOTCONN		= 0x08,
+	HSS_E_NOTFOUND		= 0x09, /* The name did not resolve */
+	/* Codes from 0x80 are positive flow indicators, not errors */
+	HSS_E_CREDIT		= 0x80, /* Success, `window` is valid */
 	HSS_E_MAX		= 0xFF
 };
 
@@ -85,11 +184,27 @@ struct hss_payload_open {
 	enum hss_type	type;
 };
 
+struct hss_payload_sockopt {
+	enum hss_sockopt	option;
+	__u32			value;
+};
+
 struct hss_payload_ack {
 	enum hss_opcode		orig_opcode;
 	enum hss_error		code;
 	union {
 		char	empty[0];
+		/*
+		 * HSS_E_CREDIT: Total TRANSMIT payload bytes the sender may
+		 * have sent on this socket, counted from the socket opening
+		 * and wrapping at 2^32.
+		 */
+		__u32	window;
+		/*
+		 * Any code answering HSS_OP_SETSOCKOPT or HSS_OP_GETSOCKOPT:
+		 * The option asked about and, on success, its value.
+		 */
+		struct hss_payload_sockopt sockopt;
 	};
 };
 
@@ -114,6 +229,16 @@ struct hss_payload_connect_ip {
 	union hss_payload_connect_ip_addr	addr;
 };
 
+struct hss_payload_open_connect {
+	struct hss_payload_open		open;
+	struct hss_payload_connect_ip	connect;
+};
+
+struct hss_payload_connect_name {
+	struct hss_payload_open		open;
+	__u16				port;
+};
+
 struct hss_packet {
 	struct hss_packet_hdr	hdr;
 	union {
@@ -121,6 +246,10 @@ struct hss_packet {
 		struct hss_payload_open open;
 		struct hss_payload_connect_ip connect;
 		struct hss_payload_ack ack;
+		struct hss_payload_open_connect open_connect;
+		struct hss_payload_connect_name connect_name;
+		struct hss_payload_connect_ip sendto;
+		struct hss_payload_sockopt sockopt;
 	};
 };
 
@@ -255,6 +384,101 @@ static inline void hss_packet_fill_connect(struct hss_packet *packet,
 		hss_packet_assign_ip6(packet, addr);
 }
 
+/**
+ * hss_packet_fill_open_connect - Fill an OPEN_CONNECT packet
+ *
+ * @packet The packet being written to
+ * @family The family, protocol and type are as for an OPEN
+ * @proto
+ * @type
+ * @local_id The ID of the new socket
+ * @addr The address to connect to
+ * @data_len The length of any data carried after the fixed fields
+ * @msg_id The message ID
+ */
+static inline void hss_packet_fill_open_connect(struct hss_packet *packet,
+	enum hss_family family, enum hss_proto proto, enum hss_type type,
+	int local_id, struct sockaddr *addr, int data_len, u16 msg_id)
+{
+	struct hss_payload_connect_ip connect;
+
+	/* Build the CONNECT half first to reuse the address helpers */
+	hss_packet_fill_connect(packet, msg_id, local_id, addr);
+	connect = packet->connect;
+	packet->open_connect.connect = connect;
+
+	packet->hdr.opcode = HSS_OP_OPEN_CONNECT;
+	packet->hdr.payload_len += HSS_FIXED_LEN_OPEN - HSS_HDR_LEN + data_len;
+	packet->open_connect.open.addr_family = family;
+	packet->open_connect.open.protocol = proto;
+	packet->open_connect.open.type = type;
+	packet->open_connect.open.handle = local_id;
+}
+
+/**
+ * hss_packet_fill_connect_name - Fill a CONNECT_NAME packet
+ *
+ * @packet The packet being written to
+ * @family The family, protocol and type are as for an OPEN
+ * @proto
+ * @type
+ * @local_id The ID of the socket
+ * @port The port to connect to in network byte order
+ * @name_len The length of the name carried after the fixed fields
+ * @msg_id The message ID
+ */
+static inline void hss_packet_fill_connect_name(struct hss_packet *packet,
+	enum hss_family family, enum hss_proto proto, enum hss_type type,
+	int local_id, __be16 port, int name_len, u16 msg_id)
+{
+	hss_fill_packet(packet, HSS_OP_CONNECT_NAME, local_id, msg_id);
+	packet->hdr.payload_len =
+		HSS_FIXED_LEN_CONN_NAME - HSS_HDR_LEN + name_len;
+	packet->connect_name.open.addr_family = family;
+	packet->connect_name.open.protocol = proto;
+	packet->connect_name.open.type = type;
+	packet->connect_name.open.handle = local_id;
+	packet->connect_name.port = port;
+}
+
+/**
+ * hss_packet_fill_sendto - Fill a SENDTO packet
+ *
+ * @packet The packet being written to
+ * @sock_id The datagram socket
+ * @addr The address the datagram goes to or came from
+ * @data_len The length of the datagram carried after the fixed fields
+ * @msg_id The message ID
+ */
+static inline void hss_packet_fill_sendto(struct hss_packet *packet,
+	int sock_id, struct sockaddr *addr, int data_len, u16 msg_id)
+{
+	/* The address fields are the CONNECT ones */
+	hss_packet_fill_connect(packet, msg_id, sock_id, addr);
+	packet->hdr.opcode = HSS_OP_SENDTO;
+	packet->hdr.payload_len += data_len;
+}
+
+/**
+ * hss_packet_fill_sockopt - Fill a SETSOCKOPT or GETSOCKOPT packet
+ *
+ * @packet The packet being written to
+ * @opcode HSS_OP_SETSOCKOPT or HSS_OP_GETSOCKOPT
+ * @sock_id The socket
+ * @option The enum hss_sockopt
+ * @value The value to set, 0 for a GETSOCKOPT
+ * @msg_id The message ID
+ */
+static inline void hss_packet_fill_sockopt(struct hss_packet *packet,
+	enum hss_opcode opcode, u32 sock_id, enum hss_sockopt option,
+	u32 value, u16 msg_id)
+{
+	hss_fill_packet(packet, opcode, sock_id, msg_id);
+	packet->hdr.payload_len = HSS_FIXED_LEN_SOCKOPT - HSS_HDR_LEN;
+	packet->sockopt.option = option;
+	packet->sockopt.value = value;
+}
+
 /**
  * hss_packet_fill_ack - Fill common ACK fields
  *
@@ -274,6 +498,40 @@ static inline void hss_packet_fill_ack(struct hss_packet_hdr *orig,
 	ack->ack.orig_opcode = orig->opcode;
 }
 
+/**
+ * hss_packet_fill_ack_credit - Fill a window update ACK
+ *
+ * @ack The ACK packet to populate
+ * @sock_id The socket the window applies to
+ * @window The new window, see struct hss_payload_ack
+ * @msg_id The message ID of the TRANSMIT being answered, or a fresh ID
+ *
+ * Window updates answer TRANSMITs but may also be sent on their own when a
+ * receiver frees buffer space.
+ */
+static inline void hss_packet_fill_ack_credit(struct hss_packet *ack,
+	u32 sock_id, u32 window, u16 msg_id)
+{
+	hss_fill_packet(ack, HSS_OP_ACK, sock_id, msg_id);
+	ack->hdr.payload_len = HSS_FIXED_LEN_ACK_CREDIT - HSS_HDR_LEN;
+	ack->ack.orig_opcode = HSS_OP_TRANSMIT;
+	ack->ack.code = HSS_E_CREDIT;
+	ack->ack.window = window;
+}
+
+/**
+ * hss_window_after - Compares two credit windows
+ *
+ * @a The first window
+ * @b The second window
+ *
+ * Returns: true if @a allows more bytes than @b, accounting for wrap.
+ */
+static inline bool hss_window_after(u32 a, u32 b)
+{
+	return (s32)(a - b) > 0;
+}
+
 /**
  * hss_packet_fill_ack_open - Fill open specific ACK
  *
@@ -319,6 +577,9 @@ static inline void hss_packet_fill_ack_connect(struct hss_packet *packet,
 	case 0:
 		ack->ack.code = HSS_E_SUCCESS;
 		break;
+	case -EINVAL:
+		ack->ack.code = HSS_E_INVAL;
+		break;
 	case -ECONNREFUSED:
 		ack->ack.code = HSS_E_CONNREFUSED;
 		break;
@@ -328,6 +589,43 @@ static inline void hss_packet_fill_ack_connect(struct hss_packet *packet,
 	case -ETIMEDOUT:
 		ack->ack.code = HSS_E_TIMEDOUT;
 		break;
+	case -ENODATA:
+		ack->ack.code = HSS_E_NOTFOUND;
+		break;
+	default:
+		ack->ack.code = HSS_E_HOSTERR;
+		break;
+	}
+}
+
+/**
+ * hss_packet_fill_ack_sockopt - Fill a SETSOCKOPT or GETSOCKOPT ACK
+ *
+ * @packet The packet being reponded to
+ * @ack The ACK packet to populate
+ * @ret The return code from the operation
+ * @value The value of the option once done, ignored unless @ret is 0
+ */
+static inline void hss_packet_fill_ack_sockopt(struct hss_packet *packet,
+	struct hss_packet *ack, int ret, u32 value)
+{
+	hss_packet_fill_ack(&packet->hdr, ack);
+	ack->hdr.payload_len = HSS_FIXED_LEN_ACK_SOCKOPT - HSS_HDR_LEN;
+	ack->ack.sockopt.option = packet->sockopt.option;
+	ack->ack.sockopt.value = ret ? 0 : value;
+	switch (ret) {
+	case 0:
+		ack->ack.code = HSS_E_SUCCESS;
+		break;
+	case -EINVAL:
+		ack->ack.code = HSS_E_INVAL;
+		break;
+	case -ENOPROTOOPT:
+		ack->ack.code = HSS_E_PROTONOSUPPORT;
+		break;
+	case -EEXIST:
+		ack->ack.code = HSS_E_NOTCONN;
+		break;
 	default:
 		ack->ack.code = HSS_E_HOSTERR;
 		break;
@@ -438,64 +736,365 @@ static inline struct hss_payload_open *hss_get_payload_open(struct hss_packet *p
 			*dst = le64_to_cpu(*dst);			\
 	} while (0)
 
+/*
+ * Copies a field that goes on the wire as it is, for addresses that are in
+ * network byte order already. For use by the codec below.
+ */
+#define _hss_raw_to_buf(dst,src,offset)					\
+	do {								\
+		memcpy(((char *)dst) + offset, src, sizeof(*src));	\
+		offset += sizeof(*src);					\
+	} while (0)
+
+#define _hss_raw_from_buf(src,dst,offset)				\
+	do {								\
+		memcpy(dst, ((char *)src) + offset, sizeof(*dst));	\
+		offset += sizeof(*dst);					\
+	} while (0)
+
+/*
+ * The wire format, one table for each run of fixed fields. Every entry is
+ * X(field, kind) in the order the fields are sent, where `kind` is LE for a
+ * field sent little-endian or RAW for one copied as it is. The codec below
+ * and the checks on the HSS_FIXED_LEN_ values are generated from these so
+ * the three cannot disagree.
+ */
+#define HSS_HDR_FIELDS(X, hdr) \
+	X(&(hdr)->opcode, LE) \
+	X(&(hdr)->msg_id, LE) \
+	X(&(hdr)->sock_id, LE) \
+	X(&(hdr)->payload_len, LE)
+
+/* OPEN, and the start of OPEN_CONNECT and CONNECT_NAME */
+#define HSS_OPEN_FIELDS(X, open) \
+	X(&(open)->handle, LE) \
+	X(&(open)->addr_family, LE) \
+	X(&(open)->protocol, LE) \
+	X(&(open)->type, LE)
+
+/* CONNECT, SENDTO and the end of OPEN_CONNECT, then the address by family */
+#define HSS_CONNECT_FIELDS(X, conn) \
+	X(&(conn)->family, LE) \
+	X(&(conn)->port, LE)
+
+#define HSS_CONNECT_IP4_FIELDS(X, conn) \
+	X(&(conn)->addr.ip4.ip_addr, RAW)
+
+#define HSS_CONNECT_IP6_FIELDS(X, conn) \
+	X(&(conn)->addr.ip6.flow_info, RAW) \
+	X(&(conn)->addr.ip6.scope_id, RAW) \
+	X(&(conn)->addr.ip6.ip_addr, RAW)
+
+/* CONNECT_NAME after its OPEN fields, the name follows */
+#define HSS_CONNECT_NAME_FIELDS(X, name) \
+	X(&(name)->port, LE)
+
+/* SETSOCKOPT, GETSOCKOPT and the end of their ACKs */
+#define HSS_SOCKOPT_FIELDS(X, opt) \
+	X(&(opt)->option, LE) \
+	X(&(opt)->value, LE)
+
+/* Every ACK, then `window` for HSS_E_CREDIT */
+#define HSS_ACK_FIELDS(X, ack) \
+	X(&(ack)->orig_opcode, LE) \
+	X(&(ack)->code, LE)
+
+#define HSS_ACK_CREDIT_FIELDS(X, ack) \
+	X(&(ack)->window, LE)
+
+#define _HSS_FIELD_LEN(field, kind) + sizeof(*(field))
+#define _HSS_FIELD_TO(field, kind) _hss_to_##kind(buf, field, cnt);
+#define _HSS_FIELD_FROM(field, kind) _hss_from_##kind(buf, field, cnt);
+#define _hss_to_LE(buf, field, cnt) _hss_packet_to_buf(buf, field, cnt, 1)
+#define _hss_to_RAW(buf, field, cnt) _hss_raw_to_buf(buf, field, cnt)
+#define _hss_from_LE(buf, field, cnt) _hss_packet_from_buf(buf, field, cnt, 1)
+#define _hss_from_RAW(buf, field, cnt) _hss_raw_from_buf(buf, field, cnt)
+
 /**
- * hss_packet_##dir##_buf - Serially steps through an HSS packet performing the descired operation
- *
- * @pkt An alligned HSS packet
- * @buf An unalligned buffer for transmission
- * @payload_fields Whether to copy fixed payload fields or just the header
+ * _HSS_CODEC - Generates the codec for one table of fields
  *
- * Goes field by field through the packet structure either reading from or writing to the field.
- * The other target is an unalligned HSS buffer that is has either been received or is about to be sent
- * over USB.
+ * @name The name to generate under
+ * @type The struct the fields are in
+ * @fields The table, see HSS_HDR_FIELDS
  *
- * Return: The number of bytes operated upon in the buffer.
+ * Defines `_hss_##name##_len`, the bytes the fields take on the wire, and
+ * `_hss_##name##_to_buf` and `_hss_##name##_from_buf`, which write or read
+ * exactly that many bytes and return the count.
  */
-#define HSS_COPY_FIELDS 1
-#define HSS_COPY_HDR 0
-#define _CREATE_HSS_PACKET_DIR(dir) \
-	static inline size_t hss_packet_##dir##_buf(struct hss_packet *pkt, char *buf, int payload_fields) \
+#define _HSS_CODEC(name, type, fields) \
+	enum { _hss_##name##_len = 0 fields(_HSS_FIELD_LEN, ((type *)0)) }; \
+	static inline size_t _hss_##name##_to_buf(type *p, char *buf) \
+	{ \
+		size_t cnt = 0; \
+ \
+		fields(_HSS_FIELD_TO, p) \
+		return cnt; \
+	} \
+	static inline size_t _hss_##name##_from_buf(type *p, const char *buf) \
 	{ \
 		size_t cnt = 0; \
  \
-		_hss_packet_##dir##_buf(buf, &pkt->hdr.opcode, cnt, 1); \
-		_hss_packet_##dir##_buf(buf, &pkt->hdr.msg_id, cnt, 1); \
-		_hss_packet_##dir##_buf(buf, &pkt->hdr.sock_id, cnt, 1); \
-		_hss_packet_##dir##_buf(buf, &pkt->hdr.payload_len, cnt, 1); \
+		fields(_HSS_FIELD_FROM, p) \
+		return cnt; \
+	}
+
+_HSS_CODEC(hdr, struct hss_packet_hdr, HSS_HDR_FIELDS)
+_HSS_CODEC(open, struct hss_payload_open, HSS_OPEN_FIELDS)
+_HSS_CODEC(connect, struct hss_payload_connect_ip, HSS_CONNECT_FIELDS)
+_HSS_CODEC(ip4, struct hss_payload_connect_ip, HSS_CONNECT_IP4_FIELDS)
+_HSS_CODEC(ip6, struct hss_payload_connect_ip, HSS_CONNECT_IP6_FIELDS)
+_HSS_CODEC(name, struct hss_payload_connect_name, HSS_CONNECT_NAME_FIELDS)
+_HSS_CODEC(sockopt, struct hss_payload_sockopt, HSS_SOCKOPT_FIELDS)
+_HSS_CODEC(ack, struct hss_payload_ack, HSS_ACK_FIELDS)
+_HSS_CODEC(credit, struct hss_payload_ack, HSS_ACK_CREDIT_FIELDS)
+
+/**
+ * _hss_check_lens - Checks the tables against the HSS_FIXED_LEN_ values
+ *
+ * Fails the build if they disagree. Also makes sure struct hss_packet_hdr is
+ * laid out as the wire header, which the header fast path relies on.
+ */
+static inline void _hss_check_lens(void)
+{
+	BUILD_BUG_ON(sizeof(struct hss_packet_hdr) != HSS_HDR_LEN);
+	BUILD_BUG_ON(_hss_hdr_len != HSS_HDR_LEN);
+	BUILD_BUG_ON(HSS_HDR_LEN + _hss_open_len != HSS_FIXED_LEN_OPEN);
+	BUILD_BUG_ON(HSS_HDR_LEN + _hss_connect_len + _hss_ip4_len !=
+		HSS_FIXED_LEN_CONN_IP4);
+	BUILD_BUG_ON(HSS_HDR_LEN + _hss_connect_len + _hss_ip6_len !=
+		HSS_FIXED_LEN_CONN_IP6);
+	BUILD_BUG_ON(HSS_FIXED_LEN_OPEN + _hss_connect_len + _hss_ip4_len !=
+		HSS_FIXED_LEN_OPEN_CONN_IP4);
+	BUILD_BUG_ON(HSS_FIXED_LEN_OPEN + _hss_connect_len + _hss_ip6_len !=
+		HSS_FIXED_LEN_OPEN_CONN_IP6);
+	BUILD_BUG_ON(HSS_FIXED_LEN_OPEN + _hss_name_len !=
+		HSS_FIXED_LEN_CONN_NAME);
+	BUILD_BUG_ON(HSS_HDR_LEN + _hss_sockopt_len != HSS_FIXED_LEN_SOCKOPT);
+	BUILD_BUG_ON(HSS_HDR_LEN + _hss_ack_len != HSS_FIXED_LEN_ACK);
+	BUILD_BUG_ON(HSS_FIXED_LEN_ACK + _hss_credit_len !=
+		HSS_FIXED_LEN_ACK_CREDIT);
+	BUILD_BUG_ON(HSS_FIXED_LEN_ACK + _hss_sockopt_len !=
+		HSS_FIXED_LEN_ACK_SOCKOPT);
+}
+
+/**
+ * hss_hdr_to_buf - Writes a packet header
+ *
+ * @hdr The header
+ * @buf The buffer, with room for HSS_HDR_LEN bytes
+ *
+ * On little-endian CPUs the header is already in wire order and goes out
+ * with a single unaligned store.
+ *
+ * Return: HSS_HDR_LEN
+ */
+static inline size_t hss_hdr_to_buf(struct hss_packet_hdr *hdr, char *buf)
+{
+	_hss_check_lens();
+#ifdef __LITTLE_ENDIAN
+	memcpy(buf, hdr, HSS_HDR_LEN);
+	return HSS_HDR_LEN;
+#else
+	return _hss_hdr_to_buf(hdr, buf);
+#endif
+}
+
+/**
+ * hss_hdr_from_buf - Reads a packet header
+ *
+ * @hdr The header to fill
+ * @buf The buffer, holding at least HSS_HDR_LEN bytes
+ *
+ * The counterpart of hss_hdr_to_buf, a single unaligned load on
+ * little-endian CPUs.
+ *
+ * Return: HSS_HDR_LEN
+ */
+static inline size_t hss_hdr_from_buf(struct hss_packet_hdr *hdr,
+	const char *buf)
+{
+#ifdef __LITTLE_ENDIAN
+	memcpy(hdr, buf, HSS_HDR_LEN);
+	return HSS_HDR_LEN;
+#else
+	return _hss_hdr_from_buf(hdr, buf);
+#endif
+}
+
+/**
+ * hss_packet_len - Checks the length a header gives its packet
+ *
+ * @hdr The header, as read by hss_hdr_from_buf
+ * @max_len The longest packet the caller can take, header included
+ *
+ * `payload_len` comes off the wire, so it is checked before it is added to
+ * anything.
+ *
+ * Return: The length of the whole packet or -EMSGSIZE if it is longer than
+ * @max_len
+ */
+static inline int hss_packet_len(struct hss_packet_hdr *hdr, size_t max_len)
+{
+	if (max_len < HSS_HDR_LEN || hdr->payload_len > max_len - HSS_HDR_LEN)
+		return -EMSGSIZE;
+	return HSS_HDR_LEN + hdr->payload_len;
+}
+
+/*
+ * Moves one table of fields between `p` and `buf` + `cnt` in direction `dir`.
+ * Reading, a table that does not fit in the `avail` bytes left fails the
+ * whole packet with -EINVAL before anything is read.
+ */
+#define _HSS_GROUP(dir, name, p) \
+	do { \
+		if (avail - cnt < _hss_##name##_len) \
+			return -EINVAL; \
+		cnt += _hss_##name##_##dir##_buf(p, buf + cnt); \
+	} while (0)
+
+/* The CONNECT fields and the address fields of their family */
+#define _HSS_GROUP_CONNECT(dir, conn) \
+	do { \
+		_HSS_GROUP(dir, connect, conn); \
+		if ((conn)->family == HSS_FAM_IP) \
+			_HSS_GROUP(dir, ip4, conn); \
+		else if ((conn)->family == HSS_FAM_IP6) \
+			_HSS_GROUP(dir, ip6, conn); \
+	} while (0)
+
+/**
+ * _hss_payload_##dir##_buf - Moves the fixed payload fields of a packet
+ *
+ * @pkt The packet, its header already filled
+ * @buf The buffer, starting after the header
+ * @avail The bytes of payload in @buf
+ *
+ * Return: The number of bytes moved or -EINVAL if the fields the opcode
+ * calls for run past @avail.
+ */
+#define _CREATE_HSS_PAYLOAD_DIR(dir, cbuf) \
+	static inline int _hss_payload_##dir##_buf(struct hss_packet *pkt, \
+		cbuf char *buf, size_t avail) \
+	{ \
+		size_t cnt = 0; \
  \
-		if (payload_fields) { \
-			switch (pkt->hdr.opcode) { \
-				case HSS_OP_OPEN: \
-					_hss_packet_##dir##_buf(buf, &pkt->open.handle, cnt, 1); \
-					_hss_packet_##dir##_buf(buf, &pkt->open.addr_family, cnt, 1); \
-					_hss_packet_##dir##_buf(buf, &pkt->open.protocol, cnt, 1); \
-					_hss_packet_##dir##_buf(buf, &pkt->open.type, cnt, 1); \
-					break; \
-				case HSS_OP_CONNECT: \
-						_hss_packet_##dir##_buf(buf, &pkt->connect.family, cnt, 1); \
-						_hss_packet_##dir##_buf(buf, &pkt->connect.port, cnt, 1); \
-						if (pkt->connect.family == HSS_FAM_IP) \
-							_hss_packet_##dir##_buf(buf, &pkt->connect.addr.ip4.ip_addr, cnt, 0); \
-						else if (pkt->connect.family == HSS_FAM_IP6) { \
-							_hss_packet_##dir##_buf(buf, &pkt->connect.addr.ip6.flow_info, cnt, 0); \
-							_hss_packet_##dir##_buf(buf, &pkt->connect.addr.ip6.scope_id, cnt, 0); \
-							_hss_packet_##dir##_buf(buf, pkt->connect.addr.ip6.ip_addr, cnt, 0); \
-						} \
-					break; \
-				case HSS_OP_ACK: \
-					_hss_packet_##dir##_buf(buf, &pkt->ack.orig_opcode, cnt, 1); \
-					_hss_packet_##dir##_buf(buf, &pkt->ack.code, cnt, 1); \
-					break; \
-				case HSS_OP_ACKDATA: \
-				case HSS_OP_CLOSE: \
-				case HSS_OP_TRANSMIT: \
-				case HSS_OP_SHUTDOWN: \
-				default: \
-					break; \
-			} \
+		switch (pkt->hdr.opcode) { \
+		case HSS_OP_OPEN: \
+			_HSS_GROUP(dir, open, &pkt->open); \
+			break; \
+		case HSS_OP_CONNECT: \
+			_HSS_GROUP_CONNECT(dir, &pkt->connect); \
+			break; \
+		case HSS_OP_OPEN_CONNECT: \
+			_HSS_GROUP(dir, open, &pkt->open_connect.open); \
+			_HSS_GROUP_CONNECT(dir, &pkt->open_connect.connect); \
+			break; \
+		case HSS_OP_CONNECT_NAME: \
+			_HSS_GROUP(dir, open, &pkt->connect_name.open); \
+			_HSS_GROUP(dir, name, &pkt->connect_name); \
+			break; \
+		case HSS_OP_SENDTO: \
+			_HSS_GROUP_CONNECT(dir, &pkt->sendto); \
+			break; \
+		case HSS_OP_SETSOCKOPT: \
+		case HSS_OP_GETSOCKOPT: \
+			_HSS_GROUP(dir, sockopt, &pkt->sockopt); \
+			break; \
+		case HSS_OP_ACK: \
+			_HSS_GROUP(dir, ack, &pkt->ack); \
+			if (pkt->ack.code == HSS_E_CREDIT) \
+				_HSS_GROUP(dir, credit, &pkt->ack); \
+			else if (pkt->ack.orig_opcode == HSS_OP_SETSOCKOPT || \
+				pkt->ack.orig_opcode == HSS_OP_GETSOCKOPT) \
+				_HSS_GROUP(dir, sockopt, &pkt->ack.sockopt); \
+			break; \
+		case HSS_OP_ACKDATA: \
+		case HSS_OP_CLOSE: \
+		case HSS_OP_TRANSMIT: \
+		case HSS_OP_SHUTDOWN: \
+		default: \
+			break; \
 		} \
 		return cnt; \
 	}
-_CREATE_HSS_PACKET_DIR(to); /* hss_packet_to_buf */
-_CREATE_HSS_PACKET_DIR(from); /* hss_packet_from_buf */
+_CREATE_HSS_PAYLOAD_DIR(to, ); /* _hss_payload_to_buf */
+_CREATE_HSS_PAYLOAD_DIR(from, const); /* _hss_payload_from_buf */
+
+#define HSS_COPY_FIELDS 1
+#define HSS_COPY_HDR 0
+
+/**
+ * hss_packet_to_buf - Serializes the header and fixed fields of a packet
+ *
+ * @pkt An alligned HSS packet
+ * @buf An unalligned buffer for transmission, with room for the fixed length
+ *	of the packet, see HSS_FIXED_LEN_
+ * @payload_fields HSS_COPY_FIELDS for the fixed payload fields too or
+ *	HSS_COPY_HDR for just the header
+ *
+ * Any arbitrary payload is left for the caller to append.
+ *
+ * Return: The number of bytes written to @buf
+ */
+static inline size_t hss_packet_to_buf(struct hss_packet *pkt, char *buf,
+	int payload_fields)
+{
+	size_t cnt = hss_hdr_to_buf(&pkt->hdr, buf);
+
+	if (payload_fields)
+		cnt += _hss_payload_to_buf(pkt, buf + cnt, SIZE_MAX);
+	return cnt;
+}
+
+/**
+ * hss_packet_from_buf - Parses the header and fixed fields of a packet
+ *
+ * @pkt The packet to fill
+ * @buf A received, unalligned buffer
+ * @len The bytes available at @buf
+ * @payload_fields HSS_COPY_FIELDS for the fixed payload fields too or
+ *	HSS_COPY_HDR for just the header
+ *
+ * Nothing is read past @len. The fixed payload fields must also lie within
+ * the `payload_len` the header gives. Check `payload_len` itself with
+ * hss_packet_len.
+ *
+ * Return: The number of bytes parsed, where any arbitrary payload starts,
+ * or -EINVAL if the fields the opcode calls for are not all there.
+ */
+static inline int hss_packet_from_buf(struct hss_packet *pkt,
+	const char *buf, size_t len, int payload_fields)
+{
+	int ret;
+
+	if (len < HSS_HDR_LEN)
+		return -EINVAL;
+	hss_hdr_from_buf(&pkt->hdr, buf);
+	if (!payload_fields)
+		return HSS_HDR_LEN;
+
+	ret = _hss_payload_from_buf(pkt, buf + HSS_HDR_LEN,
+		min_t(size_t, len - HSS_HDR_LEN, pkt->hdr.payload_len));
+	return ret < 0 ? ret : HSS_HDR_LEN + ret;
+}
+
+/**
+ * hss_connect_from_buf - Parses the CONNECT fields at the start of a payload
+ *
+ * @conn The fields to fill
+ * @buf The payload
+ * @avail The bytes of payload in @buf
+ *
+ * For SENDTO payloads read straight from where they arrived.
+ *
+ * Return: The number of bytes parsed or -EINVAL if they are not all there
+ */
+static inline int hss_connect_from_buf(struct hss_payload_connect_ip *conn,
+	const char *buf, size_t avail)
+{
+	size_t cnt = 0;
+
+	_HSS_GROUP_CONNECT(from, conn);
+	return cnt;
+}
 #endif